@@ -0,0 +1,517 @@
+// Uploads synthetic files to an in-process server through a matrix of file
+// sizes, chunk sizes, hash types and concurrency levels, and prints one JSON
+// object per case to stdout:
+//
+//   {"transport":"tcp","engine":"sync","storage":"fstream","durability":"none",
+//    "size":1048576,"chunk_size":"auto","hash":"sha256","concurrency":4,"files":256,
+//    "failed":0,"bytes":268435456,"seconds":0.81,"mb_per_s":331.4,
+//    "files_per_s":316.0,"p50_ms":11.9,"p99_ms":24.3,"cpu_s_per_gb":5.2}
+//
+// MB is 10^6 bytes. CPU is that of the whole process, so client and server
+// together; latency is that of one UploadFile() call. Logs go to stderr.
+#include <filesystem>
+#include <algorithm>
+#include <optional>
+#include <utility>
+#include <variant>
+#include <fstream>
+#include <chrono>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <climits>
+#include <string>
+#include <map>
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <grpcpp/grpcpp.h>
+#include <spdlog/spdlog.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+#include "FTPServiceImpl.hpp"
+#include "FTPClient.hpp"
+#include "ChannelPool.hpp"
+#include "hash.pb.h"
+
+namespace fs = std::filesystem;
+
+using ArgList = std::map<std::string, std::string>;
+
+namespace {
+	constexpr std::size_t kMaxMessageSize = 4 * 1024 * 1024;
+
+	struct Case {
+		std::uint64_t size;
+		std::string chunk_size;		// "auto" or bytes
+		std::string hash;
+		std::size_t concurrency;
+	};
+
+	struct Result {
+		std::size_t files = 0;
+		std::size_t failed = 0;
+		std::uint64_t bytes = 0;
+		double seconds = 0;
+		double cpu_seconds = 0;
+		std::vector<double> latencies_ms;
+	};
+}
+
+std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char* argv[])
+{
+	ArgList arglist;
+
+	const struct option options[] = {
+		{ "sizes", required_argument, nullptr, 's' },
+		{ "chunk-sizes", required_argument, nullptr, 'C' },
+		{ "hashes", required_argument, nullptr, 'H' },
+		{ "concurrency", required_argument, nullptr, 'j' },
+		{ "bytes", required_argument, nullptr, 'B' },
+		{ "max-files", required_argument, nullptr, 'F' },
+		{ "transport", required_argument, nullptr, 't' },
+		{ "engine", required_argument, nullptr, 'e' },
+		{ "storage", required_argument, nullptr, 'S' },
+		{ "durability", required_argument, nullptr, 'D' },
+		{ "dir", required_argument, nullptr, 'd' },
+		{ "loglevel", required_argument, nullptr, 'l' },
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	int optidx;
+	for (int opt; (opt = getopt_long(argc, argv, "s:C:H:j:B:F:t:e:S:D:d:l:", options, &optidx)) != -1; ) {
+		switch (opt) {
+		case 's':
+			arglist["sizes"] = optarg;
+			break;
+		case 'C':
+			arglist["chunk-sizes"] = optarg;
+			break;
+		case 'H':
+			arglist["hashes"] = optarg;
+			break;
+		case 'j':
+			arglist["concurrency"] = optarg;
+			break;
+		case 'B':
+			arglist["bytes"] = optarg;
+			break;
+		case 'F':
+			arglist["max-files"] = optarg;
+			break;
+		case 't':
+			arglist["transport"] = optarg;
+			break;
+		case 'e':
+			arglist["engine"] = optarg;
+			break;
+		case 'S':
+			arglist["storage"] = optarg;
+			break;
+		case 'D':
+			arglist["durability"] = optarg;
+			break;
+		case 'd':
+			arglist["dir"] = optarg;
+			break;
+		case 'l':
+			arglist["loglevel"] = optarg;
+			break;
+		case ':':
+			return { false, fmt::format("missing argument: {}", static_cast<char>(opt)) };
+		case '?':
+			return { false, fmt::format("invalid option: {}", static_cast<char>(optopt)) };
+		}
+	}
+
+	if (optind != argc)
+		return { false, fmt::format("usage: {} [--sizes <list>] [--chunk-sizes <list>] [--hashes <list>] [--concurrency <list>] [--bytes <bytes>] [--max-files <count>] [--transport <tcp|inproc>] [--engine <sync|callback>] [--storage <fstream|uring|direct>] [--durability <none|fdatasync|group>] [--dir <directory>] [--loglevel <level>]", *argv) };
+
+	if (arglist.find("sizes") == arglist.end())
+		arglist["sizes"] = "4K,1M,64M";
+
+	if (arglist.find("chunk-sizes") == arglist.end())
+		arglist["chunk-sizes"] = "auto,64K,1M";
+
+	if (arglist.find("hashes") == arglist.end())
+		arglist["hashes"] = "sha256,xxh3";
+
+	if (arglist.find("concurrency") == arglist.end())
+		arglist["concurrency"] = "1,8";
+
+	// Each case uploads about this much, in at least one file per thread.
+	if (arglist.find("bytes") == arglist.end())
+		arglist["bytes"] = "256M";
+
+	if (arglist.find("max-files") == arglist.end())
+		arglist["max-files"] = "2000";
+
+	if (arglist.find("transport") == arglist.end())
+		arglist["transport"] = "tcp";
+
+	if (arglist.find("engine") == arglist.end())
+		arglist["engine"] = "sync";
+
+	if (arglist.find("storage") == arglist.end())
+		arglist["storage"] = "fstream";
+
+	if (arglist.find("durability") == arglist.end())
+		arglist["durability"] = "none";
+
+	if (arglist.find("dir") == arglist.end())
+		arglist["dir"] = (fs::temp_directory_path() / "ftp-benchmark").string();
+
+	if (arglist.find("loglevel") == arglist.end())
+		arglist["loglevel"] = "warn";
+
+	return { true, arglist };
+}
+
+std::vector<std::string> SplitList(const std::string& list)
+{
+	std::vector<std::string> items;
+
+	for (std::size_t begin = 0; begin <= list.size(); ) {
+		std::size_t end = list.find(',', begin);
+		if (end == std::string::npos)
+			end = list.size();
+
+		if (end > begin)
+			items.push_back(list.substr(begin, end - begin));
+
+		begin = end + 1;
+	}
+
+	return items;
+}
+
+// Bytes, optionally with a K, M or G (binary) suffix.
+std::optional<std::uint64_t> ParseSize(const std::string& text)
+{
+	std::size_t end;
+	std::uint64_t value;
+	try {
+		value = std::stoull(text, &end);
+	} catch (std::exception& e) {
+		return std::nullopt;
+	}
+
+	const std::string suffix = text.substr(end);
+	if (suffix == "K")
+		value *= 1024;
+	else if (suffix == "M")
+		value *= 1024 * 1024;
+	else if (suffix == "G")
+		value *= 1024 * 1024 * 1024;
+	else if (!suffix.empty())
+		return std::nullopt;
+
+	return value;
+}
+
+std::optional<HashType> ParseHashType(const std::string& name)
+{
+	if (name == "sha256")
+		return HashType::HASH_TYPE_SHA256;
+	if (name == "sha512")
+		return HashType::HASH_TYPE_SHA512;
+	if (name == "tree")
+		return HashType::HASH_TYPE_SHA256_TREE;
+	if (name == "xxh3")
+		return HashType::HASH_TYPE_XXH3_128;
+	if (name == "crc32c")
+		return HashType::HASH_TYPE_CRC32C;
+
+	return std::nullopt;
+}
+
+std::optional<std::vector<Case>> MakeCases(const ArgList& arglist)
+{
+	std::vector<Case> cases;
+
+	for (const auto& size_text : SplitList(arglist.at("sizes"))) {
+		const auto size = ParseSize(size_text);
+		if (!size || *size == 0)
+			return std::nullopt;
+
+		for (const auto& chunk_size : SplitList(arglist.at("chunk-sizes"))) {
+			if (chunk_size != "auto") {
+				const auto bytes = ParseSize(chunk_size);
+				if (!bytes || *bytes == 0 || *bytes > kMaxMessageSize - 64 * 1024)
+					return std::nullopt;
+			}
+
+			for (const auto& hash : SplitList(arglist.at("hashes"))) {
+				if (!ParseHashType(hash))
+					return std::nullopt;
+
+				for (const auto& concurrency : SplitList(arglist.at("concurrency"))) {
+					std::size_t count;
+					try {
+						count = std::stoul(concurrency);
+					} catch (std::exception& e) {
+						return std::nullopt;
+					}
+
+					if (count == 0)
+						return std::nullopt;
+
+					cases.push_back(Case{ *size, chunk_size, hash, count });
+				}
+			}
+		}
+	}
+
+	return cases;
+}
+
+// Incompressible bytes from xorshift64, so no codec or filesystem makes the
+// data look smaller than it is.
+bool WriteSyntheticFile(const fs::path& path, std::uint64_t size)
+{
+	std::ofstream out(path, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+
+	std::uint64_t state = 0x9E3779B97F4A7C15ULL ^ size;
+	std::vector<std::uint64_t> block(64 * 1024 / sizeof(std::uint64_t));
+
+	for (std::uint64_t written = 0; written < size; ) {
+		for (auto& word : block) {
+			state ^= state << 13;
+			state ^= state >> 7;
+			state ^= state << 17;
+			word = state;
+		}
+
+		const std::uint64_t n = std::min<std::uint64_t>(size - written, block.size() * sizeof(std::uint64_t));
+		out.write(reinterpret_cast<const char*>(block.data()), static_cast<std::streamsize>(n));
+		written += n;
+	}
+
+	return static_cast<bool>(out);
+}
+
+double CpuSeconds()
+{
+	rusage usage{};
+	::getrusage(RUSAGE_SELF, &usage);
+
+	const auto seconds = [](const timeval& tv) { return tv.tv_sec + tv.tv_usec / 1e6; };
+	return seconds(usage.ru_utime) + seconds(usage.ru_stime);
+}
+
+double Percentile(std::vector<double> values, double p)
+{
+	if (values.empty())
+		return 0;
+
+	std::sort(values.begin(), values.end());
+	const std::size_t index = static_cast<std::size_t>(p * (values.size() - 1) + 0.5);
+
+	return values[std::min(index, values.size() - 1)];
+}
+
+Result RunCase(const Case& c, const std::vector<std::shared_ptr<grpc::Channel>>& channels,
+	       const fs::path& source, const fs::path& outdir, std::size_t files)
+{
+	FTPClient::Options options;
+	options.max_chunk_size = kMaxMessageSize - 64 * 1024;
+	options.chunk_size = (c.chunk_size == "auto") ? 0 : *ParseSize(c.chunk_size);
+
+	FTPClient client(channels, options);
+	const HashType hashtype = *ParseHashType(c.hash);
+
+	Result result;
+	result.files = files;
+	result.latencies_ms.resize(files);
+
+	std::atomic<std::size_t> next{ 0 };
+	std::atomic<std::size_t> failed{ 0 };
+
+	const double cpu_start = CpuSeconds();
+	const auto start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (std::size_t i = 0; i < c.concurrency; i++) {
+		workers.emplace_back([&] {
+			for (std::size_t index; (index = next.fetch_add(1)) < files; ) {
+				const std::string outpath = (outdir / fmt::format("{}.bin", index)).string();
+
+				const auto begin = std::chrono::steady_clock::now();
+				const auto [success, metadata, error] = client.UploadFile(source.string(), outpath, hashtype);
+				const auto end = std::chrono::steady_clock::now();
+
+				result.latencies_ms[index] = std::chrono::duration<double, std::milli>(end - begin).count();
+				if (!success) {
+					spdlog::warn("failed to upload {}: {}", outpath, error.message);
+					failed.fetch_add(1);
+				}
+			}
+		});
+	}
+
+	for (auto& worker : workers)
+		worker.join();
+
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.cpu_seconds = CpuSeconds() - cpu_start;
+	result.failed = failed.load();
+	result.bytes = (files - result.failed) * c.size;
+
+	return result;
+}
+
+void PrintResult(const ArgList& arglist, const Case& c, const Result& result)
+{
+	const double mb_per_s = result.seconds > 0 ? result.bytes / 1e6 / result.seconds : 0;
+	const double files_per_s = result.seconds > 0 ? (result.files - result.failed) / result.seconds : 0;
+	const double cpu_s_per_gb = result.bytes > 0 ? result.cpu_seconds / (result.bytes / 1e9) : 0;
+
+	fmt::print("{{\"transport\":\"{}\",\"engine\":\"{}\",\"storage\":\"{}\",\"durability\":\"{}\",\"size\":{},\"chunk_size\":\"{}\",\"hash\":\"{}\","
+		   "\"concurrency\":{},\"files\":{},\"failed\":{},\"bytes\":{},\"seconds\":{:.4f},\"mb_per_s\":{:.2f},"
+		   "\"files_per_s\":{:.2f},\"p50_ms\":{:.3f},\"p99_ms\":{:.3f},\"cpu_s_per_gb\":{:.3f}}}\n",
+		   arglist.at("transport"), arglist.at("engine"), arglist.at("storage"), arglist.at("durability"), c.size, c.chunk_size, c.hash,
+		   c.concurrency, result.files, result.failed, result.bytes, result.seconds, mb_per_s,
+		   files_per_s, Percentile(result.latencies_ms, 0.50), Percentile(result.latencies_ms, 0.99), cpu_s_per_gb);
+	std::fflush(stdout);
+}
+
+std::optional<FTPServiceImpl::Options> MakeServiceOptions(const ArgList& arglist)
+{
+	FTPServiceImpl::Options options;
+
+	const std::string& engine = arglist.at("engine");
+	if (engine == "sync")
+		options.engine = FTPServiceImpl::Engine::Sync;
+	else if (engine == "callback")
+		options.engine = FTPServiceImpl::Engine::Callback;
+	else
+		return std::nullopt;
+
+	const std::string& storage = arglist.at("storage");
+	if (storage == "fstream")
+		options.storage = FTPServiceImpl::Storage::Stream;
+	else if (storage == "uring")
+		options.storage = FTPServiceImpl::Storage::Uring;
+	else if (storage == "direct")
+		options.storage = FTPServiceImpl::Storage::Direct;
+	else
+		return std::nullopt;
+
+	const std::string& durability = arglist.at("durability");
+	if (durability == "none")
+		options.durability = FTPServiceImpl::Durability::None;
+	else if (durability == "fdatasync")
+		options.durability = FTPServiceImpl::Durability::Sync;
+	else if (durability == "group")
+		options.durability = FTPServiceImpl::Durability::Group;
+	else
+		return std::nullopt;
+
+	return options;
+}
+
+int main(int argc, char* argv[])
+{
+	// stdout carries the results only.
+	spdlog::set_default_logger(spdlog::stderr_color_mt("benchmark"));
+
+	const auto &[success, result] = ParseArgument(argc, argv);
+	if (!success) {
+		spdlog::error("failed to ParseArgument(): {}", std::get<std::string>(result));
+		return 1;
+	}
+
+	const ArgList& arglist = std::get<ArgList>(result);
+	spdlog::set_level(spdlog::level::from_str(arglist.at("loglevel")));
+
+	const auto cases = MakeCases(arglist);
+	const auto service_options = MakeServiceOptions(arglist);
+	const auto total_bytes = ParseSize(arglist.at("bytes"));
+	const auto max_files = ParseSize(arglist.at("max-files"));
+	const std::string& transport = arglist.at("transport");
+	if (!cases || !service_options || !total_bytes || !max_files || *max_files == 0 || (transport != "tcp" && transport != "inproc")) {
+		spdlog::error("invalid --sizes, --chunk-sizes, --hashes, --concurrency, --bytes, --max-files, --transport, --engine, --storage or --durability");
+		return 1;
+	}
+
+	const fs::path dir = fs::absolute(arglist.at("dir"));
+	const fs::path sources = dir / "source";
+	const fs::path root = dir / "root";
+
+	std::error_code ec;
+	fs::remove_all(root, ec);
+	fs::create_directories(sources, ec);
+	fs::create_directories(root, ec);
+	if (ec) {
+		spdlog::error("failed to create {}: {}", dir.string(), ec.message());
+		return 1;
+	}
+
+	FTPServiceImpl service(root.string(), *service_options);
+	if (!service.IsValid()) {
+		spdlog::error("failed to create FTP Service in {}", root.string());
+		return 1;
+	}
+
+	int port = 0;
+	grpc::ServerBuilder builder;
+	builder.SetMaxReceiveMessageSize(kMaxMessageSize);
+	builder.SetMaxSendMessageSize(kMaxMessageSize);
+	if (transport == "tcp")
+		builder.AddListeningPort("127.0.0.1:0", grpc::InsecureServerCredentials(), &port);
+	builder.RegisterService(&service);
+
+	std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+	if (!server || (transport == "tcp" && port == 0)) {
+		spdlog::error("failed to start the server");
+		return 1;
+	}
+
+	grpc::ChannelArguments args;
+	args.SetMaxSendMessageSize(kMaxMessageSize);
+	args.SetMaxReceiveMessageSize(kMaxMessageSize);
+
+	std::map<std::uint64_t, fs::path> source_files;
+	for (const Case& c : *cases) {
+		if (source_files.find(c.size) == source_files.end()) {
+			const fs::path source = sources / fmt::format("{}.bin", c.size);
+			if (!WriteSyntheticFile(source, c.size)) {
+				spdlog::error("failed to write {}", source.string());
+				return 1;
+			}
+			source_files[c.size] = source;
+		}
+
+		// A channel per thread, as the client's --channels would give.
+		std::vector<std::shared_ptr<grpc::Channel>> channels;
+		if (transport == "tcp") {
+			channels = ChannelPool::CreateChannels(fmt::format("127.0.0.1:{}", port), grpc::InsecureChannelCredentials(),
+							       args, c.concurrency);
+		} else {
+			for (std::size_t i = 0; i < c.concurrency; i++)
+				channels.push_back(server->InProcessChannel(args));
+		}
+
+		const std::size_t files = static_cast<std::size_t>(
+			std::clamp<std::uint64_t>(*total_bytes / c.size, c.concurrency, std::max<std::uint64_t>(*max_files, c.concurrency)));
+
+		const fs::path outdir = root / "out";
+		fs::create_directories(outdir, ec);
+
+		spdlog::info("running: size={} chunk_size={} hash={} concurrency={} files={}",
+			     c.size, c.chunk_size, c.hash, c.concurrency, files);
+		PrintResult(arglist, c, RunCase(c, channels, source_files[c.size], outdir, files));
+
+		// Uploads of the next case start from an empty directory.
+		fs::remove_all(outdir, ec);
+	}
+
+	server->Shutdown();
+	fs::remove_all(dir, ec);
+
+	return 0;
+}
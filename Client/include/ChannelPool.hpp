@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ftp_service.grpc.pb.h"
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include <grpcpp/grpcpp.h>
+
+// Spreads calls over several channels. Every stream of a channel shares one
+// HTTP/2 connection, and so one congestion window and one server I/O
+// thread; with channels from CreateChannels() each has its own connection.
+// A call goes to the channel with the fewest bytes outstanding, counting
+// the bytes each running transfer said it would move.
+class ChannelPool
+{
+public:
+	// Holds a channel for one call. Its bytes count against the channel
+	// until the lease is destroyed.
+	class Lease
+	{
+	public:
+		Lease(const Lease&) = delete;
+		Lease& operator=(const Lease&) = delete;
+		Lease(Lease&&) noexcept;
+		Lease& operator=(Lease&&) noexcept;
+		~Lease();
+
+	public:
+		FTPService::Stub* operator->() const noexcept;
+
+	private:
+		friend class ChannelPool;
+		Lease(ChannelPool* pool, std::size_t index, std::uint64_t bytes) noexcept;
+
+	private:
+		ChannelPool* pool_;
+		std::size_t index_;
+		std::uint64_t bytes_;
+	};
+
+public:
+	// Channels that don't share a connection: each gets a subchannel pool
+	// of its own, and distinct arguments so that no pool could match them.
+	static std::vector<std::shared_ptr<grpc::Channel>> CreateChannels(const std::string& target,
+									  const std::shared_ptr<grpc::ChannelCredentials>& creds,
+									  const grpc::ChannelArguments& args, std::size_t count);
+
+public:
+	explicit ChannelPool(const std::vector<std::shared_ptr<grpc::Channel>>& channels);
+
+public:
+	bool IsEmpty() const noexcept;
+	std::size_t GetSize() const noexcept;
+
+	// Ties go to the channel with fewer calls, then round-robin.
+	Lease Acquire(std::uint64_t bytes = 0);
+
+private:
+	void Release(std::size_t index, std::uint64_t bytes) noexcept;
+
+private:
+	struct Entry {
+		std::unique_ptr<FTPService::Stub> stub;
+		std::uint64_t outstanding = 0;
+		std::size_t calls = 0;
+	};
+
+	std::mutex mutex_;
+	std::vector<Entry> entries_;
+	std::size_t next_ = 0;
+};
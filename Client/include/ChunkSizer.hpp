@@ -0,0 +1,50 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+
+// Picks the upload chunk size from how the upload is going. It measures the
+// throughput of a window of chunks, doubles the size, and keeps doubling
+// while each step raises the throughput by at least kGain. A step that
+// doesn't pay off is undone, and any single write that stalls for longer
+// than kMaxLatency halves the size. Once settled it probes upward again
+// every kSettledWindows windows, so it follows changes in the link.
+class ChunkSizer
+{
+public:
+	using Clock = std::chrono::steady_clock;
+
+	static constexpr std::size_t kMinSize = 64 * 1024;
+
+public:
+	ChunkSizer(std::size_t initial, std::size_t max) noexcept;
+
+public:
+	std::size_t GetSize() const noexcept;
+
+	// Records a chunk of `bytes` whose write took `latency`, and returns
+	// the size to read the next chunks at.
+	std::size_t Observe(std::size_t bytes, Clock::duration latency) noexcept;
+
+private:
+	void EndWindow() noexcept;
+	void Resize(std::size_t size) noexcept;
+
+private:
+	const std::size_t max_;
+	std::size_t size_;
+
+	// Chunks of the current size seen since the window started.
+	Clock::time_point last_;
+	Clock::duration window_time_{};
+	std::uint64_t window_bytes_ = 0;
+	std::size_t window_chunks_ = 0;
+
+	// Throughput at previous_size_, in bytes per second.
+	double previous_rate_ = 0;
+	std::size_t previous_size_ = 0;
+
+	bool probing_ = true;
+	std::size_t settled_ = 0;
+};
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "Hasher.hpp"
+
+// Content-defined chunking with a Gear rolling hash (FastCDC style). Chunk
+// boundaries depend only on the bytes around them, so an insertion or
+// deletion changes the chunks next to it and leaves the rest of the file's
+// chunks, and their SHA-256 digests, as they were.
+class ContentChunker
+{
+public:
+	struct Chunk {
+		std::uint64_t offset;
+		std::uint64_t length;
+		std::string digest;
+	};
+
+public:
+	explicit ContentChunker(std::size_t min_size = 16 * 1024,
+				std::size_t avg_size = 64 * 1024,
+				std::size_t max_size = 256 * 1024);
+
+public:
+	std::optional<Hasher::Error> Update(const char* data, std::size_t size) noexcept;
+	std::optional<Hasher::Error> Finish() noexcept;
+
+	const std::vector<Chunk>& GetChunks() const noexcept;
+
+private:
+	std::optional<Hasher::Error> Cut() noexcept;
+
+private:
+	const std::size_t min_size_;
+	const std::size_t max_size_;
+	const std::uint64_t mask_;
+
+	std::uint64_t fingerprint_ = 0;
+	std::uint64_t offset_ = 0;
+	std::uint64_t length_ = 0;
+
+	Hasher hasher_;
+	bool hashing_ = false;
+
+	std::vector<Chunk> chunks_;
+};
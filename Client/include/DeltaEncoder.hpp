@@ -0,0 +1,79 @@
+#pragma once
+
+#include <unordered_map>
+#include <functional>
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <tuple>
+
+#include "Hasher.hpp"
+#include "RollingChecksum.hpp"
+
+#include "ftp_service.pb.h"
+
+// rsync-style delta encoding against the server's copy of a file. The local
+// file is scanned with a rolling checksum; windows that match one of the
+// server's block signatures are sent as BlockRefs, everything else as
+// literal chunks. Messages go to the sink in file order.
+class DeltaEncoder
+{
+public:
+	// Hasher::Error code when the sink refuses a message.
+	static constexpr int kSinkFailed = -2;
+
+	using Sink = std::function<bool(const UploadFileRequest&)>;
+
+public:
+	explicit DeltaEncoder(Sink sink);
+
+public:
+	std::optional<Hasher::Error> AddSignatures(const BlockSignaturesResponse& resp) noexcept;
+
+	std::optional<Hasher::Error> Update(const char* data, std::size_t size) noexcept;
+	std::optional<Hasher::Error> Finish() noexcept;
+
+	std::uint32_t GetBlockSize() const noexcept;
+	std::uint64_t GetMatchedBytes() const noexcept;
+
+private:
+	std::optional<Hasher::Error> Scan() noexcept;
+	std::optional<Hasher::Error> MatchTail() noexcept;
+	std::tuple<bool, std::uint64_t, Hasher::Error> Match(const char* data, std::size_t size, std::uint32_t weak) noexcept;
+
+	std::optional<Hasher::Error> EmitLiteral(std::size_t end) noexcept;
+	std::optional<Hasher::Error> EmitBlock(std::uint64_t index, std::size_t length) noexcept;
+	std::optional<Hasher::Error> FlushBlocks() noexcept;
+	std::optional<Hasher::Error> Emit() noexcept;
+
+	std::uint64_t BlockLength(std::uint64_t index) const noexcept;
+
+private:
+	Sink sink_;
+
+	std::uint64_t base_size_ = 0;
+	std::uint32_t block_size_ = 0;
+	std::vector<std::string> strong_;
+	std::unordered_map<std::uint32_t, std::vector<std::uint64_t>> weak_;
+
+	// buffer_[literal_, pos_) is unmatched data not sent yet; the window
+	// being checked starts at pos_.
+	std::vector<char> buffer_;
+	std::size_t literal_ = 0;
+	std::size_t pos_ = 0;
+
+	RollingChecksum checksum_;
+	bool rolling_ = false;
+
+	// BlockRef being extended by consecutive matches.
+	std::uint64_t run_index_ = 0;
+	std::uint64_t run_count_ = 0;
+
+	std::uint64_t offset_ = 0;
+	std::uint64_t matched_ = 0;
+
+	Hasher hasher_;
+	UploadFileRequest req_;
+};
@@ -2,8 +2,13 @@
 
 #include "ftp_service.grpc.pb.h"
 
+#include <functional>
 #include <optional>
+#include <cstdint>
+#include <cstddef>
 #include <string>
+#include <utility>
+#include <vector>
 #include <tuple>
 
 #include <grpcpp/grpcpp.h>
@@ -12,6 +17,11 @@
 #include "file.pb.h"
 #include "hash.pb.h"
 
+#include "ChannelPool.hpp"
+#include "ContentChunker.hpp"
+#include "DeltaEncoder.hpp"
+#include "Codec.hpp"
+
 class FTPClient
 {
 public:
@@ -20,20 +30,86 @@ public:
 		std::string message;
 	};
 
+	struct Options {
+		// Codec for upload chunks; chunks that don't compress are sent raw.
+		Codec::Type compression = Codec::Type::None;
+
+		// Ask the server to create missing parent directories of uploads.
+		bool create_parents = false;
+
+		// Upload chunk size; 0 lets ChunkSizer ramp it up from the default
+		// as far as max_chunk_size. A chunk has to fit in one message, so
+		// max_chunk_size stays below the channel's (and the server's) max
+		// message size. SHA256Tree always sends 1 MiB leaves.
+		std::size_t chunk_size = 0;
+		std::size_t max_chunk_size = 4 * 1024 * 1024 - 64 * 1024;
+	};
+
+	struct TreeSummary {
+		std::size_t files = 0;		// regular files found under the directory
+		std::size_t uploaded = 0;
+		std::uint64_t bytes = 0;	// size of the uploaded files
+		double seconds = 0;
+
+		std::vector<std::pair<std::string, Error>> failures;
+	};
+
 public:
     FTPClient(std::shared_ptr<grpc::Channel> channel);
+    FTPClient(std::shared_ptr<grpc::Channel> channel, const Options &options);
+    // Calls are spread over the channels; see ChannelPool.
+    FTPClient(const std::vector<std::shared_ptr<grpc::Channel>> &channels, const Options &options);
 
 public:
-    std::tuple<bool, FileMetaData, Error> UploadFile(const std::string &infile, const std::string &outpath, const HashType &hashtype);
+    std::tuple<bool, FileMetaData, Error> UploadFile(const std::string &infile, const std::string &outpath, const HashType &hashtype, bool resume = false);
+    std::tuple<bool, FileMetaData, Error> UploadFileStriped(const std::string &infile, const std::string &outpath, const HashType &hashtype,
+                                                            std::size_t streams, std::uint64_t stripe_size);
+    std::tuple<bool, FileMetaData, Error> UploadFileDedup(const std::string &infile, const std::string &outpath, const HashType &hashtype);
+    std::tuple<bool, FileMetaData, Error> UploadFileDelta(const std::string &infile, const std::string &outpath, const HashType &hashtype,
+                                                          std::uint64_t *bytes_saved = nullptr);
+    // Uploads many small files on one stream; each file is read whole. The
+    // results are in the order of files, one per file.
+    std::tuple<bool, std::vector<UploadBatchResult>, Error> UploadBatch(const std::vector<std::pair<std::string, std::string>> &files,
+                                                                        const HashType &hashtype);
+    // Uploads every regular file under indir to the same relative path under
+    // outdir, up to concurrency files at once over this client's channels.
+    // Remote directories are only created with Options::create_parents.
+    std::tuple<bool, TreeSummary, Error> UploadTree(const std::string &indir, const std::string &outdir, const HashType &hashtype,
+                                                    std::size_t concurrency);
+    std::tuple<bool, FileMetaData, Error> DownloadFile(const std::string &remotepath, const std::string &outfile, const HashType &hashtype,
+                                                       std::optional<std::uint64_t> offset = std::nullopt,
+                                                       std::optional<std::uint64_t> length = std::nullopt);
+    std::tuple<bool, FileMetaData, Error> Stat(const std::string &remotepath);
+    // Calls each for every entry as it arrives. The token is set when
+    // request.limit cut the listing short; it goes in page_token to go on.
+    std::tuple<bool, std::string, Error> ListDirectory(const ListDirectoryRequest &request,
+                                                       const std::function<void(const FileMetaData&)> &each);
+
+private:
+    std::tuple<bool, FileMetaData, Error> UploadFileFrom(const std::string &infile, const std::string &outpath, const HashType &hashtype, std::uint64_t offset);
+    std::tuple<std::uint64_t, Error> QueryResumeOffset(const std::string_view infile, const std::string_view outpath, const HashType &hashtype);
+    std::tuple<std::vector<bool>, Error> FindMissingChunks(const std::vector<ContentChunker::Chunk> &chunks);
+    std::tuple<bool, FileMetaData, Error> SendDedupChunks(const std::string &infile, const std::string &outpath, const HashType &hashtype,
+                                                          const std::vector<ContentChunker::Chunk> &chunks, const std::vector<bool> &missing,
+                                                          const Hash &hash);
+    std::optional<Error> FetchSignatures(const std::string &outpath, DeltaEncoder &encoder);
+    std::optional<Error> SendStripe(const std::string &infile, const std::string &outpath, const HashType &hashtype, const UploadStripe &stripe);
 
 private:
     using WriterPtr = std::unique_ptr<grpc::ClientWriter<UploadFileRequest>>;
 
     std::optional<Error> SendFile(WriterPtr& writer, const std::string_view infile, const std::string_view outpath, const HashType &hashtype);
-    std::optional<Error> SendPath(WriterPtr& writer, const std::string_view infile, const std::string_view outpath, const HashType &hashtype);
-    std::tuple<Hash, Error> SendChunk(WriterPtr& writer, const std::string_view infile, const HashType &hashtype);
+    std::optional<Error> SendPath(WriterPtr& writer, const std::string_view infile, const std::string_view outpath, const HashType &hashtype,
+                                  bool resume = false, const UploadStripe *stripe = nullptr, const DeltaBase *delta = nullptr);
+    std::tuple<Hash, Error> SendChunk(WriterPtr& writer, const std::string_view infile, const HashType &hashtype, std::uint64_t offset = 0);
+    std::tuple<Hash, Error> SendRange(WriterPtr& writer, const std::string_view infile, const HashType &hashtype, std::uint64_t offset, std::uint64_t length);
+    std::tuple<Hash, Error> SendPiped(WriterPtr& writer, const std::string_view infile, const HashType &hashtype,
+                                      std::uint64_t begin, std::uint64_t send_from, std::optional<std::uint64_t> end);
     std::optional<Error> SendHash(WriterPtr& writer, const Hash& hash);
+    void FillChunk(UploadChunk& chunk, std::string_view data, Codec& codec, std::string& scratch) const;
+    std::size_t GetChunkSize() const noexcept;
 
 private:
-    std::unique_ptr<FTPService::Stub> stub_;
+    ChannelPool pool_;
+    const Options options_;
 };
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <string_view>
+#include <optional>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <vector>
+#include <tuple>
+
+#include "Hasher.hpp"
+
+// Reads, hashes and sends a file on several threads at once: a reader thread
+// fills buffers from disk, hasher threads hash them, and the calling thread
+// hands them to the sink in file order. The stages are connected by
+// SpscQueues and the buffers go back to the reader once sent, so at most
+// depth times the largest block size bytes are in flight.
+//
+// SHA256Tree leaves are independent, so they are read one per block and
+// hashed on several threads; other hash types use a single hasher thread.
+// The block size of the other types can be changed while Run() is going.
+class SendPipeline
+{
+public:
+	struct Error {
+		int code;
+		std::string message;
+	};
+
+	struct Chunk {
+		std::string_view data;
+		std::uint64_t offset;
+		// Digest of the tree leaf this chunk is, if it is a whole leaf.
+		std::string_view leaf_digest;
+	};
+
+	// Error code when the sink refuses a chunk.
+	static constexpr int kSinkFailed = -2;
+
+	using Sink = std::function<bool(const Chunk&)>;
+
+public:
+	SendPipeline(const std::filesystem::path& path, Hasher::Type type,
+		     std::size_t block_size = 64 * BUFSIZ, std::size_t depth = 8);
+
+public:
+	// Reads from begin up to end (or EOF) and hashes all of it; only the
+	// bytes at or after send_from go to the sink. Tree leaves are counted
+	// from begin. Returns the digest.
+	std::tuple<bool, std::vector<uint8_t>, Error> Run(std::uint64_t begin, std::uint64_t send_from,
+							  std::optional<std::uint64_t> end, const Sink& sink);
+
+	// Blocks read from now on are this big; safe to call from the sink.
+	// Ignored for SHA256Tree, whose blocks are always one leaf.
+	void SetBlockSize(std::size_t block_size) noexcept;
+
+private:
+	struct Block {
+		// Allocated by the reader, and grown when the block size goes up.
+		std::unique_ptr<char[]> data;
+		std::size_t capacity = 0;
+		std::size_t length = 0;
+		std::uint64_t offset = 0;
+		std::vector<uint8_t> digest;
+	};
+
+private:
+	const std::filesystem::path path_;
+	const Hasher::Type type_;
+	std::atomic<std::size_t> block_size_;
+	const std::size_t hashers_;
+
+	std::vector<Block> blocks_;
+};
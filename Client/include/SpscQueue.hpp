@@ -0,0 +1,61 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded single-producer/single-consumer ring. Push() and Pop() are
+// lock-free while the ring is neither full nor empty; otherwise they sleep
+// in std::atomic::wait() until the other side moves.
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(std::size_t capacity)
+		: slots_(capacity)
+	{
+	}
+
+public:
+	void Push(T value) noexcept
+	{
+		const std::size_t tail = tail_.load(std::memory_order_relaxed);
+
+		for (;;) {
+			const std::size_t head = head_.load(std::memory_order_acquire);
+			if (tail - head < slots_.size())
+				break;
+
+			head_.wait(head, std::memory_order_acquire);
+		}
+
+		slots_[tail % slots_.size()] = std::move(value);
+		tail_.store(tail + 1, std::memory_order_release);
+		tail_.notify_one();
+	}
+
+	T Pop() noexcept
+	{
+		const std::size_t head = head_.load(std::memory_order_relaxed);
+
+		for (;;) {
+			const std::size_t tail = tail_.load(std::memory_order_acquire);
+			if (tail != head)
+				break;
+
+			tail_.wait(tail, std::memory_order_acquire);
+		}
+
+		T value = std::move(slots_[head % slots_.size()]);
+		head_.store(head + 1, std::memory_order_release);
+		head_.notify_one();
+
+		return value;
+	}
+
+private:
+	std::vector<T> slots_;
+
+	alignas(64) std::atomic<std::size_t> head_{ 0 };
+	alignas(64) std::atomic<std::size_t> tail_{ 0 };
+};
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+// One deque per worker. A worker takes from the front of its own deque and,
+// once that is empty, steals from the back of the others', so the owners and
+// the thieves mostly touch opposite ends.
+template <typename T>
+class WorkStealingQueue
+{
+public:
+	explicit WorkStealingQueue(std::size_t workers)
+		: lanes_(workers == 0 ? 1 : workers)
+	{
+	}
+
+public:
+	std::size_t GetWorkers() const noexcept
+	{
+		return lanes_.size();
+	}
+
+	void Push(std::size_t worker, T item)
+	{
+		Lane& lane = lanes_[worker % lanes_.size()];
+
+		std::lock_guard<std::mutex> lock(lane.mutex);
+		lane.items.push_back(std::move(item));
+	}
+
+	std::optional<T> Pop(std::size_t worker)
+	{
+		for (std::size_t i = 0; i < lanes_.size(); i++) {
+			Lane& lane = lanes_[(worker + i) % lanes_.size()];
+
+			std::lock_guard<std::mutex> lock(lane.mutex);
+			if (lane.items.empty())
+				continue;
+
+			if (i == 0) {
+				T item = std::move(lane.items.front());
+				lane.items.pop_front();
+				return item;
+			}
+
+			T item = std::move(lane.items.back());
+			lane.items.pop_back();
+			return item;
+		}
+
+		return std::nullopt;
+	}
+
+private:
+	struct Lane {
+		std::mutex mutex;
+		std::deque<T> items;
+	};
+
+	std::vector<Lane> lanes_;
+};
@@ -0,0 +1,110 @@
+#include "ChannelPool.hpp"
+
+#include <utility>
+
+namespace {
+	// Only there to make the channels' arguments differ.
+	constexpr char kChannelIndexArg[] = "ftp.channel_index";
+}
+
+ChannelPool::Lease::Lease(ChannelPool* pool, std::size_t index, std::uint64_t bytes) noexcept
+	: pool_(pool)
+	, index_(index)
+	, bytes_(bytes)
+{
+}
+
+ChannelPool::Lease::Lease(Lease&& other) noexcept
+	: pool_(std::exchange(other.pool_, nullptr))
+	, index_(other.index_)
+	, bytes_(other.bytes_)
+{
+}
+
+ChannelPool::Lease& ChannelPool::Lease::operator=(Lease&& other) noexcept
+{
+	if (this != &other) {
+		if (pool_)
+			pool_->Release(index_, bytes_);
+
+		pool_ = std::exchange(other.pool_, nullptr);
+		index_ = other.index_;
+		bytes_ = other.bytes_;
+	}
+
+	return *this;
+}
+
+ChannelPool::Lease::~Lease()
+{
+	if (pool_)
+		pool_->Release(index_, bytes_);
+}
+
+FTPService::Stub* ChannelPool::Lease::operator->() const noexcept
+{
+	return pool_->entries_[index_].stub.get();
+}
+
+std::vector<std::shared_ptr<grpc::Channel>>
+ChannelPool::CreateChannels(const std::string& target, const std::shared_ptr<grpc::ChannelCredentials>& creds,
+			    const grpc::ChannelArguments& args, std::size_t count)
+{
+	std::vector<std::shared_ptr<grpc::Channel>> channels;
+
+	for (std::size_t i = 0; i < count; i++) {
+		grpc::ChannelArguments own = args;
+		own.SetInt(GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+		own.SetInt(kChannelIndexArg, static_cast<int>(i));
+
+		channels.push_back(grpc::CreateCustomChannel(target, creds, own));
+	}
+
+	return channels;
+}
+
+ChannelPool::ChannelPool(const std::vector<std::shared_ptr<grpc::Channel>>& channels)
+{
+	for (const auto& channel : channels)
+		if (channel)
+			entries_.push_back(Entry{ FTPService::NewStub(channel) });
+}
+
+bool ChannelPool::IsEmpty() const noexcept
+{
+	return entries_.empty();
+}
+
+std::size_t ChannelPool::GetSize() const noexcept
+{
+	return entries_.size();
+}
+
+ChannelPool::Lease ChannelPool::Acquire(std::uint64_t bytes)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	std::size_t best = next_ % entries_.size();
+	for (std::size_t n = 1; n < entries_.size(); n++) {
+		const std::size_t i = (next_ + n) % entries_.size();
+		const Entry& entry = entries_[i];
+
+		if (entry.outstanding < entries_[best].outstanding
+		 || (entry.outstanding == entries_[best].outstanding && entry.calls < entries_[best].calls))
+			best = i;
+	}
+
+	next_ = best + 1;
+	entries_[best].outstanding += bytes;
+	entries_[best].calls++;
+
+	return Lease(this, best, bytes);
+}
+
+void ChannelPool::Release(std::size_t index, std::uint64_t bytes) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	entries_[index].outstanding -= bytes;
+	entries_[index].calls--;
+}
@@ -0,0 +1,101 @@
+#include "ChunkSizer.hpp"
+
+#include <algorithm>
+
+namespace {
+	constexpr std::size_t kWindowChunks = 16;
+	constexpr auto kMinWindow = std::chrono::milliseconds(50);
+
+	// A bigger size has to be this much faster to be kept.
+	constexpr double kGain = 1.1;
+
+	// A write blocked this long means chunks are too big for the link (or
+	// its flow-control window).
+	constexpr auto kMaxLatency = std::chrono::milliseconds(250);
+
+	constexpr std::size_t kSettledWindows = 32;
+}
+
+ChunkSizer::ChunkSizer(std::size_t initial, std::size_t max) noexcept
+	: max_(std::max(max, kMinSize))
+	, size_(std::clamp(initial, kMinSize, max_))
+	, last_(Clock::now())
+{
+}
+
+std::size_t ChunkSizer::GetSize() const noexcept
+{
+	return size_;
+}
+
+std::size_t ChunkSizer::Observe(std::size_t bytes, Clock::duration latency) noexcept
+{
+	const Clock::time_point now = Clock::now();
+	const Clock::duration elapsed = now - last_;
+	last_ = now;
+
+	if (latency > kMaxLatency && size_ > kMinSize) {
+		Resize(size_ / 2);
+		probing_ = false;
+		settled_ = 0;
+		return size_;
+	}
+
+	// Chunks read before the last resize (and the short last one) would
+	// skew the measurement of this size.
+	if (bytes != size_)
+		return size_;
+
+	window_time_ += elapsed;
+	window_bytes_ += bytes;
+	window_chunks_++;
+
+	if (window_chunks_ >= kWindowChunks && window_time_ >= kMinWindow)
+		EndWindow();
+
+	return size_;
+}
+
+void ChunkSizer::EndWindow() noexcept
+{
+	const double rate = static_cast<double>(window_bytes_) / std::chrono::duration<double>(window_time_).count();
+
+	window_time_ = Clock::duration{};
+	window_bytes_ = 0;
+	window_chunks_ = 0;
+
+	if (!probing_) {
+		if (++settled_ < kSettledWindows || size_ >= max_)
+			return;
+
+		probing_ = true;
+		previous_size_ = 0;
+	}
+
+	if (previous_size_ != 0 && rate < previous_rate_ * kGain) {
+		Resize(previous_size_);
+		probing_ = false;
+		settled_ = 0;
+		return;
+	}
+
+	previous_rate_ = rate;
+	previous_size_ = size_;
+
+	if (size_ >= max_) {
+		probing_ = false;
+		settled_ = 0;
+		return;
+	}
+
+	Resize(size_ * 2);
+}
+
+void ChunkSizer::Resize(std::size_t size) noexcept
+{
+	size_ = std::clamp(size, kMinSize, max_);
+
+	window_time_ = Clock::duration{};
+	window_bytes_ = 0;
+	window_chunks_ = 0;
+}
@@ -0,0 +1,111 @@
+#include "ContentChunker.hpp"
+
+#include <array>
+#include <bit>
+
+namespace {
+	// The table only has to be identical for every client that shares a
+	// chunk store, so it is generated from a fixed seed.
+	constexpr std::array<std::uint64_t, 256> MakeGearTable()
+	{
+		std::array<std::uint64_t, 256> table{};
+		std::uint64_t state = 0x9E3779B97F4A7C15ULL;
+
+		for (auto& entry : table) {
+			state += 0x9E3779B97F4A7C15ULL;
+			std::uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+			entry = z ^ (z >> 31);
+		}
+
+		return table;
+	}
+
+	constexpr std::array<std::uint64_t, 256> kGear = MakeGearTable();
+
+	// Using the top bits makes a boundary depend on the last 64 bytes.
+	constexpr std::uint64_t MakeMask(std::size_t avg_size)
+	{
+		const int bits = std::bit_width(avg_size) - 1;
+		return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+	}
+}
+
+ContentChunker::ContentChunker(std::size_t min_size, std::size_t avg_size, std::size_t max_size)
+	: min_size_(min_size)
+	, max_size_(max_size < min_size ? min_size : max_size)
+	, mask_(MakeMask(avg_size))
+	, hasher_(Hasher::Type::SHA256)
+{
+}
+
+std::optional<Hasher::Error> ContentChunker::Update(const char* data, std::size_t size) noexcept
+{
+	std::size_t start = 0;
+
+	for (std::size_t i = 0; i < size; i++) {
+		length_++;
+
+		if (length_ < min_size_)
+			continue;
+
+		fingerprint_ = (fingerprint_ << 1) + kGear[static_cast<unsigned char>(data[i])];
+		if ((fingerprint_ & mask_) != 0 && length_ < max_size_)
+			continue;
+
+		if (!hashing_) {
+			if (auto err = hasher_.Initialize())
+				return err;
+			hashing_ = true;
+		}
+
+		if (auto err = hasher_.Update(data + start, i + 1 - start))
+			return err;
+
+		if (auto err = Cut())
+			return err;
+
+		start = i + 1;
+	}
+
+	if (start == size)
+		return std::nullopt;
+
+	if (!hashing_) {
+		if (auto err = hasher_.Initialize())
+			return err;
+		hashing_ = true;
+	}
+
+	return hasher_.Update(data + start, size - start);
+}
+
+std::optional<Hasher::Error> ContentChunker::Finish() noexcept
+{
+	if (length_ == 0)
+		return std::nullopt;
+
+	return Cut();
+}
+
+const std::vector<ContentChunker::Chunk>& ContentChunker::GetChunks() const noexcept
+{
+	return chunks_;
+}
+
+std::optional<Hasher::Error> ContentChunker::Cut() noexcept
+{
+	auto [ok, digest, err] = hasher_.Finalize();
+	if (!ok)
+		return err;
+
+	chunks_.push_back(Chunk{ offset_, length_, std::string(digest.begin(), digest.end()) });
+
+	offset_ += length_;
+	length_ = 0;
+	fingerprint_ = 0;
+	hashing_ = false;
+
+	return std::nullopt;
+}
@@ -0,0 +1,280 @@
+#include "DeltaEncoder.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace {
+	// Unmatched data is sent once this much has piled up, which also bounds
+	// how much of the file is buffered.
+	constexpr std::size_t kMaxLiteral = 64 * BUFSIZ;
+
+	constexpr std::size_t kStrongSize = 32;
+
+	static Hasher::Error OkError()
+	{
+		return Hasher::Error{ 0, "" };
+	}
+}
+
+DeltaEncoder::DeltaEncoder(Sink sink)
+	: sink_(std::move(sink))
+	, hasher_(Hasher::Type::SHA256)
+{
+}
+
+std::optional<Hasher::Error> DeltaEncoder::AddSignatures(const BlockSignaturesResponse& resp) noexcept
+{
+	if (resp.block_size() == 0)
+		return Hasher::Error{ -1, "delta: block size is zero" };
+
+	if (block_size_ != 0 && (resp.block_size() != block_size_ || resp.filesize() != base_size_))
+		return Hasher::Error{ -1, "delta: signatures disagree on block size or file size" };
+
+	block_size_ = resp.block_size();
+	base_size_ = resp.filesize();
+
+	for (const BlockSignature& signature : resp.signatures()) {
+		if (signature.strong().size() != kStrongSize)
+			return Hasher::Error{ -1, "delta: strong checksum is not a SHA-256 digest" };
+
+		weak_[signature.weak()].push_back(strong_.size());
+		strong_.push_back(signature.strong());
+	}
+
+	if (strong_.size() > (base_size_ + block_size_ - 1) / block_size_)
+		return Hasher::Error{ -1, "delta: more signatures than blocks" };
+
+	return std::nullopt;
+}
+
+std::optional<Hasher::Error> DeltaEncoder::Update(const char* data, std::size_t size) noexcept
+{
+	if (literal_ > 0) {
+		buffer_.erase(buffer_.begin(), buffer_.begin() + static_cast<std::ptrdiff_t>(literal_));
+		pos_ -= literal_;
+		literal_ = 0;
+	}
+
+	buffer_.insert(buffer_.end(), data, data + size);
+
+	return Scan();
+}
+
+// Whatever is left after the last full window can still end in the server's
+// short last block; an unchanged file tail is the common case.
+std::optional<Hasher::Error> DeltaEncoder::Finish() noexcept
+{
+	if (auto err = Scan())
+		return err;
+
+	if (auto err = MatchTail())
+		return err;
+
+	if (auto err = EmitLiteral(buffer_.size()))
+		return err;
+
+	return FlushBlocks();
+}
+
+std::uint32_t DeltaEncoder::GetBlockSize() const noexcept
+{
+	return block_size_;
+}
+
+std::uint64_t DeltaEncoder::GetMatchedBytes() const noexcept
+{
+	return matched_;
+}
+
+std::optional<Hasher::Error> DeltaEncoder::Scan() noexcept
+{
+	const std::size_t block = block_size_;
+
+	if (strong_.empty()) {
+		pos_ = buffer_.size();
+		if (pos_ - literal_ >= kMaxLiteral)
+			return EmitLiteral(pos_);
+
+		return std::nullopt;
+	}
+
+	while (buffer_.size() - pos_ >= block) {
+		if (!rolling_) {
+			checksum_.Reset(&buffer_[pos_], block);
+			rolling_ = true;
+		}
+
+		auto [found, index, err] = Match(&buffer_[pos_], block, checksum_.Digest());
+		if (err.code != 0)
+			return err;
+
+		if (found) {
+			if (auto lerr = EmitLiteral(pos_))
+				return lerr;
+
+			if (auto berr = EmitBlock(index, block))
+				return berr;
+
+			pos_ += block;
+			literal_ = pos_;
+			rolling_ = false;
+			continue;
+		}
+
+		// Rolling needs the byte after the window; wait for more data.
+		if (pos_ + block == buffer_.size())
+			break;
+
+		checksum_.Roll(buffer_[pos_], buffer_[pos_ + block]);
+		pos_++;
+
+		if (pos_ - literal_ >= kMaxLiteral)
+			if (auto lerr = EmitLiteral(pos_))
+				return lerr;
+	}
+
+	return std::nullopt;
+}
+
+std::optional<Hasher::Error> DeltaEncoder::MatchTail() noexcept
+{
+	if (strong_.empty())
+		return std::nullopt;
+
+	const std::uint64_t last = strong_.size() - 1;
+	const std::size_t length = static_cast<std::size_t>(BlockLength(last));
+	if (length == block_size_ || length == 0 || buffer_.size() - literal_ < length)
+		return std::nullopt;
+
+	const char* tail = buffer_.data() + buffer_.size() - length;
+
+	auto [found, index, err] = Match(tail, length, RollingChecksum::Compute(tail, length));
+	if (err.code != 0)
+		return err;
+
+	if (!found)
+		return std::nullopt;
+
+	if (auto lerr = EmitLiteral(buffer_.size() - length))
+		return lerr;
+
+	if (auto berr = EmitBlock(index, length))
+		return berr;
+
+	literal_ = buffer_.size();
+	pos_ = literal_;
+
+	return std::nullopt;
+}
+
+// Prefers the block that continues the current run, so an unchanged region
+// stays one BlockRef even when the old file has repeated blocks.
+std::tuple<bool, std::uint64_t, Hasher::Error>
+DeltaEncoder::Match(const char* data, std::size_t size, std::uint32_t weak) noexcept
+{
+	const auto it = weak_.find(weak);
+	if (it == weak_.end())
+		return { false, 0, OkError() };
+
+	std::string digest;
+	std::optional<std::uint64_t> found;
+
+	for (const std::uint64_t index : it->second) {
+		if (BlockLength(index) != size)
+			continue;
+
+		if (digest.empty()) {
+			if (auto err = hasher_.Initialize())
+				return { false, 0, *err };
+
+			if (auto err = hasher_.Update(data, size))
+				return { false, 0, *err };
+
+			auto [ok, value, err] = hasher_.Finalize();
+			if (!ok)
+				return { false, 0, err };
+
+			digest.assign(value.begin(), value.end());
+		}
+
+		if (strong_[index] != digest)
+			continue;
+
+		if (run_count_ > 0 && index == run_index_ + run_count_)
+			return { true, index, OkError() };
+
+		if (!found)
+			found = index;
+	}
+
+	if (!found)
+		return { false, 0, OkError() };
+
+	return { true, *found, OkError() };
+}
+
+std::optional<Hasher::Error> DeltaEncoder::EmitLiteral(std::size_t end) noexcept
+{
+	while (literal_ < end) {
+		if (auto err = FlushBlocks())
+			return err;
+
+		const std::size_t length = std::min(kMaxLiteral, end - literal_);
+
+		req_.Clear();
+		UploadChunk* chunk = req_.mutable_chunk();
+		chunk->set_data(buffer_.data() + literal_, length);
+		chunk->set_offset(offset_);
+
+		if (auto err = Emit())
+			return err;
+
+		offset_ += length;
+		literal_ += length;
+	}
+
+	return std::nullopt;
+}
+
+std::optional<Hasher::Error> DeltaEncoder::EmitBlock(std::uint64_t index, std::size_t length) noexcept
+{
+	if (run_count_ == 0 || index != run_index_ + run_count_) {
+		if (auto err = FlushBlocks())
+			return err;
+
+		run_index_ = index;
+	}
+
+	run_count_++;
+	offset_ += length;
+	matched_ += length;
+
+	return std::nullopt;
+}
+
+std::optional<Hasher::Error> DeltaEncoder::FlushBlocks() noexcept
+{
+	if (run_count_ == 0)
+		return std::nullopt;
+
+	req_.Clear();
+	req_.mutable_block_ref()->set_index(run_index_);
+	req_.mutable_block_ref()->set_count(run_count_);
+
+	run_count_ = 0;
+
+	return Emit();
+}
+
+std::optional<Hasher::Error> DeltaEncoder::Emit() noexcept
+{
+	if (!sink_(req_))
+		return Hasher::Error{ kSinkFailed, "failed to write delta" };
+
+	return std::nullopt;
+}
+
+std::uint64_t DeltaEncoder::BlockLength(std::uint64_t index) const noexcept
+{
+	return std::min<std::uint64_t>(block_size_, base_size_ - index * block_size_);
+}
@@ -1,10 +1,19 @@
 #include "FTPClient.hpp"
 
+#include <system_error>
 #include <string_view>
 #include <filesystem>
+#include <algorithm>
+#include <functional>
 #include <vector>
 #include <memory>
 #include <string>
+#include <unordered_set>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <atomic>
+#include <mutex>
 #include <tuple>
 
 #include <cstdint>
@@ -12,14 +21,23 @@
 
 #include <grpcpp/grpcpp.h>
 
+#include "fmt/core.h"
+
 #include "Hasher.hpp"
 #include "ftp_service.pb.h"
 #include "hash.pb.h"
 #include "file.pb.h"
 
 #include "HashingFileStream.hpp"
+#include "SendPipeline.hpp"
+#include "ChunkSizer.hpp"
+#include "WorkStealingQueue.hpp"
 
 namespace {
+	// Error code for a failed ClientWriter::Write(); the server has closed the
+	// stream and Finish() holds the reason.
+	constexpr int kStreamClosed = -2;
+
 	static FTPClient::Error OkError()
 	{
 		return FTPClient::Error{ 0, "" };
@@ -35,11 +53,47 @@ namespace {
 		return FTPClient::Error{ static_cast<int>(st.error_code()), st.error_message() };
 	}
 
+	// For weighing a transfer in the channel pool; 0 if it can't be stat'ed.
+	static std::uint64_t LocalFileSize(const std::string& path)
+	{
+		std::error_code ec;
+		const std::uint64_t size = std::filesystem::file_size(path, ec);
+
+		return ec ? 0 : size;
+	}
+
+	// Chunk size to start from, or to use when it isn't adapted.
+	constexpr std::size_t kDefaultChunkSize = 64 * BUFSIZ;
+
+	// Files bigger than this don't belong in a batch, which reads them whole.
+	constexpr std::uint64_t kMaxBatchFileSize = 64ULL * 1024 * 1024;
+
+	static UploadBatchResult MakeBatchFailure(const std::string& filepath, const FTPClient::Error& err)
+	{
+		UploadBatchResult result;
+		result.set_filepath(filepath);
+		result.set_code(err.code != 0 ? err.code : -1);
+		result.set_message(err.message);
+
+		return result;
+	}
+
+	static std::string MakeUploadId()
+	{
+		std::random_device rd;
+		std::uniform_int_distribution<std::uint64_t> dist;
+
+		return fmt::format("{:016x}{:016x}", dist(rd), dist(rd));
+	}
+
 	static std::optional<Hasher::Type> MapHashTypeOptional(HashType hashtype)
 	{
 		switch (hashtype) {
 		case HASH_TYPE_SHA256: return Hasher::Type::SHA256;
 		case HASH_TYPE_SHA512: return Hasher::Type::SHA512;
+		case HASH_TYPE_SHA256_TREE: return Hasher::Type::SHA256Tree;
+		case HASH_TYPE_XXH3_128: return Hasher::Type::XXH3_128;
+		case HASH_TYPE_CRC32C: return Hasher::Type::CRC32C;
 		case HASH_TYPE_UNSPECIFIED:
 		default:
 			return std::nullopt;
@@ -47,35 +101,88 @@ namespace {
 
 		return std::nullopt;
 	}
+
+	static CompressionType MapCompressionType(Codec::Type type)
+	{
+		switch (type) {
+		case Codec::Type::Zstd: return COMPRESSION_TYPE_ZSTD;
+		case Codec::Type::Lz4:  return COMPRESSION_TYPE_LZ4;
+		case Codec::Type::None:
+		default:
+			return COMPRESSION_TYPE_NONE;
+		}
+	}
 }
 
 FTPClient::FTPClient(std::shared_ptr<grpc::Channel> channel)
-    : stub_(FTPService::NewStub(std::move(channel)))
+    : FTPClient(std::move(channel), Options{})
+{
+}
+
+FTPClient::FTPClient(std::shared_ptr<grpc::Channel> channel, const Options &options)
+    : FTPClient(std::vector<std::shared_ptr<grpc::Channel>>{ std::move(channel) }, options)
+{
+}
+
+FTPClient::FTPClient(const std::vector<std::shared_ptr<grpc::Channel>> &channels, const Options &options)
+    : pool_(channels)
+    , options_(options)
 {
 }
 
 std::tuple<bool, FileMetaData, FTPClient::Error>
-FTPClient::UploadFile(const std::string& infile, const std::string& outpath, const HashType &hashtype)
+FTPClient::UploadFile(const std::string& infile, const std::string& outpath, const HashType &hashtype, bool resume)
 {
-    if (!stub_)
-        return { false, FileMetaData{}, MakeErr(-1, "stub not initialized") };
+    if (pool_.IsEmpty())
+        return { false, FileMetaData{}, MakeErr(-1, "no channel to the server") };
 
     if (infile.empty() || outpath.empty())
         return { false, FileMetaData{}, MakeErr(-1, "infile/outpath is empty") };
 
+    if (!resume)
+        return UploadFileFrom(infile, outpath, hashtype, 0);
+
+    auto [offset, qerr] = QueryResumeOffset(infile, outpath, hashtype);
+    if (qerr.code != 0)
+        return { false, FileMetaData{}, qerr };
+
+    auto result = UploadFileFrom(infile, outpath, hashtype, offset);
+
+    // The server dropped the partial upload (e.g. it no longer matches its
+    // journal); the only way forward is to start over.
+    const auto& [ok, metadata, err] = result;
+    if (!ok && offset != 0 && err.code == static_cast<int>(grpc::StatusCode::FAILED_PRECONDITION))
+        return UploadFileFrom(infile, outpath, hashtype, 0);
+
+    return result;
+}
+
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::UploadFileFrom(const std::string& infile, const std::string& outpath, const HashType &hashtype, std::uint64_t offset)
+{
+    const std::uint64_t size = LocalFileSize(infile);
+    ChannelPool::Lease stub = pool_.Acquire(size > offset ? size - offset : 0);
+
     grpc::ClientContext ctx;
     UploadFileResponse resp;
 
-    WriterPtr writer = stub_->UploadFile(&ctx, &resp);
+    WriterPtr writer = stub->UploadFile(&ctx, &resp);
     if (!writer)
         return { false, FileMetaData{}, MakeErr(-1, "failed to create ClientWriter") };
 
-    if (auto err = SendPath(writer, infile, outpath, hashtype)) {
+    if (auto err = SendPath(writer, infile, outpath, hashtype, offset != 0)) {
         ctx.TryCancel();
         return { false, FileMetaData{}, *err };
     }
 
-    auto [hash, herr] = SendChunk(writer, infile, hashtype);
+    auto [hash, herr] = SendChunk(writer, infile, hashtype, offset);
+    if (herr.code == kStreamClosed) {
+        if (grpc::Status st = writer->Finish(); !st.ok())
+            return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+        return { false, FileMetaData{}, herr };
+    }
+
     if (herr.code != 0) {
         ctx.TryCancel();
         return { false, FileMetaData{}, herr };
@@ -98,6 +205,836 @@ FTPClient::UploadFile(const std::string& infile, const std::string& outpath, con
     return { true, resp.metadata(), OkError() };
 }
 
+std::tuple<bool, std::vector<UploadBatchResult>, FTPClient::Error>
+FTPClient::UploadBatch(const std::vector<std::pair<std::string, std::string>> &files, const HashType &hashtype)
+{
+    if (pool_.IsEmpty())
+        return { false, {}, MakeErr(-1, "no channel to the server") };
+
+    const auto hasher_type = MapHashTypeOptional(hashtype);
+    if (hashtype != HASH_TYPE_UNSPECIFIED && !hasher_type)
+        return { false, {}, MakeErr(-1, "invalid hashtype") };
+
+    ChannelPool::Lease stub = pool_.Acquire();
+
+    grpc::ClientContext ctx;
+    auto stream = stub->UploadBatch(&ctx);
+    if (!stream)
+        return { false, {}, MakeErr(-1, "failed to create ClientReaderWriter") };
+
+    // Results may come back while files are still being sent, so they are
+    // read on another thread; otherwise both sides could stall on flow control.
+    std::vector<UploadBatchResult> received;
+    std::thread reader([&] {
+        UploadBatchResponse resp;
+        while (stream->Read(&resp))
+            for (auto& result : *resp.mutable_results())
+                received.push_back(std::move(result));
+    });
+
+    std::vector<UploadBatchResult> results(files.size());
+    std::vector<std::size_t> sent;
+
+    const std::size_t chunk_size = GetChunkSize();
+    const grpc::WriteOptions hint = grpc::WriteOptions().set_buffer_hint();
+
+    Codec codec(options_.compression);
+    std::string content, scratch;
+    UploadFileRequest req;
+
+    for (std::size_t i = 0; i < files.size(); i++) {
+        const auto& [infile, outpath] = files[i];
+
+        std::error_code ec;
+        const std::uint64_t size = std::filesystem::file_size(infile, ec);
+        if (ec) {
+            results[i] = MakeBatchFailure(outpath, MakeErr(-1, "failed to stat infile: " + ec.message()));
+            continue;
+        }
+
+        if (size > kMaxBatchFileSize) {
+            results[i] = MakeBatchFailure(outpath, MakeErr(-1, "infile is too big for a batch"));
+            continue;
+        }
+
+        FileStream file(infile);
+        if (auto err = file.Open(std::ios::binary | std::ios::in)) {
+            results[i] = MakeBatchFailure(outpath, MakeErr(err->code, "failed to open infile: " + err->message));
+            continue;
+        }
+
+        content.resize(static_cast<std::size_t>(size));
+        auto [ok_read, len, rerr] = file.Read(content.data(), static_cast<std::streamsize>(size));
+        (void)file.Close();
+
+        if (!ok_read) {
+            results[i] = MakeBatchFailure(outpath, MakeErr(rerr.code, "failed to read infile: " + rerr.message));
+            continue;
+        }
+
+        if (static_cast<std::uint64_t>(len) != size) {
+            results[i] = MakeBatchFailure(outpath, MakeErr(-1, "infile changed while it was read"));
+            continue;
+        }
+
+        Hash hash;
+        if (hasher_type) {
+            Hasher hasher(*hasher_type);
+            std::vector<uint8_t> digest;
+
+            std::optional<Hasher::Error> herr = hasher.Initialize();
+            if (!herr)
+                herr = hasher.Update(content);
+            if (!herr) {
+                auto [ok_hash, d, ferr] = hasher.Finalize();
+                if (ok_hash)
+                    digest = std::move(d);
+                else
+                    herr = ferr;
+            }
+
+            if (herr) {
+                results[i] = MakeBatchFailure(outpath, MakeErr(herr->code, "failed to hash infile: " + herr->message));
+                continue;
+            }
+
+            hash.set_hashtype(hashtype);
+            hash.set_data(digest.data(), digest.size());
+        }
+
+        UploadInit* init = req.mutable_init();
+        init->Clear();
+        init->set_filepath(outpath);
+        init->set_filesize(size);
+        if (hasher_type)
+            init->set_hashtype(hashtype);
+        if (options_.compression != Codec::Type::None)
+            init->set_compression(MapCompressionType(options_.compression));
+        if (options_.create_parents)
+            init->set_create_parents(true);
+
+        bool ok = stream->Write(req, hint);
+
+        for (std::uint64_t offset = 0; ok && offset < size; offset += chunk_size) {
+            const std::size_t n = static_cast<std::size_t>(std::min<std::uint64_t>(chunk_size, size - offset));
+            UploadChunk* chunk = req.mutable_chunk();
+
+            FillChunk(*chunk, std::string_view(content.data() + offset, n), codec, scratch);
+            chunk->set_offset(offset);
+
+            ok = stream->Write(req, hint);
+        }
+
+        if (ok && hasher_type) {
+            *req.mutable_finish()->mutable_hash() = hash;
+            ok = stream->Write(req, hint);
+        }
+
+        // The server closed the stream; Finish() says why.
+        if (!ok)
+            break;
+
+        sent.push_back(i);
+    }
+
+    stream->WritesDone();
+    reader.join();
+
+    const grpc::Status st = stream->Finish();
+
+    for (std::size_t n = 0; n < sent.size() && n < received.size(); n++)
+        results[sent[n]] = std::move(received[n]);
+
+    if (!st.ok())
+        return { false, std::move(results), MakeGrpcErr(st) };
+
+    if (received.size() != sent.size())
+        return { false, std::move(results), MakeErr(-1, fmt::format("server returned {} results for {} files", received.size(), sent.size())) };
+
+    return { true, std::move(results), OkError() };
+}
+
+// Files are dealt out largest first, so every worker starts on a big file and
+// the small ones fill in at the end, rather than a big file starting last and
+// running alone. Idle workers steal from the others.
+std::tuple<bool, FTPClient::TreeSummary, FTPClient::Error>
+FTPClient::UploadTree(const std::string &indir, const std::string &outdir, const HashType &hashtype, std::size_t concurrency)
+{
+    TreeSummary summary;
+
+    if (pool_.IsEmpty())
+        return { false, summary, MakeErr(-1, "no channel to the server") };
+
+    if (indir.empty() || outdir.empty())
+        return { false, summary, MakeErr(-1, "indir/outdir is empty") };
+
+    struct Entry {
+        std::filesystem::path local;
+        std::string remote;
+        std::uint64_t size;
+    };
+    std::vector<Entry> entries;
+
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(indir, ec), end; !ec && it != end; it.increment(ec)) {
+        std::error_code ec_entry;
+        if (!it->is_regular_file(ec_entry))
+            continue;
+
+        const std::uint64_t size = it->file_size(ec_entry);
+        if (ec_entry) {
+            summary.failures.emplace_back(it->path().string(), MakeErr(-1, "failed to stat: " + ec_entry.message()));
+            continue;
+        }
+
+        const std::filesystem::path remote = std::filesystem::path(outdir) / it->path().lexically_relative(indir);
+        entries.push_back(Entry{ it->path(), remote.generic_string(), size });
+    }
+
+    if (ec)
+        return { false, summary, MakeErr(-1, "failed to list " + indir + ": " + ec.message()) };
+
+    std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.size > b.size; });
+    summary.files = entries.size() + summary.failures.size();
+
+    const std::size_t workers = std::clamp<std::size_t>(concurrency, 1, std::max<std::size_t>(entries.size(), 1));
+    WorkStealingQueue<std::size_t> queue(workers);
+    for (std::size_t i = 0; i < entries.size(); i++)
+        queue.Push(i % workers, i);
+
+    std::mutex mutex;
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (std::size_t w = 0; w < workers; w++)
+        threads.emplace_back([&, w] {
+            while (const auto index = queue.Pop(w)) {
+                const Entry& entry = entries[*index];
+                auto [ok, metadata, err] = UploadFile(entry.local.string(), entry.remote, hashtype);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                if (ok) {
+                    summary.uploaded++;
+                    summary.bytes += entry.size;
+                } else {
+                    summary.failures.emplace_back(entry.local.string(), std::move(err));
+                }
+            }
+        });
+
+    for (auto& thread : threads)
+        thread.join();
+
+    summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    return { true, std::move(summary), OkError() };
+}
+
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::UploadFileStriped(const std::string& infile, const std::string& outpath, const HashType &hashtype,
+                             std::size_t streams, std::uint64_t stripe_size)
+{
+    if (pool_.IsEmpty())
+        return { false, FileMetaData{}, MakeErr(-1, "no channel to the server") };
+
+    if (infile.empty() || outpath.empty())
+        return { false, FileMetaData{}, MakeErr(-1, "infile/outpath is empty") };
+
+    if (stripe_size == 0)
+        return { false, FileMetaData{}, MakeErr(-1, "stripe size must not be zero") };
+
+    std::error_code ec;
+    const std::uint64_t size = std::filesystem::file_size(infile, ec);
+    if (ec)
+        return { false, FileMetaData{}, MakeErr(-1, "failed to stat infile: " + ec.message()) };
+
+    if (streams <= 1 || size <= stripe_size)
+        return UploadFile(infile, outpath, hashtype);
+
+    const std::string upload_id = MakeUploadId();
+    const std::uint64_t count = (size + stripe_size - 1) / stripe_size;
+
+    std::atomic<std::uint64_t> next{ 0 };
+    std::atomic<bool> failed{ false };
+    std::mutex mutex;
+    Error first_error = OkError();
+
+    // Each worker owns one stream at a time and pulls the next stripe when its
+    // current one is done, so a slow stream doesn't hold up the others.
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < std::min<std::uint64_t>(streams, count); i++) {
+        workers.emplace_back([&] {
+            while (!failed.load(std::memory_order_relaxed)) {
+                const std::uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+                if (index >= count)
+                    break;
+
+                UploadStripe stripe;
+                stripe.set_upload_id(upload_id);
+                stripe.set_offset(index * stripe_size);
+                stripe.set_length(std::min(stripe_size, size - index * stripe_size));
+
+                if (auto err = SendStripe(infile, outpath, hashtype, stripe)) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!failed.exchange(true))
+                        first_error = std::move(*err);
+                    break;
+                }
+            }
+        });
+    }
+
+    for (auto& worker : workers)
+        worker.join();
+
+    if (failed)
+        return { false, FileMetaData{}, first_error };
+
+    grpc::ClientContext ctx;
+    CommitUploadRequest req;
+    UploadFileResponse resp;
+
+    req.set_upload_id(upload_id);
+    req.set_filepath(outpath);
+
+    grpc::Status st = pool_.Acquire()->CommitUpload(&ctx, req, &resp);
+    if (!st.ok())
+        return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+    return { true, resp.metadata(), OkError() };
+}
+
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::UploadFileDedup(const std::string& infile, const std::string& outpath, const HashType &hashtype)
+{
+    if (pool_.IsEmpty())
+        return { false, FileMetaData{}, MakeErr(-1, "no channel to the server") };
+
+    if (infile.empty() || outpath.empty())
+        return { false, FileMetaData{}, MakeErr(-1, "infile/outpath is empty") };
+
+    const auto hasher_type = MapHashTypeOptional(hashtype);
+    if (!hasher_type)
+        return { false, FileMetaData{}, MakeErr(-1, "dedup upload requires a hashtype") };
+
+    constexpr std::size_t kBufferSize = 64 * BUFSIZ;
+    std::vector<char> buffer(kBufferSize);
+
+    // First pass: chunk boundaries, chunk digests and the whole-file hash.
+    ContentChunker chunker;
+    Hash hash;
+    {
+        HashingFileStream stream(infile, *hasher_type);
+        if (const auto &error = stream.Open(std::ios::binary | std::ios::in))
+            return { false, FileMetaData{}, MakeErr(-1, "failed to open infile: " + error->message) };
+
+        while (true) {
+            const auto &[ok, len, err] = stream.Read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            if (!ok)
+                return { false, FileMetaData{}, MakeErr(-1, "failed to read infile: " + err.message) };
+
+            if (len <= 0)
+                break;
+
+            if (auto herr = chunker.Update(buffer.data(), static_cast<std::size_t>(len)))
+                return { false, FileMetaData{}, MakeErr(herr->code, "failed to chunk infile: " + herr->message) };
+        }
+
+        if (auto herr = chunker.Finish())
+            return { false, FileMetaData{}, MakeErr(herr->code, "failed to chunk infile: " + herr->message) };
+
+        if (const auto err = stream.Close())
+            return { false, FileMetaData{}, MakeErr(err->code, "failed to close infile: " + err->message) };
+
+        hash.set_hashtype(hashtype);
+        hash.set_data(stream.GetHash()->data(), stream.GetHash()->size());
+    }
+
+    const auto& chunks = chunker.GetChunks();
+
+    auto [missing, merr] = FindMissingChunks(chunks);
+    if (merr.code != 0)
+        return { false, FileMetaData{}, merr };
+
+    auto [ok, metadata, err] = SendDedupChunks(infile, outpath, hashtype, chunks, missing, hash);
+
+    // A chunk the server said it had may have been removed from its store
+    // since (the store can be size-limited); send every chunk's data instead.
+    if (!ok && err.code == static_cast<int>(grpc::StatusCode::FAILED_PRECONDITION)) {
+        missing.assign(chunks.size(), true);
+        return SendDedupChunks(infile, outpath, hashtype, chunks, missing, hash);
+    }
+
+    return { ok, std::move(metadata), err };
+}
+
+// Second pass of UploadFileDedup(): sends the missing chunks' data and
+// refers to the rest.
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::SendDedupChunks(const std::string& infile, const std::string& outpath, const HashType &hashtype,
+                           const std::vector<ContentChunker::Chunk>& chunks, const std::vector<bool>& missing, const Hash& hash)
+{
+    FileStream stream(infile);
+    if (const auto &error = stream.Open(std::ios::binary | std::ios::in))
+        return { false, FileMetaData{}, MakeErr(-1, "failed to open infile: " + error->message) };
+
+    std::uint64_t missing_bytes = 0;
+    for (std::size_t i = 0; i < chunks.size(); i++)
+        if (missing[i])
+            missing_bytes += chunks[i].length;
+
+    ChannelPool::Lease stub = pool_.Acquire(missing_bytes);
+
+    grpc::ClientContext ctx;
+    UploadFileResponse resp;
+
+    WriterPtr writer = stub->UploadFile(&ctx, &resp);
+    if (!writer)
+        return { false, FileMetaData{}, MakeErr(-1, "failed to create ClientWriter") };
+
+    if (auto err = SendPath(writer, infile, outpath, hashtype)) {
+        ctx.TryCancel();
+        return { false, FileMetaData{}, *err };
+    }
+
+    std::unordered_set<std::string> sent;
+    UploadFileRequest req;
+
+    for (std::size_t i = 0; i < chunks.size(); i++) {
+        const ContentChunker::Chunk& chunk = chunks[i];
+
+        if (missing[i] && sent.insert(chunk.digest).second) {
+            std::string* data = req.mutable_dedup_chunk()->mutable_data();
+            data->resize(chunk.length);
+
+            if (const auto &error = stream.Seek(static_cast<std::streamoff>(chunk.offset))) {
+                ctx.TryCancel();
+                return { false, FileMetaData{}, MakeErr(-1, "failed to seek infile: " + error->message) };
+            }
+
+            const auto &[ok, len, err] = stream.Read(*data);
+            if (!ok || static_cast<std::uint64_t>(len) != chunk.length) {
+                ctx.TryCancel();
+                return { false, FileMetaData{}, MakeErr(-1, "failed to read infile: " + err.message) };
+            }
+
+            req.mutable_dedup_chunk()->set_digest(chunk.digest);
+        } else {
+            req.mutable_chunk_ref()->set_digest(chunk.digest);
+            req.mutable_chunk_ref()->set_length(chunk.length);
+        }
+
+        if (!writer->Write(req)) {
+            if (grpc::Status st = writer->Finish(); !st.ok())
+                return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+            return { false, FileMetaData{}, MakeErr(-1, "failed to write chunk") };
+        }
+    }
+
+    if (auto err = SendHash(writer, hash)) {
+        ctx.TryCancel();
+        return { false, FileMetaData{}, *err };
+    }
+
+    writer->WritesDone();
+    grpc::Status st = writer->Finish();
+    if (!st.ok())
+        return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+    if (resp.hash().hashtype() != hash.hashtype() || resp.hash().data() != hash.data())
+        return { false, FileMetaData{}, MakeErr(-1, "server returned hash mismatch") };
+
+    return { true, resp.metadata(), OkError() };
+}
+
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::UploadFileDelta(const std::string& infile, const std::string& outpath, const HashType &hashtype, std::uint64_t *bytes_saved)
+{
+    if (pool_.IsEmpty())
+        return { false, FileMetaData{}, MakeErr(-1, "no channel to the server") };
+
+    if (infile.empty() || outpath.empty())
+        return { false, FileMetaData{}, MakeErr(-1, "infile/outpath is empty") };
+
+    const auto hasher_type = MapHashTypeOptional(hashtype);
+    if (!hasher_type)
+        return { false, FileMetaData{}, MakeErr(-1, "delta upload requires a hashtype") };
+
+    if (bytes_saved)
+        *bytes_saved = 0;
+
+    grpc::ClientContext ctx;
+    UploadFileResponse resp;
+    WriterPtr writer;
+
+    DeltaEncoder encoder([&writer](const UploadFileRequest& req) { return writer->Write(req); });
+
+    // Nothing to diff against: this is just a normal upload.
+    if (auto err = FetchSignatures(outpath, encoder)) {
+        if (err->code == static_cast<int>(grpc::StatusCode::NOT_FOUND))
+            return UploadFile(infile, outpath, hashtype);
+
+        return { false, FileMetaData{}, *err };
+    }
+
+    HashingFileStream stream(infile, *hasher_type);
+    if (const auto &error = stream.Open(std::ios::binary | std::ios::in))
+        return { false, FileMetaData{}, MakeErr(-1, "failed to open infile: " + error->message) };
+
+    // Literals are at most the whole file.
+    ChannelPool::Lease stub = pool_.Acquire(LocalFileSize(infile));
+
+    writer = stub->UploadFile(&ctx, &resp);
+    if (!writer)
+        return { false, FileMetaData{}, MakeErr(-1, "failed to create ClientWriter") };
+
+    DeltaBase delta;
+    delta.set_block_size(encoder.GetBlockSize());
+
+    if (auto err = SendPath(writer, infile, outpath, hashtype, false, nullptr, &delta)) {
+        ctx.TryCancel();
+        return { false, FileMetaData{}, *err };
+    }
+
+    constexpr std::size_t kBufferSize = 64 * BUFSIZ;
+    std::vector<char> buffer(kBufferSize);
+
+    std::optional<Hasher::Error> herr;
+    while (!herr) {
+        const auto &[ok, len, err] = stream.Read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        if (!ok) {
+            ctx.TryCancel();
+            return { false, FileMetaData{}, MakeErr(-1, "failed to read infile: " + err.message) };
+        }
+
+        if (len <= 0) {
+            herr = encoder.Finish();
+            break;
+        }
+
+        herr = encoder.Update(buffer.data(), static_cast<std::size_t>(len));
+    }
+
+    if (herr && herr->code == DeltaEncoder::kSinkFailed) {
+        if (grpc::Status st = writer->Finish(); !st.ok())
+            return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+        return { false, FileMetaData{}, MakeErr(kStreamClosed, herr->message) };
+    }
+
+    if (herr) {
+        ctx.TryCancel();
+        return { false, FileMetaData{}, MakeErr(herr->code, "failed to encode delta: " + herr->message) };
+    }
+
+    if (const auto err = stream.Close()) {
+        ctx.TryCancel();
+        return { false, FileMetaData{}, MakeErr(err->code, "failed to close infile: " + err->message) };
+    }
+
+    Hash hash;
+    hash.set_hashtype(hashtype);
+    hash.set_data(stream.GetHash()->data(), stream.GetHash()->size());
+
+    if (auto err = SendHash(writer, hash)) {
+        ctx.TryCancel();
+        return { false, FileMetaData{}, *err };
+    }
+
+    writer->WritesDone();
+    grpc::Status st = writer->Finish();
+
+    // The server's copy changed after its signatures were taken, so the
+    // rebuilt file didn't verify; the old version is still in place.
+    if (st.error_code() == grpc::StatusCode::DATA_LOSS)
+        return UploadFile(infile, outpath, hashtype);
+
+    if (!st.ok())
+        return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+    if (resp.hash().hashtype() != hash.hashtype() || resp.hash().data() != hash.data())
+        return { false, FileMetaData{}, MakeErr(-1, "server returned hash mismatch") };
+
+    if (bytes_saved)
+        *bytes_saved = resp.bytes_saved();
+
+    return { true, resp.metadata(), OkError() };
+}
+
+std::optional<FTPClient::Error>
+FTPClient::FetchSignatures(const std::string& outpath, DeltaEncoder& encoder)
+{
+    grpc::ClientContext ctx;
+    BlockSignaturesRequest req;
+
+    req.set_filepath(outpath);
+
+    ChannelPool::Lease stub = pool_.Acquire();
+    std::unique_ptr<grpc::ClientReader<BlockSignaturesResponse>> reader = stub->GetBlockSignatures(&ctx, req);
+    if (!reader)
+        return MakeErr(-1, "failed to create ClientReader");
+
+    BlockSignaturesResponse resp;
+    while (reader->Read(&resp)) {
+        if (auto err = encoder.AddSignatures(resp)) {
+            ctx.TryCancel();
+            (void)reader->Finish();
+            return MakeErr(err->code, err->message);
+        }
+    }
+
+    grpc::Status st = reader->Finish();
+    if (!st.ok())
+        return MakeGrpcErr(st);
+
+    if (encoder.GetBlockSize() == 0)
+        return MakeErr(-1, "server sent no block signatures");
+
+    return std::nullopt;
+}
+
+std::tuple<std::vector<bool>, FTPClient::Error>
+FTPClient::FindMissingChunks(const std::vector<ContentChunker::Chunk>& chunks)
+{
+    // Keeps each request far below the default 4 MiB message limit.
+    constexpr std::size_t kBatchSize = 16384;
+
+    std::vector<bool> missing(chunks.size(), false);
+
+    for (std::size_t base = 0; base < chunks.size(); base += kBatchSize) {
+        const std::size_t end = std::min(chunks.size(), base + kBatchSize);
+
+        grpc::ClientContext ctx;
+        FindMissingChunksRequest req;
+        FindMissingChunksResponse resp;
+
+        for (std::size_t i = base; i < end; i++)
+            req.add_digests(chunks[i].digest);
+
+        grpc::Status st = pool_.Acquire()->FindMissingChunks(&ctx, req, &resp);
+        if (!st.ok())
+            return { std::vector<bool>{}, MakeGrpcErr(st) };
+
+        for (const uint32_t index : resp.missing()) {
+            if (index >= end - base)
+                return { std::vector<bool>{}, MakeErr(-1, "server returned an invalid chunk index") };
+
+            missing[base + index] = true;
+        }
+    }
+
+    return { std::move(missing), OkError() };
+}
+
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::DownloadFile(const std::string& remotepath, const std::string& outfile, const HashType &hashtype,
+                        std::optional<std::uint64_t> offset, std::optional<std::uint64_t> length)
+{
+    if (pool_.IsEmpty())
+        return { false, FileMetaData{}, MakeErr(-1, "no channel to the server") };
+
+    if (remotepath.empty() || outfile.empty())
+        return { false, FileMetaData{}, MakeErr(-1, "remotepath/outfile is empty") };
+
+    const auto hasher_type = MapHashTypeOptional(hashtype);
+    if (!hasher_type)
+        return { false, FileMetaData{}, MakeErr(-1, "download requires a hashtype") };
+
+    grpc::ClientContext ctx;
+    DownloadFileRequest req;
+
+    req.set_filepath(remotepath);
+    req.set_hashtype(hashtype);
+    if (offset)
+        req.set_offset(*offset);
+    if (length)
+        req.set_length(*length);
+
+    ChannelPool::Lease stub = pool_.Acquire(length.value_or(0));
+    std::unique_ptr<grpc::ClientReader<DownloadFileResponse>> reader = stub->DownloadFile(&ctx, req);
+    if (!reader)
+        return { false, FileMetaData{}, MakeErr(-1, "failed to create ClientReader") };
+
+    auto fail = [&](Error err) -> std::tuple<bool, FileMetaData, Error> {
+        ctx.TryCancel();
+        (void)reader->Finish();
+        return { false, FileMetaData{}, std::move(err) };
+    };
+
+    DownloadFileResponse resp;
+    if (!reader->Read(&resp) || resp.response_case() != DownloadFileResponse::kInit) {
+        if (grpc::Status st = reader->Finish(); !st.ok())
+            return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+        return { false, FileMetaData{}, MakeErr(-1, "first message must be init") };
+    }
+
+    const FileMetaData metadata = resp.init().metadata();
+    const std::uint64_t first = resp.init().offset();
+    const std::uint64_t expected = resp.init().length();
+
+    HashingFileStream stream(outfile, *hasher_type);
+    if (const auto &error = stream.Open(std::ios::binary | std::ios::out | std::ios::trunc))
+        return fail(MakeErr(-1, "failed to open outfile: " + error->message));
+
+    std::uint64_t received = 0;
+    while (received < expected && reader->Read(&resp)) {
+        if (resp.response_case() != DownloadFileResponse::kChunk)
+            return fail(MakeErr(-1, "unexpected message before all chunks arrived"));
+
+        const DownloadChunk& chunk = resp.chunk();
+        if (chunk.offset() != first + received || chunk.data().size() > expected - received)
+            return fail(MakeErr(-1, "chunk does not continue the requested range"));
+
+        if (const auto &error = stream.Write(chunk.data()))
+            return fail(MakeErr(-1, "failed to write outfile: " + error->message));
+
+        received += chunk.data().size();
+    }
+
+    if (received != expected)
+        return fail(MakeErr(-1, "stream ended before the requested range was received"));
+
+    if (const auto &error = stream.Close())
+        return fail(MakeErr(error->code, "failed to close outfile: " + error->message));
+
+    if (!reader->Read(&resp) || resp.response_case() != DownloadFileResponse::kFinish || !resp.finish().has_hash())
+        return fail(MakeErr(-1, "missing finish message"));
+
+    grpc::Status st = reader->Finish();
+    if (!st.ok())
+        return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+    const Hash& hash = resp.finish().hash();
+    const auto& digest = stream.GetHash();
+    if (hash.hashtype() != hashtype || !digest || hash.data() != std::string(digest->begin(), digest->end()))
+        return { false, FileMetaData{}, MakeErr(-1, "downloaded data does not match server hash") };
+
+    return { true, metadata, OkError() };
+}
+
+std::tuple<bool, FileMetaData, FTPClient::Error>
+FTPClient::Stat(const std::string& remotepath)
+{
+    if (pool_.IsEmpty())
+        return { false, FileMetaData{}, MakeErr(-1, "no channel to the server") };
+
+    grpc::ClientContext ctx;
+    StatRequest req;
+    FileMetaData resp;
+
+    req.set_path(remotepath);
+
+    grpc::Status st = pool_.Acquire()->Stat(&ctx, req, &resp);
+    if (!st.ok())
+        return { false, FileMetaData{}, MakeGrpcErr(st) };
+
+    return { true, resp, OkError() };
+}
+
+std::tuple<bool, std::string, FTPClient::Error>
+FTPClient::ListDirectory(const ListDirectoryRequest& request, const std::function<void(const FileMetaData&)>& each)
+{
+    if (pool_.IsEmpty())
+        return { false, std::string{}, MakeErr(-1, "no channel to the server") };
+
+    grpc::ClientContext ctx;
+
+    std::unique_ptr<grpc::ClientReader<ListDirectoryResponse>> reader = pool_.Acquire()->ListDirectory(&ctx, request);
+    if (!reader)
+        return { false, std::string{}, MakeErr(-1, "failed to create ClientReader") };
+
+    ListDirectoryResponse resp;
+    std::string next_page_token;
+    while (reader->Read(&resp)) {
+        for (const FileMetaData& entry : resp.entries())
+            each(entry);
+
+        if (!resp.next_page_token().empty())
+            next_page_token = resp.next_page_token();
+    }
+
+    grpc::Status st = reader->Finish();
+    if (!st.ok())
+        return { false, std::string{}, MakeGrpcErr(st) };
+
+    return { true, next_page_token, OkError() };
+}
+
+std::optional<FTPClient::Error>
+FTPClient::SendStripe(const std::string& infile, const std::string& outpath, const HashType &hashtype, const UploadStripe &stripe)
+{
+    ChannelPool::Lease stub = pool_.Acquire(stripe.length());
+
+    grpc::ClientContext ctx;
+    UploadFileResponse resp;
+
+    WriterPtr writer = stub->UploadFile(&ctx, &resp);
+    if (!writer)
+        return MakeErr(-1, "failed to create ClientWriter");
+
+    if (auto err = SendPath(writer, infile, outpath, hashtype, false, &stripe)) {
+        ctx.TryCancel();
+        return err;
+    }
+
+    auto [hash, herr] = SendRange(writer, infile, hashtype, stripe.offset(), stripe.length());
+    if (herr.code == kStreamClosed) {
+        if (grpc::Status st = writer->Finish(); !st.ok())
+            return MakeGrpcErr(st);
+
+        return herr;
+    }
+
+    if (herr.code != 0) {
+        ctx.TryCancel();
+        return herr;
+    }
+
+    if (auto err = SendHash(writer, hash)) {
+        ctx.TryCancel();
+        return err;
+    }
+
+    writer->WritesDone();
+    grpc::Status st = writer->Finish();
+    if (!st.ok())
+        return MakeGrpcErr(st);
+
+    if (resp.hash().hashtype() != HASH_TYPE_UNSPECIFIED && !resp.hash().data().empty())
+        if (resp.hash().hashtype() != hash.hashtype() || resp.hash().data() != hash.data())
+            return MakeErr(-1, "server returned hash mismatch");
+
+    return std::nullopt;
+}
+
+std::tuple<std::uint64_t, FTPClient::Error>
+FTPClient::QueryResumeOffset(const std::string_view infile, const std::string_view outpath, const HashType &hashtype)
+{
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(infile, ec);
+    if (ec)
+        return { 0, MakeErr(-1, "failed to stat infile: " + ec.message()) };
+
+    grpc::ClientContext ctx;
+    QueryUploadRequest req;
+    QueryUploadResponse resp;
+
+    req.set_filepath(std::string(outpath));
+    req.set_filesize(size);
+    req.set_hashtype(hashtype);
+
+    grpc::Status st = pool_.Acquire()->QueryUpload(&ctx, req, &resp);
+    if (!st.ok())
+        return { 0, MakeGrpcErr(st) };
+
+    if (resp.offset() > size)
+        return { 0, OkError() };
+
+    return { resp.offset(), OkError() };
+}
+
 std::optional<FTPClient::Error>
 FTPClient::SendFile(WriterPtr& writer, const std::string_view infile, const std::string_view outpath, const HashType &hashtype)
 {
@@ -118,9 +1055,16 @@ std::optional<FTPClient::Error>
 FTPClient::SendPath(WriterPtr& writer,
                     const std::string_view infile,
                     const std::string_view outpath,
-					const HashType &hashtype)
+					const HashType &hashtype,
+					bool resume,
+					const UploadStripe *stripe,
+					const DeltaBase *delta)
 {
-    uintmax_t size = std::filesystem::file_size(infile);
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(infile, ec);
+    if (ec)
+        return MakeErr(-1, "failed to stat infile: " + ec.message());
+
     UploadFileRequest req;
     UploadInit init;
 
@@ -129,6 +1073,21 @@ FTPClient::SendPath(WriterPtr& writer,
 
     init.set_hashtype(hashtype);
 
+    if (resume)
+        init.set_resume(true);
+
+    if (stripe)
+        *init.mutable_stripe() = *stripe;
+
+    if (delta)
+        *init.mutable_delta() = *delta;
+
+    if (options_.compression != Codec::Type::None)
+        init.set_compression(MapCompressionType(options_.compression));
+
+    if (options_.create_parents)
+        init.set_create_parents(true);
+
     *req.mutable_init() = std::move(init);
 
     if (!writer->Write(req))
@@ -139,45 +1098,65 @@ FTPClient::SendPath(WriterPtr& writer,
 
 std::tuple<Hash, FTPClient::Error> FTPClient::SendChunk(
 	WriterPtr& writer, const std::string_view infile,
-	const HashType &hashtype
+	const HashType &hashtype, std::uint64_t offset
 ) {
-    HashingFileStream stream(infile, *MapHashTypeOptional(hashtype));
-    if (const auto &error = stream.Open(std::ios::binary | std::ios::in))
-        return { Hash{}, MakeErr(-1, "failed to open infile: " + error->message) };
-    
-    constexpr std::size_t kChunkSize = 64 * BUFSIZ;
-    std::vector<char> buffer(kChunkSize);
+    // The server already has [0, offset); it is only read to keep the
+    // whole-file hash going.
+    return SendPiped(writer, infile, hashtype, 0, offset, std::nullopt);
+}
 
-    std::uint64_t offset = 0;
+std::tuple<Hash, FTPClient::Error> FTPClient::SendRange(
+	WriterPtr& writer, const std::string_view infile,
+	const HashType &hashtype, std::uint64_t offset, std::uint64_t length
+) {
+    return SendPiped(writer, infile, hashtype, offset, offset, offset + length);
+}
 
-    while (true) {
-        const auto &[ok, len, err] = stream.Read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
-		if (!ok)
-			return { Hash{}, MakeErr(-1, "failed to read infile: " + err.message) };
+// Reading and hashing run on SendPipeline's threads; this thread only builds
+// and writes the messages, so disk, SHA and network time overlap instead of
+// adding up. The request is reused so its data buffer isn't reallocated.
+// Unless the chunk size is fixed, every write is timed and the pipeline
+// reads at the size ChunkSizer asks for.
+std::tuple<Hash, FTPClient::Error> FTPClient::SendPiped(
+	WriterPtr& writer, const std::string_view infile, const HashType &hashtype,
+	std::uint64_t begin, std::uint64_t send_from, std::optional<std::uint64_t> end
+) {
+    const Hasher::Type type = *MapHashTypeOptional(hashtype);
+    if (type == Hasher::Type::SHA256Tree && options_.max_chunk_size < Hasher::kTreeLeafSize)
+        return { Hash{}, MakeErr(-1, "tree hash needs a max chunk size of at least 1 MiB") };
 
-		if (len <= 0)
-			break;
-        
-        UploadFileRequest req;
-        UploadChunk chunk;
+    const bool adaptive = options_.chunk_size == 0 && type != Hasher::Type::SHA256Tree;
+    ChunkSizer sizer(kDefaultChunkSize, options_.max_chunk_size);
 
-        chunk.set_data(buffer.data(), static_cast<std::size_t>(len));
-        chunk.set_offset(offset);
+    SendPipeline pipeline(infile, type, adaptive ? sizer.GetSize() : GetChunkSize());
 
-        *req.mutable_chunk() = std::move(chunk);
+    Codec codec(options_.compression);
+    std::string scratch;
+    UploadFileRequest req;
 
-        if (!writer->Write(req))
-            return { Hash{}, MakeErr(-1, "failed to write chunk") };
+    auto [ok, digest, err] = pipeline.Run(begin, send_from, end, [&](const SendPipeline::Chunk& piece) {
+        UploadChunk* chunk = req.mutable_chunk();
 
-        offset += static_cast<std::uint64_t>(len);
-    }
+        FillChunk(*chunk, piece.data, codec, scratch);
+        chunk->set_offset(piece.offset);
+        chunk->set_leaf_hash(piece.leaf_digest.data(), piece.leaf_digest.size());
+
+        if (!adaptive)
+            return writer->Write(req);
 
-	if (const auto err = stream.Close())
-		return { Hash{}, MakeErr(err->code, "failed to close infile: " + err->message) };
+        const auto start = ChunkSizer::Clock::now();
+        if (!writer->Write(req))
+            return false;
+
+        pipeline.SetBlockSize(sizer.Observe(piece.data.size(), ChunkSizer::Clock::now() - start));
+        return true;
+    });
+    if (!ok)
+        return { Hash{}, MakeErr(err.code == SendPipeline::kSinkFailed ? kStreamClosed : err.code, err.message) };
 
     Hash hash;
     hash.set_hashtype(hashtype);
-    hash.set_data(stream.GetHash()->data(), stream.GetHash()->size());
+    hash.set_data(digest.data(), digest.size());
 
     return { std::move(hash), OkError() };
 }
@@ -196,3 +1175,31 @@ FTPClient::SendHash(WriterPtr& writer, const Hash& hash)
 
     return std::nullopt;
 }
+
+std::size_t FTPClient::GetChunkSize() const noexcept
+{
+    const std::size_t size = options_.chunk_size != 0 ? options_.chunk_size : kDefaultChunkSize;
+
+    return std::min(size, options_.max_chunk_size);
+}
+
+// Compressed data is sent only when the entropy probe expects it to shrink
+// and it actually saved at least 1/16 of the chunk; otherwise the chunk goes
+// out raw and the server doesn't have to decompress it.
+void FTPClient::FillChunk(UploadChunk& chunk, std::string_view data, Codec& codec, std::string& scratch) const
+{
+    chunk.clear_raw_size();
+
+    if (codec.GetType() == Codec::Type::None || !Codec::IsCompressible(data)) {
+        chunk.set_data(data.data(), data.size());
+        return;
+    }
+
+    if (codec.Compress(data, scratch) || scratch.size() > data.size() - data.size() / 16) {
+        chunk.set_data(data.data(), data.size());
+        return;
+    }
+
+    chunk.set_data(scratch);
+    chunk.set_raw_size(data.size());
+}
@@ -0,0 +1,233 @@
+#include "SendPipeline.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <limits>
+
+#include "FileStream.hpp"
+#include "SpscQueue.hpp"
+
+namespace {
+	// Passed down the queues after the last block.
+	constexpr std::uint32_t kEnd = std::numeric_limits<std::uint32_t>::max();
+
+	constexpr std::size_t kMaxTreeHashers = 4;
+
+	std::size_t CountHashers(Hasher::Type type)
+	{
+		if (type != Hasher::Type::SHA256Tree)
+			return 1;
+
+		return std::clamp<std::size_t>(std::thread::hardware_concurrency() / 2, 1, kMaxTreeHashers);
+	}
+}
+
+SendPipeline::SendPipeline(const std::filesystem::path& path, Hasher::Type type,
+			   std::size_t block_size, std::size_t depth)
+	: path_(path)
+	, type_(type)
+	, block_size_(type == Hasher::Type::SHA256Tree ? Hasher::kTreeLeafSize : block_size)
+	, hashers_(CountHashers(type))
+	, blocks_(std::max<std::size_t>(depth, 2 * hashers_))
+{
+}
+
+void SendPipeline::SetBlockSize(std::size_t block_size) noexcept
+{
+	if (type_ != Hasher::Type::SHA256Tree && block_size > 0)
+		block_size_.store(block_size, std::memory_order_relaxed);
+}
+
+std::tuple<bool, std::vector<uint8_t>, SendPipeline::Error>
+SendPipeline::Run(std::uint64_t begin, std::uint64_t send_from, std::optional<std::uint64_t> end, const Sink& sink)
+{
+	const bool tree = type_ == Hasher::Type::SHA256Tree;
+
+	FileStream file(path_);
+	if (const auto err = file.Open(std::ios::binary | std::ios::in))
+		return { false, {}, Error{ err->code, "failed to open infile: " + err->message } };
+
+	if (begin > 0)
+		if (const auto err = file.Seek(static_cast<std::streamoff>(begin)))
+			return { false, {}, Error{ err->code, "failed to seek infile: " + err->message } };
+
+	Hasher hasher(type_);
+	if (!tree)
+		if (auto herr = hasher.Initialize())
+			return { false, {}, Error{ herr->code, herr->message } };
+
+	// Block n goes through hashing[n % hashers_] and sending[n % hashers_],
+	// so each queue keeps one producer and one consumer and the sending
+	// stage gets the blocks back in order.
+	std::vector<std::unique_ptr<SpscQueue<std::uint32_t>>> hashing, sending;
+	for (std::size_t i = 0; i < hashers_; i++) {
+		hashing.push_back(std::make_unique<SpscQueue<std::uint32_t>>(blocks_.size()));
+		sending.push_back(std::make_unique<SpscQueue<std::uint32_t>>(blocks_.size()));
+	}
+
+	SpscQueue<std::uint32_t> free(blocks_.size());
+	for (std::uint32_t i = 0; i < blocks_.size(); i++)
+		free.Push(i);
+
+	std::atomic<bool> stop{ false };
+	std::optional<Error> read_error;
+	std::vector<std::optional<Error>> hash_errors(hashers_);
+
+	// Every stage ends by passing kEnd on, and the sending stage recycles
+	// blocks until it sees kEnd, so no stage can be left waiting.
+	std::thread reader([&] {
+		std::uint64_t pos = begin;
+
+		for (std::size_t n = 0; !stop.load(std::memory_order_relaxed); n++) {
+			if (end && pos >= *end)
+				break;
+
+			const std::size_t size = block_size_.load(std::memory_order_relaxed);
+			const std::size_t want = end ? std::min<std::uint64_t>(size, *end - pos) : size;
+
+			const std::uint32_t index = free.Pop();
+			Block& block = blocks_[index];
+
+			if (block.capacity < want) {
+				block.data = std::make_unique<char[]>(want);
+				block.capacity = want;
+			}
+
+			block.length = 0;
+			while (block.length < want) {
+				const auto [ok, len, err] = file.Read(block.data.get() + block.length,
+								      static_cast<std::streamsize>(want - block.length));
+				if (!ok) {
+					read_error = Error{ err.code, "failed to read infile: " + err.message };
+					break;
+				}
+
+				if (len <= 0)
+					break;
+
+				block.length += static_cast<std::size_t>(len);
+			}
+
+			if (!read_error && block.length < want && (end || pos + block.length < send_from))
+				read_error = Error{ -1, "infile is shorter than expected" };
+
+			if (read_error) {
+				stop = true;
+				break;
+			}
+
+			if (block.length == 0)
+				break;
+
+			block.offset = pos;
+			pos += block.length;
+
+			hashing[n % hashers_]->Push(index);
+
+			if (block.length < want)
+				break;
+		}
+
+		for (auto& queue : hashing)
+			queue->Push(kEnd);
+	});
+
+	std::vector<std::thread> hasher_threads;
+	for (std::size_t i = 0; i < hashers_; i++)
+		hasher_threads.emplace_back([&, i] {
+			for (;;) {
+				const std::uint32_t index = hashing[i]->Pop();
+
+				if (index != kEnd && !hash_errors[i]) {
+					Block& block = blocks_[index];
+
+					if (tree) {
+						auto [ok, digest, herr] = Hasher::HashLeaf(block.data.get(), block.length);
+						if (ok)
+							block.digest = std::move(digest);
+						else
+							hash_errors[i] = Error{ herr.code, herr.message };
+					} else if (auto herr = hasher.Update(block.data.get(), block.length)) {
+						hash_errors[i] = Error{ herr->code, herr->message };
+					}
+
+					if (hash_errors[i])
+						stop = true;
+				}
+
+				sending[i]->Push(index);
+				if (index == kEnd)
+					break;
+			}
+		});
+
+	std::vector<uint8_t> leaves;
+	bool sink_failed = false;
+
+	for (std::size_t n = 0; ; n++) {
+		const std::uint32_t index = sending[n % hashers_]->Pop();
+		if (index == kEnd)
+			break;
+
+		const Block& block = blocks_[index];
+		if (tree)
+			leaves.insert(leaves.end(), block.digest.begin(), block.digest.end());
+
+		const std::uint64_t block_end = block.offset + block.length;
+		if (!stop.load(std::memory_order_relaxed) && block_end > send_from) {
+			const std::size_t skip = block.offset < send_from ? static_cast<std::size_t>(send_from - block.offset) : 0;
+
+			Chunk chunk{ std::string_view(block.data.get() + skip, block.length - skip), block.offset + skip, {} };
+			if (tree && skip == 0)
+				chunk.leaf_digest = std::string_view(reinterpret_cast<const char*>(block.digest.data()), block.digest.size());
+
+			if (!sink(chunk)) {
+				sink_failed = true;
+				stop = true;
+			}
+		}
+
+		free.Push(index);
+	}
+
+	reader.join();
+	for (auto& thread : hasher_threads)
+		thread.join();
+
+	if (sink_failed)
+		return { false, {}, Error{ kSinkFailed, "failed to write chunk" } };
+
+	if (read_error)
+		return { false, {}, *read_error };
+
+	for (const auto& hash_error : hash_errors)
+		if (hash_error)
+			return { false, {}, *hash_error };
+
+	if (const auto err = file.Close())
+		return { false, {}, Error{ err->code, "failed to close infile: " + err->message } };
+
+	if (tree) {
+		// An empty range is a single empty leaf.
+		if (leaves.empty()) {
+			auto [ok, digest, herr] = Hasher::HashLeaf(nullptr, 0);
+			if (!ok)
+				return { false, {}, Error{ herr.code, herr.message } };
+
+			leaves = std::move(digest);
+		}
+
+		auto [ok, root, herr] = Hasher::CombineLeaves(leaves);
+		if (!ok)
+			return { false, {}, Error{ herr.code, herr.message } };
+
+		return { true, std::move(root), Error{ 0, "" } };
+	}
+
+	auto [ok, digest, herr] = hasher.Finalize();
+	if (!ok)
+		return { false, {}, Error{ herr.code, herr.message } };
+
+	return { true, std::move(digest), Error{ 0, "" } };
+}
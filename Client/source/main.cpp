@@ -1,5 +1,13 @@
+#include <filesystem>
+#include <optional>
+#include <utility>
 #include <variant>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 #include <getopt.h>
 
@@ -19,13 +27,105 @@ std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char
 	ArgList arglist;
 
 	const struct option options[] = {
+		{ "resume", no_argument, nullptr, 'R' },
+		{ "streams", required_argument, nullptr, 'n' },
+		{ "stripe-size", required_argument, nullptr, 's' },
+		{ "download", no_argument, nullptr, 'd' },
+		{ "dedup", no_argument, nullptr, 'D' },
+		{ "delta", no_argument, nullptr, 'e' },
+		{ "batch", no_argument, nullptr, 'b' },
+		{ "recursive", no_argument, nullptr, 'r' },
+		{ "concurrency", required_argument, nullptr, 'j' },
+		{ "compress", required_argument, nullptr, 'c' },
+		{ "hash", required_argument, nullptr, 'H' },
+		{ "offset", required_argument, nullptr, 'o' },
+		{ "length", required_argument, nullptr, 'L' },
+		{ "chunk-size", required_argument, nullptr, 'C' },
+		{ "max-message-size", required_argument, nullptr, 'M' },
+		{ "window-size", required_argument, nullptr, 'W' },
+		{ "bdp-probe", required_argument, nullptr, 'P' },
+		{ "channels", required_argument, nullptr, 'N' },
+		{ "stat", no_argument, nullptr, 'T' },
+		{ "list", no_argument, nullptr, 'l' },
+		{ "glob", required_argument, nullptr, 'g' },
+		{ "limit", required_argument, nullptr, 'm' },
+		{ "page-token", required_argument, nullptr, 'p' },
 		{ nullptr, 0, nullptr, 0 }
 	};
 
 	try {
 		int optidx;
-		for (int opt; (opt = getopt_long(argc, argv, "", options, &optidx)) != -1; ) {
+		for (int opt; (opt = getopt_long(argc, argv, "Rn:s:do:L:Dec:H:brj:C:M:W:P:N:Tlg:m:p:", options, &optidx)) != -1; ) {
 			switch (opt) {
+			case 'R':
+				arglist["resume"] = "true";
+				break;
+			case 'n':
+				arglist["streams"] = std::to_string(std::stoul(optarg));
+				break;
+			case 's':
+				arglist["stripe-size"] = std::to_string(std::stoull(optarg));
+				break;
+			case 'd':
+				arglist["download"] = "true";
+				break;
+			case 'D':
+				arglist["dedup"] = "true";
+				break;
+			case 'e':
+				arglist["delta"] = "true";
+				break;
+			case 'b':
+				arglist["batch"] = "true";
+				break;
+			case 'r':
+				arglist["recursive"] = "true";
+				break;
+			case 'j':
+				arglist["concurrency"] = std::to_string(std::stoul(optarg));
+				break;
+			case 'c':
+				arglist["compress"] = optarg;
+				break;
+			case 'H':
+				arglist["hash"] = optarg;
+				break;
+			case 'o':
+				arglist["offset"] = std::to_string(std::stoull(optarg));
+				break;
+			case 'L':
+				arglist["length"] = std::to_string(std::stoull(optarg));
+				break;
+			case 'C':
+				arglist["chunk-size"] = (std::string_view(optarg) == "auto") ? "auto" : std::to_string(std::stoull(optarg));
+				break;
+			case 'M':
+				arglist["max-message-size"] = std::to_string(std::stoull(optarg));
+				break;
+			case 'W':
+				arglist["window-size"] = std::to_string(std::stoull(optarg));
+				break;
+			case 'P':
+				arglist["bdp-probe"] = optarg;
+				break;
+			case 'N':
+				arglist["channels"] = std::to_string(std::stoul(optarg));
+				break;
+			case 'T':
+				arglist["stat"] = "true";
+				break;
+			case 'l':
+				arglist["list"] = "true";
+				break;
+			case 'g':
+				arglist["glob"] = optarg;
+				break;
+			case 'm':
+				arglist["limit"] = std::to_string(std::stoull(optarg));
+				break;
+			case 'p':
+				arglist["page-token"] = optarg;
+				break;
 			case ':':
 				return { false, fmt::format("missing argument: {}", static_cast<char>(opt)) };
 			case '?':
@@ -36,20 +136,181 @@ std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char
 		return { false, fmt::format("invalid argument: {}", e.what()) };
 	}
 
+	// --stat and --list only take the remote path.
+	const bool remote_only = arglist.find("stat") != arglist.end() || arglist.find("list") != arglist.end();
+
 	argc -= optind;
-	if (argc < 4)
-		return { false, fmt::format("usage: {} <host> <service> <infile> <outpath>", *argv) };
+	if (argc < (remote_only ? 3 : 4))
+		return { false, fmt::format("usage: {} [--stat | --list [--recursive] [--glob <pattern>] [--limit <count>] [--page-token <token>] <host> <service> <remotepath>] [--resume] [--streams <count>] [--stripe-size <bytes>] [--dedup] [--delta] [--batch] [--recursive [--concurrency <count>]] [--compress <none|zstd|lz4>] [--hash <sha256|sha512|tree|xxh3|crc32c>] [--chunk-size <bytes|auto>] [--max-message-size <bytes>] [--window-size <bytes>] [--bdp-probe <on|off>] [--channels <count>] [--download [--offset <bytes>] [--length <bytes>]] <host> <service> <infile> <outpath>", *argv) };
 
 	argv += optind;
 
 	arglist["host"] = *argv++;
 	arglist["service"] = *argv++;
 	arglist["infile"] = *argv++;
-	arglist["outpath"] = *argv++;
+	arglist["outpath"] = remote_only ? "" : *argv++;
+
+	if (arglist.find("resume") == arglist.end())
+		arglist["resume"] = "false";
+
+	if (arglist.find("download") == arglist.end())
+		arglist["download"] = "false";
+
+	if (arglist.find("stat") == arglist.end())
+		arglist["stat"] = "false";
+
+	if (arglist.find("list") == arglist.end())
+		arglist["list"] = "false";
+
+	if (arglist.find("limit") == arglist.end())
+		arglist["limit"] = "0";
+
+	if (arglist.find("dedup") == arglist.end())
+		arglist["dedup"] = "false";
+
+	if (arglist.find("delta") == arglist.end())
+		arglist["delta"] = "false";
+
+	if (arglist.find("batch") == arglist.end())
+		arglist["batch"] = "false";
+
+	if (arglist.find("recursive") == arglist.end())
+		arglist["recursive"] = "false";
+
+	if (arglist.find("concurrency") == arglist.end())
+		arglist["concurrency"] = "4";
+
+	if (arglist.find("compress") == arglist.end())
+		arglist["compress"] = "none";
+
+	if (arglist.find("hash") == arglist.end())
+		arglist["hash"] = "sha256";
+
+	if (arglist.find("streams") == arglist.end())
+		arglist["streams"] = "1";
+
+	if (arglist.find("stripe-size") == arglist.end())
+		arglist["stripe-size"] = std::to_string(64ULL * 1024 * 1024);
+
+	if (arglist.find("chunk-size") == arglist.end())
+		arglist["chunk-size"] = "auto";
+
+	// gRPC's own default
+	if (arglist.find("max-message-size") == arglist.end())
+		arglist["max-message-size"] = std::to_string(4 * 1024 * 1024);
+
+	// Left to gRPC (and to BDP probing) unless given.
+	if (arglist.find("window-size") == arglist.end())
+		arglist["window-size"] = "default";
+
+	if (arglist.find("bdp-probe") == arglist.end())
+		arglist["bdp-probe"] = "on";
+
+	if (arglist.find("channels") == arglist.end())
+		arglist["channels"] = "1";
 
 	return { true, arglist };
 }
 
+std::optional<FTPClient::Options> MakeClientOptions(const ArgList& arglist)
+{
+	FTPClient::Options options;
+
+	const std::string& compress = arglist.at("compress");
+	if (compress == "zstd")
+		options.compression = Codec::Type::Zstd;
+	else if (compress == "lz4")
+		options.compression = Codec::Type::Lz4;
+	else if (compress != "none")
+		return std::nullopt;
+
+	// Trees and batches are uploaded into directories that may not exist yet.
+	options.create_parents = arglist.at("recursive") == "true" || arglist.at("batch") == "true";
+
+	// Room for the rest of the message around the chunk data.
+	constexpr std::size_t kMessageOverhead = 64 * 1024;
+
+	const std::size_t max_message_size = std::stoull(arglist.at("max-message-size"));
+	if (max_message_size < 2 * kMessageOverhead)
+		return std::nullopt;
+
+	options.max_chunk_size = max_message_size - kMessageOverhead;
+
+	if (arglist.at("chunk-size") != "auto") {
+		options.chunk_size = std::stoull(arglist.at("chunk-size"));
+		if (options.chunk_size == 0 || options.chunk_size > options.max_chunk_size)
+			return std::nullopt;
+	}
+
+	return options;
+}
+
+// Message size limits and HTTP/2 flow control. --window-size sets the
+// initial stream window; with BDP probing on, gRPC grows the windows from
+// there as it measures the link.
+std::optional<grpc::ChannelArguments> MakeChannelArguments(const ArgList& arglist)
+{
+	grpc::ChannelArguments args;
+
+	const int max_message_size = static_cast<int>(std::min<std::uint64_t>(std::stoull(arglist.at("max-message-size")), INT_MAX));
+	args.SetMaxSendMessageSize(max_message_size);
+	args.SetMaxReceiveMessageSize(max_message_size);
+
+	if (arglist.at("window-size") != "default")
+		args.SetInt(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+			    static_cast<int>(std::min<std::uint64_t>(std::stoull(arglist.at("window-size")), INT_MAX)));
+
+	const std::string& bdp_probe = arglist.at("bdp-probe");
+	if (bdp_probe != "on" && bdp_probe != "off")
+		return std::nullopt;
+
+	args.SetInt(GRPC_ARG_HTTP2_BDP_PROBE, bdp_probe == "on" ? 1 : 0);
+
+	return args;
+}
+
+std::optional<HashType> ParseHashType(const std::string& name)
+{
+	if (name == "sha256")
+		return HashType::HASH_TYPE_SHA256;
+	if (name == "sha512")
+		return HashType::HASH_TYPE_SHA512;
+	if (name == "tree")
+		return HashType::HASH_TYPE_SHA256_TREE;
+	if (name == "xxh3")
+		return HashType::HASH_TYPE_XXH3_128;
+	if (name == "crc32c")
+		return HashType::HASH_TYPE_CRC32C;
+
+	return std::nullopt;
+}
+
+// --batch uploads the regular files directly in the <infile> directory to
+// <outpath>/<name>.
+std::optional<std::vector<std::pair<std::string, std::string>>> ListBatchFiles(const std::string& indir, const std::string& outdir)
+{
+	std::error_code ec;
+	std::filesystem::directory_iterator it(indir, ec);
+	if (ec)
+		return std::nullopt;
+
+	std::vector<std::pair<std::string, std::string>> files;
+	for (const auto& entry : it)
+		if (entry.is_regular_file(ec))
+			files.emplace_back(entry.path().string(), (std::filesystem::path(outdir) / entry.path().filename()).string());
+
+	return files;
+}
+
+// One line per entry: size, modification time and path, with a trailing
+// slash for directories.
+void PrintEntry(const FileMetaData& entry)
+{
+	fmt::print("{:>14} {} {}{}\n", entry.size(),
+		   google::protobuf::util::TimeUtil::ToString(entry.modify_time()),
+		   entry.path(), entry.directory() ? "/" : "");
+}
+
 void ShowArgument(const ArgList& arglist)
 {
 	for (const auto &[name, value]: arglist)
@@ -67,13 +328,165 @@ int main(int argc, char* argv[])
 	const ArgList& arglist = std::get<ArgList>(result);
 	ShowArgument(arglist);
 
+	const auto options = MakeClientOptions(arglist);
+	if (!options) {
+		spdlog::error("invalid --compress, --chunk-size or --max-message-size");
+		return 1;
+	}
+
+	const auto channel_args = MakeChannelArguments(arglist);
+	if (!channel_args) {
+		spdlog::error("invalid --bdp-probe: {}", arglist.at("bdp-probe"));
+		return 1;
+	}
+
+	const auto hashtype = ParseHashType(arglist.at("hash"));
+	if (!hashtype) {
+		spdlog::error("invalid --hash: {}", arglist.at("hash"));
+		return 1;
+	}
+
+	const std::size_t channel_count = std::stoul(arglist.at("channels"));
+	if (channel_count == 0) {
+		spdlog::error("invalid --channels: {}", arglist.at("channels"));
+		return 1;
+	}
+
+	// Each channel is a TCP connection of its own; --streams and --recursive
+	// spread their transfers over them.
 	const std::string target = fmt::format("{}:{}", arglist.at("host"), arglist.at("service"));
-	std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(target, grpc::InsecureChannelCredentials());
-	spdlog::info("channel opened at: {}", target);
+	const auto channels = ChannelPool::CreateChannels(target, grpc::InsecureChannelCredentials(), *channel_args, channel_count);
+	spdlog::info("{} channel(s) opened at: {}", channels.size(), target);
+
+	FTPClient client(channels, *options);
 
-	FTPClient client(channel);
+	if (arglist.at("stat") == "true") {
+		const auto [success_stat, metadata, status] = client.Stat(arglist.at("infile"));
+		if (!success_stat) {
+			spdlog::error("failed to stat: {}", status.message);
+			return 1;
+		}
+
+		PrintEntry(metadata);
+
+		return 0;
+	}
+
+	if (arglist.at("list") == "true") {
+		ListDirectoryRequest request;
+		request.set_path(arglist.at("infile"));
+		request.set_recursive(arglist.at("recursive") == "true");
+		request.set_limit(std::stoull(arglist.at("limit")));
+		if (arglist.find("page-token") != arglist.end())
+			request.set_page_token(arglist.at("page-token"));
+		if (arglist.find("glob") != arglist.end())
+			request.mutable_filter()->set_name_glob(arglist.at("glob"));
+
+		std::uint64_t listed = 0;
+		const auto [success_list, next_page_token, status] = client.ListDirectory(request, [&listed](const FileMetaData& entry) {
+			PrintEntry(entry);
+			listed++;
+		});
+		if (!success_list) {
+			spdlog::error("failed to list directory: {}", status.message);
+			return 1;
+		}
+
+		if (!next_page_token.empty())
+			spdlog::info("{} entries listed; more with --page-token {}", listed, next_page_token);
+
+		return 0;
+	}
+
+	if (arglist.at("download") == "true") {
+		std::optional<std::uint64_t> offset, length;
+		if (arglist.find("offset") != arglist.end())
+			offset = std::stoull(arglist.at("offset"));
+		if (arglist.find("length") != arglist.end())
+			length = std::stoull(arglist.at("length"));
+
+		const auto [success_download, metadata, status] = client.DownloadFile(arglist.at("infile"), arglist.at("outpath"),
+										      *hashtype, offset, length);
+		if (!success_download) {
+			spdlog::error("failed to download file: {}", status.message);
+			return 1;
+		}
+
+		spdlog::info("file downloaded successfully: \n{}", metadata.DebugString());
+
+		return 0;
+	}
+
+	if (arglist.at("delta") == "true") {
+		std::uint64_t bytes_saved = 0;
+		const auto [success_delta, metadata, status] = client.UploadFileDelta(arglist.at("infile"), arglist.at("outpath"),
+										      *hashtype, &bytes_saved);
+		if (!success_delta) {
+			spdlog::error("failed to upload file: {}", status.message);
+			return 1;
+		}
+
+		spdlog::info("file uploaded successfully ({} bytes reused on the server): \n{}",
+			     bytes_saved, metadata.DebugString());
+
+		return 0;
+	}
+
+	if (arglist.at("recursive") == "true") {
+		const auto [success_tree, summary, status] = client.UploadTree(arglist.at("infile"), arglist.at("outpath"), *hashtype,
+										 std::stoul(arglist.at("concurrency")));
+		if (!success_tree) {
+			spdlog::error("failed to upload directory: {}", status.message);
+			return 1;
+		}
+
+		for (const auto& [path, error] : summary.failures)
+			spdlog::error("failed to upload {}: {}", path, error.message);
+
+		const double mib = static_cast<double>(summary.bytes) / (1024 * 1024);
+		spdlog::info("uploaded {}/{} files, {:.1f} MiB in {:.2f}s ({:.1f} MiB/s), {} failed",
+			     summary.uploaded, summary.files, mib, summary.seconds,
+			     summary.seconds > 0 ? mib / summary.seconds : 0.0, summary.failures.size());
+
+		return summary.failures.empty() ? 0 : 1;
+	}
+
+	if (arglist.at("batch") == "true") {
+		const auto files = ListBatchFiles(arglist.at("infile"), arglist.at("outpath"));
+		if (!files) {
+			spdlog::error("failed to list directory: {}", arglist.at("infile"));
+			return 1;
+		}
+
+		const auto [success_batch, results, status] = client.UploadBatch(*files, *hashtype);
+
+		std::size_t failed = 0;
+		for (const auto& result : results) {
+			if (result.code() == 0)
+				continue;
+
+			spdlog::error("failed to upload {}: {}", result.filepath(), result.message());
+			failed++;
+		}
+
+		if (!success_batch) {
+			spdlog::error("failed to upload batch: {}", status.message);
+			return 1;
+		}
+
+		spdlog::info("batch uploaded: {} files, {} failed", results.size(), failed);
+
+		return failed == 0 ? 0 : 1;
+	}
 
-	const auto [success_upload, metadata, status] = client.UploadFile(arglist.at("infile"), arglist.at("outpath"), HashType::HASH_TYPE_SHA256);
+	const std::size_t streams = std::stoul(arglist.at("streams"));
+	const auto [success_upload, metadata, status] = (arglist.at("dedup") == "true")
+		? client.UploadFileDedup(arglist.at("infile"), arglist.at("outpath"), *hashtype)
+		: (streams > 1)
+		? client.UploadFileStriped(arglist.at("infile"), arglist.at("outpath"), *hashtype,
+					   streams, std::stoull(arglist.at("stripe-size")))
+		: client.UploadFile(arglist.at("infile"), arglist.at("outpath"), *hashtype,
+				    arglist.at("resume") == "true");
 	if (!success_upload) {
 		spdlog::error("failed to upload file: {}", status.message);
 		return 1;
@@ -0,0 +1,366 @@
+// Write and hash throughput of FileStream, its subclasses, HashingFileStream
+// and Hasher, next to raw write()/pwrite() and raw EVP, for buffer sizes
+// from 4 KiB to 16 MiB. Every iteration writes (or hashes) kFileSize bytes,
+// one buffer at a time, so bytes_per_second compares directly across sizes.
+// File benchmarks fdatasync() before closing, so a disk run measures the disk
+// rather than the page cache.
+//
+// File benchmarks run once per directory given with --dirs (by default a
+// tmpfs and a disk) and are named after its file system, e.g.
+// FileStream/Write/tmpfs/65536/real_time. Google Benchmark's own flags work as usual:
+//
+//   StreamBenchmark --dirs=/dev/shm,/var/tmp --benchmark_format=json
+#include <functional>
+#include <algorithm>
+#include <optional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+
+#include <benchmark/benchmark.h>
+#include <openssl/evp.h>
+#include <fmt/core.h>
+
+#include "HashingFileStream.hpp"
+#include "DirectFileStream.hpp"
+#include "UringFileStream.hpp"
+#include "FileStream.hpp"
+#include "Hasher.hpp"
+
+namespace {
+    constexpr std::size_t kFileSize = 64 * 1024 * 1024;
+    constexpr std::int64_t kMinBuffer = 4 * 1024;
+    constexpr std::int64_t kMaxBuffer = 16 * 1024 * 1024;
+
+    // Same as the server's.
+    constexpr std::size_t kDirectBufferSize = 1024 * 1024;
+
+    using EvpContext = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+
+    // Random, so that no file system can compress or dedupe it.
+    const std::string& Data()
+    {
+        static const std::string data = [] {
+            std::string bytes(kMaxBuffer, '\0');
+            std::mt19937_64 engine(42);
+            for (std::size_t i = 0; i < bytes.size(); i += sizeof(std::uint64_t)) {
+                const std::uint64_t word = engine();
+                std::memcpy(bytes.data() + i, &word, sizeof(word));
+            }
+            return bytes;
+        }();
+
+        return data;
+    }
+
+    // Calls write(buffer) until kFileSize bytes are written.
+    template <typename Write>
+    bool WriteFile(std::size_t buffer_size, Write&& write)
+    {
+        const std::string& data = Data();
+
+        for (std::size_t offset = 0; offset < kFileSize; offset += buffer_size) {
+            const std::size_t n = std::min(buffer_size, kFileSize - offset);
+            if (!write(std::string_view(data.data(), n), offset))
+                return false;
+        }
+
+        return true;
+    }
+
+    bool WriteAll(int fd, std::string_view data) noexcept
+    {
+        while (!data.empty()) {
+            const ssize_t n = ::write(fd, data.data(), data.size());
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+
+            data.remove_prefix(static_cast<std::size_t>(n));
+        }
+
+        return true;
+    }
+
+    bool PwriteAll(int fd, std::string_view data, std::uint64_t offset) noexcept
+    {
+        while (!data.empty()) {
+            const ssize_t n = ::pwrite(fd, data.data(), data.size(), static_cast<off_t>(offset));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+
+            data.remove_prefix(static_cast<std::size_t>(n));
+            offset += static_cast<std::uint64_t>(n);
+        }
+
+        return true;
+    }
+
+    void Finish(benchmark::State& state)
+    {
+        state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * kFileSize));
+        state.counters["buffer"] = static_cast<double>(state.range(0));
+    }
+
+    void RawWrite(benchmark::State& state, std::string path)
+    {
+        for (auto _ : state) {
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+                return state.SkipWithError("open failed");
+
+            const bool ok = WriteFile(state.range(0), [fd](std::string_view data, std::uint64_t) {
+                return WriteAll(fd, data);
+            }) && ::fdatasync(fd) == 0;
+            ::close(fd);
+
+            if (!ok)
+                return state.SkipWithError("write or fdatasync failed");
+        }
+
+        Finish(state);
+        ::unlink(path.c_str());
+    }
+
+    void RawPwrite(benchmark::State& state, std::string path)
+    {
+        for (auto _ : state) {
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+                return state.SkipWithError("open failed");
+
+            const bool ok = WriteFile(state.range(0), [fd](std::string_view data, std::uint64_t offset) {
+                return PwriteAll(fd, data, offset);
+            }) && ::fdatasync(fd) == 0;
+            ::close(fd);
+
+            if (!ok)
+                return state.SkipWithError("pwrite or fdatasync failed");
+        }
+
+        Finish(state);
+        ::unlink(path.c_str());
+    }
+
+    // What HashingFileStream would cost without its layers.
+    void RawWriteEvp(benchmark::State& state, std::string path)
+    {
+        const EvpContext ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length;
+
+        for (auto _ : state) {
+            const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (fd < 0)
+                return state.SkipWithError("open failed");
+
+            EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+            const bool ok = WriteFile(state.range(0), [fd, &ctx](std::string_view data, std::uint64_t) {
+                return WriteAll(fd, data) && EVP_DigestUpdate(ctx.get(), data.data(), data.size()) == 1;
+            }) && ::fdatasync(fd) == 0;
+            EVP_DigestFinal_ex(ctx.get(), digest, &length);
+            ::close(fd);
+
+            if (!ok)
+                return state.SkipWithError("write or fdatasync failed");
+        }
+
+        Finish(state);
+        ::unlink(path.c_str());
+    }
+
+    // Any FileStream, opened as the server opens an upload.
+    void StreamWrite(benchmark::State& state, std::string path,
+                     std::function<std::unique_ptr<FileStream>(const std::string&)> make)
+    {
+        for (auto _ : state) {
+            std::unique_ptr<FileStream> file = make(path);
+            if (file->Open(std::ios::out | std::ios::binary | std::ios::trunc))
+                return state.SkipWithError("Open failed");
+
+            const bool ok = WriteFile(state.range(0), [&file](std::string_view data, std::uint64_t) {
+                return !file->Write(data);
+            }) && !file->Sync();
+
+            if (file->Close() || !ok)
+                return state.SkipWithError("Write or Sync failed");
+        }
+
+        Finish(state);
+        ::unlink(path.c_str());
+    }
+
+    void HashingStreamWrite(benchmark::State& state, std::string path, Hasher::Type type)
+    {
+        for (auto _ : state) {
+            HashingFileStream file(path, type);
+            if (file.Open(std::ios::out | std::ios::binary | std::ios::trunc))
+                return state.SkipWithError("Open failed");
+
+            const bool ok = WriteFile(state.range(0), [&file](std::string_view data, std::uint64_t) {
+                return !file.Write(data);
+            }) && !file.Sync();
+
+            if (file.Close() || !ok)
+                return state.SkipWithError("Write or Sync failed");
+
+            benchmark::DoNotOptimize(file.GetHash());
+        }
+
+        Finish(state);
+        ::unlink(path.c_str());
+    }
+
+    void HasherUpdate(benchmark::State& state, Hasher::Type type)
+    {
+        Hasher hasher(type);
+
+        for (auto _ : state) {
+            if (hasher.Initialize())
+                return state.SkipWithError("Initialize failed");
+
+            const bool ok = WriteFile(state.range(0), [&hasher](std::string_view data, std::uint64_t) {
+                return !hasher.Update(data.data(), data.size());
+            });
+
+            auto [finalized, digest, error] = hasher.Finalize();
+            if (!ok || !finalized)
+                return state.SkipWithError("Update failed");
+
+            benchmark::DoNotOptimize(digest);
+        }
+
+        Finish(state);
+    }
+
+    void RawEvp(benchmark::State& state, const EVP_MD* md)
+    {
+        const EvpContext ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+        unsigned char digest[EVP_MAX_MD_SIZE];
+        unsigned int length;
+
+        for (auto _ : state) {
+            EVP_DigestInit_ex(ctx.get(), md, nullptr);
+            WriteFile(state.range(0), [&ctx](std::string_view data, std::uint64_t) {
+                return EVP_DigestUpdate(ctx.get(), data.data(), data.size()) == 1;
+            });
+            EVP_DigestFinal_ex(ctx.get(), digest, &length);
+
+            benchmark::DoNotOptimize(digest);
+        }
+
+        Finish(state);
+    }
+
+    std::string FileSystemOf(const std::string& dir)
+    {
+        struct statfs fs{};
+        if (::statfs(dir.c_str(), &fs) != 0)
+            return "unknown";
+
+        return fs.f_type == TMPFS_MAGIC ? "tmpfs" : "disk";
+    }
+
+    // Buffer sizes from 4 KiB to 16 MiB, by powers of four.
+    benchmark::internal::Benchmark* Sized(benchmark::internal::Benchmark* b)
+    {
+        return b->RangeMultiplier(4)->Range(kMinBuffer, kMaxBuffer)->UseRealTime()->Unit(benchmark::kMillisecond);
+    }
+
+    void RegisterFileBenchmarks(const std::string& dir)
+    {
+        const std::string fs = FileSystemOf(dir);
+        const std::string path = dir + "/stream-benchmark.bin";
+
+        benchmark::AddCustomContext(dir, fs);
+
+        Sized(benchmark::RegisterBenchmark(fmt::format("Raw/write/{}", fs).c_str(), RawWrite, path));
+        Sized(benchmark::RegisterBenchmark(fmt::format("Raw/pwrite/{}", fs).c_str(), RawPwrite, path));
+        Sized(benchmark::RegisterBenchmark(fmt::format("Raw/write+EVP_sha256/{}", fs).c_str(), RawWriteEvp, path));
+
+        Sized(benchmark::RegisterBenchmark(fmt::format("FileStream/Write/{}", fs).c_str(), StreamWrite, path,
+                                          [](const std::string& p) { return std::make_unique<FileStream>(p); }));
+        Sized(benchmark::RegisterBenchmark(fmt::format("UringFileStream/Write/{}", fs).c_str(), StreamWrite, path,
+                                          [](const std::string& p) { return std::make_unique<UringFileStream>(p); }));
+
+        const auto pool = std::make_shared<AlignedBufferPool>(kDirectBufferSize);
+        Sized(benchmark::RegisterBenchmark(fmt::format("DirectFileStream/Write/{}", fs).c_str(), StreamWrite, path,
+                                          [pool](const std::string& p) { return std::make_unique<DirectFileStream>(p, pool, kFileSize); }));
+
+        Sized(benchmark::RegisterBenchmark(fmt::format("HashingFileStream/Write/sha256/{}", fs).c_str(),
+                                          HashingStreamWrite, path, Hasher::Type::SHA256));
+        Sized(benchmark::RegisterBenchmark(fmt::format("HashingFileStream/Write/xxh3/{}", fs).c_str(),
+                                          HashingStreamWrite, path, Hasher::Type::XXH3_128));
+    }
+
+    void RegisterHashBenchmarks()
+    {
+        Sized(benchmark::RegisterBenchmark("Hasher/Update/sha256", HasherUpdate, Hasher::Type::SHA256));
+        Sized(benchmark::RegisterBenchmark("Hasher/Update/sha512", HasherUpdate, Hasher::Type::SHA512));
+        Sized(benchmark::RegisterBenchmark("Hasher/Update/tree", HasherUpdate, Hasher::Type::SHA256Tree));
+        Sized(benchmark::RegisterBenchmark("Hasher/Update/xxh3", HasherUpdate, Hasher::Type::XXH3_128));
+        Sized(benchmark::RegisterBenchmark("Hasher/Update/crc32c", HasherUpdate, Hasher::Type::CRC32C));
+
+        Sized(benchmark::RegisterBenchmark("EVP/sha256", RawEvp, EVP_sha256()));
+        Sized(benchmark::RegisterBenchmark("EVP/sha512", RawEvp, EVP_sha512()));
+    }
+
+    // --dirs=<dir>[,<dir>...], left over after Google Benchmark's flags.
+    std::optional<std::vector<std::string>> ParseDirs(int argc, char* argv[])
+    {
+        std::string list = "/dev/shm,/var/tmp";
+
+        for (int i = 1; i < argc; i++) {
+            const std::string_view arg = argv[i];
+            if (!arg.starts_with("--dirs="))
+                return std::nullopt;
+
+            list = arg.substr(std::strlen("--dirs="));
+        }
+
+        std::vector<std::string> dirs;
+        for (std::size_t begin = 0; begin <= list.size(); ) {
+            std::size_t end = list.find(',', begin);
+            if (end == std::string::npos)
+                end = list.size();
+
+            if (end > begin)
+                dirs.push_back(list.substr(begin, end - begin));
+
+            begin = end + 1;
+        }
+
+        return dirs;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    benchmark::Initialize(&argc, argv);
+
+    const auto dirs = ParseDirs(argc, argv);
+    if (!dirs) {
+        fmt::print(stderr, "usage: {} [--dirs=<dir>[,<dir>...]] [--benchmark_...]\n", argv[0]);
+        return 1;
+    }
+
+    for (const auto& dir : *dirs)
+        RegisterFileBenchmarks(dir);
+    RegisterHashBenchmarks();
+
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+
+    return 0;
+}
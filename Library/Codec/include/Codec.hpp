@@ -0,0 +1,55 @@
+#pragma once
+
+#include <string_view>
+#include <optional>
+#include <cstddef>
+#include <string>
+
+struct ZSTD_CCtx_s;
+struct ZSTD_DCtx_s;
+
+// Block compression for upload chunks. Every chunk is compressed on its own,
+// so the receiver needs nothing but the chunk and its uncompressed size.
+class Codec
+{
+public:
+	enum class Type {
+		None = 0,
+		Zstd,
+		Lz4
+	};
+
+	struct Error {
+		int code;
+		std::string message;
+	};
+
+public:
+	// Can be moved, but can't be copied
+	Codec(const Codec&) = delete;
+	Codec& operator=(const Codec&) = delete;
+	Codec(Codec&&) noexcept;
+	Codec& operator=(Codec&&) noexcept;
+
+public:
+	Codec();
+	explicit Codec(Type type);
+	~Codec();
+
+public:
+	Type GetType() const noexcept;
+
+	std::optional<Error> Compress(std::string_view data, std::string& out) noexcept;
+	std::optional<Error> Decompress(std::string_view data, std::size_t size, std::string& out) noexcept;
+
+	// Estimates the byte entropy of a sample of data. Archives, media and
+	// encrypted data come out close to 8 bits per byte and aren't worth
+	// compressing again.
+	static bool IsCompressible(std::string_view data) noexcept;
+
+private:
+	Type type_;
+
+	ZSTD_CCtx_s* cctx_;
+	ZSTD_DCtx_s* dctx_;
+};
@@ -0,0 +1,199 @@
+#include "Codec.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+
+#include "zstd.h"
+#include "lz4.h"
+
+namespace {
+	// zstd's default level; faster levels lose ratio on text, slower ones
+	// can't keep up with a fast link.
+	constexpr int kZstdLevel = 3;
+
+	// Probe at most this many bytes, taken from kProbeSpans places in the
+	// data, and call anything above kMaxEntropy bits per byte incompressible.
+	constexpr std::size_t kProbeSize = 4096;
+	constexpr std::size_t kProbeSpans = 16;
+	constexpr double kMaxEntropy = 7.5;
+
+	Codec::Error MakeError(int code, std::string message) noexcept
+	{
+		Codec::Error error;
+
+		error.code = code;
+		error.message = std::move(message);
+
+		return error;
+	}
+}
+
+Codec::Codec()
+	: Codec(Type::None)
+{
+}
+
+Codec::Codec(Type type)
+	: type_(type)
+	, cctx_(nullptr)
+	, dctx_(nullptr)
+{
+}
+
+Codec::~Codec()
+{
+	ZSTD_freeCCtx(cctx_);
+	ZSTD_freeDCtx(dctx_);
+}
+
+Codec::Codec(Codec&& other) noexcept
+	: type_(other.type_)
+	, cctx_(other.cctx_)
+	, dctx_(other.dctx_)
+{
+	other.cctx_ = nullptr;
+	other.dctx_ = nullptr;
+}
+
+Codec& Codec::operator=(Codec&& other) noexcept
+{
+	if (this == &other)
+		return *this;
+
+	ZSTD_freeCCtx(cctx_);
+	ZSTD_freeDCtx(dctx_);
+
+	type_ = other.type_;
+	cctx_ = other.cctx_;
+	dctx_ = other.dctx_;
+
+	other.cctx_ = nullptr;
+	other.dctx_ = nullptr;
+
+	return *this;
+}
+
+Codec::Type Codec::GetType() const noexcept
+{
+	return type_;
+}
+
+std::optional<Codec::Error> Codec::Compress(std::string_view data, std::string& out) noexcept
+{
+	switch (type_) {
+	case Type::Zstd: {
+		if (!cctx_ && !(cctx_ = ZSTD_createCCtx()))
+			return MakeError(-1, "zstd: failed to create context");
+
+		out.resize(ZSTD_compressBound(data.size()));
+
+		const std::size_t size = ZSTD_compressCCtx(cctx_, out.data(), out.size(),
+							  data.data(), data.size(), kZstdLevel);
+		if (ZSTD_isError(size))
+			return MakeError(-1, std::string("zstd: ") + ZSTD_getErrorName(size));
+
+		out.resize(size);
+		return std::nullopt;
+	}
+
+	case Type::Lz4: {
+		if (data.size() > LZ4_MAX_INPUT_SIZE)
+			return MakeError(-1, "lz4: input too large");
+
+		out.resize(static_cast<std::size_t>(LZ4_compressBound(static_cast<int>(data.size()))));
+
+		const int size = LZ4_compress_default(data.data(), out.data(),
+						      static_cast<int>(data.size()), static_cast<int>(out.size()));
+		if (size <= 0)
+			return MakeError(-1, "lz4: compression failed");
+
+		out.resize(static_cast<std::size_t>(size));
+		return std::nullopt;
+	}
+
+	case Type::None:
+		break;
+	}
+
+	out.assign(data);
+	return std::nullopt;
+}
+
+std::optional<Codec::Error> Codec::Decompress(std::string_view data, std::size_t size, std::string& out) noexcept
+{
+	switch (type_) {
+	case Type::Zstd: {
+		if (!dctx_ && !(dctx_ = ZSTD_createDCtx()))
+			return MakeError(-1, "zstd: failed to create context");
+
+		out.resize(size);
+
+		const std::size_t result = ZSTD_decompressDCtx(dctx_, out.data(), out.size(), data.data(), data.size());
+		if (ZSTD_isError(result))
+			return MakeError(-1, std::string("zstd: ") + ZSTD_getErrorName(result));
+
+		if (result != size)
+			return MakeError(-1, "zstd: decompressed size mismatch");
+
+		return std::nullopt;
+	}
+
+	case Type::Lz4: {
+		if (size > LZ4_MAX_INPUT_SIZE || data.size() > LZ4_MAX_INPUT_SIZE)
+			return MakeError(-1, "lz4: input too large");
+
+		out.resize(size);
+
+		const int result = LZ4_decompress_safe(data.data(), out.data(),
+						       static_cast<int>(data.size()), static_cast<int>(size));
+		if (result < 0 || static_cast<std::size_t>(result) != size)
+			return MakeError(-1, "lz4: corrupted block");
+
+		return std::nullopt;
+	}
+
+	case Type::None:
+		break;
+	}
+
+	if (data.size() != size)
+		return MakeError(-1, "size mismatch");
+
+	out.assign(data);
+	return std::nullopt;
+}
+
+bool Codec::IsCompressible(std::string_view data) noexcept
+{
+	if (data.empty())
+		return false;
+
+	std::array<std::size_t, 256> counts{};
+	std::size_t total = 0;
+
+	const std::size_t spans = data.size() <= kProbeSize ? 1 : kProbeSpans;
+	const std::size_t span = data.size() <= kProbeSize ? data.size() : kProbeSize / kProbeSpans;
+	const std::size_t stride = data.size() / spans;
+
+	for (std::size_t i = 0; i < spans; i++) {
+		const std::size_t begin = i * stride;
+		const std::size_t end = std::min(data.size(), begin + span);
+
+		for (std::size_t j = begin; j < end; j++)
+			counts[static_cast<unsigned char>(data[j])]++;
+
+		total += end - begin;
+	}
+
+	double entropy = 0.0;
+	for (const std::size_t count : counts) {
+		if (count == 0)
+			continue;
+
+		const double p = static_cast<double>(count) / static_cast<double>(total);
+		entropy -= p * std::log2(p);
+	}
+
+	return entropy < kMaxEntropy;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Fixed-size buffers aligned for O_DIRECT, shared by every stream of a
+// server. Released buffers are kept for reuse up to max_cached of them.
+class AlignedBufferPool
+{
+public:
+	struct Returner {
+		AlignedBufferPool* pool;
+		void operator()(char* buffer) const noexcept;
+	};
+
+	using Buffer = std::unique_ptr<char, Returner>;
+
+public:
+	AlignedBufferPool(const AlignedBufferPool&) = delete;
+	AlignedBufferPool& operator=(const AlignedBufferPool&) = delete;
+
+public:
+	explicit AlignedBufferPool(std::size_t buffer_size, std::size_t alignment = 4096, std::size_t max_cached = 64);
+	~AlignedBufferPool();
+
+public:
+	// nullptr when the allocation fails.
+	Buffer Acquire() noexcept;
+
+	std::size_t GetBufferSize() const noexcept;
+	std::size_t GetAlignment() const noexcept;
+
+private:
+	void Release(char* buffer) noexcept;
+
+private:
+	const std::size_t buffer_size_;
+	const std::size_t alignment_;
+	const std::size_t max_cached_;
+
+	std::mutex mutex_;
+	std::vector<char*> cached_;
+};
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+
+#include "AlignedBufferPool.hpp"
+#include "FileStream.hpp"
+
+// FileStream that writes with O_DIRECT so large uploads don't push other
+// data out of the page cache. Writes are gathered into an aligned buffer
+// from the pool and written one full buffer at a time. The unaligned tail is
+// written padded to the alignment, and Close() truncates the file back to
+// the bytes actually written. Reads go through a second, buffered descriptor.
+//
+// Only one writer may use a file at a time: a partial block at either end
+// is read back and rewritten. With preallocate > 0 the file is allocated up
+// front with fallocate(). Read-only opens, and file systems without
+// O_DIRECT (e.g. tmpfs), fall back to buffered I/O.
+class DirectFileStream final : public FileStream {
+public:
+	DirectFileStream(const std::filesystem::path& path, std::shared_ptr<AlignedBufferPool> pool,
+			 uint64_t preallocate = 0);
+	~DirectFileStream() override;
+
+public:
+	bool IsDirect() const noexcept;
+
+public:
+	std::optional<Error> Open(std::ios::openmode mode) noexcept override;
+	std::optional<Error> Write(std::string_view data) noexcept override;
+
+	std::tuple<bool, std::streamsize, Error> Read(char* data, std::streamsize size) noexcept override;
+	using FileStream::Read;
+
+	std::optional<Error> Seek(std::streamoff offset) noexcept override;
+	std::optional<Error> Sync() noexcept override;
+
+	std::optional<Error> Close() noexcept override;
+
+private:
+	uint64_t Position() const noexcept;
+
+	std::optional<Error> WriteBlock(std::size_t length) noexcept;
+	std::optional<Error> FlushTail() noexcept;
+	std::optional<Error> LoadBlock(uint64_t offset) noexcept;
+
+private:
+	const std::shared_ptr<AlignedBufferPool> pool_;
+	const uint64_t preallocate_;
+
+	bool passthrough_ = false;
+	bool direct_ = false;
+
+	int fd_ = -1;
+	int read_fd_ = -1;
+
+	AlignedBufferPool::Buffer buffer_;
+	uint64_t block_offset_ = 0;
+	std::size_t fill_ = 0;
+
+	// The file is cut back to max(initial size, end of written data).
+	uint64_t initial_size_ = 0;
+	uint64_t end_ = 0;
+};
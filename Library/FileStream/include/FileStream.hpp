@@ -28,8 +28,15 @@ public:
 	virtual std::tuple<bool, std::streamsize, Error> Read(std::string& data) noexcept;
 	virtual std::tuple<bool, std::streamsize, Error> Read(char* data, std::streamsize size) noexcept;
 
+	virtual std::optional<Error> Seek(std::streamoff offset) noexcept;
+	virtual std::optional<Error> Sync() noexcept;
+	virtual std::optional<Error> Prefetch(std::streamoff offset, std::streamsize length) noexcept;
+
 	virtual std::optional<Error> Close() noexcept;
 
+protected:
+	Error errno_error(const char* context) const noexcept;
+
 private:
 	Error stream_error(const std::ios& stream, const char* context) const noexcept;
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <filesystem>
+#include <memory>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -18,27 +19,37 @@ public:
 public:
     explicit HashingFileStream(const std::filesystem::path& path, Hasher::Type type);
 
+    // Hashes on top of another FileStream implementation (e.g. UringFileStream).
+    HashingFileStream(std::unique_ptr<FileStream> file, Hasher::Type type);
+
 public:
     const std::filesystem::path& GetPath() const noexcept;
 
 public:
     std::optional<Error> Open(std::ios::openmode mode) noexcept;
     std::optional<Error> Write(std::string_view data) noexcept;
+    // Writes one tree leaf whose digest the caller has already computed.
+    std::optional<Error> WriteLeaf(std::string_view data, const std::vector<uint8_t>& digest) noexcept;
 
     std::tuple<bool, std::streamsize, Error> Read(std::string& data) noexcept;
     std::tuple<bool, std::streamsize, Error> Read(char* data, std::streamsize size) noexcept;
 
+    std::optional<Error> Seek(std::streamoff offset) noexcept;
+    std::optional<Error> Sync() noexcept;
+    std::optional<Error> Prefetch(std::streamoff offset, std::streamsize length) noexcept;
+
     std::optional<Error> Close() noexcept;
 
 public:
-    std::optional<std::vector<uint8_t>> GetHash() const noexcept;
+    const std::optional<std::vector<uint8_t>>& GetHash() const noexcept;
+    std::optional<std::vector<uint8_t>> GetPartialHash() const noexcept;
     std::optional<std::string> GetHashHex() const;
 
 private:
     static Error ConvertHasherError(const Hasher::Error& e);
 
 private:
-    FileStream file_;
+    std::unique_ptr<FileStream> file_;
     Hasher hasher_;
     std::optional<std::vector<uint8_t>> digest_;
 };
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+// Minimal io_uring wrapper on the raw syscalls: one submission and one
+// completion ring, used by a single thread at a time. IsValid() is false
+// when the kernel (or a seccomp policy) doesn't allow io_uring.
+class IoUring
+{
+public:
+	IoUring(const IoUring&) = delete;
+	IoUring& operator=(const IoUring&) = delete;
+
+public:
+	explicit IoUring(unsigned entries);
+	~IoUring();
+
+public:
+	bool IsValid() const noexcept;
+	int GetError() const noexcept;
+
+	// Both return 0 or a negative errno.
+	int RegisterBuffers(const iovec* iovecs, unsigned count) noexcept;
+	int Submit(unsigned wait) noexcept;
+
+	// nullptr when the submission queue is full; call Submit() first.
+	io_uring_sqe* GetSqe() noexcept;
+
+	// Pops one completion, if there is one.
+	bool PopCqe(io_uring_cqe& cqe) noexcept;
+
+private:
+	int fd_ = -1;
+	int error_ = 0;
+
+	void* sq_ring_ = nullptr;
+	void* cq_ring_ = nullptr;
+	std::size_t sq_ring_size_ = 0;
+	std::size_t cq_ring_size_ = 0;
+
+	io_uring_sqe* sqes_ = nullptr;
+	std::size_t sqes_size_ = 0;
+
+	unsigned* sq_head_ = nullptr;
+	unsigned* sq_tail_ = nullptr;
+	unsigned* sq_array_ = nullptr;
+	unsigned sq_mask_ = 0;
+	unsigned sq_entries_ = 0;
+
+	unsigned* cq_head_ = nullptr;
+	unsigned* cq_tail_ = nullptr;
+	io_uring_cqe* cqes_ = nullptr;
+	unsigned cq_mask_ = 0;
+
+	unsigned pending_ = 0;
+};
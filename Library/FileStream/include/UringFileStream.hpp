@@ -0,0 +1,70 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+#include "FileStream.hpp"
+
+class IoUring;
+
+// FileStream whose writes are queued on io_uring. Write() copies the data
+// into one of queue_depth registered buffers and returns once it has been
+// submitted, so the caller can go back to the network while the kernel
+// writes; it only blocks when every buffer is in flight. A failed write is
+// reported by the next call that touches the file (Write, Read, Seek, Sync
+// or Close). Without io_uring the stream behaves exactly like FileStream.
+class UringFileStream final : public FileStream {
+public:
+	explicit UringFileStream(const std::filesystem::path& path, unsigned queue_depth = 8,
+				 std::size_t buffer_size = 64 * BUFSIZ);
+	~UringFileStream() override;
+
+public:
+	bool IsAsync() const noexcept;
+
+public:
+	std::optional<Error> Open(std::ios::openmode mode) noexcept override;
+	std::optional<Error> Write(std::string_view data) noexcept override;
+
+	std::tuple<bool, std::streamsize, Error> Read(char* data, std::streamsize size) noexcept override;
+	using FileStream::Read;
+
+	std::optional<Error> Seek(std::streamoff offset) noexcept override;
+	std::optional<Error> Sync() noexcept override;
+
+	std::optional<Error> Close() noexcept override;
+
+private:
+	struct Slot {
+		std::unique_ptr<char[]> buffer;
+		uint64_t offset = 0;
+		std::size_t length = 0;
+		std::size_t done = 0;
+	};
+
+private:
+	std::optional<Error> Submit(unsigned index) noexcept;
+	std::optional<Error> Reap(unsigned wait) noexcept;
+	std::optional<Error> Drain() noexcept;
+	Error MakeError(int err, const char* context) noexcept;
+
+private:
+	const unsigned queue_depth_;
+	const std::size_t buffer_size_;
+
+	std::unique_ptr<IoUring> ring_;
+	int fd_ = -1;
+	bool fixed_ = false;
+
+	std::vector<Slot> slots_;
+	std::vector<unsigned> free_;
+	unsigned inflight_ = 0;
+
+	uint64_t offset_ = 0;
+	std::optional<Error> error_;
+};
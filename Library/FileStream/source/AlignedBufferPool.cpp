@@ -0,0 +1,62 @@
+#include "AlignedBufferPool.hpp"
+
+#include <cstdlib>
+
+void AlignedBufferPool::Returner::operator()(char* buffer) const noexcept
+{
+	pool->Release(buffer);
+}
+
+AlignedBufferPool::AlignedBufferPool(std::size_t buffer_size, std::size_t alignment, std::size_t max_cached)
+	: buffer_size_((buffer_size + alignment - 1) / alignment * alignment)
+	, alignment_(alignment)
+	, max_cached_(max_cached)
+{
+}
+
+AlignedBufferPool::~AlignedBufferPool()
+{
+	for (char* buffer : cached_)
+		std::free(buffer);
+}
+
+AlignedBufferPool::Buffer AlignedBufferPool::Acquire() noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (!cached_.empty()) {
+			char* buffer = cached_.back();
+			cached_.pop_back();
+			return Buffer(buffer, Returner{ this });
+		}
+	}
+
+	void* memory = nullptr;
+	if (::posix_memalign(&memory, alignment_, buffer_size_) != 0)
+		return Buffer(nullptr, Returner{ this });
+
+	return Buffer(static_cast<char*>(memory), Returner{ this });
+}
+
+std::size_t AlignedBufferPool::GetBufferSize() const noexcept
+{
+	return buffer_size_;
+}
+
+std::size_t AlignedBufferPool::GetAlignment() const noexcept
+{
+	return alignment_;
+}
+
+void AlignedBufferPool::Release(char* buffer) noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (cached_.size() < max_cached_) {
+			cached_.push_back(buffer);
+			return;
+		}
+	}
+
+	std::free(buffer);
+}
@@ -0,0 +1,318 @@
+#include "DirectFileStream.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+DirectFileStream::DirectFileStream(const std::filesystem::path& path, std::shared_ptr<AlignedBufferPool> pool,
+                                   uint64_t preallocate)
+    : FileStream(path)
+    , pool_(std::move(pool))
+    , preallocate_(preallocate)
+    , buffer_(nullptr, AlignedBufferPool::Returner{ pool_.get() })
+{
+}
+
+DirectFileStream::~DirectFileStream()
+{
+    (void)Close();
+}
+
+bool DirectFileStream::IsDirect() const noexcept
+{
+    return !passthrough_ && direct_;
+}
+
+std::optional<FileStream::Error> DirectFileStream::Open(std::ios::openmode mode) noexcept
+{
+    if (auto err = Close())
+        return err;
+
+    const bool in = (mode & std::ios::in) != 0;
+    const bool out = (mode & std::ios::out) != 0;
+
+    passthrough_ = !out || (mode & std::ios::app) || !pool_;
+    if (passthrough_)
+        return FileStream::Open(mode);
+
+    // Same file creation rules as std::fstream.
+    int flags = O_CLOEXEC | (in ? O_RDWR : O_WRONLY);
+    if (!in || (mode & std::ios::trunc))
+        flags |= O_CREAT | O_TRUNC;
+
+    direct_ = true;
+    fd_ = ::open(GetPath().c_str(), flags | O_DIRECT, 0666);
+    if (fd_ < 0 && errno == EINVAL) {
+        direct_ = false;
+        fd_ = ::open(GetPath().c_str(), flags, 0666);
+    }
+
+    if (fd_ < 0)
+        return errno_error("open");
+
+    auto fail = [this](const char* context) -> std::optional<Error> {
+        const Error error = errno_error(context);
+
+        if (read_fd_ >= 0)
+            ::close(read_fd_);
+        ::close(fd_);
+
+        read_fd_ = fd_ = -1;
+        buffer_.reset();
+
+        return error;
+    };
+
+    read_fd_ = ::open(GetPath().c_str(), O_RDONLY | O_CLOEXEC);
+    if (read_fd_ < 0)
+        return fail("open");
+
+    struct stat st;
+    if (::fstat(fd_, &st) != 0)
+        return fail("stat");
+
+    initial_size_ = static_cast<uint64_t>(st.st_size);
+    end_ = 0;
+
+    // Reserving the extents now keeps the file contiguous and spares the
+    // file system an allocation and size update on every write.
+    if (preallocate_ > initial_size_ && ::fallocate(fd_, 0, 0, static_cast<off_t>(preallocate_)) != 0
+                                     && errno != EOPNOTSUPP)
+        return fail("fallocate");
+
+    buffer_ = pool_->Acquire();
+    if (!buffer_) {
+        errno = ENOMEM;
+        return fail("open");
+    }
+
+    block_offset_ = 0;
+    fill_ = 0;
+
+    return std::nullopt;
+}
+
+std::optional<FileStream::Error> DirectFileStream::Write(std::string_view data) noexcept
+{
+    if (passthrough_)
+        return FileStream::Write(data);
+
+    if (fd_ < 0)
+        return Error{-1, "write: stream is not open"};
+
+    const std::size_t capacity = pool_->GetBufferSize();
+
+    while (!data.empty()) {
+        const std::size_t n = std::min(capacity - fill_, data.size());
+        std::memcpy(buffer_.get() + fill_, data.data(), n);
+
+        fill_ += n;
+        data.remove_prefix(n);
+        end_ = std::max(end_, Position());
+
+        if (fill_ < capacity)
+            continue;
+
+        if (auto err = WriteBlock(capacity))
+            return err;
+
+        block_offset_ += capacity;
+        fill_ = 0;
+    }
+
+    return std::nullopt;
+}
+
+std::tuple<bool, std::streamsize, FileStream::Error> DirectFileStream::Read(char* data, std::streamsize size) noexcept
+{
+    if (passthrough_)
+        return FileStream::Read(data, size);
+
+    if (fd_ < 0)
+        return { false, 0, Error{ -1, "read: stream is not open"} };
+
+    if (size < 0)
+        return { false, 0, Error{ -1, "read: invalid size"} };
+
+    if (auto err = FlushTail())
+        return { false, 0, *err };
+
+    const uint64_t position = Position();
+
+    std::streamsize total = 0;
+    while (total < size) {
+        const ssize_t n = ::pread(read_fd_, data + total, static_cast<std::size_t>(size - total),
+                                  static_cast<off_t>(position + total));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return { false, total, errno_error("read") };
+        }
+
+        if (n == 0)
+            break;
+
+        total += n;
+    }
+
+    if (auto err = LoadBlock(position + static_cast<uint64_t>(total)))
+        return { false, total, *err };
+
+    return { true, total, Error{} };
+}
+
+std::optional<FileStream::Error> DirectFileStream::Seek(std::streamoff offset) noexcept
+{
+    if (passthrough_)
+        return FileStream::Seek(offset);
+
+    if (fd_ < 0)
+        return Error{-1, "seek: stream is not open"};
+
+    if (offset < 0)
+        return Error{-1, "seek: invalid offset"};
+
+    if (auto err = FlushTail())
+        return err;
+
+    return LoadBlock(static_cast<uint64_t>(offset));
+}
+
+std::optional<FileStream::Error> DirectFileStream::Sync() noexcept
+{
+    if (passthrough_)
+        return FileStream::Sync();
+
+    if (fd_ < 0)
+        return Error{-1, "sync: stream is not open"};
+
+    if (auto err = FlushTail())
+        return err;
+
+    if (::fdatasync(fd_) != 0)
+        return errno_error("sync");
+
+    return std::nullopt;
+}
+
+std::optional<FileStream::Error> DirectFileStream::Close() noexcept
+{
+    if (passthrough_)
+        return FileStream::Close();
+
+    if (fd_ < 0)
+        return std::nullopt;
+
+    std::optional<Error> error = FlushTail();
+
+    // Drops the padding of the last block and any preallocated space that
+    // wasn't written.
+    if (!error && ::ftruncate(fd_, static_cast<off_t>(std::max(initial_size_, end_))) != 0)
+        error = errno_error("truncate");
+
+    if (::close(fd_) != 0 && !error)
+        error = errno_error("close");
+
+    ::close(read_fd_);
+
+    fd_ = read_fd_ = -1;
+    buffer_.reset();
+
+    return error;
+}
+
+uint64_t DirectFileStream::Position() const noexcept
+{
+    return block_offset_ + fill_;
+}
+
+std::optional<FileStream::Error> DirectFileStream::WriteBlock(std::size_t length) noexcept
+{
+    for (std::size_t done = 0; done < length; ) {
+        const ssize_t n = ::pwrite(fd_, buffer_.get() + done, length - done,
+                                   static_cast<off_t>(block_offset_ + done));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return errno_error("write");
+        }
+
+        if (n == 0) {
+            errno = EIO;
+            return errno_error("write");
+        }
+
+        done += static_cast<std::size_t>(n);
+    }
+
+    return std::nullopt;
+}
+
+// Writes the buffered partial block padded to the alignment. The padding is
+// what the file already holds there (or zeros past its end), so nothing
+// after the current position is lost; the block stays buffered and is
+// written again once more data arrives.
+std::optional<FileStream::Error> DirectFileStream::FlushTail() noexcept
+{
+    if (fill_ == 0)
+        return std::nullopt;
+
+    const std::size_t alignment = pool_->GetAlignment();
+    const std::size_t padded = (fill_ + alignment - 1) / alignment * alignment;
+
+    std::size_t kept = 0;
+    while (fill_ + kept < padded) {
+        const ssize_t n = ::pread(read_fd_, buffer_.get() + fill_ + kept, padded - fill_ - kept,
+                                  static_cast<off_t>(Position() + kept));
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0)
+            return errno_error("read");
+
+        if (n == 0)
+            break;
+
+        kept += static_cast<std::size_t>(n);
+    }
+
+    std::memset(buffer_.get() + fill_ + kept, 0, padded - fill_ - kept);
+
+    return WriteBlock(padded);
+}
+
+// Positions the stream at offset; the part of its block before offset is
+// read back so the block can be rewritten whole.
+std::optional<FileStream::Error> DirectFileStream::LoadBlock(uint64_t offset) noexcept
+{
+    const std::size_t alignment = pool_->GetAlignment();
+
+    block_offset_ = offset / alignment * alignment;
+    fill_ = static_cast<std::size_t>(offset - block_offset_);
+
+    std::size_t loaded = 0;
+    while (loaded < fill_) {
+        const ssize_t n = ::pread(read_fd_, buffer_.get() + loaded, fill_ - loaded,
+                                  static_cast<off_t>(block_offset_ + loaded));
+        if (n < 0 && errno == EINTR)
+            continue;
+
+        if (n < 0)
+            return errno_error("read");
+
+        if (n == 0)
+            break;
+
+        loaded += static_cast<std::size_t>(n);
+    }
+
+    std::memset(buffer_.get() + loaded, 0, fill_ - loaded);
+
+    return std::nullopt;
+}
@@ -4,6 +4,9 @@
 #include <cstring>
 #include <sstream>
 
+#include <fcntl.h>
+#include <unistd.h>
+
 FileStream::FileStream(const std::filesystem::path& path)
     : path_(path)
 {
@@ -86,6 +89,74 @@ std::tuple<bool, std::streamsize, FileStream::Error> FileStream::Read(char* data
     return { true, n, Error{} };
 }
 
+std::optional<FileStream::Error> FileStream::Seek(std::streamoff offset) noexcept
+{
+    if (!stream_.is_open())
+        return Error{-1, "seek: stream is not open"};
+
+    if (offset < 0)
+        return Error{-1, "seek: invalid offset"};
+
+    stream_.clear();
+    stream_.seekp(offset);
+
+    if (stream_.bad() || stream_.fail())
+        return stream_error(stream_, "seek");
+
+    return std::nullopt;
+}
+
+// Flushes the stream buffer and waits until the data has reached the disk.
+// std::fstream hides its descriptor, so the sync goes through a second one;
+// fdatasync() applies to the inode, not to the descriptor it is called on.
+std::optional<FileStream::Error> FileStream::Sync() noexcept
+{
+    if (!stream_.is_open())
+        return Error{-1, "sync: stream is not open"};
+
+    errno = 0;
+    stream_.flush();
+    if (stream_.bad() || stream_.fail())
+        return stream_error(stream_, "sync");
+
+    const int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno_error("sync");
+
+    if (::fdatasync(fd) != 0) {
+        const Error error = errno_error("sync");
+        ::close(fd);
+        return error;
+    }
+
+    ::close(fd);
+
+    return std::nullopt;
+}
+
+// Asks the kernel to start reading [offset, offset + length) into the page
+// cache. Like Sync(), this goes through its own descriptor: WILLNEED acts on
+// the page cache of the inode, so the stream's reads benefit from it.
+std::optional<FileStream::Error> FileStream::Prefetch(std::streamoff offset, std::streamsize length) noexcept
+{
+    if (offset < 0 || length < 0)
+        return Error{-1, "prefetch: invalid range"};
+
+    const int fd = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return errno_error("prefetch");
+
+    const int err = ::posix_fadvise(fd, offset, length, POSIX_FADV_WILLNEED);
+    ::close(fd);
+
+    if (err != 0) {
+        errno = err;
+        return errno_error("prefetch");
+    }
+
+    return std::nullopt;
+}
+
 std::optional<FileStream::Error> FileStream::Close() noexcept
 {
     if (!stream_.is_open())
@@ -122,3 +193,15 @@ FileStream::Error FileStream::stream_error(const std::ios& stream, const char* c
 
     return Error{ static_cast<int>(state), oss.str() };
 }
+
+FileStream::Error FileStream::errno_error(const char* context) const noexcept
+{
+    const int err = errno;
+
+    std::ostringstream oss;
+    oss << (context ? context : "file")
+        << ": errno=" << err << " (" << std::strerror(err) << ")"
+        << ", path=" << path_.string();
+
+    return Error{ err, oss.str() };
+}
@@ -3,25 +3,30 @@
 #include <sstream>
 
 HashingFileStream::HashingFileStream(const std::filesystem::path& path, Hasher::Type type)
-    : file_(path)
+    : HashingFileStream(std::make_unique<FileStream>(path), type)
+{
+}
+
+HashingFileStream::HashingFileStream(std::unique_ptr<FileStream> file, Hasher::Type type)
+    : file_(std::move(file))
     , hasher_(type)
 {
 }
 
 const std::filesystem::path& HashingFileStream::GetPath() const noexcept
 {
-    return file_.GetPath();
+    return file_->GetPath();
 }
 
 std::optional<HashingFileStream::Error> HashingFileStream::Open(std::ios::openmode mode) noexcept
 {
     digest_.reset();
 
-    if (auto err = file_.Open(mode))
+    if (auto err = file_->Open(mode))
         return err;
 
     if (auto herr = hasher_.Initialize()) {
-        (void)file_.Close();
+        (void)file_->Close();
         return ConvertHasherError(*herr);
     }
 
@@ -30,7 +35,7 @@ std::optional<HashingFileStream::Error> HashingFileStream::Open(std::ios::openmo
 
 std::optional<HashingFileStream::Error> HashingFileStream::Write(std::string_view data) noexcept
 {
-    if (auto err = file_.Write(data))
+    if (auto err = file_->Write(data))
         return err;
 
     if (data.empty())
@@ -42,10 +47,21 @@ std::optional<HashingFileStream::Error> HashingFileStream::Write(std::string_vie
     return std::nullopt;
 }
 
+std::optional<HashingFileStream::Error> HashingFileStream::WriteLeaf(std::string_view data, const std::vector<uint8_t>& digest) noexcept
+{
+    if (auto err = file_->Write(data))
+        return err;
+
+    if (auto herr = hasher_.AddLeaf(digest, data.size()))
+        return ConvertHasherError(*herr);
+
+    return std::nullopt;
+}
+
 std::tuple<bool, std::streamsize, HashingFileStream::Error>
 HashingFileStream::Read(std::string& data) noexcept
 {
-    auto [ok, n, err] = file_.Read(data);
+    auto [ok, n, err] = file_->Read(data);
     if (!ok)
         return { false, n, err };
 
@@ -64,7 +80,7 @@ HashingFileStream::Read(std::string& data) noexcept
 std::tuple<bool, std::streamsize, HashingFileStream::Error>
 HashingFileStream::Read(char* data, std::streamsize size) noexcept
 {
-    auto [ok, n, err] = file_.Read(data, size);
+    auto [ok, n, err] = file_->Read(data, size);
     if (!ok)
         return { false, n, err };
 
@@ -77,26 +93,51 @@ HashingFileStream::Read(char* data, std::streamsize size) noexcept
     return { true, n, Error{} };
 }
 
+std::optional<HashingFileStream::Error> HashingFileStream::Seek(std::streamoff offset) noexcept
+{
+    return file_->Seek(offset);
+}
+
+std::optional<HashingFileStream::Error> HashingFileStream::Sync() noexcept
+{
+    return file_->Sync();
+}
+
+std::optional<HashingFileStream::Error> HashingFileStream::Prefetch(std::streamoff offset, std::streamsize length) noexcept
+{
+    return file_->Prefetch(offset, length);
+}
+
 std::optional<HashingFileStream::Error> HashingFileStream::Close() noexcept
 {
     auto [ok, digest, herr] = hasher_.Finalize();
     if (!ok) {
-		(void)file_.Close();
+		(void)file_->Close();
 		return ConvertHasherError(herr);
     }
 
     digest_ = std::move(digest);
-    if (auto err = file_.Close())
+    if (auto err = file_->Close())
         return err;
 
     return std::nullopt;
 }
 
-std::optional<std::vector<uint8_t>> HashingFileStream::GetHash() const noexcept
+const std::optional<std::vector<uint8_t>>& HashingFileStream::GetHash() const noexcept
 {
     return digest_;
 }
 
+// Digest of everything hashed so far; hashing can continue afterwards.
+std::optional<std::vector<uint8_t>> HashingFileStream::GetPartialHash() const noexcept
+{
+    auto [ok, digest, herr] = hasher_.Snapshot();
+    if (!ok)
+        return std::nullopt;
+
+    return digest;
+}
+
 std::optional<std::string> HashingFileStream::GetHashHex() const
 {
     if (!digest_.has_value())
@@ -0,0 +1,166 @@
+#include "IoUring.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace {
+	template <typename T>
+	T* At(void* base, unsigned offset) noexcept
+	{
+		return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+	}
+
+	unsigned LoadAcquire(unsigned* p) noexcept
+	{
+		return std::atomic_ref<unsigned>(*p).load(std::memory_order_acquire);
+	}
+
+	void StoreRelease(unsigned* p, unsigned value) noexcept
+	{
+		std::atomic_ref<unsigned>(*p).store(value, std::memory_order_release);
+	}
+}
+
+IoUring::IoUring(unsigned entries)
+{
+	io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+
+	fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+	if (fd_ < 0) {
+		error_ = errno;
+		return;
+	}
+
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (single_mmap)
+		sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+	sq_ring_ = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+	if (sq_ring_ == MAP_FAILED) {
+		sq_ring_ = nullptr;
+		error_ = errno;
+		return;
+	}
+
+	if (single_mmap) {
+		cq_ring_ = sq_ring_;
+	} else {
+		cq_ring_ = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+		if (cq_ring_ == MAP_FAILED) {
+			cq_ring_ = nullptr;
+			error_ = errno;
+			return;
+		}
+	}
+
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	void* sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+	if (sqes == MAP_FAILED) {
+		error_ = errno;
+		return;
+	}
+	sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+	sq_head_ = At<unsigned>(sq_ring_, params.sq_off.head);
+	sq_tail_ = At<unsigned>(sq_ring_, params.sq_off.tail);
+	sq_array_ = At<unsigned>(sq_ring_, params.sq_off.array);
+	sq_mask_ = *At<unsigned>(sq_ring_, params.sq_off.ring_mask);
+	sq_entries_ = params.sq_entries;
+
+	cq_head_ = At<unsigned>(cq_ring_, params.cq_off.head);
+	cq_tail_ = At<unsigned>(cq_ring_, params.cq_off.tail);
+	cqes_ = At<io_uring_cqe>(cq_ring_, params.cq_off.cqes);
+	cq_mask_ = *At<unsigned>(cq_ring_, params.cq_off.ring_mask);
+}
+
+IoUring::~IoUring()
+{
+	if (sqes_)
+		::munmap(sqes_, sqes_size_);
+
+	if (cq_ring_ && cq_ring_ != sq_ring_)
+		::munmap(cq_ring_, cq_ring_size_);
+
+	if (sq_ring_)
+		::munmap(sq_ring_, sq_ring_size_);
+
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+bool IoUring::IsValid() const noexcept
+{
+	return fd_ >= 0 && sqes_ != nullptr;
+}
+
+int IoUring::GetError() const noexcept
+{
+	return error_;
+}
+
+int IoUring::RegisterBuffers(const iovec* iovecs, unsigned count) noexcept
+{
+	if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, iovecs, count) < 0)
+		return -errno;
+
+	return 0;
+}
+
+io_uring_sqe* IoUring::GetSqe() noexcept
+{
+	const unsigned tail = *sq_tail_ + pending_;
+	if (tail - LoadAcquire(sq_head_) >= sq_entries_)
+		return nullptr;
+
+	const unsigned index = tail & sq_mask_;
+	io_uring_sqe* sqe = &sqes_[index];
+
+	std::memset(sqe, 0, sizeof(*sqe));
+	sq_array_[index] = index;
+	pending_++;
+
+	return sqe;
+}
+
+int IoUring::Submit(unsigned wait) noexcept
+{
+	const unsigned submit = pending_;
+	if (submit > 0) {
+		StoreRelease(sq_tail_, *sq_tail_ + submit);
+		pending_ = 0;
+	}
+
+	if (submit == 0 && wait == 0)
+		return 0;
+
+	const unsigned flags = wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+	for (;;) {
+		if (::syscall(__NR_io_uring_enter, fd_, submit, wait, flags, nullptr, 0) >= 0)
+			return 0;
+
+		if (errno != EINTR)
+			return -errno;
+	}
+}
+
+bool IoUring::PopCqe(io_uring_cqe& cqe) noexcept
+{
+	const unsigned head = *cq_head_;
+	if (head == LoadAcquire(cq_tail_))
+		return false;
+
+	cqe = cqes_[head & cq_mask_];
+	StoreRelease(cq_head_, head + 1);
+
+	return true;
+}
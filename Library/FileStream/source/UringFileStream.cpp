@@ -0,0 +1,297 @@
+#include "UringFileStream.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "IoUring.hpp"
+
+UringFileStream::UringFileStream(const std::filesystem::path& path, unsigned queue_depth, std::size_t buffer_size)
+    : FileStream(path)
+    , queue_depth_(std::max(queue_depth, 1U))
+    , buffer_size_(std::max<std::size_t>(buffer_size, BUFSIZ))
+{
+}
+
+UringFileStream::~UringFileStream()
+{
+    (void)Close();
+}
+
+bool UringFileStream::IsAsync() const noexcept
+{
+    return ring_ != nullptr;
+}
+
+std::optional<FileStream::Error> UringFileStream::Open(std::ios::openmode mode) noexcept
+{
+    if (auto err = Close())
+        return err;
+
+    // Positional writes can't express O_APPEND; leave that to std::fstream.
+    if (!ring_ && !(mode & std::ios::app)) {
+        ring_ = std::make_unique<IoUring>(queue_depth_);
+        if (!ring_->IsValid())
+            ring_.reset();
+    }
+
+    if (!ring_ || (mode & std::ios::app)) {
+        ring_.reset();
+        return FileStream::Open(mode);
+    }
+
+    const bool in = (mode & std::ios::in) != 0;
+    const bool out = (mode & std::ios::out) != 0;
+
+    // Same file creation rules as std::fstream.
+    int flags = O_CLOEXEC | (in && out ? O_RDWR : out ? O_WRONLY : O_RDONLY);
+    if (out && (!in || (mode & std::ios::trunc)))
+        flags |= O_CREAT | O_TRUNC;
+
+    fd_ = ::open(GetPath().c_str(), flags, 0666);
+    if (fd_ < 0)
+        return errno_error("open");
+
+    if (slots_.empty()) {
+        slots_.resize(queue_depth_);
+
+        std::vector<iovec> iovecs(queue_depth_);
+        for (unsigned i = 0; i < queue_depth_; i++) {
+            slots_[i].buffer = std::make_unique<char[]>(buffer_size_);
+            iovecs[i].iov_base = slots_[i].buffer.get();
+            iovecs[i].iov_len = buffer_size_;
+        }
+
+        // Registration fails under a tight RLIMIT_MEMLOCK on older kernels;
+        // plain IORING_OP_WRITE on the same buffers still works.
+        fixed_ = ring_->RegisterBuffers(iovecs.data(), queue_depth_) == 0;
+    }
+
+    free_.clear();
+    for (unsigned i = 0; i < queue_depth_; i++)
+        free_.push_back(queue_depth_ - 1 - i);
+
+    inflight_ = 0;
+    offset_ = 0;
+    error_.reset();
+
+    return std::nullopt;
+}
+
+std::optional<FileStream::Error> UringFileStream::Write(std::string_view data) noexcept
+{
+    if (!ring_)
+        return FileStream::Write(data);
+
+    if (fd_ < 0)
+        return Error{-1, "write: stream is not open"};
+
+    if (error_)
+        return error_;
+
+    while (!data.empty()) {
+        if (free_.empty()) {
+            if (auto err = Reap(1))
+                return err;
+
+            continue;
+        }
+
+        const unsigned index = free_.back();
+        free_.pop_back();
+
+        Slot& slot = slots_[index];
+        slot.offset = offset_;
+        slot.length = std::min(buffer_size_, data.size());
+        slot.done = 0;
+        std::memcpy(slot.buffer.get(), data.data(), slot.length);
+
+        if (auto err = Submit(index)) {
+            free_.push_back(index);
+            return err;
+        }
+
+        offset_ += slot.length;
+        data.remove_prefix(slot.length);
+    }
+
+    return Reap(0);
+}
+
+std::tuple<bool, std::streamsize, FileStream::Error> UringFileStream::Read(char* data, std::streamsize size) noexcept
+{
+    if (!ring_)
+        return FileStream::Read(data, size);
+
+    if (fd_ < 0)
+        return { false, 0, Error{ -1, "read: stream is not open"} };
+
+    if (size < 0)
+        return { false, 0, Error{ -1, "read: invalid size"} };
+
+    if (auto err = Drain())
+        return { false, 0, *err };
+
+    std::streamsize total = 0;
+    while (total < size) {
+        const ssize_t n = ::pread(fd_, data + total, static_cast<std::size_t>(size - total),
+                                  static_cast<off_t>(offset_));
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+
+            return { false, total, errno_error("read") };
+        }
+
+        if (n == 0)
+            break;
+
+        total += n;
+        offset_ += static_cast<uint64_t>(n);
+    }
+
+    return { true, total, Error{} };
+}
+
+std::optional<FileStream::Error> UringFileStream::Seek(std::streamoff offset) noexcept
+{
+    if (!ring_)
+        return FileStream::Seek(offset);
+
+    if (fd_ < 0)
+        return Error{-1, "seek: stream is not open"};
+
+    if (offset < 0)
+        return Error{-1, "seek: invalid offset"};
+
+    if (auto err = Drain())
+        return err;
+
+    offset_ = static_cast<uint64_t>(offset);
+
+    return std::nullopt;
+}
+
+std::optional<FileStream::Error> UringFileStream::Sync() noexcept
+{
+    if (!ring_)
+        return FileStream::Sync();
+
+    if (fd_ < 0)
+        return Error{-1, "sync: stream is not open"};
+
+    if (auto err = Drain())
+        return err;
+
+    if (::fdatasync(fd_) != 0)
+        return errno_error("sync");
+
+    return std::nullopt;
+}
+
+std::optional<FileStream::Error> UringFileStream::Close() noexcept
+{
+    if (!ring_)
+        return FileStream::Close();
+
+    if (fd_ < 0)
+        return std::nullopt;
+
+    std::optional<Error> error = Drain();
+
+    if (::close(fd_) != 0 && !error)
+        error = errno_error("close");
+
+    fd_ = -1;
+
+    return error;
+}
+
+std::optional<FileStream::Error> UringFileStream::Submit(unsigned index) noexcept
+{
+    io_uring_sqe* sqe = ring_->GetSqe();
+    if (!sqe)
+        return Error{-1, "write: submission queue is full"};
+
+    Slot& slot = slots_[index];
+
+    sqe->opcode = fixed_ ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+    sqe->fd = fd_;
+    sqe->addr = reinterpret_cast<uint64_t>(slot.buffer.get() + slot.done);
+    sqe->len = static_cast<uint32_t>(slot.length - slot.done);
+    sqe->off = slot.offset + slot.done;
+    sqe->buf_index = fixed_ ? static_cast<uint16_t>(index) : 0;
+    sqe->user_data = index;
+
+    inflight_++;
+
+    // The entry is queued either way; a failed enter is retried by the next
+    // Submit() and reported through error_.
+    if (const int rc = ring_->Submit(0); rc < 0 && !error_)
+        error_ = MakeError(-rc, "write");
+
+    return std::nullopt;
+}
+
+// Collects finished writes, waiting for at least `wait` of them. The first
+// failure is kept and returned from then on; short writes are resubmitted.
+std::optional<FileStream::Error> UringFileStream::Reap(unsigned wait) noexcept
+{
+    if (wait > 0 && inflight_ > 0)
+        if (const int rc = ring_->Submit(std::min(wait, inflight_)); rc < 0)
+            return MakeError(-rc, "write");
+
+    io_uring_cqe cqe;
+    while (ring_->PopCqe(cqe)) {
+        const unsigned index = static_cast<unsigned>(cqe.user_data);
+        Slot& slot = slots_[index];
+
+        inflight_--;
+
+        if (cqe.res <= 0) {
+            if (!error_)
+                error_ = MakeError(cqe.res < 0 ? -cqe.res : EIO, "write");
+
+            free_.push_back(index);
+            continue;
+        }
+
+        slot.done += static_cast<std::size_t>(cqe.res);
+        if (slot.done < slot.length && !error_) {
+            auto err = Submit(index);
+            if (!err)
+                continue;
+
+            if (!error_)
+                error_ = err;
+        }
+
+        free_.push_back(index);
+    }
+
+    return error_;
+}
+
+std::optional<FileStream::Error> UringFileStream::Drain() noexcept
+{
+    while (inflight_ > 0) {
+        if (const int rc = ring_->Submit(inflight_); rc < 0) {
+            if (!error_)
+                error_ = MakeError(-rc, "write");
+            break;
+        }
+
+        (void)Reap(0);
+    }
+
+    return error_;
+}
+
+FileStream::Error UringFileStream::MakeError(int err, const char* context) noexcept
+{
+    errno = err;
+    return errno_error(context);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC-32C (Castagnoli). The kernel is picked once at runtime: the SSE4.2
+// crc32 instruction on x86-64, the ARMv8 CRC extension on AArch64, and a
+// slicing-by-8 table otherwise.
+class Crc32c
+{
+public:
+	// Continues a CRC over more data; start from 0.
+	static uint32_t Extend(uint32_t crc, const char* data, std::size_t size) noexcept;
+
+	static const char* GetKernelName() noexcept;
+};
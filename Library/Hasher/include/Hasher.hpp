@@ -1,19 +1,31 @@
 #pragma once
 
 #include <optional>
+#include <cstddef>
+#include <cstdint>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include "openssl/evp.h"
 
+struct XXH3_state_s;
+
 class Hasher
 {
 public:
 	enum class Type {
 		SHA256 = 0,
-		SHA512
+		SHA512,
+		// Merkle tree of SHA-256 over kTreeLeafSize leaves; see HashLeaf()
+		SHA256Tree,
+		// Non-cryptographic; they only catch accidental corruption
+		XXH3_128,
+		CRC32C
 	};
 
+	static constexpr std::size_t kTreeLeafSize = 1024 * 1024;
+
 	struct Error {
 		int code;
 		std::string message;
@@ -35,9 +47,36 @@ public:
     	std::optional<Error> Update(const char* buffer, const size_t size) noexcept;
 	std::optional<Error> Update(const std::string &data) noexcept;
 	std::tuple<bool, std::vector<uint8_t>, Error> Finalize() noexcept;
+	std::tuple<bool, std::vector<uint8_t>, Error> Snapshot() const noexcept;
+
+	// SHA256Tree only: appends a leaf whose digest is already known (e.g.
+	// one checked by HashLeaf()) instead of hashing its data again. The
+	// hasher must be at a leaf boundary.
+	std::optional<Error> AddLeaf(const std::vector<uint8_t>& digest, size_t size) noexcept;
+
+public:
+	// Leaves and inner nodes are prefixed with 0x00 and 0x01 so that one
+	// can't pass for the other. Leaves can be hashed in any order or in
+	// parallel and combined afterwards.
+	static std::tuple<bool, std::vector<uint8_t>, Error> HashLeaf(const char* data, size_t size) noexcept;
+	static std::tuple<bool, std::vector<uint8_t>, Error> CombineLeaves(const std::vector<uint8_t>& leaves) noexcept;
+
+private:
+	std::optional<Error> StartLeaf() noexcept;
+	std::optional<Error> EndLeaf() noexcept;
 
 private:
     Type type_;
     const EVP_MD* md_;
     EVP_MD_CTX *ctx_;
+
+    // SHA256Tree state: finished leaf digests back to back, and how much of
+    // the current leaf (hashed in ctx_) has been seen.
+    std::vector<uint8_t> leaves_;
+    size_t leaf_fill_ = 0;
+    bool short_leaf_ = false;
+
+    // XXH3_128 and CRC32C don't go through EVP.
+    XXH3_state_s *xxh_ = nullptr;
+    uint32_t crc_ = 0;
 };
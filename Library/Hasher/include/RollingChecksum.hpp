@@ -0,0 +1,24 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// rsync's weak checksum: two 16-bit sums over a window that can be moved by
+// one byte in O(1). Only good for finding candidates; matches must be
+// confirmed with a strong digest.
+class RollingChecksum
+{
+public:
+	void Reset(const char* data, std::size_t size) noexcept;
+	void Roll(char out, char in) noexcept;
+
+	uint32_t Digest() const noexcept;
+
+public:
+	static uint32_t Compute(const char* data, std::size_t size) noexcept;
+
+private:
+	uint32_t a_ = 0;
+	uint32_t b_ = 0;
+	std::size_t size_ = 0;
+};
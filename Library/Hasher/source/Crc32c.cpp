@@ -0,0 +1,136 @@
+#include "Crc32c.hpp"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <asm/hwcap.h>
+#include <sys/auxv.h>
+#endif
+
+namespace {
+	using Kernel = uint32_t (*)(uint32_t, const unsigned char*, std::size_t);
+
+	constexpr uint32_t kPolynomial = 0x82F63B78; // reflected Castagnoli
+
+	constexpr std::array<std::array<uint32_t, 256>, 8> MakeTables()
+	{
+		std::array<std::array<uint32_t, 256>, 8> tables{};
+
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t crc = i;
+			for (int bit = 0; bit < 8; bit++)
+				crc = (crc >> 1) ^ ((crc & 1) ? kPolynomial : 0);
+
+			tables[0][i] = crc;
+		}
+
+		for (std::size_t t = 1; t < 8; t++)
+			for (uint32_t i = 0; i < 256; i++)
+				tables[t][i] = (tables[t - 1][i] >> 8) ^ tables[0][tables[t - 1][i] & 0xFF];
+
+		return tables;
+	}
+
+	constexpr auto kTables = MakeTables();
+
+	uint32_t ExtendPortable(uint32_t crc, const unsigned char* p, std::size_t size)
+	{
+		for (; size >= 8; p += 8, size -= 8) {
+			uint64_t word;
+			std::memcpy(&word, p, sizeof(word));
+			word ^= crc;
+
+			crc = kTables[7][word & 0xFF] ^ kTables[6][(word >> 8) & 0xFF]
+			    ^ kTables[5][(word >> 16) & 0xFF] ^ kTables[4][(word >> 24) & 0xFF]
+			    ^ kTables[3][(word >> 32) & 0xFF] ^ kTables[2][(word >> 40) & 0xFF]
+			    ^ kTables[1][(word >> 48) & 0xFF] ^ kTables[0][word >> 56];
+		}
+
+		for (; size > 0; p++, size--)
+			crc = (crc >> 8) ^ kTables[0][(crc ^ *p) & 0xFF];
+
+		return crc;
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sse4.2")))
+	uint32_t ExtendHardware(uint32_t crc, const unsigned char* p, std::size_t size)
+	{
+		uint64_t state = crc;
+
+		for (; size >= 8; p += 8, size -= 8) {
+			uint64_t word;
+			std::memcpy(&word, p, sizeof(word));
+			state = _mm_crc32_u64(state, word);
+		}
+
+		crc = static_cast<uint32_t>(state);
+		for (; size > 0; p++, size--)
+			crc = _mm_crc32_u8(crc, *p);
+
+		return crc;
+	}
+
+	bool HasHardware() noexcept
+	{
+		return __builtin_cpu_supports("sse4.2");
+	}
+#elif defined(__aarch64__)
+	__attribute__((target("+crc")))
+	uint32_t ExtendHardware(uint32_t crc, const unsigned char* p, std::size_t size)
+	{
+		for (; size >= 8; p += 8, size -= 8) {
+			uint64_t word;
+			std::memcpy(&word, p, sizeof(word));
+			crc = __crc32cd(crc, word);
+		}
+
+		for (; size > 0; p++, size--)
+			crc = __crc32cb(crc, *p);
+
+		return crc;
+	}
+
+	bool HasHardware() noexcept
+	{
+		return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+	}
+#else
+	uint32_t ExtendHardware(uint32_t crc, const unsigned char* p, std::size_t size)
+	{
+		return ExtendPortable(crc, p, size);
+	}
+
+	bool HasHardware() noexcept
+	{
+		return false;
+	}
+#endif
+
+	Kernel GetKernel() noexcept
+	{
+		static const Kernel kernel = HasHardware() ? ExtendHardware : ExtendPortable;
+		return kernel;
+	}
+}
+
+uint32_t Crc32c::Extend(uint32_t crc, const char* data, std::size_t size) noexcept
+{
+	return ~GetKernel()(~crc, reinterpret_cast<const unsigned char*>(data), size);
+}
+
+const char* Crc32c::GetKernelName() noexcept
+{
+	if (GetKernel() == ExtendPortable)
+		return "portable";
+
+#if defined(__x86_64__)
+	return "sse4.2";
+#else
+	return "armv8-crc";
+#endif
+}
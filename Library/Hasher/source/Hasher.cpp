@@ -1,7 +1,18 @@
 #include "Hasher.hpp"
 
+#include <algorithm>
+#include <cstring>
+
+#include "Crc32c.hpp"
+
 #include "fmt/core.h"
 
+#if defined(__x86_64__)
+#include "xxh_x86dispatch.h"
+#else
+#include "xxhash.h"
+#endif
+
 #include "openssl/sha.h"
 #include "openssl/err.h"
 
@@ -38,9 +49,13 @@ namespace {
 	{
 		switch (type) {
 		case Hasher::Type::SHA256:
+		case Hasher::Type::SHA256Tree:
 			return EVP_sha256();
 		case Hasher::Type::SHA512:
 			return EVP_sha512();
+		case Hasher::Type::XXH3_128:
+		case Hasher::Type::CRC32C:
+			return nullptr;
 		}
 
 		return nullptr;
@@ -50,13 +65,48 @@ namespace {
 	{
 		switch (type) {
 		case Hasher::Type::SHA256:
+		case Hasher::Type::SHA256Tree:
 			return SHA256_DIGEST_LENGTH;
 		case Hasher::Type::SHA512:
 			return SHA512_DIGEST_LENGTH;
+		case Hasher::Type::XXH3_128:
+			return sizeof(XXH128_canonical_t);
+		case Hasher::Type::CRC32C:
+			return sizeof(uint32_t);
 		}
 
 		return 0;
 	}
+
+	// XXH3 picks SSE2/AVX2/AVX-512 at runtime through libxxhash's x86
+	// dispatcher; elsewhere the vector width is chosen at build time.
+	XXH_errorcode UpdateXXH3(XXH3_state_t* state, const char* data, size_t size) noexcept
+	{
+#if defined(__x86_64__)
+		return XXH3_128bits_update_dispatch(state, data, size);
+#else
+		return XXH3_128bits_update(state, data, size);
+#endif
+	}
+
+	std::vector<uint8_t> DigestXXH3(const XXH3_state_t* state) noexcept
+	{
+		XXH128_canonical_t canonical;
+		XXH128_canonicalFromHash(&canonical, XXH3_128bits_digest(state));
+
+		return std::vector<uint8_t>(canonical.digest, canonical.digest + sizeof(canonical.digest));
+	}
+
+	std::vector<uint8_t> DigestCRC32C(uint32_t crc) noexcept
+	{
+		return {
+			static_cast<uint8_t>(crc >> 24), static_cast<uint8_t>(crc >> 16),
+			static_cast<uint8_t>(crc >> 8),  static_cast<uint8_t>(crc)
+		};
+	}
+
+	constexpr unsigned char kLeafPrefix = 0x00;
+	constexpr unsigned char kNodePrefix = 0x01;
 }
 
 Hasher::Hasher(Type type)
@@ -72,15 +122,26 @@ Hasher::~Hasher()
 		EVP_MD_CTX_free(ctx_);
 		ctx_ = nullptr;
 	}
+
+	if (xxh_) {
+		XXH3_freeState(xxh_);
+		xxh_ = nullptr;
+	}
 }
 
 Hasher::Hasher(Hasher&& other) noexcept
 	: type_(other.type_)
 	, md_(other.md_)
 	, ctx_(other.ctx_)
+	, leaves_(std::move(other.leaves_))
+	, leaf_fill_(other.leaf_fill_)
+	, short_leaf_(other.short_leaf_)
+	, xxh_(other.xxh_)
+	, crc_(other.crc_)
 {
 	other.md_ = nullptr;
 	other.ctx_ = nullptr;
+	other.xxh_ = nullptr;
 }
 
 Hasher& Hasher::operator=(Hasher&& other) noexcept
@@ -93,25 +154,65 @@ Hasher& Hasher::operator=(Hasher&& other) noexcept
 		ctx_ = nullptr;
 	}
 
+	if (xxh_) {
+		XXH3_freeState(xxh_);
+		xxh_ = nullptr;
+	}
+
 	type_ = other.type_;
 	md_   = other.md_;
 	ctx_  = other.ctx_;
 
+	leaves_     = std::move(other.leaves_);
+	leaf_fill_  = other.leaf_fill_;
+	short_leaf_ = other.short_leaf_;
+	xxh_        = other.xxh_;
+	crc_        = other.crc_;
+
 	other.md_  = nullptr;
 	other.ctx_ = nullptr;
+	other.xxh_ = nullptr;
 
 	return *this;
 }
 
 std::optional<Hasher::Error> Hasher::Initialize() noexcept
 {
+	if (type_ == Type::CRC32C) {
+		crc_ = 0;
+		return std::nullopt;
+	}
+
+	if (type_ == Type::XXH3_128) {
+		if (!xxh_)
+			xxh_ = XXH3_createState();
+		if (!xxh_)
+			return MakeError(-2, "XXH3_createState failed");
+
+		if (XXH3_128bits_reset(xxh_) != XXH_OK)
+			return MakeError(-2, "XXH3_128bits_reset failed");
+
+		return std::nullopt;
+	}
+
 	if (!md_)
 		return MakeError(-1, "Unsupported hash type");
 
-	ctx_ = EVP_MD_CTX_new();
+	// A Hasher can be initialized again to start a new digest; the context
+	// is reset by EVP_DigestInit_ex() instead of being leaked.
+	if (!ctx_)
+		ctx_ = EVP_MD_CTX_new();
 	if (!ctx_)
 		return GetLastError("EVP_MD_CTX_new failed");
 
+	if (type_ == Type::SHA256Tree) {
+		leaves_.clear();
+		leaf_fill_ = 0;
+		short_leaf_ = false;
+
+		return StartLeaf();
+	}
+
 	if (EVP_DigestInit_ex(ctx_, md_, nullptr) != 1)
 		return GetLastError("EVP_DigestInit_ex failed");
 
@@ -127,8 +228,46 @@ std::optional<Hasher::Error> Hasher::Update(const char* buffer,
 	if (size == 0)
 		return std::nullopt;
 
-	if (EVP_DigestUpdate(ctx_, buffer, size) != 1)
-		return GetLastError("EVP_DigestUpdate failed");
+	if (type_ == Type::CRC32C) {
+		crc_ = Crc32c::Extend(crc_, buffer, size);
+		return std::nullopt;
+	}
+
+	if (type_ == Type::XXH3_128) {
+		if (!xxh_)
+			return MakeError(-5, "Hasher is not initialized");
+
+		if (UpdateXXH3(xxh_, buffer, size) != XXH_OK)
+			return MakeError(-2, "XXH3_128bits_update failed");
+
+		return std::nullopt;
+	}
+
+	if (type_ != Type::SHA256Tree) {
+		if (EVP_DigestUpdate(ctx_, buffer, size) != 1)
+			return GetLastError("EVP_DigestUpdate failed");
+
+		return std::nullopt;
+	}
+
+	if (short_leaf_)
+		return MakeError(-6, "Update after the last leaf");
+
+	for (size_t done = 0; done < size; ) {
+		const size_t take = std::min(size - done, kTreeLeafSize - leaf_fill_);
+		if (EVP_DigestUpdate(ctx_, buffer + done, take) != 1)
+			return GetLastError("EVP_DigestUpdate failed");
+
+		done += take;
+		leaf_fill_ += take;
+
+		if (leaf_fill_ == kTreeLeafSize) {
+			if (auto err = EndLeaf())
+				return err;
+			if (auto err = StartLeaf())
+				return err;
+		}
+	}
 
 	return std::nullopt;
 }
@@ -140,6 +279,22 @@ std::optional<Hasher::Error> Hasher::Update(const std::string& data) noexcept
 
 std::tuple<bool, std::vector<uint8_t>, Hasher::Error> Hasher::Finalize() noexcept
 {
+	// Neither digest changes the state, so Snapshot() shares this.
+	if (type_ == Type::CRC32C || type_ == Type::XXH3_128)
+		return Snapshot();
+
+	if (type_ == Type::SHA256Tree) {
+		if (!ctx_)
+			return { false, {}, MakeError(-5, "Hasher is not initialized") };
+
+		// An empty input is a single empty leaf.
+		if (leaf_fill_ > 0 || leaves_.empty())
+			if (auto err = EndLeaf())
+				return { false, {}, *err };
+
+		return CombineLeaves(leaves_);
+	}
+
 	unsigned int out_len = EVP_MD_size(md_);
 	if (out_len == 0U || out_len > 1024U) {
 		return {
@@ -163,3 +318,165 @@ std::tuple<bool, std::vector<uint8_t>, Hasher::Error> Hasher::Finalize() noexcep
 
 	return { true, std::move(digest), Hasher::Error{0, ""} };
 }
+
+// Finalizes a copy of the running context, so the caller gets the digest of
+// the data seen so far without ending the computation. OpenSSL 3 contexts
+// can't be serialized; this is what a resume journal records instead.
+std::tuple<bool, std::vector<uint8_t>, Hasher::Error> Hasher::Snapshot() const noexcept
+{
+	if (type_ == Type::CRC32C)
+		return { true, DigestCRC32C(crc_), Hasher::Error{0, ""} };
+
+	if (type_ == Type::XXH3_128) {
+		if (!xxh_)
+			return { false, {}, MakeError(-5, "Hasher is not initialized") };
+
+		return { true, DigestXXH3(xxh_), Hasher::Error{0, ""} };
+	}
+
+	if (!ctx_)
+		return { false, {}, MakeError(-5, "Hasher is not initialized") };
+
+	EVP_MD_CTX *copy = EVP_MD_CTX_new();
+	if (!copy)
+		return { false, {}, GetLastError("EVP_MD_CTX_new failed") };
+
+	if (EVP_MD_CTX_copy_ex(copy, ctx_) != 1) {
+		EVP_MD_CTX_free(copy);
+		return { false, {}, GetLastError("EVP_MD_CTX_copy_ex failed") };
+	}
+
+	if (type_ == Type::SHA256Tree) {
+		std::vector<uint8_t> leaves = leaves_;
+
+		if (leaf_fill_ > 0 || leaves.empty()) {
+			unsigned char leaf[EVP_MAX_MD_SIZE];
+			unsigned int leaf_len = 0;
+
+			if (EVP_DigestFinal_ex(copy, leaf, &leaf_len) != 1) {
+				EVP_MD_CTX_free(copy);
+				return { false, {}, GetLastError("EVP_DigestFinal_ex failed") };
+			}
+
+			leaves.insert(leaves.end(), leaf, leaf + leaf_len);
+		}
+
+		EVP_MD_CTX_free(copy);
+
+		return CombineLeaves(leaves);
+	}
+
+	unsigned int out_len = EVP_MD_size(md_);
+	std::vector<uint8_t> digest(out_len);
+
+	if (EVP_DigestFinal_ex(copy, digest.data(), &out_len) != 1) {
+		EVP_MD_CTX_free(copy);
+		return { false, {}, GetLastError("EVP_DigestFinal_ex failed") };
+	}
+
+	EVP_MD_CTX_free(copy);
+	digest.resize(out_len);
+
+	return { true, std::move(digest), Hasher::Error{0, ""} };
+}
+
+std::optional<Hasher::Error> Hasher::AddLeaf(const std::vector<uint8_t>& digest, size_t size) noexcept
+{
+	if (type_ != Type::SHA256Tree)
+		return MakeError(-6, "AddLeaf requires a tree hash");
+
+	if (leaf_fill_ != 0 || short_leaf_)
+		return MakeError(-6, "AddLeaf is not at a leaf boundary");
+
+	if (digest.size() != SHA256_DIGEST_LENGTH || size == 0 || size > kTreeLeafSize)
+		return MakeError(-6, "AddLeaf received an invalid leaf");
+
+	leaves_.insert(leaves_.end(), digest.begin(), digest.end());
+	short_leaf_ = size < kTreeLeafSize;
+
+	return std::nullopt;
+}
+
+std::tuple<bool, std::vector<uint8_t>, Hasher::Error> Hasher::HashLeaf(const char* data, size_t size) noexcept
+{
+	if (!data && size != 0)
+		return { false, {}, MakeError(-3, "HashLeaf received null buffer with non-zero size") };
+
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (!ctx)
+		return { false, {}, GetLastError("EVP_MD_CTX_new failed") };
+
+	std::vector<uint8_t> digest(SHA256_DIGEST_LENGTH);
+	unsigned int out_len = 0;
+
+	const bool ok = EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr) == 1
+		&& EVP_DigestUpdate(ctx, &kLeafPrefix, 1) == 1
+		&& (size == 0 || EVP_DigestUpdate(ctx, data, size) == 1)
+		&& EVP_DigestFinal_ex(ctx, digest.data(), &out_len) == 1;
+
+	EVP_MD_CTX_free(ctx);
+	if (!ok)
+		return { false, {}, GetLastError("HashLeaf failed") };
+
+	return { true, std::move(digest), Hasher::Error{0, ""} };
+}
+
+// Pairs are hashed level by level; an odd node out is carried up unchanged.
+std::tuple<bool, std::vector<uint8_t>, Hasher::Error> Hasher::CombineLeaves(const std::vector<uint8_t>& leaves) noexcept
+{
+	constexpr size_t kSize = SHA256_DIGEST_LENGTH;
+
+	if (leaves.empty() || leaves.size() % kSize != 0)
+		return { false, {}, MakeError(-6, "CombineLeaves received invalid leaves") };
+
+	std::vector<uint8_t> level = leaves;
+	unsigned char node[1 + 2 * kSize];
+	node[0] = kNodePrefix;
+
+	while (level.size() > kSize) {
+		const size_t count = level.size() / kSize;
+		std::vector<uint8_t> next((count + 1) / 2 * kSize);
+
+		for (size_t i = 0; i + 1 < count; i += 2) {
+			std::memcpy(node + 1, level.data() + i * kSize, 2 * kSize);
+
+			unsigned int out_len = 0;
+			if (EVP_Digest(node, sizeof(node), next.data() + i / 2 * kSize, &out_len, EVP_sha256(), nullptr) != 1)
+				return { false, {}, GetLastError("EVP_Digest failed") };
+		}
+
+		if (count % 2 != 0)
+			std::memcpy(next.data() + count / 2 * kSize, level.data() + (count - 1) * kSize, kSize);
+
+		level = std::move(next);
+	}
+
+	return { true, std::move(level), Hasher::Error{0, ""} };
+}
+
+std::optional<Hasher::Error> Hasher::StartLeaf() noexcept
+{
+	if (EVP_DigestInit_ex(ctx_, md_, nullptr) != 1)
+		return GetLastError("EVP_DigestInit_ex failed");
+
+	if (EVP_DigestUpdate(ctx_, &kLeafPrefix, 1) != 1)
+		return GetLastError("EVP_DigestUpdate failed");
+
+	leaf_fill_ = 0;
+
+	return std::nullopt;
+}
+
+std::optional<Hasher::Error> Hasher::EndLeaf() noexcept
+{
+	unsigned char leaf[EVP_MAX_MD_SIZE];
+	unsigned int leaf_len = 0;
+
+	if (EVP_DigestFinal_ex(ctx_, leaf, &leaf_len) != 1)
+		return GetLastError("EVP_DigestFinal_ex failed");
+
+	leaves_.insert(leaves_.end(), leaf, leaf + leaf_len);
+	leaf_fill_ = 0;
+
+	return std::nullopt;
+}
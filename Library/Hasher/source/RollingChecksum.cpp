@@ -0,0 +1,40 @@
+#include "RollingChecksum.hpp"
+
+void RollingChecksum::Reset(const char* data, std::size_t size) noexcept
+{
+	a_ = 0;
+	b_ = 0;
+	size_ = size;
+
+	for (std::size_t i = 0; i < size; i++) {
+		const uint32_t x = static_cast<unsigned char>(data[i]);
+
+		a_ += x;
+		b_ += static_cast<uint32_t>(size - i) * x;
+	}
+
+	a_ &= 0xFFFF;
+	b_ &= 0xFFFF;
+}
+
+void RollingChecksum::Roll(char out, char in) noexcept
+{
+	const uint32_t x = static_cast<unsigned char>(out);
+	const uint32_t y = static_cast<unsigned char>(in);
+
+	a_ = (a_ - x + y) & 0xFFFF;
+	b_ = (b_ - static_cast<uint32_t>(size_) * x + a_) & 0xFFFF;
+}
+
+uint32_t RollingChecksum::Digest() const noexcept
+{
+	return a_ | (b_ << 16);
+}
+
+uint32_t RollingChecksum::Compute(const char* data, std::size_t size) noexcept
+{
+	RollingChecksum checksum;
+	checksum.Reset(data, size);
+
+	return checksum.Digest();
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <unordered_map>
+#include <unordered_set>
+#include <filesystem>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <tuple>
+#include <list>
+
+#include "FileStream.hpp"
+
+// Content-addressed store of deduplication chunks, one file per chunk under
+// <root>/ab/cdef..., named by the hex SHA-256 of the chunk data.
+//
+// With a limit, the chunks stored add up to at most limit bytes: past that
+// the least recently stored or used ones are removed. The chunks already
+// under root are taken in at construction, oldest first. Chunks an upload
+// holds Pins on are never removed, even if that takes the store past its
+// limit. A client that was told a chunk is present may still find it gone
+// when it refers to it, and has to send it again.
+class ChunkStore
+{
+public:
+	// The chunks one upload has stored or referred to, so that it can refer
+	// to them again later on; released when it is gone.
+	class Pins
+	{
+	public:
+		Pins() = default;
+		~Pins();
+
+		Pins(Pins&& other) noexcept;
+		Pins& operator=(Pins&& other) noexcept;
+
+		Pins(const Pins&) = delete;
+		Pins& operator=(const Pins&) = delete;
+
+	private:
+		friend class ChunkStore;
+
+		ChunkStore* store_ = nullptr;
+		std::unordered_set<std::string> digests_;
+	};
+
+public:
+	// A limit of 0 lets the store grow without bound.
+	explicit ChunkStore(const std::filesystem::path& root, std::uint64_t limit = 0);
+
+public:
+	bool Contains(const std::string& digest) const noexcept;
+
+	// Both pin the chunk with pins, if given.
+	std::optional<FileStream::Error> Put(const std::string& digest, std::string_view data, Pins* pins = nullptr) noexcept;
+	std::tuple<bool, std::string, FileStream::Error> Get(const std::string& digest, Pins* pins = nullptr) noexcept;
+
+	std::uint64_t GetSize() const noexcept;
+
+public:
+	static bool IsValidDigest(const std::string& digest) noexcept;
+
+private:
+	struct Entry {
+		std::uint64_t size;
+		std::list<std::string>::iterator lru;	// lru_.end() while pinned
+		std::size_t pins = 0;
+	};
+
+private:
+	std::filesystem::path PathFor(const std::string& digest) const;
+
+	void Load();
+	void Touch(const std::string& digest) const noexcept;
+	void Insert(const std::string& digest, std::uint64_t size, Pins* pins);
+	void Pin(const std::string& digest, Pins& pins) noexcept;
+	void Hold(const std::string& digest, Pins& pins) noexcept;
+	void Unpin(const std::unordered_set<std::string>& digests) noexcept;
+	void Evict(const std::string* keep) noexcept;
+
+private:
+	const std::filesystem::path root_;
+	const std::uint64_t limit_;
+
+	// Only kept with a limit.
+	mutable std::mutex mutex_;
+	mutable std::list<std::string> lru_;		// most recently used first; not pinned
+	std::unordered_map<std::string, Entry> entries_;
+	std::uint64_t size_ = 0;
+};
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <thread>
+#include <vector>
+#include <mutex>
+
+#include "FileStream.hpp"
+
+// Moves verified uploads from their staging file onto their target. The
+// rename is atomic, so readers see the old version or the new one; how much
+// survives a crash depends on the durability:
+//
+//   None   rename only; the page cache is written back whenever the kernel
+//          gets to it, and a crash may lose uploads that had been answered.
+//   Sync   fdatasync() the file, rename it, then fsync() its directory, all
+//          before answering.
+//   Group  as Sync, but on one thread that takes every upload finished in
+//          the meantime at once: writeback of the whole group is started
+//          before waiting on any of it, and each directory is synced once.
+//          While one group is being synced the next one collects, so the
+//          more uploads finish together the less each one waits.
+class CommitQueue
+{
+public:
+	enum class Durability {
+		None, Sync, Group
+	};
+
+	using Error = FileStream::Error;
+	using Done = std::function<void(std::optional<Error>)>;
+
+public:
+	explicit CommitQueue(Durability durability);
+	~CommitQueue();
+
+	CommitQueue(const CommitQueue&) = delete;
+	CommitQueue& operator=(const CommitQueue&) = delete;
+
+public:
+	// Calls done once staged is durably in place of target (or failed to
+	// be): right away except with Group, where it is called from the
+	// commit thread.
+	void Commit(std::filesystem::path staged, std::filesystem::path target, Done done);
+	// Blocks until then.
+	std::optional<Error> Commit(std::filesystem::path staged, std::filesystem::path target);
+
+private:
+	struct Entry {
+		std::filesystem::path staged;
+		std::filesystem::path target;
+		Done done;
+		std::optional<Error> error;
+	};
+
+private:
+	void Run() noexcept;
+	static void SyncAndRename(std::vector<Entry>& group) noexcept;
+
+private:
+	const Durability durability_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::vector<Entry> queue_;
+	bool stopping_ = false;
+	std::thread thread_;
+};
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <unordered_map>
+#include <filesystem>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <tuple>
+#include <map>
+
+#include "file.pb.h"
+
+// Every file and directory under the server's root, kept in memory so that
+// Stat and ListDirectory never walk the disk. The root is walked once when
+// the index starts; after that it is kept up to date by inotify, with a
+// watch on every directory, and by the server's own uploads (Update()), which
+// are visible as soon as they are answered. A lost inotify event (a queue
+// overflow) makes the index walk the root again.
+//
+// Files count as changed when they are closed after writing, not on every
+// write: a file that another process still has open shows its size as of
+// when it was created or last closed. The server's uploads directory (staged
+// files and journals) and its chunk store are left out. Symbolic links are not followed.
+class DirectoryIndex
+{
+public:
+	struct Filter {
+		std::string name_glob;		// fnmatch(3) on the last component; empty matches all
+		bool files_only = false;
+		// A directory matches neither bound.
+		std::optional<std::uint64_t> min_size;
+		std::optional<std::uint64_t> max_size;
+		std::optional<std::pair<std::int64_t, std::uint32_t>> modified_after;	// seconds, nanos
+	};
+
+	struct Page {
+		std::vector<FileMetaData> entries;
+		std::string last;		// last path looked at; the next page starts after it
+		bool more = false;
+	};
+
+	struct Usage {
+		std::size_t files;
+		std::size_t directories;
+		bool ready;
+	};
+
+public:
+	explicit DirectoryIndex(const std::filesystem::path& root);
+	~DirectoryIndex();
+
+	DirectoryIndex(const DirectoryIndex&) = delete;
+	DirectoryIndex& operator=(const DirectoryIndex&) = delete;
+
+public:
+	// False until the first walk of the root (or the one after an
+	// overflow) is done; nothing can be looked up until then.
+	bool IsReady() const noexcept;
+	bool Covers(const std::filesystem::path& path) const noexcept;
+
+	std::tuple<bool, FileMetaData> Stat(const std::filesystem::path& path) const;
+	// Up to count entries below dir, in path order, starting after `after`.
+	// Looks at a bounded number of entries per call, so a page may come
+	// back short (even empty) with more set. False if dir is not an indexed
+	// directory.
+	std::tuple<bool, Page> List(const std::filesystem::path& dir, bool recursive, const std::string& after,
+				    const Filter& filter, std::size_t count) const;
+
+	// A file the server has just put in place.
+	void Update(const std::filesystem::path& path, const FileMetaData& metadata) noexcept;
+
+	Usage GetUsage() const noexcept;
+
+private:
+	struct Time {
+		std::int64_t seconds;
+		std::uint32_t nanos;
+	};
+
+	struct Entry {
+		bool directory;
+		std::uint64_t size;
+		Time ctime, mtime, atime;
+	};
+
+	using Entries = std::map<std::string, Entry>;
+
+private:
+	void Run() noexcept;
+	void Build() noexcept;
+	void Walk(const std::string& dir) noexcept;
+	void Refresh(const std::string& path) noexcept;
+	void EraseTree(const std::string& dir) noexcept;
+	void Watch(const std::string& dir) noexcept;
+	void UnwatchAll() noexcept;
+
+	void Put(const std::string& path, const Entry& entry);
+	Entries::iterator Erase(Entries::iterator it) noexcept;
+
+	bool IsInternal(const std::string& path) const noexcept;
+	static std::optional<Entry> Load(const std::string& path) noexcept;
+	static FileMetaData ToMetaData(const std::string& path, const Entry& entry);
+	static bool Matches(const std::string& path, const Entry& entry, const Filter& filter) noexcept;
+
+private:
+	const std::string root_;
+	const std::string uploads_;
+	const std::string chunks_;
+
+	int inotify_ = -1;
+	int wakeup_ = -1;
+	std::thread thread_;
+	std::atomic<bool> stopping_ = false;
+	std::atomic<bool> ready_ = false;
+
+	// Only used by the index thread.
+	std::unordered_map<int, std::string> watches_;		// watch -> directory
+	std::unordered_map<std::string, int> watched_;		// directory -> watch
+	bool watch_limit_logged_ = false;
+
+	mutable std::mutex mutex_;
+	Entries entries_;
+	std::size_t files_ = 0;
+	std::size_t directories_ = 0;
+};
@@ -4,27 +4,167 @@
 #include "ftp_service.pb.h"
 #include "file.pb.h"
 
+#include <condition_variable>
+#include <filesystem>
+#include <chrono>
+#include <functional>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <memory>
 #include <string>
+#include <thread>
+#include <mutex>
 #include <tuple>
 
+#include "AlignedBufferPool.hpp"
+#include "CommitQueue.hpp"
+#include "StripeRegistry.hpp"
+#include "ChunkStore.hpp"
+#include "DirectoryIndex.hpp"
+#include "MemoryBudget.hpp"
+#include "MetadataCache.hpp"
+#include "RequestReader.hpp"
 #include "UploadSession.hpp"
+#include "WorkerPool.hpp"
 
 class FTPServiceImpl final : public FTPService::Service
 {
 public:
-        FTPServiceImpl(const std::string_view root_dir);
+        using Durability = CommitQueue::Durability;
+
+        enum class Engine {
+                Sync,           // one gRPC sync-server thread per in-flight upload
+                Callback        // ServerReadReactor; disk work runs on a fixed I/O pool
+        };
+
+        enum class Storage {
+                Stream,         // std::fstream, one blocking write per chunk
+                Uring,          // UringFileStream; falls back to Stream without io_uring
+                Direct          // DirectFileStream: O_DIRECT, preallocated, bypasses the page cache
+        };
+
+        struct Options {
+                Engine engine = Engine::Sync;
+                std::size_t io_threads = 4;
+
+                // Threads the leaf digests of HASH_TYPE_SHA256_TREE uploads
+                // are checked on, up to this many leaves of an upload at
+                // once; 0 checks each on the thread that received it.
+                std::size_t hash_threads = 4;
+
+                Storage storage = Storage::Stream;
+                unsigned queue_depth = 8;
+
+                // Bytes all uploads may hold at once; 0 is unlimited.
+                std::size_t memory_budget = 0;
+
+                // What a successful response promises about a crash.
+                Durability durability = Durability::None;
+
+                // FileMetaData kept for this many files; 0 disables it.
+                std::size_t metadata_cache = 0;
+
+                // Bytes the deduplication chunk store (root_dir/.chunks) may
+                // hold before its least recently used chunks are removed;
+                // 0 is unlimited.
+                std::uint64_t chunk_store_limit = 0;
+
+                // Keep an index of root_dir for Stat and ListDirectory.
+                bool directory_index = false;
+
+                // Journals and staged files (root_dir/.uploads) of uploads
+                // not written to for this long are removed, at startup and
+                // then periodically; 0 keeps them.
+                std::chrono::seconds upload_expiry{ 0 };
+        };
+
+public:
+        FTPServiceImpl(const std::string_view root_dir, const Options& options);
 
 public:
         bool IsValid() const noexcept;
+        MemoryBudget::Usage GetMemoryUsage() const noexcept;
+        MetadataCache::Usage GetMetadataCacheUsage() const noexcept;
+        std::optional<DirectoryIndex::Usage> GetIndexUsage() const noexcept;
+
+private:
+        grpc::Status QueryUpload(grpc::ServerContext* context, const QueryUploadRequest* request, QueryUploadResponse* response) override;
+        grpc::Status CommitUpload(grpc::ServerContext* context, const CommitUploadRequest* request, UploadFileResponse* response) override;
+        grpc::Status DownloadFile(grpc::ServerContext* context, const DownloadFileRequest* request, grpc::ServerWriter<DownloadFileResponse>* writer) override;
+        grpc::Status FindMissingChunks(grpc::ServerContext* context, const FindMissingChunksRequest* request, FindMissingChunksResponse* response) override;
+        grpc::Status GetBlockSignatures(grpc::ServerContext* context, const BlockSignaturesRequest* request, grpc::ServerWriter<BlockSignaturesResponse>* writer) override;
+        grpc::Status Stat(grpc::ServerContext* context, const StatRequest* request, FileMetaData* response) override;
+        grpc::Status ListDirectory(grpc::ServerContext* context, const ListDirectoryRequest* request, grpc::ServerWriter<ListDirectoryResponse>* writer) override;
 
 private:
-        grpc::Status UploadFile(grpc::ServerContext* context, grpc::ServerReader<UploadFileRequest>* reader, UploadFileResponse* response) override;
+	// UploadFile and UploadBatch take their messages as raw ByteBuffers, which
+	// RequestReader parses into one kept request; the constructor installs
+	// these in place of the generated handlers.
+	grpc::Status UploadFileRaw(grpc::ServerContext* context, grpc::ServerReader<grpc::ByteBuffer>* reader, UploadFileResponse* response);
+	grpc::Status UploadBatchRaw(grpc::ServerContext* context, grpc::ServerReaderWriter<UploadBatchResponse, grpc::ByteBuffer>* stream);
+
+	// All three read from requests, one message at a time.
+	std::tuple<bool, UploadSession, grpc::Status> OpenFile(grpc::ServerReader<grpc::ByteBuffer>* reader, RequestReader& requests) noexcept;
+	std::tuple<bool, grpc::Status> WriteToFile(grpc::ServerReader<grpc::ByteBuffer>* reader, UploadSession& session, RequestReader& requests,
+						   MemoryBudget::Reservation& memory) noexcept;
+	std::tuple<bool, FileMetaData, grpc::Status> CheckHash(grpc::ServerReader<grpc::ByteBuffer>* reader, const UploadSession& session,
+							       RequestReader& requests) noexcept;
 
 private:
-	std::tuple<bool, UploadSession, grpc::Status> OpenFile(grpc::ServerReader<UploadFileRequest>* reader) noexcept;
-	std::tuple<bool, grpc::Status> WriteToFile(grpc::ServerReader<UploadFileRequest>* reader, UploadSession& session) noexcept;
-	std::tuple<bool, FileMetaData, grpc::Status> CheckHash(grpc::ServerReader<UploadFileRequest>* reader, const UploadSession& session) noexcept;
-	
+        using CheckDone = std::function<void(bool, FileMetaData, grpc::Status)>;
+
+        // Per-message steps shared by the sync loop above and UploadReactor.
+        // CheckHash() only looks at `last` when the session is hashing.
+        // OpenFile() skips the parent directory check when it is known_dir.
+	std::tuple<bool, UploadSession, grpc::Status> OpenFile(const UploadFileRequest& first,
+							       const std::filesystem::path* known_dir = nullptr) noexcept;
+	std::tuple<bool, grpc::Status> ResumeFile(const UploadInit& init, UploadSession& session) noexcept;
+	std::tuple<bool, grpc::Status> OpenStripe(const UploadInit& init, UploadSession& session) noexcept;
+	std::tuple<bool, grpc::Status> OpenDelta(const UploadInit& init, UploadSession& session) noexcept;
+	// CreateStaged() stages the upload in a new file of its own; both set
+	// up the session's streams on session.path.
+	grpc::Status CreateStaged(const UploadInit& init, UploadSession& session) const noexcept;
+	void MakeStreams(const UploadInit& init, UploadSession& session) const;
+	std::tuple<bool, grpc::Status> WriteToFile(const UploadFileRequest& req, UploadSession& session) noexcept;
+	std::tuple<bool, grpc::Status> CopyFromBase(const BlockRef& ref, UploadSession& session) noexcept;
+	std::tuple<bool, grpc::Status> AppendToFile(std::string_view data, UploadSession& session) noexcept;
+	std::tuple<bool, grpc::Status> AppendChunk(std::string_view data, const std::string& leaf_hash, UploadSession& session) noexcept;
+	std::tuple<bool, grpc::Status> CloseFile(UploadSession& session) noexcept;
+	std::tuple<bool, FileMetaData, grpc::Status> CheckHash(const UploadFileRequest& last, const UploadSession& session) noexcept;
+	void CheckHash(const UploadFileRequest& last, const UploadSession& session, CheckDone done) noexcept;
+	grpc::Status VerifyUpload(const UploadFileRequest& last, const UploadSession& session) noexcept;
+	std::tuple<bool, FileMetaData, grpc::Status> CompleteUpload(const std::filesystem::path& path, const std::filesystem::path& target,
+								     uint64_t received, std::chrono::steady_clock::time_point opened) noexcept;
+	grpc::Status VerifyFile(const UploadFileRequest& last, const UploadSession& session) const noexcept;
+
+	void FillResponse(const UploadSession& session, FileMetaData&& metadata, UploadFileResponse* response) const;
+	void BuildResponse(const UploadSession& session, FileMetaData&& metadata, UploadFileResponse* response) const;
+
+	void SweepUploads(std::stop_token stop) noexcept;
+
+	std::unique_ptr<FileStream> MakeFileStream(const std::filesystem::path& path, const UploadInit& init) const;
+	std::size_t UploadMemory(const UploadFileRequest& req, std::size_t buffers = 0) const noexcept;
+
 private:
+        friend class UploadReactor;
+        friend class UploadAllocationTest;
+
         const std::string root_dir_;
+        const Options options_;
+        const std::filesystem::path uploads_dir_;      // journals and staged uploads
+
+        std::unique_ptr<WorkerPool> leaf_pool_;        // before io_pool_: its tasks submit here
+        std::unique_ptr<WorkerPool> io_pool_;
+        std::shared_ptr<AlignedBufferPool> buffers_;
+        StripeRegistry stripes_;
+        ChunkStore chunks_;
+        MemoryBudget memory_;
+        CommitQueue commits_;
+        MetadataCache metadata_;
+        std::unique_ptr<DirectoryIndex> index_;
+
+        std::mutex sweep_mutex_;
+        std::condition_variable_any sweep_cv_;
+        std::jthread sweeper_;          // last: stopped before the rest goes
 };
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <condition_variable>
+#include <string_view>
+#include <optional>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include <mutex>
+
+#include "FileStream.hpp"
+#include "WorkerPool.hpp"
+
+// Checks the leaf digests that come with the chunks of a HASH_TYPE_SHA256_TREE
+// upload on a worker pool, so that the leaves of one upload are hashed in
+// parallel while its stream goes on. Each leaf is copied into a buffer of its
+// own, which is kept for the next one; at most depth leaves are checked at
+// once, and Submit() waits for one of them to finish past that.
+//
+// Errors come back as a FileStream::Error; code -2 is a corrupted leaf.
+class LeafVerifier
+{
+public:
+	LeafVerifier(WorkerPool& pool, std::size_t depth);
+
+	LeafVerifier(const LeafVerifier&) = delete;
+	LeafVerifier& operator=(const LeafVerifier&) = delete;
+
+public:
+	// Queues data, which starts at offset in the file, to be checked
+	// against digest.
+	void Submit(std::string_view data, std::string_view digest, std::uint64_t offset);
+
+	// The first failure so far, without waiting.
+	std::optional<FileStream::Error> GetError() const noexcept;
+	// Waits until every leaf submitted has been checked.
+	std::optional<FileStream::Error> Wait() const noexcept;
+
+	// What the leaf buffers can take up.
+	std::size_t GetBufferSize() const noexcept;
+
+private:
+	struct Leaf {
+		std::string data;
+		std::string digest;
+		std::uint64_t offset = 0;
+	};
+
+	// Shared with the tasks in the pool, which may outlive the verifier.
+	struct State {
+		mutable std::mutex mutex;
+		mutable std::condition_variable cv;
+		std::vector<Leaf> leaves;
+		std::vector<std::size_t> free;
+		std::optional<FileStream::Error> error;
+	};
+
+private:
+	static void Check(State& state, std::size_t index) noexcept;
+
+private:
+	WorkerPool& pool_;
+	std::shared_ptr<State> state_;
+};
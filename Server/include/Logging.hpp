@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <spdlog/spdlog.h>
+
+// Server-wide logging setup, and sampling for the messages logged once per
+// upload.
+//
+// After Start() the default logger formats and writes on a background
+// thread: a log call only copies its arguments into a ring buffer, and when
+// the buffer is full the oldest message is dropped instead of blocking an
+// upload. Arguments that are costly to build (DebugString(), a hex digest)
+// belong under an if (Logging::Sampled(...)), so they are only built for
+// messages that will be written.
+class Logging
+{
+public:
+	// Messages that are logged for every upload. Errors aren't sampled.
+	enum class Class {
+		Invoked,		// "UploadFile() service invoked"
+		Opened,			// "open file successfully"
+		Written,		// "write file data successfully"
+		Result			// digest and response of a completed upload
+	};
+
+	static constexpr std::size_t kClasses = 4;
+
+public:
+	// queue_size is the number of messages the ring buffer holds.
+	static void Start(spdlog::level::level_enum level, std::size_t queue_size);
+	// Flushes what is queued and stops the background thread.
+	static void Stop();
+
+	// Log 1 in every messages of the class; 0 logs none of them.
+	static void SetSampleRate(Class cls, std::uint32_t every) noexcept;
+
+	// Whether this message of the class is to be logged at level. Counts it
+	// toward the sample only when the level is enabled.
+	static bool Sampled(Class cls, spdlog::level::level_enum level) noexcept;
+};
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <functional>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Caps the memory that uploads hold at once: request buffers, inflated
+// chunks and file stream buffers. An upload reserves what it needs before it
+// reads more from its stream, and when the budget is used up the read waits
+// instead of failing, so the client is held back by HTTP/2 flow control.
+// Waiters are served in order. Memory that is already in use (a message
+// bigger than what was reserved for it) is charged even over the limit, and
+// an upload that needs more than the whole budget gets it once it's alone.
+class MemoryBudget
+{
+public:
+	struct Usage {
+		std::size_t used;
+		std::size_t peak;
+		std::size_t limit;	// 0 is unlimited
+		std::size_t waiting;
+	};
+
+	// What one upload holds. Released when destroyed.
+	class Reservation
+	{
+	public:
+		Reservation() = default;
+		explicit Reservation(MemoryBudget* budget) noexcept;
+
+		Reservation(const Reservation&) = delete;
+		Reservation& operator=(const Reservation&) = delete;
+		Reservation(Reservation&&) noexcept;
+		Reservation& operator=(Reservation&&) noexcept;
+		~Reservation();
+
+	public:
+		std::size_t GetSize() const noexcept;
+
+		// Makes the reservation at least bytes. Growing gives back what
+		// is held and waits for the whole amount, so that no waiter holds
+		// memory that others are waiting for. The second form doesn't
+		// block; ready is called (possibly on another thread) when the
+		// memory is there.
+		void Reserve(std::size_t bytes);
+		void Reserve(std::size_t bytes, std::function<void()> ready);
+
+		// Grows the reservation to bytes without waiting.
+		void Charge(std::size_t bytes) noexcept;
+
+	private:
+		void Reset() noexcept;
+
+	private:
+		MemoryBudget* budget_ = nullptr;
+		std::size_t size_ = 0;
+	};
+
+public:
+	explicit MemoryBudget(std::size_t limit);
+
+	MemoryBudget(const MemoryBudget&) = delete;
+	MemoryBudget& operator=(const MemoryBudget&) = delete;
+
+public:
+	Usage GetUsage() const noexcept;
+
+private:
+	void Acquire(std::size_t bytes, std::function<void()> granted);
+	void Charge(std::size_t bytes) noexcept;
+	void Release(std::size_t bytes) noexcept;
+
+	bool Fits(std::size_t bytes) const noexcept;
+
+private:
+	struct Waiter {
+		std::size_t bytes;
+		std::function<void()> granted;
+	};
+
+	const std::size_t limit_;
+
+	mutable std::mutex mutex_;
+	std::size_t used_ = 0;
+	std::size_t peak_ = 0;
+	std::deque<Waiter> waiters_;
+};
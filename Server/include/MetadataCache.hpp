@@ -0,0 +1,87 @@
+#pragma once
+
+#include <unordered_map>
+#include <system_error>
+#include <filesystem>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <tuple>
+#include <list>
+
+#include "file.pb.h"
+
+// FileMetaData of recently used files, so that repeated requests for the
+// same path are served without a statx() each. Holds at most capacity
+// entries and drops the least recently used one past that.
+//
+// An entry is dropped by the server when it writes the file (Invalidate())
+// and by inotify when anything else does: the directory of every cached file
+// is watched. A path whose directory can't be watched is not cached. The
+// access time of a cached entry is that of when it was stat'd; reads don't
+// invalidate it.
+class MetadataCache
+{
+public:
+	struct Usage {
+		std::size_t entries;
+		std::size_t capacity;	// 0 disables the cache
+		std::uint64_t hits;
+		std::uint64_t misses;
+	};
+
+public:
+	explicit MetadataCache(std::size_t capacity);
+	~MetadataCache();
+
+	MetadataCache(const MetadataCache&) = delete;
+	MetadataCache& operator=(const MetadataCache&) = delete;
+
+public:
+	std::tuple<bool, FileMetaData, std::error_code> Get(const std::filesystem::path& path);
+	void Invalidate(const std::filesystem::path& path) noexcept;
+
+	Usage GetUsage() const noexcept;
+
+private:
+	struct Entry {
+		FileMetaData metadata;
+		std::list<std::string>::iterator lru;
+		int watch;
+	};
+
+	struct Watch {
+		std::string dir;
+		std::size_t entries;
+		// Bumped by every change seen in dir, so that a statx() that
+		// raced with one isn't cached.
+		std::uint64_t generation;
+	};
+
+private:
+	void Run() noexcept;
+
+	void Insert(const std::string& path, int watch, const FileMetaData& metadata);
+	void Erase(std::unordered_map<std::string, Entry>::iterator it) noexcept;
+	void EraseDirectory(std::unordered_map<int, Watch>::iterator watch) noexcept;
+	void Unwatch(std::unordered_map<int, Watch>::iterator watch) noexcept;
+	void Clear() noexcept;
+
+private:
+	const std::size_t capacity_;
+
+	int inotify_ = -1;
+	int wakeup_ = -1;
+	std::thread thread_;
+
+	mutable std::mutex mutex_;
+	bool running_ = false;		// false: nothing is cached
+	std::unordered_map<std::string, Entry> entries_;
+	std::list<std::string> lru_;			// most recently used first
+	std::unordered_map<int, Watch> watches_;
+	std::unordered_map<std::string, int> watched_;	// directory -> watch
+	std::uint64_t hits_ = 0;
+	std::uint64_t misses_ = 0;
+};
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <functional>
+#include <chrono>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// Process-wide upload metrics, rendered in the Prometheus text format.
+//
+// Recording doesn't lock or share cache lines: each thread writes to a shard
+// of its own (handed to the next new thread once it exits), and Render()
+// adds the shards up. Histograms are log-linear like HDR histograms: 16
+// buckets per power of two, so any value is placed within 1/16 of itself.
+class Metrics
+{
+public:
+	// Where an upload's time goes. Read is the wait for the next message,
+	// i.e. the network and the client; the others are FTPServiceImpl steps.
+	// Commit includes the wait for the rest of a group to be synced.
+	enum class Phase {
+		Read, Open, Write, Close, Verify, Commit
+	};
+
+	enum class Counter {
+		BytesReceived,		// chunk payload, as sent
+		UploadsCompleted,
+		UploadsFailed
+	};
+
+	enum class Histogram {
+		ChunkSize,		// bytes
+		UploadRate		// bytes per second over a completed upload
+	};
+
+	enum class Gauge {
+		Sessions		// uploads open right now
+	};
+
+	// Records the time until it is destroyed.
+	class Timer
+	{
+	public:
+		explicit Timer(Phase phase) noexcept;
+		~Timer();
+
+		Timer(const Timer&) = delete;
+		Timer& operator=(const Timer&) = delete;
+
+	private:
+		const Phase phase_;
+		const std::chrono::steady_clock::time_point start_;
+	};
+
+	// Holds a gauge up by one while it lives.
+	class Tracked
+	{
+	public:
+		Tracked() = default;
+		explicit Tracked(Gauge gauge) noexcept;
+
+		Tracked(const Tracked&) = delete;
+		Tracked& operator=(const Tracked&) = delete;
+		Tracked(Tracked&&) noexcept;
+		Tracked& operator=(Tracked&&) noexcept;
+		~Tracked();
+
+	private:
+		Gauge gauge_ = Gauge::Sessions;
+		bool active_ = false;
+	};
+
+public:
+	static void Add(Counter counter, std::uint64_t n = 1) noexcept;
+	static void Add(Gauge gauge, std::int64_t n) noexcept;
+	static void Record(Histogram histogram, std::uint64_t value) noexcept;
+	static void Record(Phase phase, std::chrono::steady_clock::duration elapsed) noexcept;
+
+	// A gauge that is read when rendering, e.g. from the memory budget.
+	static void AddCallback(std::string name, std::string help, std::function<double()> read);
+
+	static std::string Render();
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <thread>
+
+// Serves GET /metrics over plain HTTP/1.1 for Prometheus to scrape. One
+// request per connection, answered on a single thread with whatever render
+// returns; anything else gets a 404. Meant for a local or internal port.
+class MetricsServer
+{
+public:
+	using Render = std::function<std::string()>;
+
+public:
+	MetricsServer(const std::string& host, unsigned short port, Render render);
+	~MetricsServer();
+
+	MetricsServer(const MetricsServer&) = delete;
+	MetricsServer& operator=(const MetricsServer&) = delete;
+
+public:
+	bool IsValid() const noexcept;
+	// errno of the failed socket(), bind() or listen().
+	int GetError() const noexcept;
+
+private:
+	void Run() noexcept;
+	void Serve(int client) noexcept;
+
+private:
+	const Render render_;
+
+	int fd_ = -1;
+	int error_ = 0;
+	std::thread thread_;
+};
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <grpcpp/support/byte_buffer.h>
+
+#include "ftp_service.pb.h"
+
+// Reads each message of an upload into the same UploadFileRequest. gRPC's own
+// parse would Clear() the request and free its chunk, so every chunk would
+// allocate its data again; the upload methods take raw ByteBuffers instead and
+// they are merged into the request after clearing only the chunk, which keeps
+// its data's capacity. Once a chunk has been as big as the ones that follow,
+// reading a chunk allocates nothing.
+class RequestReader
+{
+public:
+	RequestReader() = default;
+
+	RequestReader(const RequestReader&) = delete;
+	RequestReader& operator=(const RequestReader&) = delete;
+
+public:
+	// Reads the next message from a reader of ByteBuffers (ServerReader,
+	// ServerReaderWriter). A message that doesn't parse ends the stream, as
+	// it does for gRPC's typed readers.
+	template <class Reader>
+	bool Read(Reader* reader)
+	{
+		return reader->Read(&buffer_) && Parse();
+	}
+
+	// For reads started elsewhere (UploadReactor): the message is read into
+	// GetBuffer() and then parsed.
+	bool Parse() noexcept;
+
+	grpc::ByteBuffer* GetBuffer() noexcept { return &buffer_; }
+	const UploadFileRequest& Get() const noexcept { return request_; }
+
+private:
+	grpc::ByteBuffer buffer_;
+	UploadFileRequest request_;
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <unordered_map>
+#include <filesystem>
+#include <optional>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <mutex>
+#include <tuple>
+#include <map>
+
+#include "FileStream.hpp"
+
+#include "hash.pb.h"
+
+// Tracks striped uploads: the stripes of one upload_id all write into the
+// same staged file, which is created at path and preallocated by whichever
+// stripe arrives first; Begin() returns where it is. CommitUpload succeeds
+// once the verified stripes cover the file.
+//
+// An upload that no stripe has begun or completed for kIdleTimeout is given
+// up on, and its file removed; its upload_id is then unknown to CommitUpload.
+class StripeRegistry
+{
+public:
+	static constexpr std::chrono::hours kIdleTimeout{ 24 };
+
+public:
+	std::tuple<bool, std::filesystem::path, FileStream::Error> Begin(const std::string& upload_id, const std::filesystem::path& target,
+									 const std::filesystem::path& path, uint64_t filesize,
+									 HashType hashtype) noexcept;
+	void Complete(const std::string& upload_id, uint64_t offset, uint64_t length) noexcept;
+	std::tuple<bool, std::filesystem::path, std::string> Commit(const std::string& upload_id,
+								    const std::filesystem::path& target) noexcept;
+
+private:
+	struct Upload {
+		std::filesystem::path target;
+		std::filesystem::path path;
+		uint64_t filesize;
+		HashType hashtype;
+		std::map<uint64_t, uint64_t> ranges; // offset -> length of verified stripes
+		std::chrono::steady_clock::time_point touched;
+	};
+
+private:
+	void Expire(std::chrono::steady_clock::time_point now) noexcept;
+
+private:
+	std::mutex mutex_;
+	std::unordered_map<std::string, Upload> uploads_;
+};
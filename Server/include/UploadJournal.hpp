@@ -0,0 +1,24 @@
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <chrono>
+
+#include "FileStream.hpp"
+
+#include "journal.pb.h"
+
+// Journals and staged uploads are kept in a directory of the server's own
+// (root/.uploads), where no client can name them: nothing in there is ever
+// user data. Staged files are renamed onto their targets from there, so the
+// root is expected to be one filesystem.
+std::filesystem::path UploadJournalPathFor(const std::filesystem::path& dir, const std::filesystem::path& target);
+bool IsStagingPath(const std::filesystem::path& dir, const std::filesystem::path& path) noexcept;
+
+std::optional<UploadJournal> LoadUploadJournal(const std::filesystem::path& dir, const std::filesystem::path& target) noexcept;
+std::optional<FileStream::Error> SaveUploadJournal(const std::filesystem::path& path, const UploadJournal& journal) noexcept;
+void RemoveUploadJournal(const std::filesystem::path& dir, const std::filesystem::path& target) noexcept;
+
+// Removes the journals and staged files in dir that haven't been written for
+// max_age: uploads that were given up on and never resumed.
+void RemoveStaleUploads(const std::filesystem::path& dir, std::chrono::seconds max_age) noexcept;
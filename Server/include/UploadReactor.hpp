@@ -0,0 +1,52 @@
+#pragma once
+
+#include <chrono>
+
+#include <grpcpp/grpcpp.h>
+
+#include "ftp_service.pb.h"
+
+#include "MemoryBudget.hpp"
+#include "RequestReader.hpp"
+#include "UploadSession.hpp"
+#include "WorkerPool.hpp"
+
+class FTPServiceImpl;
+
+// Callback-API engine for UploadFile. gRPC threads only hand messages over;
+// validation and disk I/O run on the service's I/O pool, and the next read is
+// started only after the previous message has been consumed, so a stream never
+// holds a thread while it waits on the network. Nor while it waits for room
+// in the memory budget: the next read is started by whoever frees it.
+class UploadReactor final : public grpc::ServerReadReactor<grpc::ByteBuffer>
+{
+public:
+	UploadReactor(FTPServiceImpl& service, WorkerPool& pool, UploadFileResponse* response);
+
+public:
+	void OnReadDone(bool ok) override;
+	void OnDone() override;
+
+private:
+	enum class State {
+		Init, Chunk, Finish, Trailer
+	};
+
+private:
+	void Process(bool ok) noexcept;
+	void ReadChunk() noexcept;
+	void Read() noexcept;
+	void Complete() noexcept;
+	void Fail(const char* what, grpc::Status status) noexcept;
+
+private:
+	FTPServiceImpl& service_;
+	WorkerPool& pool_;
+	UploadFileResponse* response_;
+
+	State state_ = State::Init;
+	std::chrono::steady_clock::time_point read_start_;
+	RequestReader requests_;
+	UploadSession session_;
+	MemoryBudget::Reservation memory_;
+};
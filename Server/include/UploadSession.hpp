@@ -2,15 +2,48 @@
 
 #include <filesystem>
 #include <optional>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <tuple>
 
 #include "FileStream.hpp"
 #include "HashingFileStream.hpp"
+#include "Codec.hpp"
+#include "ChunkStore.hpp"
+#include "LeafVerifier.hpp"
+#include "Metrics.hpp"
 
+#include "journal.pb.h"
 #include "hash.pb.h"
 
 struct UploadSession {
 	std::filesystem::path path;
-	uint64_t expected_size;
+	uint64_t expected_size = 0;
+	uint64_t received = 0;
+	uint64_t checkpointed = 0;
+
+	// Set when this stream carries one stripe of a striped upload; the
+	// session then covers [base_offset, base_offset + expected_size).
+	std::string stripe_id;
+	uint64_t base_offset = 0;
+
+	// Every upload is staged at path and moved onto target once verified
+	// (a striped one by CommitUpload, once all of its stripes are).
+	std::filesystem::path target;
+	// Where Checkpoint() records the upload for a resume.
+	std::filesystem::path journal_path;
+
+	// Set for delta uploads: BlockRefs are read from base, the old version.
+	std::unique_ptr<FileStream> base;
+	uint64_t base_size = 0;
+	uint32_t block_size = 0;
+
+	uint64_t bytes_saved = 0;
+
+	// Dedup uploads: chunks stored or referred to so far, which a later
+	// ChunkRef may name again.
+	ChunkStore::Pins chunk_pins;
 
 	bool touch_only = false;
 	bool hashing_enabled = false;
@@ -20,8 +53,31 @@ struct UploadSession {
 
 	HashType hash_type = HASH_TYPE_UNSPECIFIED;
 
+	// Decompresses chunks that carry a raw_size; inflated is reused for them.
+	Codec codec;
+	std::string inflated;
+
+	// Checks the leaf digests of a HASH_TYPE_SHA256_TREE upload; null until
+	// the first one arrives, or when they are checked as they arrive.
+	std::unique_ptr<LeafVerifier> leaves;
+
+	// Counted in the sessions gauge from open until the session is gone.
+	std::chrono::steady_clock::time_point opened;
+	Metrics::Tracked active;
+
 	std::optional<FileStream::Error> Open(std::ios::openmode mode) noexcept;
 	std::optional<FileStream::Error> Write(std::string_view data) noexcept;
+	std::optional<FileStream::Error> WriteLeaf(std::string_view data, const std::vector<uint8_t>& digest) noexcept;
+	std::tuple<bool, std::streamsize, FileStream::Error> Read(char* data, std::streamsize size) noexcept;
+	std::optional<FileStream::Error> Seek(std::streamoff offset) noexcept;
 	std::optional<FileStream::Error> Close() noexcept;
-	std::optional<std::vector<uint8_t>> GetHash() const noexcept;
+	// Null until the hashing stream is closed (or when not hashing).
+	const std::vector<uint8_t>* GetHash() const noexcept;
+
+	// The inflate buffer and the leaves being checked.
+	std::size_t GetBufferSize() const noexcept;
+
+	std::optional<FileStream::Error> Restore(const UploadJournal& journal) noexcept;
+	std::optional<FileStream::Error> Checkpoint() noexcept;
+	void Discard() noexcept;
 };
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <cstddef>
+#include <thread>
+#include <vector>
+#include <deque>
+#include <mutex>
+
+class WorkerPool
+{
+public:
+	using Task = std::function<void()>;
+
+public:
+	explicit WorkerPool(std::size_t threads);
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+public:
+	void Submit(Task task);
+	std::size_t Size() const noexcept;
+
+private:
+	void Run() noexcept;
+
+private:
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	std::deque<Task> tasks_;
+	std::vector<std::thread> threads_;
+	bool stopping_ = false;
+};
@@ -0,0 +1,341 @@
+#include "ChunkStore.hpp"
+
+#include <system_error>
+#include <algorithm>
+#include <fstream>
+#include <atomic>
+#include <utility>
+#include <vector>
+
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+#include "Hasher.hpp"
+
+namespace {
+	constexpr std::size_t kDigestSize = 32; // SHA-256
+
+	std::string FromHex(const std::string& hex)
+	{
+		auto nibble = [](char c) { return c <= '9' ? c - '0' : c - 'a' + 10; };
+
+		std::string out(hex.size() / 2, '\0');
+		for (std::size_t i = 0; i < out.size(); i++)
+			out[i] = static_cast<char>((nibble(hex[2 * i]) << 4) | nibble(hex[2 * i + 1]));
+
+		return out;
+	}
+
+	std::string ToHex(const std::string& digest)
+	{
+		static const char* kHex = "0123456789abcdef";
+
+		std::string out;
+		out.reserve(digest.size() * 2);
+		for (unsigned char b : digest) {
+			out.push_back(kHex[(b >> 4) & 0xF]);
+			out.push_back(kHex[b & 0xF]);
+		}
+
+		return out;
+	}
+}
+
+ChunkStore::Pins::~Pins()
+{
+    if (store_)
+        store_->Unpin(digests_);
+}
+
+ChunkStore::Pins::Pins(Pins&& other) noexcept
+    : store_(std::exchange(other.store_, nullptr))
+    , digests_(std::move(other.digests_))
+{
+}
+
+ChunkStore::Pins& ChunkStore::Pins::operator=(Pins&& other) noexcept
+{
+    if (this != &other) {
+        if (store_)
+            store_->Unpin(digests_);
+
+        store_ = std::exchange(other.store_, nullptr);
+        digests_ = std::move(other.digests_);
+    }
+
+    return *this;
+}
+
+ChunkStore::ChunkStore(const std::filesystem::path& root, std::uint64_t limit)
+    : root_(root)
+    , limit_(limit)
+{
+    if (limit_ > 0)
+        Load();
+}
+
+bool ChunkStore::IsValidDigest(const std::string& digest) noexcept
+{
+    return digest.size() == kDigestSize;
+}
+
+std::filesystem::path ChunkStore::PathFor(const std::string& digest) const
+{
+    const std::string hex = ToHex(digest);
+
+    return root_ / hex.substr(0, 2) / hex.substr(2);
+}
+
+bool ChunkStore::Contains(const std::string& digest) const noexcept
+{
+    if (!IsValidDigest(digest))
+        return false;
+
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(PathFor(digest), ec))
+        return false;
+
+    Touch(digest);
+
+    return true;
+}
+
+// The data is hashed again before it is stored: a chunk that doesn't match
+// its name would corrupt every later upload that refers to it.
+std::optional<FileStream::Error> ChunkStore::Put(const std::string& digest, std::string_view data, Pins* pins) noexcept
+{
+    if (!IsValidDigest(digest))
+        return FileStream::Error{ -1, "chunk store: invalid digest" };
+
+    Hasher hasher(Hasher::Type::SHA256);
+    if (auto err = hasher.Initialize())
+        return FileStream::Error{ err->code, err->message };
+
+    if (auto err = hasher.Update(data.data(), data.size()))
+        return FileStream::Error{ err->code, err->message };
+
+    auto [ok, actual, herr] = hasher.Finalize();
+    if (!ok)
+        return FileStream::Error{ herr.code, herr.message };
+
+    if (digest != std::string(actual.begin(), actual.end()))
+        return FileStream::Error{ -2, "chunk store: data does not match digest" };
+
+    const std::filesystem::path path = PathFor(digest);
+
+    std::error_code ec;
+    if (std::filesystem::is_regular_file(path, ec)) {
+        Touch(digest);
+        if (pins)
+            Pin(digest, *pins);
+
+        return std::nullopt;
+    }
+
+    std::filesystem::create_directories(path.parent_path(), ec);
+    if (ec)
+        return FileStream::Error{ ec.value(), "chunk store: " + ec.message() };
+
+    // Concurrent uploads may store the same chunk; each writes its own
+    // temporary file and the rename makes whichever finishes last visible.
+    static std::atomic<uint64_t> sequence{ 0 };
+    std::filesystem::path temp = path;
+    temp += ".tmp." + std::to_string(::getpid()) + "." + std::to_string(sequence.fetch_add(1));
+
+    FileStream stream(temp);
+    if (auto err = stream.Open(std::ios::binary | std::ios::out | std::ios::trunc))
+        return err;
+
+    if (auto err = stream.Write(data)) {
+        (void)stream.Close();
+        std::filesystem::remove(temp, ec);
+        return err;
+    }
+
+    if (auto err = stream.Close()) {
+        std::filesystem::remove(temp, ec);
+        return err;
+    }
+
+    std::filesystem::rename(temp, path, ec);
+    if (ec) {
+        std::filesystem::remove(temp, ec);
+        return FileStream::Error{ ec.value(), "chunk store: rename failed: " + ec.message() };
+    }
+
+    Insert(digest, data.size(), pins);
+
+    return std::nullopt;
+}
+
+std::tuple<bool, std::string, FileStream::Error> ChunkStore::Get(const std::string& digest, Pins* pins) noexcept
+{
+    if (!IsValidDigest(digest))
+        return { false, {}, FileStream::Error{ -1, "chunk store: invalid digest" } };
+
+    // Pinned first, so that it isn't removed between here and the read.
+    if (pins)
+        Pin(digest, *pins);
+
+    const std::filesystem::path path = PathFor(digest);
+
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return { false, {}, FileStream::Error{ ec.value(), "chunk store: chunk not found" } };
+
+    FileStream stream(path);
+    if (auto err = stream.Open(std::ios::binary | std::ios::in))
+        return { false, {}, *err };
+
+    std::string data(size, '\0');
+    auto [ok, len, err] = stream.Read(data);
+    if (!ok)
+        return { false, {}, err };
+
+    if (static_cast<uintmax_t>(len) != size)
+        return { false, {}, FileStream::Error{ -1, "chunk store: short read" } };
+
+    (void)stream.Close();
+
+    Touch(digest);
+
+    return { true, std::move(data), FileStream::Error{} };
+}
+
+std::uint64_t ChunkStore::GetSize() const noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return size_;
+}
+
+// Chunks are only ever written once, so the modification time is when one
+// was stored; that is the best guess at use there is after a restart.
+void ChunkStore::Load()
+{
+    struct Found {
+        std::filesystem::file_time_type mtime;
+        std::string hex;
+        std::uint64_t size;
+    };
+
+    std::vector<Found> found;
+
+    std::error_code ec;
+    for (std::filesystem::recursive_directory_iterator it(root_, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it.depth() != 1 || it->path().parent_path().filename().string().size() != 2)
+            continue;
+
+        const std::string hex = it->path().parent_path().filename().string() + it->path().filename().string();
+        if (hex.size() != kDigestSize * 2 || hex.find_first_not_of("0123456789abcdef") != std::string::npos)
+            continue;
+
+        std::error_code file_ec;
+        const uintmax_t size = it->file_size(file_ec);
+        const auto mtime = it->last_write_time(file_ec);
+        if (!file_ec)
+            found.push_back(Found{ mtime, hex, size });
+    }
+
+    std::sort(found.begin(), found.end(), [](const Found& a, const Found& b) { return a.mtime < b.mtime; });
+
+    for (const Found& chunk : found)
+        Insert(FromHex(chunk.hex), chunk.size, nullptr);
+
+    spdlog::info("chunk store: {} chunks, {} of {} bytes", entries_.size(), size_, limit_);
+}
+
+void ChunkStore::Touch(const std::string& digest) const noexcept
+{
+    if (limit_ == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (auto it = entries_.find(digest); it != entries_.end() && it->second.pins == 0)
+        lru_.splice(lru_.begin(), lru_, it->second.lru);
+}
+
+void ChunkStore::Insert(const std::string& digest, std::uint64_t size, Pins* pins)
+{
+    if (limit_ == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (auto it = entries_.find(digest); it != entries_.end()) {
+        if (it->second.pins == 0)
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+    } else {
+        lru_.push_front(digest);
+        entries_.emplace(digest, Entry{ size, lru_.begin() });
+        size_ += size;
+    }
+
+    if (pins)
+        Hold(digest, *pins);
+
+    // The chunk just stored is kept even if it alone is over the limit.
+    Evict(&digest);
+}
+
+void ChunkStore::Pin(const std::string& digest, Pins& pins) noexcept
+{
+    if (limit_ == 0)
+        return;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    Hold(digest, pins);
+}
+
+// Called with mutex_ held.
+void ChunkStore::Hold(const std::string& digest, Pins& pins) noexcept
+{
+    auto it = entries_.find(digest);
+    if (it == entries_.end() || (pins.store_ == this && pins.digests_.contains(digest)))
+        return;
+
+    pins.store_ = this;
+    pins.digests_.insert(digest);
+
+    if (it->second.pins++ == 0) {
+        lru_.erase(it->second.lru);
+        it->second.lru = lru_.end();
+    }
+}
+
+// Released chunks count as just used.
+void ChunkStore::Unpin(const std::unordered_set<std::string>& digests) noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    for (const std::string& digest : digests) {
+        auto it = entries_.find(digest);
+        if (it == entries_.end() || --it->second.pins > 0)
+            continue;
+
+        lru_.push_front(digest);
+        it->second.lru = lru_.begin();
+    }
+
+    Evict(nullptr);
+}
+
+// Removes the least recently used chunks until the store is within its
+// limit, or only pinned ones and keep are left. Called with mutex_ held.
+void ChunkStore::Evict(const std::string* keep) noexcept
+{
+    while (size_ > limit_ && !lru_.empty() && !(keep && lru_.back() == *keep)) {
+        auto it = entries_.find(lru_.back());
+
+        std::error_code ec;
+        std::filesystem::remove(PathFor(it->first), ec);
+
+        size_ -= it->second.size;
+        lru_.pop_back();
+        entries_.erase(it);
+    }
+}
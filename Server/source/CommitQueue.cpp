@@ -0,0 +1,173 @@
+#include "CommitQueue.hpp"
+
+#include <system_error>
+#include <algorithm>
+#include <utility>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+	CommitQueue::Error ErrnoError(const char* context, const std::filesystem::path& path)
+	{
+		return CommitQueue::Error{ errno, std::string(context) + " " + path.string() + ": " + std::strerror(errno) };
+	}
+}
+
+CommitQueue::CommitQueue(Durability durability)
+    : durability_(durability)
+{
+    if (durability_ == Durability::Group)
+        thread_ = std::thread([this] { Run(); });
+}
+
+CommitQueue::~CommitQueue()
+{
+    if (!thread_.joinable())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+
+    cv_.notify_one();
+    thread_.join();
+}
+
+void CommitQueue::Commit(std::filesystem::path staged, std::filesystem::path target, Done done)
+{
+    if (durability_ == Durability::None) {
+        std::error_code ec;
+        std::filesystem::rename(staged, target, ec);
+        if (ec)
+            return done(Error{ ec.value(), "rename failed: " + ec.message() });
+
+        return done(std::nullopt);
+    }
+
+    if (durability_ == Durability::Sync) {
+        std::vector<Entry> group;
+        group.push_back(Entry{ std::move(staged), std::move(target), std::move(done), std::nullopt });
+
+        SyncAndRename(group);
+        return group.front().done(std::move(group.front().error));
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        queue_.push_back(Entry{ std::move(staged), std::move(target), std::move(done), std::nullopt });
+    }
+
+    cv_.notify_one();
+}
+
+std::optional<CommitQueue::Error> CommitQueue::Commit(std::filesystem::path staged, std::filesystem::path target)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool finished = false;
+    std::optional<Error> result;
+
+    // Notified under the lock, as in MemoryBudget::Reservation::Reserve().
+    Commit(std::move(staged), std::move(target), [&](std::optional<Error> error) {
+        std::lock_guard<std::mutex> lock(mutex);
+        result = std::move(error);
+        finished = true;
+        cv.notify_one();
+    });
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return finished; });
+
+    return result;
+}
+
+void CommitQueue::Run() noexcept
+{
+    std::vector<Entry> group;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+
+            // Whatever is queued is committed before stopping.
+            if (queue_.empty())
+                return;
+
+            group.swap(queue_);
+        }
+
+        SyncAndRename(group);
+
+        for (Entry& entry : group)
+            entry.done(std::move(entry.error));
+
+        group.clear();
+    }
+}
+
+// Writeback of every file is started before waiting on any of it, so the
+// device sees the whole group at once instead of one file at a time.
+void CommitQueue::SyncAndRename(std::vector<Entry>& group) noexcept
+{
+    std::vector<int> fds(group.size(), -1);
+
+    for (std::size_t i = 0; i < group.size(); i++) {
+        fds[i] = ::open(group[i].staged.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fds[i] < 0) {
+            group[i].error = ErrnoError("open failed:", group[i].staged);
+            continue;
+        }
+
+        (void)::sync_file_range(fds[i], 0, 0, SYNC_FILE_RANGE_WRITE);
+    }
+
+    for (std::size_t i = 0; i < group.size(); i++) {
+        if (fds[i] < 0)
+            continue;
+
+        if (::fdatasync(fds[i]) != 0)
+            group[i].error = ErrnoError("fdatasync failed:", group[i].staged);
+
+        ::close(fds[i]);
+    }
+
+    std::vector<std::filesystem::path> dirs;
+    for (Entry& entry : group) {
+        if (entry.error)
+            continue;
+
+        std::error_code ec;
+        std::filesystem::rename(entry.staged, entry.target, ec);
+        if (ec) {
+            entry.error = Error{ ec.value(), "rename failed: " + ec.message() };
+            continue;
+        }
+
+        dirs.push_back(entry.target.parent_path());
+    }
+
+    // The renames are only durable once their directories are.
+    std::sort(dirs.begin(), dirs.end());
+    dirs.erase(std::unique(dirs.begin(), dirs.end()), dirs.end());
+
+    for (const auto& dir : dirs) {
+        const int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0 && ::fsync(fd) == 0) {
+            ::close(fd);
+            continue;
+        }
+
+        const Error error = ErrnoError("fsync failed:", dir);
+        if (fd >= 0)
+            ::close(fd);
+
+        for (Entry& entry : group)
+            if (!entry.error && entry.target.parent_path() == dir)
+                entry.error = error;
+    }
+}
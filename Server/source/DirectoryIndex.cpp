@@ -0,0 +1,509 @@
+#include "DirectoryIndex.hpp"
+
+#include <system_error>
+#include <chrono>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <fnmatch.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+	// IN_MODIFY is left out on purpose: it comes with every write, and
+	// uploads write a lot. IN_CLOSE_WRITE catches the end of one.
+	constexpr std::uint32_t kWatchMask = IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+					   | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+					   | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+	constexpr std::size_t kEventBufferSize = 64 * 1024;
+
+	// Entries List() looks at per call, matching or not, so that a filter
+	// that matches little doesn't hold the index for long.
+	constexpr std::size_t kMaxScan = 64 * 1024;
+
+	std::string Normalize(const std::filesystem::path& path)
+	{
+		std::string normal = path.lexically_normal().string();
+		if (normal.size() > 1 && normal.back() == '/')
+			normal.pop_back();
+
+		return normal;
+	}
+
+	std::string ChildPrefix(const std::string& dir)
+	{
+		return dir.back() == '/' ? dir : dir + '/';
+	}
+
+	// The first key past every path that starts with prefix ("a/b/" -> "a/b0").
+	std::string SubtreeEnd(std::string prefix)
+	{
+		prefix.back() = '/' + 1;
+		return prefix;
+	}
+
+	std::string ParentOf(const std::string& path)
+	{
+		return std::filesystem::path(path).parent_path().string();
+	}
+
+	void SetTimestamp(google::protobuf::Timestamp* out, std::int64_t seconds, std::uint32_t nanos)
+	{
+		out->set_seconds(seconds);
+		out->set_nanos(nanos);
+	}
+}
+
+DirectoryIndex::DirectoryIndex(const std::filesystem::path& root)
+    : root_(Normalize(std::filesystem::absolute(root)))
+    , uploads_(ChildPrefix(root_) + ".uploads")
+    , chunks_(ChildPrefix(root_) + ".chunks")
+{
+    inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wakeup_ = eventfd(0, EFD_CLOEXEC);
+    if (inotify_ < 0 || wakeup_ < 0) {
+        spdlog::error("directory index disabled: inotify: {}", std::strerror(errno));
+
+        if (inotify_ >= 0)
+            close(inotify_);
+        if (wakeup_ >= 0)
+            close(wakeup_);
+
+        inotify_ = wakeup_ = -1;
+        return;
+    }
+
+    thread_ = std::thread([this] { Run(); });
+}
+
+DirectoryIndex::~DirectoryIndex()
+{
+    if (!thread_.joinable())
+        return;
+
+    stopping_ = true;
+
+    const std::uint64_t one = 1;
+    (void)write(wakeup_, &one, sizeof(one));
+    thread_.join();
+
+    close(inotify_);
+    close(wakeup_);
+}
+
+bool DirectoryIndex::IsReady() const noexcept
+{
+    return ready_;
+}
+
+bool DirectoryIndex::Covers(const std::filesystem::path& path) const noexcept
+{
+    const std::string normal = Normalize(path);
+    return normal == root_ || normal.starts_with(ChildPrefix(root_));
+}
+
+std::tuple<bool, FileMetaData> DirectoryIndex::Stat(const std::filesystem::path& path) const
+{
+    const std::string key = Normalize(path);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = entries_.find(key);
+    if (it == entries_.end())
+        return { false, FileMetaData{} };
+
+    return { true, ToMetaData(it->first, it->second) };
+}
+
+std::tuple<bool, DirectoryIndex::Page> DirectoryIndex::List(const std::filesystem::path& dir, bool recursive, const std::string& after,
+                                                            const Filter& filter, std::size_t count) const
+{
+    const std::string key = Normalize(dir);
+    const std::string prefix = ChildPrefix(key);
+    const std::string end = SubtreeEnd(prefix);
+
+    Page page;
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (auto it = entries_.find(key); it == entries_.end() || !it->second.directory)
+        return { false, std::move(page) };
+
+    auto it = (after.empty() || after < prefix) ? entries_.lower_bound(prefix) : entries_.upper_bound(after);
+    for (std::size_t looked = 0; it != entries_.end() && it->first < end; looked++) {
+        if (page.entries.size() == count || looked == kMaxScan) {
+            page.more = true;
+            break;
+        }
+
+        page.last = it->first;
+
+        // Below a subdirectory: skip all of it.
+        const std::size_t slash = it->first.find('/', prefix.size());
+        if (!recursive && slash != std::string::npos) {
+            it = entries_.lower_bound(SubtreeEnd(it->first.substr(0, slash + 1)));
+            continue;
+        }
+
+        if (Matches(it->first, it->second, filter))
+            page.entries.push_back(ToMetaData(it->first, it->second));
+
+        ++it;
+    }
+
+    return { true, std::move(page) };
+}
+
+void DirectoryIndex::Update(const std::filesystem::path& path, const FileMetaData& metadata) noexcept
+{
+    if (!ready_ || !Covers(path))
+        return;
+
+    const std::string key = Normalize(path);
+    if (IsInternal(key))
+        return;
+
+    const Entry entry{
+        false, metadata.size(),
+        { metadata.create_time().seconds(), static_cast<std::uint32_t>(metadata.create_time().nanos()) },
+        { metadata.modify_time().seconds(), static_cast<std::uint32_t>(metadata.modify_time().nanos()) },
+        { metadata.access_time().seconds(), static_cast<std::uint32_t>(metadata.access_time().nanos()) }
+    };
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // A new directory is left to inotify, which walks it.
+    if (auto parent = entries_.find(ParentOf(key)); parent == entries_.end() || !parent->second.directory)
+        return;
+
+    Put(key, entry);
+}
+
+DirectoryIndex::Usage DirectoryIndex::GetUsage() const noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return Usage{ files_, directories_, ready_ };
+}
+
+void DirectoryIndex::Run() noexcept
+{
+    Build();
+
+    alignas(inotify_event) char buffer[kEventBufferSize];
+
+    pollfd fds[2] = {
+        { inotify_, POLLIN, 0 },
+        { wakeup_, POLLIN, 0 }
+    };
+
+    while (!stopping_) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            spdlog::error("directory index: poll failed: {}", std::strerror(errno));
+            ready_ = false;
+            return;
+        }
+
+        if (fds[1].revents)
+            return;
+
+        const ssize_t length = read(inotify_, buffer, sizeof(buffer));
+        if (length <= 0)
+            continue;
+
+        bool overflow = false;
+        for (ssize_t offset = 0; offset < length && !overflow; ) {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                overflow = true;
+                continue;
+            }
+
+            auto watch = watches_.find(event->wd);
+            if (watch == watches_.end())
+                continue;
+
+            if (event->mask & IN_IGNORED) {
+                watched_.erase(watch->second);
+                watches_.erase(watch);
+                continue;
+            }
+
+            const std::string dir = watch->second;
+
+            // Its parent sees the same as IN_DELETE or IN_MOVED_FROM, unless
+            // it is the root.
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                if (dir == root_)
+                    spdlog::error("directory index: {} was removed or moved", root_);
+
+                EraseTree(dir);
+                continue;
+            }
+
+            if (event->len == 0)
+                continue;
+
+            const std::string path = ChildPrefix(dir) + event->name;
+            if (IsInternal(path))
+                continue;
+
+            if (event->mask & (IN_DELETE | IN_MOVED_FROM))
+                EraseTree(path);
+            else if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+                Walk(path);
+            else
+                Refresh(path);
+        }
+
+        if (overflow) {
+            spdlog::warn("directory index: inotify queue overflowed; walking {} again", root_);
+            Build();
+        }
+    }
+}
+
+// Walks the root from scratch; nothing is served meanwhile.
+void DirectoryIndex::Build() noexcept
+{
+    ready_ = false;
+
+    UnwatchAll();
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        entries_.clear();
+        files_ = directories_ = 0;
+    }
+
+    const auto started = std::chrono::steady_clock::now();
+    Walk(root_);
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+
+    const Usage usage = GetUsage();
+    spdlog::info("directory index: {} files in {} directories under {} ({:.2f}s)",
+                 usage.files, usage.directories, root_, elapsed.count());
+
+    ready_ = !stopping_;
+}
+
+void DirectoryIndex::Walk(const std::string& top) noexcept
+{
+    std::vector<std::string> pending{ top };
+
+    while (!pending.empty() && !stopping_) {
+        const std::string dir = std::move(pending.back());
+        pending.pop_back();
+
+        if (IsInternal(dir))
+            continue;
+
+        // Watched before it is read, so that nothing created meanwhile is
+        // missed.
+        Watch(dir);
+
+        const auto self = Load(dir);
+        if (!self || !self->directory)
+            continue;
+
+        std::vector<std::pair<std::string, Entry>> found;
+
+        std::error_code ec;
+        for (std::filesystem::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            std::string path = it->path().string();
+            if (IsInternal(path))
+                continue;
+
+            const auto entry = Load(path);
+            if (!entry)
+                continue;
+
+            // Its own entry is put when it is walked.
+            if (entry->directory)
+                pending.push_back(std::move(path));
+            else
+                found.emplace_back(std::move(path), *entry);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        Put(dir, *self);
+        for (const auto& [path, entry] : found)
+            Put(path, entry);
+    }
+}
+
+void DirectoryIndex::Refresh(const std::string& path) noexcept
+{
+    const auto entry = Load(path);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (!entry) {
+        if (auto it = entries_.find(path); it != entries_.end() && !it->second.directory)
+            Erase(it);
+        return;
+    }
+
+    // Anything else is put when its directory is walked.
+    if (auto parent = entries_.find(ParentOf(path)); parent == entries_.end() || !parent->second.directory)
+        return;
+
+    Put(path, *entry);
+}
+
+// path and, if it is a directory, everything below it.
+void DirectoryIndex::EraseTree(const std::string& path) noexcept
+{
+    const std::string prefix = ChildPrefix(path);
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (auto it = entries_.find(path); it != entries_.end())
+        Erase(it);
+
+    auto it = entries_.lower_bound(prefix);
+    while (it != entries_.end() && it->first.starts_with(prefix))
+        it = Erase(it);
+
+    // A moved directory keeps its watches; they would report under the old
+    // path.
+    for (auto watch = watched_.begin(); watch != watched_.end(); ) {
+        if (watch->first != path && !watch->first.starts_with(prefix)) {
+            ++watch;
+            continue;
+        }
+
+        (void)inotify_rm_watch(inotify_, watch->second);
+        watches_.erase(watch->second);
+        watch = watched_.erase(watch);
+    }
+}
+
+void DirectoryIndex::Watch(const std::string& dir) noexcept
+{
+    if (watched_.find(dir) != watched_.end())
+        return;
+
+    const int wd = inotify_add_watch(inotify_, dir.c_str(), kWatchMask);
+    if (wd < 0) {
+        if (errno == ENOSPC && !watch_limit_logged_) {
+            spdlog::warn("directory index: out of inotify watches at {}; changes below it are not seen "
+                         "(raise fs.inotify.max_user_watches)", dir);
+            watch_limit_logged_ = true;
+        }
+        return;
+    }
+
+    // The same directory under another name gets its existing watch.
+    if (auto it = watches_.find(wd); it != watches_.end())
+        watched_.erase(it->second);
+
+    watches_[wd] = dir;
+    watched_[dir] = wd;
+}
+
+void DirectoryIndex::UnwatchAll() noexcept
+{
+    for (const auto& [wd, dir] : watches_)
+        (void)inotify_rm_watch(inotify_, wd);
+
+    watches_.clear();
+    watched_.clear();
+    watch_limit_logged_ = false;
+}
+
+void DirectoryIndex::Put(const std::string& path, const Entry& entry)
+{
+    auto [it, inserted] = entries_.try_emplace(path, entry);
+    if (!inserted) {
+        (it->second.directory ? directories_ : files_)--;
+        it->second = entry;
+    }
+
+    (entry.directory ? directories_ : files_)++;
+}
+
+DirectoryIndex::Entries::iterator DirectoryIndex::Erase(Entries::iterator it) noexcept
+{
+    (it->second.directory ? directories_ : files_)--;
+
+    return entries_.erase(it);
+}
+
+// The server's uploads directory (see UploadJournal) and the chunk store.
+bool DirectoryIndex::IsInternal(const std::string& path) const noexcept
+{
+    return path == uploads_ || path.starts_with(ChildPrefix(uploads_))
+        || path == chunks_ || path.starts_with(ChildPrefix(chunks_));
+}
+
+std::optional<DirectoryIndex::Entry> DirectoryIndex::Load(const std::string& path) noexcept
+{
+    constexpr unsigned int kMask = STATX_TYPE | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_CTIME;
+
+    struct statx stx;
+    if (statx(AT_FDCWD, path.c_str(), AT_SYMLINK_NOFOLLOW | AT_STATX_SYNC_AS_STAT, kMask, &stx) != 0)
+        return std::nullopt;
+
+    if (!S_ISREG(stx.stx_mode) && !S_ISDIR(stx.stx_mode))
+        return std::nullopt;
+
+    const bool directory = S_ISDIR(stx.stx_mode);
+
+    return Entry{
+        directory, directory ? 0 : stx.stx_size,
+        { stx.stx_ctime.tv_sec, stx.stx_ctime.tv_nsec },
+        { stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec },
+        { stx.stx_atime.tv_sec, stx.stx_atime.tv_nsec }
+    };
+}
+
+FileMetaData DirectoryIndex::ToMetaData(const std::string& path, const Entry& entry)
+{
+    FileMetaData data;
+
+    data.set_path(path);
+    data.set_size(entry.size);
+    data.set_directory(entry.directory);
+
+    SetTimestamp(data.mutable_create_time(), entry.ctime.seconds, entry.ctime.nanos);
+    SetTimestamp(data.mutable_modify_time(), entry.mtime.seconds, entry.mtime.nanos);
+    SetTimestamp(data.mutable_access_time(), entry.atime.seconds, entry.atime.nanos);
+
+    return data;
+}
+
+bool DirectoryIndex::Matches(const std::string& path, const Entry& entry, const Filter& filter) noexcept
+{
+    if (entry.directory && (filter.files_only || filter.min_size || filter.max_size))
+        return false;
+
+    if (filter.min_size && entry.size < *filter.min_size)
+        return false;
+
+    if (filter.max_size && entry.size > *filter.max_size)
+        return false;
+
+    if (filter.modified_after && std::make_pair(entry.mtime.seconds, entry.mtime.nanos) <= *filter.modified_after)
+        return false;
+
+    if (!filter.name_glob.empty()) {
+        const char* name = path.c_str() + path.rfind('/') + 1;
+        if (fnmatch(filter.name_glob.c_str(), name, 0) != 0)
+            return false;
+    }
+
+    return true;
+}
@@ -3,16 +3,41 @@
 #include <system_error>
 #include <string_view>
 #include <filesystem>
+#include <algorithm>
+#include <condition_variable>
 #include <optional>
+#include <utility>
 #include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
 #include <tuple>
 
 #include <cstring>
+#include <random>
+#include <cerrno>
+#include <cmath>
+#include <bit>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <google/protobuf/descriptor.h>
 
 #include "spdlog/fmt/bin_to_hex.h"
 #include "spdlog/spdlog.h"
 
+#include "RollingChecksum.hpp"
+#include "DirectFileStream.hpp"
+#include "UringFileStream.hpp"
+#include "IoUring.hpp"
 #include "FileMetaData.hpp"
+#include "UploadJournal.hpp"
+#include "LeafVerifier.hpp"
+#include "UploadReactor.hpp"
+#include "DirectoryIndex.hpp"
+#include "Metrics.hpp"
+#include "Logging.hpp"
 
 #include "ftp_service.pb.h"
 #include "hash.pb.h"
@@ -21,11 +46,88 @@
 namespace fs = std::filesystem;
 
 namespace {
+	// With a durability other than none, received data is made durable and
+	// journaled at least this often, so a server crash loses at most this
+	// much of a resumable upload. Without one nothing is synced on the way;
+	// an interrupted upload is still journaled once, when its stream ends.
+	constexpr uint64_t kCheckpointInterval = 64ULL * 1024 * 1024;
+
+	// Size of the O_DIRECT staging buffers: large enough that each write
+	// is one big sequential request.
+	constexpr std::size_t kDirectBufferSize = 1024 * 1024;
+
+	// Memory budgeted for a chunk before one has arrived: the client's
+	// default chunk size.
+	constexpr std::size_t kChunkReserve = 64 * BUFSIZ;
+
+	// HASH_TYPE_SHA256_TREE leaf digests are SHA-256.
+	constexpr std::size_t kLeafDigestSize = 32;
+
+	// Delta block sizes; the default grows with the square root of the file
+	// size like rsync's, which balances signature size against match rate.
+	constexpr uint32_t kMinBlockSize = 512;
+	constexpr uint32_t kMaxBlockSize = 1024 * 1024;
+	constexpr int kSignaturesPerMessage = 4096;
+
+	static uint32_t DefaultBlockSize(uint64_t filesize) noexcept
+	{
+		const uint64_t root = static_cast<uint64_t>(std::sqrt(static_cast<double>(filesize)));
+		return static_cast<uint32_t>(std::clamp<uint64_t>(std::bit_ceil(root), 2048, 128 * 1024));
+	}
+
+	// A new name in the uploads directory for an upload to be staged under.
+	// Every upload gets its own, so that concurrent uploads of one target
+	// never write into the same file; the name is kept in the upload's journal.
+	static std::filesystem::path NewStagingPath(const std::filesystem::path& dir)
+	{
+		thread_local std::mt19937_64 engine(std::random_device{}());
+
+		return dir / fmt::format("{:016x}.partial", engine());
+	}
+
+	// Creates path, which must not exist yet.
+	static std::error_code CreateStagingFile(const std::filesystem::path& path) noexcept
+	{
+		const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return std::error_code(errno, std::system_category());
+
+		::close(fd);
+
+		return std::error_code();
+	}
+
+	// Same test as DirectoryIndex::Covers(), for when the index is off.
+	static bool IsUnderRoot(const std::filesystem::path& root, const std::filesystem::path& path)
+	{
+		const std::filesystem::path relative = path.lexically_normal()
+			.lexically_relative(std::filesystem::absolute(root).lexically_normal());
+
+		return !relative.empty() && *relative.begin() != "..";
+	}
+
 	static std::optional<Hasher::Type> MapHasherType(HashType t) noexcept
 	{
 		switch (t) {
 		case HASH_TYPE_SHA256: return Hasher::Type::SHA256;
 		case HASH_TYPE_SHA512: return Hasher::Type::SHA512;
+		case HASH_TYPE_SHA256_TREE: return Hasher::Type::SHA256Tree;
+		case HASH_TYPE_XXH3_128: return Hasher::Type::XXH3_128;
+		case HASH_TYPE_CRC32C: return Hasher::Type::CRC32C;
+		default: return std::nullopt;
+		}
+	}
+
+	// Upper bound for chunk.raw_size, so a small compressed chunk can't make
+	// the server allocate an arbitrary amount of memory.
+	constexpr uint64_t kMaxRawChunkSize = 16ULL * 1024 * 1024;
+
+	static std::optional<Codec::Type> MapCodecType(CompressionType t) noexcept
+	{
+		switch (t) {
+		case COMPRESSION_TYPE_NONE: return Codec::Type::None;
+		case COMPRESSION_TYPE_ZSTD: return Codec::Type::Zstd;
+		case COMPRESSION_TYPE_LZ4:  return Codec::Type::Lz4;
 		default: return std::nullopt;
 		}
 	}
@@ -35,11 +137,25 @@ namespace {
 		return grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, std::move(msg));
 	}
 
+	static grpc::Status Precondition(std::string msg)
+	{
+		return grpc::Status(grpc::StatusCode::FAILED_PRECONDITION, std::move(msg));
+	}
+
 	static grpc::Status Internal(std::string msg)
 	{
 		return grpc::Status(grpc::StatusCode::INTERNAL, std::move(msg));
 	}
 
+	// A leaf that failed its check: corrupted (-2) or not hashed at all.
+	static grpc::Status LeafStatus(const FileStream::Error& err)
+	{
+		if (err.code == -2)
+			return grpc::Status(grpc::StatusCode::DATA_LOSS, err.message);
+
+		return Internal(err.message);
+	}
+
 	static std::optional<Hasher::Type> MapHashTypeOptional(const UploadInit& init)
 	{
 		if (!init.has_hashtype())
@@ -48,17 +164,112 @@ namespace {
 		switch (init.hashtype()) {
 		case HASH_TYPE_SHA256: return Hasher::Type::SHA256;
 		case HASH_TYPE_SHA512: return Hasher::Type::SHA512;
+		case HASH_TYPE_SHA256_TREE: return Hasher::Type::SHA256Tree;
+		case HASH_TYPE_XXH3_128: return Hasher::Type::XXH3_128;
+		case HASH_TYPE_CRC32C: return Hasher::Type::CRC32C;
 		case HASH_TYPE_UNSPECIFIED:
 		default:
 			return std::nullopt;
 		}
 	}
 
+	// Sends [offset, offset + length) of an open stream as DownloadChunk
+	// messages, keeping the page cache kReadAhead bytes ahead of the reader.
+	template <typename Stream>
+	static grpc::Status StreamRange(grpc::ServerContext* context, Stream& stream,
+					grpc::ServerWriter<DownloadFileResponse>* writer,
+					uint64_t offset, uint64_t length)
+	{
+		constexpr uint64_t kReadAhead = 8ULL * 1024 * 1024;
+		constexpr std::size_t kChunkSize = 64 * BUFSIZ;
+
+		if (auto err = stream.Seek(static_cast<std::streamoff>(offset)))
+			return Internal("seek failed: " + err->message);
+
+		std::vector<char> buffer(kChunkSize);
+		DownloadFileResponse resp;
+		DownloadChunk* chunk = resp.mutable_chunk();
+
+		uint64_t prefetched = offset;
+		for (uint64_t sent = 0; sent < length; ) {
+			if (context->IsCancelled())
+				return grpc::Status::CANCELLED;
+
+			if (offset + sent + kReadAhead > prefetched && prefetched < offset + length) {
+				const uint64_t window = std::min(2 * kReadAhead, offset + length - prefetched);
+				(void)stream.Prefetch(static_cast<std::streamoff>(prefetched), static_cast<std::streamsize>(window));
+				prefetched += window;
+			}
+
+			const uint64_t want = std::min<uint64_t>(buffer.size(), length - sent);
+			const auto [ok, len, err] = stream.Read(buffer.data(), static_cast<std::streamsize>(want));
+			if (!ok)
+				return Internal("read failed: " + err.message);
+
+			if (len <= 0)
+				return grpc::Status(grpc::StatusCode::DATA_LOSS, "file shrank while being sent");
+
+			chunk->set_data(buffer.data(), static_cast<std::size_t>(len));
+			chunk->set_offset(offset + sent);
+
+			if (!writer->Write(resp))
+				return grpc::Status(grpc::StatusCode::UNAVAILABLE, "failed to write chunk");
+
+			sent += static_cast<uint64_t>(len);
+		}
+
+		if (auto err = stream.Close())
+			return Internal("close failed: " + err->message);
+
+		return grpc::Status::OK;
+	}
+
+	// Results are sent back this many at a time.
+	constexpr int kBatchResults = 256;
+
+	// Batches are meant for many small files; the features for big ones
+	// don't apply.
+	static grpc::Status CheckBatchInit(const UploadInit& init)
+	{
+		if (!init.has_filesize())
+			return InvalidArg("batch: init.filesize is required");
+
+		if (init.has_stripe() || init.has_delta() || (init.has_resume() && init.resume()))
+			return InvalidArg("batch: stripe, delta and resume are not supported");
+
+		return grpc::Status::OK;
+	}
+
+	// Entries per ListDirectory message: what the client asks for, up to
+	// this many.
+	constexpr std::size_t kListPageSize = 1000;
+	constexpr std::size_t kMaxListPageSize = 10000;
+
+	static DirectoryIndex::Filter MakeListFilter(const ListFilter& in)
+	{
+		DirectoryIndex::Filter filter;
+
+		filter.name_glob = in.name_glob();
+		filter.files_only = in.files_only();
+		if (in.has_min_size())
+			filter.min_size = in.min_size();
+		if (in.has_max_size())
+			filter.max_size = in.max_size();
+		if (in.has_modified_after())
+			filter.modified_after = std::make_pair(in.modified_after().seconds(),
+							       static_cast<std::uint32_t>(in.modified_after().nanos()));
+
+		return filter;
+	}
+
 	static bool HashLengthMatches(HashType t, size_t n)
 	{
 		switch (t) {
 		case HASH_TYPE_SHA256: return n == 32;
 		case HASH_TYPE_SHA512: return n == 64;
+		case HASH_TYPE_SHA256_TREE: return n == 32;
+		case HASH_TYPE_XXH3_128: return n == 16;
+		case HASH_TYPE_CRC32C: return n == 4;
 		case HASH_TYPE_UNSPECIFIED:
 		default:
 			return n == 0;
@@ -66,9 +277,97 @@ namespace {
 	}
 }
 
-FTPServiceImpl::FTPServiceImpl(const std::string_view root_dir)
+FTPServiceImpl::FTPServiceImpl(const std::string_view root_dir, const Options& options)
     : root_dir_(root_dir)
+    , options_(options)
+    , uploads_dir_(fs::path(root_dir_) / ".uploads")
+    , chunks_(fs::path(root_dir_) / ".chunks", options.chunk_store_limit)
+    , memory_(options.memory_budget)
+    , commits_(options.durability)
+    , metadata_(options.metadata_cache)
+{
+    if (options_.storage == Storage::Uring) {
+        IoUring probe(1);
+        if (!probe.IsValid())
+            spdlog::warn("io_uring is not available ({}); writing through std::fstream",
+                         std::strerror(probe.GetError()));
+    }
+
+    if (options_.storage == Storage::Direct)
+        buffers_ = std::make_shared<AlignedBufferPool>(kDirectBufferSize);
+
+    if (IsValid()) {
+        std::error_code ec;
+        fs::create_directories(uploads_dir_, ec);
+        if (ec)
+            spdlog::error("failed to create {}: {}", uploads_dir_.string(), ec.message());
+    }
+
+    if (options_.hash_threads > 0)
+        leaf_pool_ = std::make_unique<WorkerPool>(options_.hash_threads);
+
+    if (options_.directory_index && IsValid())
+        index_ = std::make_unique<DirectoryIndex>(root_dir_);
+
+    if (options_.upload_expiry.count() > 0 && IsValid())
+        sweeper_ = std::jthread([this](std::stop_token stop) { SweepUploads(stop); });
+
+    // UploadFile and UploadBatch read raw ByteBuffers, which RequestReader
+    // parses into one kept request, so their handlers are replaced with ones
+    // typed on grpc::ByteBuffer (UploadFile's with a callback one for the
+    // callback engine). The generated service adds its methods in descriptor
+    // order, so the indices are taken from there rather than from where the
+    // methods sit in the .proto.
+    const google::protobuf::ServiceDescriptor* descriptor = UploadFileRequest::descriptor()->file()->FindServiceByName("FTPService");
+    const google::protobuf::MethodDescriptor* upload = descriptor ? descriptor->FindMethodByName("UploadFile") : nullptr;
+    const google::protobuf::MethodDescriptor* batch = descriptor ? descriptor->FindMethodByName("UploadBatch") : nullptr;
+    if (!upload || !batch) {
+        spdlog::error("FTPService.UploadFile or UploadBatch not found in ftp_service.proto");
+        return;
+    }
+
+    // A sync client-streaming method is a bidi one that happens to write
+    // once; from the server's side the two only differ in their handler.
+    MarkMethodStreamed(batch->index(), new grpc::internal::BidiStreamingHandler<FTPService::Service, grpc::ByteBuffer, UploadBatchResponse>(
+        [](FTPService::Service* service, grpc::ServerContext* context,
+           grpc::ServerReaderWriter<UploadBatchResponse, grpc::ByteBuffer>* stream) {
+            return static_cast<FTPServiceImpl*>(service)->UploadBatchRaw(context, stream);
+        }, this
+    ));
+
+    if (options_.engine != Engine::Callback) {
+        MarkMethodStreamed(upload->index(), new grpc::internal::ClientStreamingHandler<FTPService::Service, grpc::ByteBuffer, UploadFileResponse>(
+            [](FTPService::Service* service, grpc::ServerContext* context,
+               grpc::ServerReader<grpc::ByteBuffer>* reader, UploadFileResponse* response) {
+                return static_cast<FTPServiceImpl*>(service)->UploadFileRaw(context, reader, response);
+            }, this
+        ));
+        return;
+    }
+
+    io_pool_ = std::make_unique<WorkerPool>(options_.io_threads);
+
+    // This is what FTPService::WithRawCallbackMethod_UploadFile does, but
+    // keeps the other methods of this service on the sync API.
+    MarkMethodRawCallback(upload->index(), new grpc::internal::CallbackClientStreamingHandler<grpc::ByteBuffer, UploadFileResponse>(
+        [this](grpc::CallbackServerContext* context, UploadFileResponse* response) {
+            return new UploadReactor(*this, *io_pool_, response);
+        }
+    ));
+}
+
+// Uploads only go stale after upload_expiry, so looking once an hour (or
+// every upload_expiry, if that is shorter) is often enough.
+void FTPServiceImpl::SweepUploads(std::stop_token stop) noexcept
 {
+    const std::chrono::seconds interval = std::min<std::chrono::seconds>(options_.upload_expiry, std::chrono::hours(1));
+
+    while (!stop.stop_requested()) {
+        RemoveStaleUploads(uploads_dir_, options_.upload_expiry);
+
+        std::unique_lock<std::mutex> lock(sweep_mutex_);
+        sweep_cv_.wait_for(lock, stop, interval, [] { return false; });
+    }
 }
 
 bool FTPServiceImpl::IsValid() const noexcept
@@ -79,55 +378,584 @@ bool FTPServiceImpl::IsValid() const noexcept
         && fs::is_directory(root_dir_, ec);
 }
 
-grpc::Status FTPServiceImpl::UploadFile(grpc::ServerContext* context,
-                                        grpc::ServerReader<UploadFileRequest>* reader,
-                                        UploadFileResponse* response)
+MemoryBudget::Usage FTPServiceImpl::GetMemoryUsage() const noexcept
+{
+    return memory_.GetUsage();
+}
+
+MetadataCache::Usage FTPServiceImpl::GetMetadataCacheUsage() const noexcept
+{
+    return metadata_.GetUsage();
+}
+
+std::optional<DirectoryIndex::Usage> FTPServiceImpl::GetIndexUsage() const noexcept
 {
-	spdlog::info("UploadFile() service invoked");
+    if (!index_)
+        return std::nullopt;
 
-    auto [ok_open, session, st_open] = OpenFile(reader);
+    return index_->GetUsage();
+}
+
+grpc::Status FTPServiceImpl::UploadFileRaw(grpc::ServerContext* context,
+                                           grpc::ServerReader<grpc::ByteBuffer>* reader,
+                                           UploadFileResponse* response)
+{
+    if (Logging::Sampled(Logging::Class::Invoked, spdlog::level::info))
+        spdlog::info("UploadFile() service invoked");
+
+    RequestReader requests;
+
+    MemoryBudget::Reservation memory(&memory_);
+    memory.Reserve(UploadMemory(requests.Get()));
+
+    auto [ok_open, session, st_open] = OpenFile(reader, requests);
     if (!ok_open) {
 		spdlog::error("failed to open file: {}", st_open.error_message());
+        session.Discard();
+        Metrics::Add(Metrics::Counter::UploadsFailed);
         return st_open;
 	}
-	spdlog::info("open file successfully: {} (hash: {}) (size: {})",
-				 session.path.c_str(), HashType_Name(session.hash_type),
-				 session.expected_size);
+    if (Logging::Sampled(Logging::Class::Opened, spdlog::level::info))
+        spdlog::info("open file successfully: {} (hash: {}) (size: {})",
+                     session.target.c_str(), HashType_Name(session.hash_type),
+                     session.expected_size);
 
-    auto [ok_write, st_write] = WriteToFile(reader, session);
+    auto [ok_write, st_write] = WriteToFile(reader, session, requests, memory);
     if (!ok_write) {
 		spdlog::error("failed to wrtie file: {}", st_write.error_message());
+        session.Discard();
+        Metrics::Add(Metrics::Counter::UploadsFailed);
         return st_write;
 	}
-	spdlog::info("write file data successfully: {}",
-				 MakeFileMetaDataFrom(session.path).DebugString());
+    // What was written is already known; no need to stat the file for it.
+    if (Logging::Sampled(Logging::Class::Written, spdlog::level::info))
+        spdlog::info("write file data successfully: {} ({} bytes)",
+                     session.target.c_str(), session.received);
 
-    auto [ok_hash, metadata, st_meta] = CheckHash(reader, session);
+    auto [ok_hash, metadata, st_meta] = CheckHash(reader, session, requests);
     if (!ok_hash) {
 		spdlog::error("failed to check hash: {}", st_meta.error_message());
+        session.Discard();
+        Metrics::Add(Metrics::Counter::UploadsFailed);
         return st_meta;
 	}
-	spdlog::info("hash check complete: {}", spdlog::to_hex(*session.GetHash()));
 
-    Hash hash_out;
-    hash_out.set_hashtype(session.hash_type);
-    hash_out.set_data(session.GetHash()->data(), session.GetHash()->size());
-    *response->mutable_hash() = hash_out;
+    FillResponse(session, std::move(metadata), response);
+
+    return grpc::Status::OK;
+}
+
+// Runs each file through the same steps as UploadFile. What is paid once per
+// batch instead of once per file: the stream, the response message, the
+// parent directory check for files in the directory seen last, and the info
+// logs.
+grpc::Status FTPServiceImpl::UploadBatchRaw(grpc::ServerContext* context,
+                                            grpc::ServerReaderWriter<UploadBatchResponse, grpc::ByteBuffer>* stream)
+{
+    spdlog::info("UploadBatch() service invoked");
+
+    UploadBatchResponse batch;
+    RequestReader requests;
+    MemoryBudget::Reservation memory(&memory_);
+
+    std::optional<UploadSession> session;
+    std::filesystem::path known_dir;
+    std::string filepath;
+    bool skipping = false;
+    std::uint64_t stored = 0, failed = 0;
+
+    // Files being committed; their results are picked up between reads. It
+    // is shared with the callbacks, which may outlive an aborted stream.
+    struct Committing {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::size_t pending = 0;
+        std::uint64_t stored = 0, failed = 0;
+        std::vector<UploadBatchResult> results;
+    };
+    const auto committing = std::make_shared<Committing>();
+
+    const auto collect = [&](bool wait) {
+        std::unique_lock<std::mutex> lock(committing->mutex);
+        if (wait)
+            committing->cv.wait(lock, [&] { return committing->pending == 0; });
+
+        for (UploadBatchResult& result : committing->results)
+            *batch.add_results() = std::move(result);
+        committing->results.clear();
+
+        stored += std::exchange(committing->stored, 0);
+        failed += std::exchange(committing->failed, 0);
+    };
+
+    // A failed file is reported and the rest of its messages are skipped.
+    const auto fail = [&](const grpc::Status& st) {
+        spdlog::debug("UploadBatch(): {} failed: {}", filepath, st.error_message());
+
+        if (session) {
+            session->Discard();
+            session.reset();
+        }
+
+        UploadBatchResult* result = batch.add_results();
+        result->set_filepath(filepath);
+        result->set_code(static_cast<int>(st.error_code()));
+        result->set_message(st.error_message());
+
+        skipping = true;
+        failed++;
+        Metrics::Add(Metrics::Counter::UploadsFailed);
+    };
+
+    // The commit goes on while the next files are read, so that with group
+    // durability the small files of a batch are synced together.
+    const auto complete = [&](const UploadFileRequest& last) {
+        if (auto [ok_close, st_close] = CloseFile(*session); !ok_close)
+            return fail(st_close);
+
+        auto closed = std::make_shared<UploadSession>(std::move(*session));
+        session.reset();
+
+        {
+            std::lock_guard<std::mutex> lock(committing->mutex);
+            committing->pending++;
+        }
+
+        CheckHash(last, *closed, [this, committing, closed, filepath](bool ok_hash, FileMetaData metadata, grpc::Status st_meta) {
+            UploadBatchResult result;
+            result.set_filepath(filepath);
+
+            if (ok_hash) {
+                BuildResponse(*closed, std::move(metadata), result.mutable_response());
+            } else {
+                spdlog::debug("UploadBatch(): {} failed: {}", filepath, st_meta.error_message());
+                closed->Discard();
+                result.set_code(static_cast<int>(st_meta.error_code()));
+                result.set_message(st_meta.error_message());
+                Metrics::Add(Metrics::Counter::UploadsFailed);
+            }
+
+            std::lock_guard<std::mutex> lock(committing->mutex);
+            (ok_hash ? committing->stored : committing->failed)++;
+            committing->results.push_back(std::move(result));
+            committing->pending--;
+            committing->cv.notify_one();
+        });
+    };
+
+    const auto ready = [&] {
+        return session->received == session->expected_size && !session->hashing_enabled;
+    };
+
+    // Like UploadFile's reads, each one waits for room in the memory budget.
+    const auto read = [&] {
+        memory.Reserve(UploadMemory(requests.Get(), session ? session->GetBufferSize() : 0));
+
+        const Metrics::Timer timer(Metrics::Phase::Read);
+        if (!requests.Read(stream))
+            return false;
+
+        memory.Charge(UploadMemory(requests.Get(), session ? session->GetBufferSize() : 0));
+        return true;
+    };
+
+    while (read()) {
+        const UploadFileRequest& req = requests.Get();
+
+        if (req.request_case() == UploadFileRequest::kInit) {
+            if (session)
+                fail(InvalidArg("batch: init arrived before the previous file was complete"));
+
+            filepath = req.init().filepath();
+            skipping = false;
+
+            if (auto st = CheckBatchInit(req.init()); !st.ok()) {
+                fail(st);
+            } else if (auto [ok_open, opened, st_open] = OpenFile(req, &known_dir); !ok_open) {
+                opened.Discard();
+                fail(st_open);
+            } else {
+                known_dir = opened.path.parent_path();
+                session = std::move(opened);
+
+                if (ready())
+                    complete(req);
+            }
+        } else if (skipping) {
+            continue;
+        } else if (!session) {
+            return InvalidArg("batch: each file must start with init");
+        } else if (session->received < session->expected_size) {
+            if (auto [ok_write, st_write] = WriteToFile(req, *session); !ok_write)
+                fail(st_write);
+            else if (ready())
+                complete(req);
+        } else {
+            complete(req);
+        }
+
+        collect(false);
+
+        if (batch.results_size() >= kBatchResults) {
+            if (!stream->Write(batch))
+                return grpc::Status(grpc::StatusCode::CANCELLED, "failed to write batch results");
+            batch.Clear();
+        }
+    }
+
+    if (session)
+        fail(InvalidArg("batch: stream ended before the file was complete"));
+
+    collect(true);
+
+    if (batch.results_size() > 0 && !stream->Write(batch))
+        return grpc::Status(grpc::StatusCode::CANCELLED, "failed to write batch results");
+
+    spdlog::info("UploadBatch() result: {} stored, {} failed", stored, failed);
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::QueryUpload(grpc::ServerContext* context,
+                                         const QueryUploadRequest* request,
+                                         QueryUploadResponse* response)
+{
+    const std::filesystem::path path = request->filepath();
+    if (path.empty() || !path.is_absolute())
+        return InvalidArg("filepath must be an absolute path");
+
+    response->set_offset(0);
+
+    const auto journal = LoadUploadJournal(uploads_dir_, path);
+    if (!journal)
+        return grpc::Status::OK;
+
+    const HashType hashtype = request->has_hashtype() ? request->hashtype() : HASH_TYPE_UNSPECIFIED;
+    if (journal->filesize() != request->filesize() || journal->hashtype() != hashtype)
+        return grpc::Status::OK;
+
+    std::error_code ec;
+    const uintmax_t size = std::filesystem::file_size(journal->staging(), ec);
+    if (ec || size < journal->offset())
+        return grpc::Status::OK;
+
+    response->set_offset(journal->offset());
+    spdlog::info("QueryUpload(): {} can resume at offset {}", path.c_str(), journal->offset());
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::CommitUpload(grpc::ServerContext* context,
+                                          const CommitUploadRequest* request,
+                                          UploadFileResponse* response)
+{
+    spdlog::info("CommitUpload() service invoked: {}", request->upload_id());
+
+    const std::filesystem::path target = request->filepath();
+
+    auto [ok, path, error] = stripes_.Commit(request->upload_id(), target);
+    if (!ok) {
+        spdlog::error("failed to commit upload: {}", error);
+        return Precondition(error);
+    }
+
+    {
+        const Metrics::Timer timer(Metrics::Phase::Commit);
+        if (auto err = commits_.Commit(path, target)) {
+            spdlog::error("failed to commit upload: {}", err->message);
+            return Internal("failed to replace " + target.string() + ": " + err->message);
+        }
+    }
+
+    metadata_.Invalidate(target);
+
+    auto [ok_stat, metadata, ec] = metadata_.Get(target);
+    if (!ok_stat)
+        return Internal("failed to stat " + target.string() + ": " + ec.message());
+
+    if (index_)
+        index_->Update(target, metadata);
+
     *response->mutable_metadata() = std::move(metadata);
 
-	spdlog::info("UploadFile() result: \n{}", response->DebugString());
+	spdlog::info("CommitUpload() result: \n{}", response->DebugString());
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::DownloadFile(grpc::ServerContext* context,
+                                          const DownloadFileRequest* request,
+                                          grpc::ServerWriter<DownloadFileResponse>* writer)
+{
+	spdlog::info("DownloadFile() service invoked");
+
+    const std::filesystem::path path = request->filepath();
+    if (path.empty() || !path.is_absolute())
+        return InvalidArg("filepath must be an absolute path");
+
+    if (!(index_ ? index_->Covers(path) : IsUnderRoot(root_dir_, path)))
+        return InvalidArg("filepath is outside of the server's root");
+
+    // Fails for anything but a regular file.
+    auto [ok_stat, metadata, ec] = metadata_.Get(path);
+    if (!ok_stat)
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, "filepath is not a regular file");
+
+    const HashType hashtype = request->has_hashtype() ? request->hashtype() : HASH_TYPE_UNSPECIFIED;
+    const auto hasher_type = MapHasherType(hashtype);
+    if (hashtype != HASH_TYPE_UNSPECIFIED && !hasher_type)
+        return InvalidArg("invalid hashtype");
+
+    DownloadFileResponse init_resp;
+    DownloadInit* init = init_resp.mutable_init();
+    *init->mutable_metadata() = std::move(metadata);
+
+    const uint64_t size = init->metadata().size();
+    const uint64_t offset = request->has_offset() ? request->offset() : 0;
+    if (offset > size)
+        return grpc::Status(grpc::StatusCode::OUT_OF_RANGE, "offset is past the end of file");
+
+    const uint64_t length = request->has_length() ? std::min(request->length(), size - offset) : size - offset;
+    init->set_offset(offset);
+    init->set_length(length);
+
+    if (!writer->Write(init_resp))
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "failed to write init");
+
+    DownloadFileResponse finish_resp;
+    DownloadFinish* finish = finish_resp.mutable_finish();
+
+    if (hasher_type) {
+        HashingFileStream stream(path, *hasher_type);
+        if (auto err = stream.Open(std::ios::binary | std::ios::in))
+            return Internal("open failed: " + err->message);
+
+        if (auto st = StreamRange(context, stream, writer, offset, length); !st.ok()) {
+            spdlog::error("failed to send file: {}", st.error_message());
+            return st;
+        }
+
+        finish->mutable_hash()->set_hashtype(hashtype);
+        finish->mutable_hash()->set_data(stream.GetHash()->data(), stream.GetHash()->size());
+    } else {
+        FileStream stream(path);
+        if (auto err = stream.Open(std::ios::binary | std::ios::in))
+            return Internal("open failed: " + err->message);
+
+        if (auto st = StreamRange(context, stream, writer, offset, length); !st.ok()) {
+            spdlog::error("failed to send file: {}", st.error_message());
+            return st;
+        }
+    }
+
+    if (!writer->Write(finish_resp))
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "failed to write finish");
+
+    spdlog::info("DownloadFile() sent {} bytes of {} from offset {}", length, path.c_str(), offset);
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::FindMissingChunks(grpc::ServerContext* context,
+                                               const FindMissingChunksRequest* request,
+                                               FindMissingChunksResponse* response)
+{
+    for (int i = 0; i < request->digests_size(); i++) {
+        if (!ChunkStore::IsValidDigest(request->digests(i)))
+            return InvalidArg("digests must be SHA-256 digests");
+
+        if (!chunks_.Contains(request->digests(i)))
+            response->add_missing(static_cast<uint32_t>(i));
+    }
+
+    spdlog::info("FindMissingChunks(): {} of {} chunks missing",
+                 response->missing_size(), request->digests_size());
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::GetBlockSignatures(grpc::ServerContext* context,
+                                                const BlockSignaturesRequest* request,
+                                                grpc::ServerWriter<BlockSignaturesResponse>* writer)
+{
+    const std::filesystem::path path = request->filepath();
+    if (path.empty() || !path.is_absolute())
+        return InvalidArg("filepath must be an absolute path");
+
+    if (!(index_ ? index_->Covers(path) : IsUnderRoot(root_dir_, path)))
+        return InvalidArg("filepath is outside of the server's root");
+
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(path, ec))
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, "filepath is not a regular file");
+
+    const uint64_t size = std::filesystem::file_size(path, ec);
+    if (ec)
+        return Internal("stat failed: " + ec.message());
+
+    const uint32_t block_size = request->block_size() != 0 ? request->block_size() : DefaultBlockSize(size);
+    if (block_size < kMinBlockSize || block_size > kMaxBlockSize)
+        return InvalidArg("block_size is out of range");
+
+    FileStream stream(path);
+    if (auto err = stream.Open(std::ios::binary | std::ios::in))
+        return Internal("open failed: " + err->message);
+
+    Hasher hasher(Hasher::Type::SHA256);
+    std::vector<char> block(block_size);
+
+    BlockSignaturesResponse resp;
+    resp.set_filesize(size);
+    resp.set_block_size(block_size);
+
+    for (uint64_t offset = 0; offset < size; ) {
+        if (context->IsCancelled())
+            return grpc::Status::CANCELLED;
+
+        const uint64_t want = std::min<uint64_t>(block_size, size - offset);
+        const auto [ok, len, err] = stream.Read(block.data(), static_cast<std::streamsize>(want));
+        if (!ok)
+            return Internal("read failed: " + err.message);
+
+        if (static_cast<uint64_t>(len) != want)
+            return grpc::Status(grpc::StatusCode::DATA_LOSS, "file shrank while being read");
+
+        if (auto herr = hasher.Initialize())
+            return Internal(herr->message);
+
+        if (auto herr = hasher.Update(block.data(), want))
+            return Internal(herr->message);
+
+        auto [ok_hash, strong, herr] = hasher.Finalize();
+        if (!ok_hash)
+            return Internal(herr.message);
+
+        BlockSignature* signature = resp.add_signatures();
+        signature->set_weak(RollingChecksum::Compute(block.data(), want));
+        signature->set_strong(strong.data(), strong.size());
+
+        offset += want;
+
+        if (resp.signatures_size() == kSignaturesPerMessage || offset == size) {
+            if (!writer->Write(resp))
+                return grpc::Status(grpc::StatusCode::UNAVAILABLE, "failed to write signatures");
+
+            resp.clear_signatures();
+        }
+    }
+
+    if (size == 0 && !writer->Write(resp))
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "failed to write signatures");
+
+    spdlog::info("GetBlockSignatures(): {} ({} bytes, {} byte blocks)", path.c_str(), size, block_size);
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::Stat(grpc::ServerContext* context, const StatRequest* request, FileMetaData* response)
+{
+    const std::filesystem::path path = request->path();
+    if (path.empty() || !path.is_absolute())
+        return InvalidArg("path must be an absolute path");
+
+    if (!(index_ ? index_->Covers(path) : IsUnderRoot(root_dir_, path)))
+        return InvalidArg("path is outside of the server's root");
+
+    if (index_ && index_->IsReady()) {
+        auto [ok, metadata] = index_->Stat(path);
+        if (!ok)
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "path is not in the index");
+
+        *response = std::move(metadata);
+        return grpc::Status::OK;
+    }
+
+    // The index is off or still being built.
+    auto [ok, metadata, ec] = metadata_.Get(path);
+    if (!ok)
+        return grpc::Status(grpc::StatusCode::NOT_FOUND, "stat failed: " + ec.message());
+
+    *response = std::move(metadata);
+    return grpc::Status::OK;
+}
+
+// Pages are taken from the index one at a time, so it isn't held while a
+// message is written, and a slow client only slows down its own listing.
+grpc::Status FTPServiceImpl::ListDirectory(grpc::ServerContext* context,
+                                           const ListDirectoryRequest* request,
+                                           grpc::ServerWriter<ListDirectoryResponse>* writer)
+{
+    spdlog::info("ListDirectory() service invoked: {}", request->path());
+
+    const std::filesystem::path path = request->path();
+    if (path.empty() || !path.is_absolute())
+        return InvalidArg("path must be an absolute path");
+
+    if (!index_)
+        return Precondition("the directory index is disabled");
+
+    if (!index_->IsReady())
+        return grpc::Status(grpc::StatusCode::UNAVAILABLE, "the directory index is being built");
+
+    if (!index_->Covers(path))
+        return InvalidArg("path is outside of the server's root");
+
+    const DirectoryIndex::Filter filter = MakeListFilter(request->filter());
+    const std::size_t page_size = request->page_size() == 0
+        ? kListPageSize : std::min<std::size_t>(request->page_size(), kMaxListPageSize);
+
+    uint64_t remaining = request->limit() == 0 ? UINT64_MAX : request->limit();
+    std::string after = request->page_token();
+    uint64_t listed = 0;
+
+    ListDirectoryResponse response;
+    while (remaining > 0) {
+        if (context->IsCancelled())
+            return grpc::Status::CANCELLED;
+
+        auto [ok, page] = index_->List(path, request->recursive(), after,
+                                       filter, std::min<uint64_t>(page_size, remaining));
+        if (!ok)
+            return grpc::Status(grpc::StatusCode::NOT_FOUND, "path is not a directory in the index");
+
+        remaining -= page.entries.size();
+        listed += page.entries.size();
+        if (!page.last.empty())
+            after = page.last;
+
+        response.Clear();
+        for (FileMetaData& entry : page.entries)
+            *response.add_entries() = std::move(entry);
+
+        if (page.more && remaining == 0)
+            response.set_next_page_token(after);
+
+        if ((response.entries_size() > 0 || !response.next_page_token().empty()) && !writer->Write(response))
+            return grpc::Status(grpc::StatusCode::UNAVAILABLE, "failed to write listing");
+
+        if (!page.more)
+            break;
+    }
+
+    spdlog::info("ListDirectory(): {} entries under {}", listed, path.c_str());
 
     return grpc::Status::OK;
 }
 
 std::tuple<bool, UploadSession, grpc::Status>
-FTPServiceImpl::OpenFile(grpc::ServerReader<UploadFileRequest>* reader) noexcept
+FTPServiceImpl::OpenFile(grpc::ServerReader<grpc::ByteBuffer>* reader, RequestReader& requests) noexcept
 {
-    UploadSession session;
+    if (!requests.Read(reader))
+        return { false, UploadSession{}, InvalidArg("empty request stream") };
+
+    return OpenFile(requests.Get());
+}
 
-    UploadFileRequest first;
-    if (!reader->Read(&first))
-        return { false, std::move(session), InvalidArg("empty request stream") };
+std::tuple<bool, UploadSession, grpc::Status>
+FTPServiceImpl::OpenFile(const UploadFileRequest& first, const std::filesystem::path* known_dir) noexcept
+{
+    const Metrics::Timer timer(Metrics::Phase::Open);
+    UploadSession session;
 
     if (first.request_case() != UploadFileRequest::kInit)
         return { false, std::move(session), InvalidArg("first message must be init") };
@@ -141,10 +969,25 @@ FTPServiceImpl::OpenFile(grpc::ServerReader<UploadFileRequest>* reader) noexcept
     if (!path.is_absolute())
 		return { false, std::move(session), InvalidArg("init.filepath must be an absolute path") };
 
-    if (!std::filesystem::exists(path.parent_path()))
-		return { false, std::move(session), InvalidArg("init.filepath can't be created (no such directory)") };
+    if (IsUnderRoot(uploads_dir_, path))
+		return { false, std::move(session), InvalidArg("init.filepath is in the server's uploads directory") };
 
-    session.path = path;
+    if ((!known_dir || path.parent_path() != *known_dir) && !std::filesystem::exists(path.parent_path())) {
+        if (!init.create_parents())
+            return { false, std::move(session), InvalidArg("init.filepath can't be created (no such directory)") };
+
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        if (ec)
+            return { false, std::move(session), Internal("failed to create parent directories: " + ec.message()) };
+    }
+
+    // Staged in uploads_dir_ and moved onto the target once verified, so a
+    // failed upload or a crash never leaves a torn file in its place. The
+    // staged file is created below: a resumed upload continues the one
+    // named in its journal, and a stripe joins that of its upload.
+    session.target = path;
+    session.journal_path = UploadJournalPathFor(uploads_dir_, path);
 
     session.touch_only = !init.has_filesize();
     session.expected_size = init.has_filesize() ? init.filesize() : 0;
@@ -155,114 +998,640 @@ FTPServiceImpl::OpenFile(grpc::ServerReader<UploadFileRequest>* reader) noexcept
     if (session.hashing_enabled && session.touch_only)
 		return { false, std::move(session), InvalidArg("") };
 
-    if (session.hashing_enabled) {
-        auto opt = MapHasherType(session.hash_type);
-        if (!opt)
-            return { false, std::move(session), InvalidArg("invalid hashtype") };
+    if (init.has_compression()) {
+        auto codec = MapCodecType(init.compression());
+        if (!codec)
+            return { false, std::move(session), InvalidArg("invalid compression") };
 
-        session.hashing = std::make_unique<HashingFileStream>(session.path, *opt);
-    } else {
-        session.plain = std::make_unique<FileStream>(session.path);
+        session.codec = Codec(*codec);
+    }
+
+    if (session.hashing_enabled && !MapHasherType(session.hash_type))
+        return { false, std::move(session), InvalidArg("invalid hashtype") };
+
+    session.opened = std::chrono::steady_clock::now();
+    session.active = Metrics::Tracked(Metrics::Gauge::Sessions);
+
+    if (init.has_delta()) {
+        auto [ok_delta, st_delta] = OpenDelta(init, session);
+        return { ok_delta, std::move(session), st_delta };
+    }
+
+    if (init.has_stripe()) {
+        auto [ok_stripe, st_stripe] = OpenStripe(init, session);
+        return { ok_stripe, std::move(session), st_stripe };
+    }
+
+    if (init.has_resume() && init.resume()) {
+        auto [ok_resume, st_resume] = ResumeFile(init, session);
+        return { ok_resume, std::move(session), st_resume };
     }
 
+    if (auto st = CreateStaged(init, session); !st.ok())
+        return { false, std::move(session), st };
+
+    RemoveUploadJournal(uploads_dir_, session.target);
+
     if (auto err = session.Open(std::ios::binary | std::ios::out | std::ios::trunc))
        return { false, std::move(session), Internal("open failed: " + err->message) };
 
     return { true, std::move(session), grpc::Status::OK };
 }
 
-std::tuple<bool, grpc::Status> FTPServiceImpl::WriteToFile(grpc::ServerReader<UploadFileRequest>* reader, UploadSession& session) noexcept
+grpc::Status FTPServiceImpl::CreateStaged(const UploadInit& init, UploadSession& session) const noexcept
+{
+    const std::filesystem::path path = NewStagingPath(uploads_dir_);
+    if (auto ec = CreateStagingFile(path))
+        return Internal("failed to create " + path.string() + ": " + ec.message());
+
+    session.path = path;
+    MakeStreams(init, session);
+
+    return grpc::Status::OK;
+}
+
+void FTPServiceImpl::MakeStreams(const UploadInit& init, UploadSession& session) const
+{
+    if (session.hashing_enabled)
+        session.hashing = std::make_unique<HashingFileStream>(MakeFileStream(session.path, init),
+                                                              *MapHasherType(session.hash_type));
+    else
+        session.plain = MakeFileStream(session.path, init);
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::OpenStripe(const UploadInit& init, UploadSession& session) noexcept
+{
+    const UploadStripe& stripe = init.stripe();
+
+    if (session.touch_only)
+        return { false, InvalidArg("init.filesize is required for a stripe") };
+
+    if (init.has_resume() && init.resume())
+        return { false, InvalidArg("a stripe can't be resumed") };
+
+    if (stripe.upload_id().empty())
+        return { false, InvalidArg("init.stripe.upload_id is empty") };
+
+    if (stripe.length() == 0 || stripe.offset() > session.expected_size
+                             || stripe.length() > session.expected_size - stripe.offset())
+        return { false, InvalidArg("init.stripe is outside of filesize") };
+
+    // Set first: the staged file is shared, and Discard() must leave it to
+    // the other stripes even when this one is turned away.
+    session.stripe_id = stripe.upload_id();
+
+    auto [ok, path, err] = stripes_.Begin(stripe.upload_id(), session.target, NewStagingPath(uploads_dir_),
+                                          session.expected_size, session.hash_type);
+    if (!ok)
+        return { false, err.code == -1 ? InvalidArg(err.message) : Internal(err.message) };
+
+    session.path = std::move(path);
+    MakeStreams(init, session);
+
+    session.base_offset = stripe.offset();
+    session.expected_size = stripe.length();
+
+    if (auto err = session.Open(std::ios::binary | std::ios::in | std::ios::out))
+        return { false, Internal("open failed: " + err->message) };
+
+    if (auto err = session.Seek(static_cast<std::streamoff>(session.base_offset)))
+        return { false, Internal("seek failed: " + err->message) };
+
+    return { true, grpc::Status::OK };
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::OpenDelta(const UploadInit& init, UploadSession& session) noexcept
 {
-    const uint64_t expected = session.expected_size;
-    uint64_t total = 0;
+    if (session.touch_only)
+        return { false, InvalidArg("init.filesize is required for a delta upload") };
 
-    UploadFileRequest req;
-    while (total < expected && reader->Read(&req)) {
-        switch (req.request_case()) {
-        case UploadFileRequest::kChunk: {
-            const std::string& data = req.chunk().data();
-            if (data.empty())
-				break;
+    if (init.has_stripe() || (init.has_resume() && init.resume()))
+        return { false, InvalidArg("a delta upload can't be striped or resumed") };
 
-            const uint64_t add = static_cast<uint64_t>(data.size());
-            if (total + add > expected)
-                return { false, InvalidArg("received more bytes than filesize") };
+    const uint32_t block_size = init.delta().block_size();
+    if (block_size < kMinBlockSize || block_size > kMaxBlockSize)
+        return { false, InvalidArg("init.delta.block_size is out of range") };
 
-            if (auto err = session.Write(std::string_view(data.data(), data.size())))
-                return { false, Internal("write failed: " + err->message) };
+    std::error_code ec;
+    if (!std::filesystem::is_regular_file(session.target, ec))
+        return { false, Precondition("init.filepath has no old version to apply a delta to") };
+
+    session.base_size = std::filesystem::file_size(session.target, ec);
+    if (ec)
+        return { false, Internal("stat failed: " + ec.message()) };
+
+    session.block_size = block_size;
+    session.base = std::make_unique<FileStream>(session.target);
+    if (auto err = session.base->Open(std::ios::binary | std::ios::in))
+        return { false, Internal("open failed: " + err->message) };
+
+    if (auto st = CreateStaged(init, session); !st.ok())
+        return { false, st };
+
+    if (auto err = session.Open(std::ios::binary | std::ios::out | std::ios::trunc))
+        return { false, Internal("open failed: " + err->message) };
+
+    return { true, grpc::Status::OK };
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::ResumeFile(const UploadInit& init, UploadSession& session) noexcept
+{
+    auto journal = LoadUploadJournal(uploads_dir_, session.target);
+    if (!journal)
+        return { false, Precondition("no resumable upload for init.filepath") };
+
+    if (journal->filesize() != session.expected_size || journal->hashtype() != session.hash_type) {
+        std::error_code ec;
+        std::filesystem::remove(journal->staging(), ec);
+        RemoveUploadJournal(uploads_dir_, session.target);
+        return { false, Precondition("init does not match the interrupted upload") };
+    }
+
+    // Taken over under a new name, so that a second resume of the same
+    // upload finds nothing instead of writing into the same file.
+    std::error_code ec;
+    const std::filesystem::path path = NewStagingPath(uploads_dir_);
+    std::filesystem::rename(journal->staging(), path, ec);
+    if (ec)
+        return { false, Precondition("no resumable upload for init.filepath") };
 
-            total += add;
+    session.path = path;
+    MakeStreams(init, session);
+
+    journal->set_staging(path.string());
+    if (auto err = SaveUploadJournal(session.journal_path, *journal))
+        return { false, Internal("resume failed: " + err->message) };
+
+    std::filesystem::resize_file(session.path, journal->offset(), ec);
+    if (ec) {
+        RemoveUploadJournal(uploads_dir_, session.target);
+        return { false, Precondition("resume failed: " + ec.message()) };
+    }
+
+    if (auto err = session.Open(std::ios::binary | std::ios::in | std::ios::out))
+        return { false, Internal("open failed: " + err->message) };
+
+    if (auto err = session.Restore(*journal)) {
+        RemoveUploadJournal(uploads_dir_, session.target);
+        return { false, Precondition(err->message) };
+    }
+
+    spdlog::info("resuming upload: {} at offset {}", session.target.c_str(), session.received);
+
+    return { true, grpc::Status::OK };
+}
+
+// Nothing more is read from the stream until the memory budget has room for
+// it; meanwhile HTTP/2 flow control holds the client back.
+std::tuple<bool, grpc::Status> FTPServiceImpl::WriteToFile(grpc::ServerReader<grpc::ByteBuffer>* reader, UploadSession& session,
+                                                           RequestReader& requests, MemoryBudget::Reservation& memory) noexcept
+{
+    while (session.received < session.expected_size) {
+        memory.Reserve(UploadMemory(requests.Get(), session.GetBufferSize()));
+
+        const auto read_start = std::chrono::steady_clock::now();
+        if (!requests.Read(reader))
             break;
-        }
+        Metrics::Record(Metrics::Phase::Read, std::chrono::steady_clock::now() - read_start);
 
-        case UploadFileRequest::kFinish:
-            return { false, InvalidArg("finish must appear only as the last message") };
+        // The message may be bigger than what was reserved for it.
+        memory.Charge(UploadMemory(requests.Get(), session.GetBufferSize()));
 
-        case UploadFileRequest::kInit:
-            return { false, InvalidArg("init must appear only as the first message") };
+        if (auto [ok, st] = WriteToFile(requests.Get(), session); !ok)
+            return { false, st };
+    }
 
-        case UploadFileRequest::REQUEST_NOT_SET:
-        default:
-            return { false, InvalidArg("invalid request") };
-        }
+    return CloseFile(session);
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::WriteToFile(const UploadFileRequest& req, UploadSession& session) noexcept
+{
+    const Metrics::Timer timer(Metrics::Phase::Write);
 
-        if (total == expected)
+    switch (req.request_case()) {
+    case UploadFileRequest::kChunk: {
+        const std::string& data = req.chunk().data();
+        if (data.empty())
             break;
+
+        Metrics::Add(Metrics::Counter::BytesReceived, data.size());
+        Metrics::Record(Metrics::Histogram::ChunkSize, data.size());
+
+        if (req.chunk().has_offset() && req.chunk().offset() != session.base_offset + session.received)
+            return { false, InvalidArg("chunk.offset does not match received bytes") };
+
+        if (!req.chunk().has_raw_size())
+            return AppendChunk(data, req.chunk().leaf_hash(), session);
+
+        const uint64_t raw_size = req.chunk().raw_size();
+        if (session.codec.GetType() == Codec::Type::None)
+            return { false, InvalidArg("chunk is compressed but init.compression is not set") };
+
+        if (raw_size == 0 || raw_size > kMaxRawChunkSize || session.received + raw_size > session.expected_size)
+            return { false, InvalidArg("chunk.raw_size is out of range") };
+
+        if (auto err = session.codec.Decompress(data, static_cast<std::size_t>(raw_size), session.inflated))
+            return { false, InvalidArg("failed to decompress chunk: " + err->message) };
+
+        return AppendChunk(session.inflated, req.chunk().leaf_hash(), session);
+    }
+
+    case UploadFileRequest::kDedupChunk: {
+        const DedupChunk& chunk = req.dedup_chunk();
+        if (!ChunkStore::IsValidDigest(chunk.digest()))
+            return { false, InvalidArg("dedup_chunk.digest is not a SHA-256 digest") };
+
+        if (chunk.data().empty())
+            return { false, InvalidArg("dedup_chunk.data is empty") };
+
+        if (session.received + chunk.data().size() > session.expected_size)
+            return { false, InvalidArg("received more bytes than filesize") };
+
+        Metrics::Add(Metrics::Counter::BytesReceived, chunk.data().size());
+        Metrics::Record(Metrics::Histogram::ChunkSize, chunk.data().size());
+
+        if (auto err = chunks_.Put(chunk.digest(), chunk.data(), &session.chunk_pins))
+            return { false, err->code == -2 ? grpc::Status(grpc::StatusCode::DATA_LOSS, err->message)
+                                            : Internal(err->message) };
+
+        return AppendToFile(chunk.data(), session);
+    }
+
+    case UploadFileRequest::kChunkRef: {
+        const ChunkRef& ref = req.chunk_ref();
+        if (!ChunkStore::IsValidDigest(ref.digest()))
+            return { false, InvalidArg("chunk_ref.digest is not a SHA-256 digest") };
+
+        if (session.received + ref.length() > session.expected_size)
+            return { false, InvalidArg("received more bytes than filesize") };
+
+        auto [ok, data, err] = chunks_.Get(ref.digest(), &session.chunk_pins);
+        if (!ok)
+            return { false, Precondition("chunk_ref is not in the chunk store") };
+
+        if (data.size() != ref.length())
+            return { false, InvalidArg("chunk_ref.length does not match the stored chunk") };
+
+        session.bytes_saved += ref.length();
+
+        return AppendToFile(data, session);
+    }
+
+    case UploadFileRequest::kBlockRef: {
+        if (!session.base)
+            return { false, InvalidArg("block_ref is only valid in a delta upload") };
+
+        return CopyFromBase(req.block_ref(), session);
+    }
+
+    case UploadFileRequest::kFinish:
+        return { false, InvalidArg("finish must appear only as the last message") };
+
+    case UploadFileRequest::kInit:
+        return { false, InvalidArg("init must appear only as the first message") };
+
+    case UploadFileRequest::REQUEST_NOT_SET:
+    default:
+        return { false, InvalidArg("invalid request") };
+    }
+
+    return { true, grpc::Status::OK };
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::CopyFromBase(const BlockRef& ref, UploadSession& session) noexcept
+{
+    const uint64_t blocks = (session.base_size + session.block_size - 1) / session.block_size;
+    if (ref.count() == 0 || ref.index() >= blocks || ref.count() > blocks - ref.index())
+        return { false, InvalidArg("block_ref is outside of the old file") };
+
+    const uint64_t begin = ref.index() * session.block_size;
+    const uint64_t end = std::min(session.base_size, (ref.index() + ref.count()) * session.block_size);
+    if (session.received + (end - begin) > session.expected_size)
+        return { false, InvalidArg("received more bytes than filesize") };
+
+    if (auto err = session.base->Seek(static_cast<std::streamoff>(begin)))
+        return { false, Internal("seek failed: " + err->message) };
+
+    std::vector<char> buffer(std::min<uint64_t>(64 * BUFSIZ, end - begin));
+    for (uint64_t copied = 0; copied < end - begin; ) {
+        const uint64_t want = std::min<uint64_t>(buffer.size(), end - begin - copied);
+        const auto [ok, len, err] = session.base->Read(buffer.data(), static_cast<std::streamsize>(want));
+        if (!ok)
+            return { false, Internal("read failed: " + err.message) };
+
+        if (len <= 0)
+            return { false, grpc::Status(grpc::StatusCode::DATA_LOSS, "old file shrank during delta upload") };
+
+        if (auto [ok_append, st_append] = AppendToFile(std::string_view(buffer.data(), static_cast<std::size_t>(len)), session); !ok_append)
+            return { false, st_append };
+
+        copied += static_cast<uint64_t>(len);
+    }
+
+    session.bytes_saved += end - begin;
+
+    return { true, grpc::Status::OK };
+}
+
+// A chunk with a leaf_hash is one leaf of a tree-hashed upload. Its digest is
+// checked here, so corruption is reported at the chunk instead of after the
+// whole file, and then reused for the root instead of hashing the data again.
+std::tuple<bool, grpc::Status> FTPServiceImpl::AppendChunk(std::string_view data, const std::string& leaf_hash, UploadSession& session) noexcept
+{
+    if (leaf_hash.empty())
+        return AppendToFile(data, session);
+
+    if (session.hash_type != HASH_TYPE_SHA256_TREE)
+        return { false, InvalidArg("chunk.leaf_hash requires HASH_TYPE_SHA256_TREE") };
+
+    if (session.received % Hasher::kTreeLeafSize != 0 ||
+        (data.size() != Hasher::kTreeLeafSize && session.received + data.size() != session.expected_size))
+        return { false, InvalidArg("chunk with leaf_hash is not exactly one leaf") };
+
+    if (session.received + data.size() > session.expected_size)
+        return { false, InvalidArg("received more bytes than filesize") };
+
+    if (leaf_hash.size() != kLeafDigestSize)
+        return { false, InvalidArg("chunk.leaf_hash is not a SHA-256 digest") };
+
+    const uint64_t offset = session.base_offset + session.received;
+    std::vector<uint8_t> digest(leaf_hash.begin(), leaf_hash.end());
+
+    if (leaf_pool_) {
+        // Written with the digest the client sent while the pool checks it;
+        // the staged file only replaces the target once all leaves are.
+        if (!session.leaves)
+            session.leaves = std::make_unique<LeafVerifier>(*leaf_pool_, leaf_pool_->Size());
+
+        if (auto err = session.leaves->GetError())
+            return { false, LeafStatus(*err) };
+
+        session.leaves->Submit(data, leaf_hash, offset);
+    } else {
+        auto [ok, actual, herr] = Hasher::HashLeaf(data.data(), data.size());
+        if (!ok)
+            return { false, Internal("failed to hash leaf: " + herr.message) };
+
+        if (actual != digest)
+            return { false, LeafStatus(FileStream::Error{ -2, fmt::format("leaf at offset {} is corrupted", offset) }) };
     }
 
-    if (total != expected)
+    if (auto err = session.WriteLeaf(data, digest))
+        return { false, Internal("write failed: " + err->message) };
+
+    session.received += data.size();
+
+    if (options_.durability != Durability::None && session.received - session.checkpointed >= kCheckpointInterval)
+        if (auto err = session.Checkpoint())
+            return { false, err->code == -2 ? LeafStatus(*err) : Internal("checkpoint failed: " + err->message) };
+
+    return { true, grpc::Status::OK };
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::AppendToFile(std::string_view data, UploadSession& session) noexcept
+{
+    const uint64_t add = static_cast<uint64_t>(data.size());
+    if (session.received + add > session.expected_size)
+        return { false, InvalidArg("received more bytes than filesize") };
+
+    if (auto err = session.Write(data))
+        return { false, Internal("write failed: " + err->message) };
+
+    session.received += add;
+
+    if (options_.durability != Durability::None && session.received - session.checkpointed >= kCheckpointInterval)
+        if (auto err = session.Checkpoint())
+            return { false, Internal("checkpoint failed: " + err->message) };
+
+    return { true, grpc::Status::OK };
+}
+
+std::tuple<bool, grpc::Status> FTPServiceImpl::CloseFile(UploadSession& session) noexcept
+{
+    const Metrics::Timer timer(Metrics::Phase::Close);
+
+    // Before the checkpoint below, too: it must not cover a corrupted leaf.
+    if (session.leaves)
+        if (auto err = session.leaves->Wait())
+            return { false, LeafStatus(*err) };
+
+    if (session.received != session.expected_size) {
+        // Keep what we have so the client can resume instead of starting over.
+        if (auto err = session.Checkpoint())
+            spdlog::error("failed to checkpoint interrupted upload: {}", err->message);
+
         return { false, InvalidArg("stream ended before receiving filesize bytes") };
+    }
 
     if (auto err = session.Close())
         return { false, Internal("close failed: " + err->message) };
 
+    if (session.base)
+        (void)session.base->Close();
+
+    if (session.stripe_id.empty())
+        RemoveUploadJournal(uploads_dir_, session.target);
+
     return { true, grpc::Status::OK };
 }
 
 std::tuple<bool, FileMetaData, grpc::Status>
-FTPServiceImpl::CheckHash(grpc::ServerReader<UploadFileRequest>* reader, const UploadSession& session) noexcept
+FTPServiceImpl::CheckHash(grpc::ServerReader<grpc::ByteBuffer>* reader, const UploadSession& session,
+                          RequestReader& requests) noexcept
 {
-    const FileMetaData metadata = MakeFileMetaDataFrom(session.path);
+    if (session.hashing_enabled) {
+        if (!requests.Read(reader))
+            return { false, FileMetaData{}, InvalidArg("failed to read last request") };
 
-    if (!session.hashing_enabled) {
-		if (session.touch_only)
-			return { true, std::move(metadata), grpc::Status::OK };
+        grpc::ByteBuffer extra;
+        if (reader->Read(&extra))
+            return { false, FileMetaData{}, InvalidArg("extra messages after finish are not allowed") };
+    }
+
+    return CheckHash(requests.Get(), session);
+}
+
+std::tuple<bool, FileMetaData, grpc::Status>
+FTPServiceImpl::CheckHash(const UploadFileRequest& last, const UploadSession& session) noexcept
+{
+    if (auto st = VerifyUpload(last, session); !st.ok())
+        return { false, FileMetaData{}, st };
+
+    // A stripe is moved into place with the whole upload, by CommitUpload.
+    if (!session.stripe_id.empty())
+        return CompleteUpload(session.path, session.target, session.received, session.opened);
+
+    std::optional<CommitQueue::Error> error;
+    {
+        const Metrics::Timer timer(Metrics::Phase::Commit);
+        error = commits_.Commit(session.path, session.target);
+    }
+
+    if (error)
+        return { false, FileMetaData{}, Internal("failed to replace " + session.target.string() + ": " + error->message) };
+
+    return CompleteUpload(session.target, session.target, session.received, session.opened);
+}
+
+// As above, but done is called once the upload is committed, from the commit
+// thread with group durability; nothing of the session is used by then.
+void FTPServiceImpl::CheckHash(const UploadFileRequest& last, const UploadSession& session, CheckDone done) noexcept
+{
+    if (!session.stripe_id.empty()) {
+        auto [ok, metadata, st] = CheckHash(last, session);
+        return done(ok, std::move(metadata), std::move(st));
+    }
+
+    if (auto st = VerifyUpload(last, session); !st.ok())
+        return done(false, FileMetaData{}, std::move(st));
+
+    const auto started = std::chrono::steady_clock::now();
+    commits_.Commit(session.path, session.target,
+        [this, target = session.target, received = session.received, opened = session.opened,
+         started, done = std::move(done)](std::optional<CommitQueue::Error> error) {
+            Metrics::Record(Metrics::Phase::Commit, std::chrono::steady_clock::now() - started);
+
+            if (error)
+                return done(false, FileMetaData{}, Internal("failed to replace " + target.string() + ": " + error->message));
+
+            auto [ok, metadata, st] = CompleteUpload(target, target, received, opened);
+            done(ok, std::move(metadata), std::move(st));
+        });
+}
 
-		if (metadata.size() != session.expected_size)
-			return { false, FileMetaData{}, InvalidArg("file size mismatch after write") };
+// The upload is done once its hash checks out and it is in place; what is
+// reported is the file at path, under the name the client sent. A committed
+// target replaces whatever the cache held for it.
+std::tuple<bool, FileMetaData, grpc::Status>
+FTPServiceImpl::CompleteUpload(const std::filesystem::path& path, const std::filesystem::path& target,
+                               uint64_t received, std::chrono::steady_clock::time_point opened) noexcept
+{
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - opened;
 
-		return { true, std::move(metadata), grpc::Status::OK };
+    std::error_code ec;
+    FileMetaData metadata;
+    if (path == target) {
+        metadata_.Invalidate(target);
+        std::tie(std::ignore, metadata, ec) = metadata_.Get(target);
+    } else {
+        metadata = MakeFileMetaDataFrom(path, ec);
     }
 
-    UploadFileRequest last;
-    if (!reader->Read(&last))
-        return { false, FileMetaData{}, InvalidArg("failed to read last request") };
+    if (ec)
+        return { false, FileMetaData{}, Internal("failed to stat " + path.string() + ": " + ec.message()) };
+
+    Metrics::Add(Metrics::Counter::UploadsCompleted);
+    if (elapsed.count() > 0)
+        Metrics::Record(Metrics::Histogram::UploadRate, static_cast<std::uint64_t>(received / elapsed.count()));
+
+    metadata.set_path(target);
+    if (index_ && path == target)
+        index_->Update(target, metadata);
+
+    return { true, std::move(metadata), grpc::Status::OK };
+}
+
+grpc::Status FTPServiceImpl::VerifyUpload(const UploadFileRequest& last, const UploadSession& session) noexcept
+{
+    const Metrics::Timer timer(Metrics::Phase::Verify);
+
+    if (auto st = VerifyFile(last, session); !st.ok())
+        return st;
+
+    if (!session.stripe_id.empty())
+        stripes_.Complete(session.stripe_id, session.base_offset, session.expected_size);
+
+    return grpc::Status::OK;
+}
+
+grpc::Status FTPServiceImpl::VerifyFile(const UploadFileRequest& last, const UploadSession& session) const noexcept
+{
+    if (!session.hashing_enabled) {
+		if (session.touch_only || !session.stripe_id.empty())
+			return grpc::Status::OK;
+
+		std::error_code ec;
+		if (std::filesystem::file_size(session.path, ec) != session.expected_size || ec)
+			return InvalidArg("file size mismatch after write");
 
-    UploadFileRequest extra;
-    if (reader->Read(&extra))
-        return { false, FileMetaData{}, InvalidArg("extra messages after finish are not allowed") };
+		return grpc::Status::OK;
+    }
 
     if (last.request_case() != UploadFileRequest::kFinish)
-		return { false, FileMetaData{}, InvalidArg("finish must be the last message") };
+		return InvalidArg("finish must be the last message");
 
     if (!last.finish().has_hash())
-        return { false, FileMetaData{}, InvalidArg("failed to read hash") };
+        return InvalidArg("failed to read hash");
 
-    const auto hash_opt = session.GetHash();
-    if (!hash_opt)
-		return { false, FileMetaData{}, Internal("failed to read server hash") };
+    const std::vector<uint8_t>* server_hash_ptr = session.GetHash();
+    if (!server_hash_ptr)
+		return Internal("failed to read server hash");
 
-    const std::vector<uint8_t> server_hash = *hash_opt;
+    const std::vector<uint8_t>& server_hash = *server_hash_ptr;
     const Hash &expected = last.finish().hash();
     if (expected.hashtype() != session.hash_type)
-        return { false, FileMetaData{}, InvalidArg("finish.hash.hashtype mismatch with init.hashtype") };
+        return InvalidArg("finish.hash.hashtype mismatch with init.hashtype");
 
     if (!HashLengthMatches(expected.hashtype(), static_cast<size_t>(expected.data().size())))
-        return { false, FileMetaData{}, InvalidArg("finish.hash.data length does not match hashtype") };
+        return InvalidArg("finish.hash.data length does not match hashtype");
 
     if (expected.data().size() != server_hash.size()  ||
         std::memcmp(expected.data().data(), server_hash.data(), expected.data().size()) != 0)
-		return { false, FileMetaData{}, grpc::Status(grpc::StatusCode::DATA_LOSS, "hash mismatch") };
-    
-    return { true, std::move(metadata), grpc::Status::OK };
+		return grpc::Status(grpc::StatusCode::DATA_LOSS, "hash mismatch");
+
+    return grpc::Status::OK;
+}
+
+void FTPServiceImpl::FillResponse(const UploadSession& session, FileMetaData&& metadata, UploadFileResponse* response) const
+{
+    BuildResponse(session, std::move(metadata), response);
+
+    // The hex digest and DebugString() are only built for a sampled message.
+    if (!Logging::Sampled(Logging::Class::Result, spdlog::level::info))
+        return;
+
+    if (const std::vector<uint8_t>* digest = session.GetHash(); session.hashing_enabled && digest)
+        spdlog::info("hash check complete: {}", spdlog::to_hex(*digest));
+
+    spdlog::info("UploadFile() result: \n{}", response->DebugString());
+}
+
+void FTPServiceImpl::BuildResponse(const UploadSession& session, FileMetaData&& metadata, UploadFileResponse* response) const
+{
+    if (const std::vector<uint8_t>* digest = session.GetHash(); session.hashing_enabled && digest) {
+        Hash* hash_out = response->mutable_hash();
+        hash_out->set_hashtype(session.hash_type);
+        hash_out->set_data(digest->data(), digest->size());
+    }
+    *response->mutable_metadata() = std::move(metadata);
+    response->set_bytes_saved(session.bytes_saved);
+}
+
+// Stripes of one file are written by several streams at once, which the
+// block read-back of DirectFileStream can't allow; they stay buffered.
+std::unique_ptr<FileStream> FTPServiceImpl::MakeFileStream(const std::filesystem::path& path, const UploadInit& init) const
+{
+    if (options_.storage == Storage::Direct && !init.has_stripe())
+        return std::make_unique<DirectFileStream>(path, buffers_, init.has_filesize() ? init.filesize() : 0);
+
+    if (options_.storage == Storage::Uring)
+        return std::make_unique<UringFileStream>(path, options_.queue_depth);
+
+    return std::make_unique<FileStream>(path);
+}
+
+// What an upload holds while it handles req: its file stream's buffers, the
+// request's payload (RequestReader keeps it across reads, so its capacity
+// counts) and the session's own buffers (UploadSession::GetBufferSize()).
+std::size_t FTPServiceImpl::UploadMemory(const UploadFileRequest& req, std::size_t buffers) const noexcept
+{
+    std::size_t stream = BUFSIZ;
+    if (options_.storage == Storage::Direct)
+        stream = kDirectBufferSize;
+    else if (options_.storage == Storage::Uring)
+        stream = options_.queue_depth * 64 * BUFSIZ;
+
+    const std::string& data = req.request_case() == UploadFileRequest::kDedupChunk ? req.dedup_chunk().data() : req.chunk().data();
+
+    return stream + std::max(data.capacity(), kChunkReserve) + buffers;
 }
@@ -0,0 +1,83 @@
+#include "LeafVerifier.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include "fmt/core.h"
+
+#include "Hasher.hpp"
+
+LeafVerifier::LeafVerifier(WorkerPool& pool, std::size_t depth)
+    : pool_(pool)
+    , state_(std::make_shared<State>())
+{
+    depth = std::max<std::size_t>(depth, 1);
+
+    state_->leaves.resize(depth);
+    for (std::size_t i = 0; i < depth; i++)
+        state_->free.push_back(depth - 1 - i);
+}
+
+void LeafVerifier::Submit(std::string_view data, std::string_view digest, std::uint64_t offset)
+{
+    std::size_t index;
+    {
+        std::unique_lock<std::mutex> lock(state_->mutex);
+        state_->cv.wait(lock, [this] { return !state_->free.empty(); });
+
+        index = state_->free.back();
+        state_->free.pop_back();
+    }
+
+    // Nobody else touches a leaf that isn't free.
+    Leaf& leaf = state_->leaves[index];
+    leaf.data.assign(data);
+    leaf.digest.assign(digest);
+    leaf.offset = offset;
+
+    pool_.Submit([state = state_, index] { Check(*state, index); });
+}
+
+std::optional<FileStream::Error> LeafVerifier::GetError() const noexcept
+{
+    std::lock_guard<std::mutex> lock(state_->mutex);
+
+    return state_->error;
+}
+
+std::optional<FileStream::Error> LeafVerifier::Wait() const noexcept
+{
+    std::unique_lock<std::mutex> lock(state_->mutex);
+    state_->cv.wait(lock, [this] { return state_->free.size() == state_->leaves.size(); });
+
+    return state_->error;
+}
+
+std::size_t LeafVerifier::GetBufferSize() const noexcept
+{
+    return state_->leaves.size() * Hasher::kTreeLeafSize;
+}
+
+void LeafVerifier::Check(State& state, std::size_t index) noexcept
+{
+    const Leaf& leaf = state.leaves[index];
+
+    auto [ok, digest, herr] = Hasher::HashLeaf(leaf.data.data(), leaf.data.size());
+
+    std::optional<FileStream::Error> error;
+    if (!ok)
+        error = FileStream::Error{ herr.code, "failed to hash leaf: " + herr.message };
+    else if (leaf.digest.size() != digest.size() || std::memcmp(leaf.digest.data(), digest.data(), digest.size()) != 0)
+        error = FileStream::Error{ -2, fmt::format("leaf at offset {} is corrupted", leaf.offset) };
+
+    {
+        std::lock_guard<std::mutex> lock(state.mutex);
+
+        if (error && !state.error)
+            state.error = std::move(error);
+
+        state.free.push_back(index);
+    }
+
+    state.cv.notify_all();
+}
@@ -0,0 +1,53 @@
+#include "Logging.hpp"
+
+#include <atomic>
+#include <array>
+
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+
+namespace {
+	struct Sampler {
+		std::atomic<std::uint32_t> every{ 1 };
+		std::atomic<std::uint64_t> seen{ 0 };
+	};
+
+	std::array<Sampler, Logging::kClasses> samplers;
+}
+
+void Logging::Start(spdlog::level::level_enum level, std::size_t queue_size)
+{
+	// One thread writes, so messages come out in the order they were queued.
+	spdlog::init_thread_pool(queue_size, 1);
+
+	auto logger = spdlog::create_async_nb<spdlog::sinks::stdout_color_sink_mt>("server");
+	logger->set_level(level);
+	logger->flush_on(spdlog::level::warn);
+
+	spdlog::set_default_logger(std::move(logger));
+}
+
+void Logging::Stop()
+{
+	spdlog::shutdown();
+}
+
+void Logging::SetSampleRate(Class cls, std::uint32_t every) noexcept
+{
+	samplers[static_cast<std::size_t>(cls)].every.store(every, std::memory_order_relaxed);
+}
+
+bool Logging::Sampled(Class cls, spdlog::level::level_enum level) noexcept
+{
+	if (!spdlog::should_log(level))
+		return false;
+
+	Sampler& sampler = samplers[static_cast<std::size_t>(cls)];
+
+	const std::uint32_t every = sampler.every.load(std::memory_order_relaxed);
+	if (every <= 1)
+		return every == 1;
+
+	// The first message of the class is always logged.
+	return sampler.seen.fetch_add(1, std::memory_order_relaxed) % every == 0;
+}
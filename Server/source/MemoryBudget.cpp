@@ -0,0 +1,161 @@
+#include "MemoryBudget.hpp"
+
+#include <condition_variable>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+MemoryBudget::Reservation::Reservation(MemoryBudget* budget) noexcept
+    : budget_(budget)
+{
+}
+
+MemoryBudget::Reservation::Reservation(Reservation&& other) noexcept
+    : budget_(std::exchange(other.budget_, nullptr))
+    , size_(std::exchange(other.size_, 0))
+{
+}
+
+MemoryBudget::Reservation& MemoryBudget::Reservation::operator=(Reservation&& other) noexcept
+{
+    if (this != &other) {
+        Reset();
+
+        budget_ = std::exchange(other.budget_, nullptr);
+        size_ = std::exchange(other.size_, 0);
+    }
+
+    return *this;
+}
+
+MemoryBudget::Reservation::~Reservation()
+{
+    Reset();
+}
+
+std::size_t MemoryBudget::Reservation::GetSize() const noexcept
+{
+    return size_;
+}
+
+void MemoryBudget::Reservation::Reserve(std::size_t bytes)
+{
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool done = false;
+
+    // Notified under the lock, so the waiter can't return (and destroy cv)
+    // before notify_one() is done with it.
+    Reserve(bytes, [&] {
+        std::lock_guard<std::mutex> lock(mutex);
+        done = true;
+        cv.notify_one();
+    });
+
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&] { return done; });
+}
+
+void MemoryBudget::Reservation::Reserve(std::size_t bytes, std::function<void()> ready)
+{
+    if (!budget_ || bytes <= size_)
+        return ready();
+
+    Reset();
+
+    budget_->Acquire(bytes, [this, bytes, ready = std::move(ready)] {
+        size_ = bytes;
+        ready();
+    });
+}
+
+void MemoryBudget::Reservation::Charge(std::size_t bytes) noexcept
+{
+    if (!budget_ || bytes <= size_)
+        return;
+
+    budget_->Charge(bytes - size_);
+    size_ = bytes;
+}
+
+void MemoryBudget::Reservation::Reset() noexcept
+{
+    if (budget_ && size_ > 0)
+        budget_->Release(size_);
+
+    size_ = 0;
+}
+
+MemoryBudget::MemoryBudget(std::size_t limit)
+    : limit_(limit)
+{
+}
+
+MemoryBudget::Usage MemoryBudget::GetUsage() const noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return Usage{ used_, peak_, limit_, waiters_.size() };
+}
+
+void MemoryBudget::Acquire(std::size_t bytes, std::function<void()> granted)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (!waiters_.empty() || !Fits(bytes)) {
+            if (waiters_.empty())
+                spdlog::warn("memory budget used up ({} of {} bytes); uploads wait for memory", used_, limit_);
+
+            waiters_.push_back(Waiter{ bytes, std::move(granted) });
+            return;
+        }
+
+        used_ += bytes;
+        peak_ = std::max(peak_, used_);
+    }
+
+    granted();
+}
+
+void MemoryBudget::Charge(std::size_t bytes) noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    used_ += bytes;
+    peak_ = std::max(peak_, used_);
+}
+
+void MemoryBudget::Release(std::size_t bytes) noexcept
+{
+    std::vector<std::function<void()>> granted;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        used_ -= std::min(bytes, used_);
+
+        if (waiters_.empty())
+            return;
+
+        while (!waiters_.empty() && Fits(waiters_.front().bytes)) {
+            used_ += waiters_.front().bytes;
+            granted.push_back(std::move(waiters_.front().granted));
+            waiters_.pop_front();
+        }
+        peak_ = std::max(peak_, used_);
+
+        if (waiters_.empty())
+            spdlog::info("memory budget available again ({} of {} bytes)", used_, limit_);
+    }
+
+    // Outside the lock: a waiter may start reading (and reserving) right away.
+    for (auto& ready : granted)
+        ready();
+}
+
+bool MemoryBudget::Fits(std::size_t bytes) const noexcept
+{
+    return limit_ == 0 || used_ == 0 || used_ + bytes <= limit_;
+}
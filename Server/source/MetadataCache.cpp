@@ -0,0 +1,257 @@
+#include "MetadataCache.hpp"
+
+#include <cstring>
+#include <cerrno>
+
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "spdlog/spdlog.h"
+
+#include "FileMetaData.hpp"
+
+namespace {
+	// Whatever could change what statx() says about a file in the directory,
+	// or take the directory itself away.
+	constexpr std::uint32_t kWatchMask = IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE
+					   | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF
+					   | IN_ONLYDIR;
+
+	constexpr std::size_t kEventBufferSize = 64 * 1024;
+}
+
+MetadataCache::MetadataCache(std::size_t capacity)
+    : capacity_(capacity)
+{
+    if (capacity_ == 0)
+        return;
+
+    inotify_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    wakeup_ = eventfd(0, EFD_CLOEXEC);
+    if (inotify_ < 0 || wakeup_ < 0) {
+        spdlog::warn("metadata cache disabled: inotify: {}", std::strerror(errno));
+
+        if (inotify_ >= 0)
+            close(inotify_);
+        if (wakeup_ >= 0)
+            close(wakeup_);
+
+        inotify_ = wakeup_ = -1;
+        return;
+    }
+
+    running_ = true;
+    thread_ = std::thread([this] { Run(); });
+}
+
+MetadataCache::~MetadataCache()
+{
+    if (!thread_.joinable())
+        return;
+
+    const std::uint64_t one = 1;
+    (void)write(wakeup_, &one, sizeof(one));
+    thread_.join();
+
+    close(inotify_);
+    close(wakeup_);
+}
+
+std::tuple<bool, FileMetaData, std::error_code> MetadataCache::Get(const std::filesystem::path& path)
+{
+    const std::filesystem::path normal = path.lexically_normal();
+    const std::string key = normal.string();
+    const std::string dir = normal.parent_path().string();
+
+    std::error_code ec;
+    int watch = -1;
+    std::uint64_t generation = 0;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            hits_++;
+            lru_.splice(lru_.begin(), lru_, it->second.lru);
+            return { true, it->second.metadata, ec };
+        }
+
+        misses_++;
+
+        // Watched before the statx(), so that no change after it is missed.
+        if (!running_) {
+            watch = -1;
+        } else if (auto it = watched_.find(dir); it != watched_.end()) {
+            watch = it->second;
+        } else {
+            watch = inotify_add_watch(inotify_, dir.c_str(), kWatchMask);
+            if (watch >= 0) {
+                watches_[watch] = Watch{ dir, 0, 0 };
+                watched_[dir] = watch;
+            }
+        }
+
+        generation = watch >= 0 ? watches_[watch].generation : 0;
+    }
+
+    FileMetaData metadata = MakeFileMetaDataFrom(path, ec);
+    if (watch < 0)
+        return { !ec, std::move(metadata), ec };
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    auto it = watches_.find(watch);
+    if (it == watches_.end())
+        return { !ec, std::move(metadata), ec };
+
+    if (!ec && it->second.generation == generation && entries_.find(key) == entries_.end())
+        Insert(key, watch, metadata);
+    else if (it->second.entries == 0)
+        Unwatch(it);
+
+    return { !ec, std::move(metadata), ec };
+}
+
+void MetadataCache::Invalidate(const std::filesystem::path& path) noexcept
+{
+    const std::filesystem::path normal = path.lexically_normal();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    // A statx() running right now may have seen the old file.
+    if (auto it = watched_.find(normal.parent_path().string()); it != watched_.end())
+        watches_[it->second].generation++;
+
+    if (auto it = entries_.find(normal.string()); it != entries_.end())
+        Erase(it);
+}
+
+MetadataCache::Usage MetadataCache::GetUsage() const noexcept
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    return Usage{ entries_.size(), running_ ? capacity_ : 0, hits_, misses_ };
+}
+
+void MetadataCache::Run() noexcept
+{
+    alignas(inotify_event) char buffer[kEventBufferSize];
+
+    pollfd fds[2] = {
+        { inotify_, POLLIN, 0 },
+        { wakeup_, POLLIN, 0 }
+    };
+
+    while (true) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+
+            spdlog::error("metadata cache: poll failed: {}", std::strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents)
+            return;
+
+        const ssize_t length = read(inotify_, buffer, sizeof(buffer));
+        if (length <= 0)
+            continue;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+
+        for (ssize_t offset = 0; offset < length; ) {
+            const auto* event = reinterpret_cast<const inotify_event*>(buffer + offset);
+            offset += sizeof(inotify_event) + event->len;
+
+            // Events were lost; nothing cached can be trusted.
+            if (event->mask & IN_Q_OVERFLOW) {
+                Clear();
+                continue;
+            }
+
+            auto it = watches_.find(event->wd);
+            if (it == watches_.end())
+                continue;
+
+            it->second.generation++;
+
+            if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+                EraseDirectory(it);
+                continue;
+            }
+
+            if (event->len == 0)
+                continue;
+
+            const std::string path = (std::filesystem::path(it->second.dir) / event->name).string();
+            if (auto entry = entries_.find(path); entry != entries_.end())
+                Erase(entry);
+        }
+    }
+
+    // Without events the cache would go stale.
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = false;
+    Clear();
+}
+
+void MetadataCache::Insert(const std::string& path, int watch, const FileMetaData& metadata)
+{
+    lru_.push_front(path);
+    entries_.emplace(path, Entry{ metadata, lru_.begin(), watch });
+    watches_[watch].entries++;
+
+    while (entries_.size() > capacity_)
+        Erase(entries_.find(lru_.back()));
+}
+
+void MetadataCache::Erase(std::unordered_map<std::string, Entry>::iterator it) noexcept
+{
+    auto watch = watches_.find(it->second.watch);
+
+    lru_.erase(it->second.lru);
+    entries_.erase(it);
+
+    if (watch != watches_.end() && --watch->second.entries == 0)
+        Unwatch(watch);
+}
+
+// The directory is gone, or its watch is: so are the entries in it.
+void MetadataCache::EraseDirectory(std::unordered_map<int, Watch>::iterator watch) noexcept
+{
+    const int wd = watch->first;
+
+    for (auto it = entries_.begin(); it != entries_.end(); ) {
+        if (it->second.watch != wd) {
+            ++it;
+            continue;
+        }
+
+        lru_.erase(it->second.lru);
+        it = entries_.erase(it);
+    }
+
+    watched_.erase(watch->second.dir);
+    watches_.erase(watch);
+}
+
+void MetadataCache::Unwatch(std::unordered_map<int, Watch>::iterator watch) noexcept
+{
+    (void)inotify_rm_watch(inotify_, watch->first);
+
+    watched_.erase(watch->second.dir);
+    watches_.erase(watch);
+}
+
+void MetadataCache::Clear() noexcept
+{
+    for (auto& [wd, watch] : watches_)
+        (void)inotify_rm_watch(inotify_, wd);
+
+    entries_.clear();
+    lru_.clear();
+    watches_.clear();
+    watched_.clear();
+}
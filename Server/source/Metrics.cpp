@@ -0,0 +1,302 @@
+#include "Metrics.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <array>
+#include <mutex>
+#include <bit>
+
+#include "fmt/format.h"
+
+namespace {
+	constexpr std::size_t kCounters = 3;
+	constexpr std::size_t kGauges = 1;
+	constexpr std::size_t kHistograms = 2;
+	constexpr std::size_t kPhases = 6;
+
+	// 16 buckets per power of two; values from 2^40 up share the last one.
+	constexpr int kSubBits = 4;
+	constexpr std::uint64_t kSub = 1 << kSubBits;
+	constexpr int kMaxBits = 40;
+	constexpr std::size_t kBuckets = (kMaxBits - kSubBits + 1) * kSub;
+
+	std::size_t BucketOf(std::uint64_t value) noexcept
+	{
+		value = std::min<std::uint64_t>(value, (1ULL << kMaxBits) - 1);
+		if (value < kSub)
+			return static_cast<std::size_t>(value);
+
+		const int shift = std::bit_width(value) - 1 - kSubBits;
+		return static_cast<std::size_t>((shift + 1) * kSub + ((value >> shift) & (kSub - 1)));
+	}
+
+	std::uint64_t LowestOf(std::size_t bucket) noexcept
+	{
+		if (bucket < kSub)
+			return bucket;
+
+		const int shift = static_cast<int>(bucket / kSub) - 1;
+		return (kSub + bucket % kSub) << shift;
+	}
+
+	struct HistogramData {
+		std::array<std::atomic<std::uint64_t>, kBuckets> buckets{};
+		std::atomic<std::uint64_t> sum{ 0 };
+		std::atomic<std::uint64_t> count{ 0 };
+	};
+
+	// Written by one thread at a time, so a plain load and store is enough
+	// (and cheaper than a locked add); Render() reads it concurrently.
+	struct Shard {
+		std::array<std::atomic<std::uint64_t>, kCounters> counters{};
+		std::array<std::atomic<std::int64_t>, kGauges> gauges{};
+		std::array<HistogramData, kHistograms + kPhases> histograms;
+	};
+
+	template <typename T>
+	void Bump(std::atomic<T>& value, T n) noexcept
+	{
+		value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	struct Callback {
+		std::string name;
+		std::string help;
+		std::function<double()> read;
+	};
+
+	struct Registry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Shard>> shards;
+		std::vector<Shard*> free;
+		std::vector<Callback> callbacks;
+	};
+
+	// Never destroyed: threads may still record while the process exits.
+	Registry& GetRegistry()
+	{
+		static Registry* registry = new Registry;
+		return *registry;
+	}
+
+	// A shard keeps its counts when its thread exits; the next new thread
+	// carries on from them.
+	struct ShardHolder {
+		Shard* shard = nullptr;
+
+		~ShardHolder()
+		{
+			if (!shard)
+				return;
+
+			Registry& registry = GetRegistry();
+			std::lock_guard<std::mutex> lock(registry.mutex);
+			registry.free.push_back(shard);
+		}
+	};
+
+	Shard& LocalShard()
+	{
+		thread_local ShardHolder holder;
+		if (holder.shard)
+			return *holder.shard;
+
+		Registry& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		if (!registry.free.empty()) {
+			holder.shard = registry.free.back();
+			registry.free.pop_back();
+		} else {
+			registry.shards.push_back(std::make_unique<Shard>());
+			holder.shard = registry.shards.back().get();
+		}
+
+		return *holder.shard;
+	}
+
+	void RecordInto(HistogramData& histogram, std::uint64_t value) noexcept
+	{
+		Bump(histogram.buckets[BucketOf(value)], std::uint64_t{ 1 });
+		Bump(histogram.sum, value);
+		Bump(histogram.count, std::uint64_t{ 1 });
+	}
+
+	struct Totals {
+		std::array<std::uint64_t, kBuckets> buckets{};
+		std::uint64_t sum = 0;
+		std::uint64_t count = 0;
+	};
+
+	// Bounds are powers of two from 2^first to 2^last, every step bits.
+	// A bucket counts toward a bound when all of it is at or below it.
+	void RenderHistogram(std::string& out, const std::string& name, const std::string& labels, const Totals& totals,
+			     int first, int last, int step, double scale)
+	{
+		const std::string sep = labels.empty() ? "" : ",";
+
+		std::uint64_t cumulative = 0;
+		std::size_t bucket = 0;
+		for (int bits = first; bits <= last; bits += step) {
+			const std::uint64_t bound = 1ULL << bits;
+			while (bucket + 1 < kBuckets && LowestOf(bucket + 1) - 1 <= bound)
+				cumulative += totals.buckets[bucket++];
+
+			fmt::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"{}\"}} {}\n",
+				       name, labels, sep, static_cast<double>(bound) * scale, cumulative);
+		}
+
+		fmt::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, totals.count);
+
+		const std::string braces = labels.empty() ? "" : "{" + labels + "}";
+		fmt::format_to(std::back_inserter(out), "{}_sum{} {}\n", name, braces, static_cast<double>(totals.sum) * scale);
+		fmt::format_to(std::back_inserter(out), "{}_count{} {}\n", name, braces, totals.count);
+	}
+
+	void RenderHeader(std::string& out, const char* name, const char* type, const char* help)
+	{
+		fmt::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+	}
+
+	constexpr std::array<const char*, kPhases> kPhaseNames = { "read", "open", "write", "close", "verify", "commit" };
+}
+
+Metrics::Timer::Timer(Phase phase) noexcept
+	: phase_(phase)
+	, start_(std::chrono::steady_clock::now())
+{
+}
+
+Metrics::Timer::~Timer()
+{
+	Record(phase_, std::chrono::steady_clock::now() - start_);
+}
+
+Metrics::Tracked::Tracked(Gauge gauge) noexcept
+	: gauge_(gauge)
+	, active_(true)
+{
+	Add(gauge_, 1);
+}
+
+Metrics::Tracked::Tracked(Tracked&& other) noexcept
+	: gauge_(other.gauge_)
+	, active_(std::exchange(other.active_, false))
+{
+}
+
+Metrics::Tracked& Metrics::Tracked::operator=(Tracked&& other) noexcept
+{
+	if (this != &other) {
+		if (active_)
+			Add(gauge_, -1);
+
+		gauge_ = other.gauge_;
+		active_ = std::exchange(other.active_, false);
+	}
+
+	return *this;
+}
+
+Metrics::Tracked::~Tracked()
+{
+	if (active_)
+		Add(gauge_, -1);
+}
+
+void Metrics::Add(Counter counter, std::uint64_t n) noexcept
+{
+	Bump(LocalShard().counters[static_cast<std::size_t>(counter)], n);
+}
+
+void Metrics::Add(Gauge gauge, std::int64_t n) noexcept
+{
+	Bump(LocalShard().gauges[static_cast<std::size_t>(gauge)], n);
+}
+
+void Metrics::Record(Histogram histogram, std::uint64_t value) noexcept
+{
+	RecordInto(LocalShard().histograms[static_cast<std::size_t>(histogram)], value);
+}
+
+// In microseconds: 2^40 of them is about 12 days.
+void Metrics::Record(Phase phase, std::chrono::steady_clock::duration elapsed) noexcept
+{
+	const auto us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+	RecordInto(LocalShard().histograms[kHistograms + static_cast<std::size_t>(phase)], static_cast<std::uint64_t>(std::max<std::int64_t>(us, 0)));
+}
+
+void Metrics::AddCallback(std::string name, std::string help, std::function<double()> read)
+{
+	Registry& registry = GetRegistry();
+	std::lock_guard<std::mutex> lock(registry.mutex);
+
+	registry.callbacks.push_back(Callback{ std::move(name), std::move(help), std::move(read) });
+}
+
+std::string Metrics::Render()
+{
+	std::array<std::uint64_t, kCounters> counters{};
+	std::array<std::int64_t, kGauges> gauges{};
+	std::vector<Totals> histograms(kHistograms + kPhases);
+	std::vector<Callback> callbacks;
+
+	{
+		Registry& registry = GetRegistry();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+
+		for (const auto& shard : registry.shards) {
+			for (std::size_t i = 0; i < kCounters; i++)
+				counters[i] += shard->counters[i].load(std::memory_order_relaxed);
+
+			for (std::size_t i = 0; i < kGauges; i++)
+				gauges[i] += shard->gauges[i].load(std::memory_order_relaxed);
+
+			for (std::size_t h = 0; h < histograms.size(); h++) {
+				const HistogramData& data = shard->histograms[h];
+				for (std::size_t b = 0; b < kBuckets; b++)
+					histograms[h].buckets[b] += data.buckets[b].load(std::memory_order_relaxed);
+
+				histograms[h].sum += data.sum.load(std::memory_order_relaxed);
+				histograms[h].count += data.count.load(std::memory_order_relaxed);
+			}
+		}
+
+		// Called outside the lock, in case one records metrics itself.
+		callbacks = registry.callbacks;
+	}
+
+	std::string out;
+
+	RenderHeader(out, "ftp_upload_received_bytes_total", "counter", "Chunk payload bytes received, as sent.");
+	fmt::format_to(std::back_inserter(out), "ftp_upload_received_bytes_total {}\n", counters[static_cast<std::size_t>(Counter::BytesReceived)]);
+
+	RenderHeader(out, "ftp_uploads_total", "counter", "Uploads finished, by result.");
+	fmt::format_to(std::back_inserter(out), "ftp_uploads_total{{result=\"ok\"}} {}\n", counters[static_cast<std::size_t>(Counter::UploadsCompleted)]);
+	fmt::format_to(std::back_inserter(out), "ftp_uploads_total{{result=\"failed\"}} {}\n", counters[static_cast<std::size_t>(Counter::UploadsFailed)]);
+
+	RenderHeader(out, "ftp_upload_sessions", "gauge", "Uploads open right now.");
+	fmt::format_to(std::back_inserter(out), "ftp_upload_sessions {}\n", gauges[static_cast<std::size_t>(Gauge::Sessions)]);
+
+	RenderHeader(out, "ftp_upload_chunk_size_bytes", "histogram", "Size of received chunks, as sent.");
+	RenderHistogram(out, "ftp_upload_chunk_size_bytes", "", histograms[static_cast<std::size_t>(Histogram::ChunkSize)], 10, 26, 1, 1.0);
+
+	RenderHeader(out, "ftp_upload_rate_bytes_per_second", "histogram", "Average rate of each completed upload.");
+	RenderHistogram(out, "ftp_upload_rate_bytes_per_second", "", histograms[static_cast<std::size_t>(Histogram::UploadRate)], 16, 36, 2, 1.0);
+
+	RenderHeader(out, "ftp_upload_phase_seconds", "histogram", "Time spent in each step of an upload.");
+	for (std::size_t p = 0; p < kPhases; p++)
+		RenderHistogram(out, "ftp_upload_phase_seconds", fmt::format("phase=\"{}\"", kPhaseNames[p]),
+				histograms[kHistograms + p], 4, 34, 2, 1e-6);
+
+	for (const auto& callback : callbacks) {
+		RenderHeader(out, callback.name.c_str(), "gauge", callback.help.c_str());
+		fmt::format_to(std::back_inserter(out), "{} {}\n", callback.name, callback.read());
+	}
+
+	return out;
+}
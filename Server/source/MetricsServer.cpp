@@ -0,0 +1,150 @@
+#include "MetricsServer.hpp"
+
+#include <string_view>
+#include <cerrno>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include "fmt/core.h"
+
+namespace {
+	constexpr std::size_t kMaxRequest = 8192;
+
+	// A scraper that stops talking mustn't hold the only thread for long.
+	constexpr int kTimeoutSeconds = 5;
+
+	bool SendAll(int fd, std::string_view data) noexcept
+	{
+		while (!data.empty()) {
+			const ssize_t n = ::send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+
+			data.remove_prefix(static_cast<std::size_t>(n));
+		}
+
+		return true;
+	}
+}
+
+MetricsServer::MetricsServer(const std::string& host, unsigned short port, Render render)
+    : render_(std::move(render))
+{
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+
+    addrinfo* result = nullptr;
+    const std::string service = std::to_string(port);
+    if (::getaddrinfo(host.empty() ? nullptr : host.c_str(), service.c_str(), &hints, &result) != 0) {
+        error_ = EINVAL;
+        return;
+    }
+
+    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+        fd_ = ::socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd_ < 0) {
+            error_ = errno;
+            continue;
+        }
+
+        const int on = 1;
+        (void)::setsockopt(fd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+        if (::bind(fd_, ai->ai_addr, ai->ai_addrlen) == 0 && ::listen(fd_, 16) == 0) {
+            error_ = 0;
+            break;
+        }
+
+        error_ = errno;
+        ::close(fd_);
+        fd_ = -1;
+    }
+
+    ::freeaddrinfo(result);
+
+    if (fd_ >= 0)
+        thread_ = std::thread([this] { Run(); });
+}
+
+MetricsServer::~MetricsServer()
+{
+    if (fd_ < 0)
+        return;
+
+    // Wakes up accept() with an error.
+    ::shutdown(fd_, SHUT_RDWR);
+    thread_.join();
+    ::close(fd_);
+}
+
+bool MetricsServer::IsValid() const noexcept
+{
+    return fd_ >= 0;
+}
+
+int MetricsServer::GetError() const noexcept
+{
+    return error_;
+}
+
+void MetricsServer::Run() noexcept
+{
+    while (true) {
+        const int client = ::accept4(fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+
+            return;
+        }
+
+        Serve(client);
+        ::close(client);
+    }
+}
+
+void MetricsServer::Serve(int client) noexcept
+{
+    const timeval timeout{ kTimeoutSeconds, 0 };
+    (void)::setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    (void)::setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    // Only the request line matters; the headers are read and dropped.
+    std::string request;
+    char buffer[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < kMaxRequest) {
+        const ssize_t n = ::recv(client, buffer, sizeof(buffer), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+
+        request.append(buffer, static_cast<std::size_t>(n));
+    }
+
+    const std::string_view line = std::string_view(request).substr(0, request.find("\r\n"));
+    const bool metrics = line.starts_with("GET /metrics ") || line.starts_with("GET /metrics?");
+
+    try {
+        const std::string body = metrics ? render_() : "not found\n";
+        const std::string head = fmt::format("HTTP/1.1 {}\r\n"
+                                             "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                                             "Content-Length: {}\r\n"
+                                             "Connection: close\r\n\r\n",
+                                             metrics ? "200 OK" : "404 Not Found", body.size());
+
+        if (SendAll(client, head))
+            (void)SendAll(client, body);
+    } catch (...) {
+        // Out of memory while rendering; the scraper sees a closed connection.
+    }
+}
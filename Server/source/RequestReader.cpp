@@ -0,0 +1,33 @@
+#include "RequestReader.hpp"
+
+#include <grpcpp/support/proto_buffer_reader.h>
+
+bool RequestReader::Parse() noexcept
+{
+    // The request only has its oneof, so clearing the member that is set
+    // clears it all; a message of another kind replaces it while merging.
+    switch (request_.request_case()) {
+    case UploadFileRequest::kChunk:
+        request_.mutable_chunk()->Clear();
+        break;
+    case UploadFileRequest::kDedupChunk:
+        request_.mutable_dedup_chunk()->Clear();
+        break;
+    default:
+        request_.Clear();
+        break;
+    }
+
+    bool ok = false;
+    {
+        grpc::ProtoBufferReader reader(&buffer_);
+        ok = reader.status().ok()
+            && request_.MergeFromBoundedZeroCopyStream(&reader, static_cast<int>(buffer_.Length()));
+    }
+
+    // Its bytes are in the request now; the slices needn't wait for the
+    // next read to be released.
+    buffer_.Clear();
+
+    return ok;
+}
@@ -0,0 +1,119 @@
+#include "StripeRegistry.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "spdlog/spdlog.h"
+
+namespace {
+	// Never over an existing file: that would wipe the stripes in it.
+	std::optional<FileStream::Error> CreatePreallocated(const std::filesystem::path& path, uint64_t size) noexcept
+	{
+		const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd < 0)
+			return FileStream::Error{ errno, std::string("stripe: open failed: ") + std::strerror(errno) };
+
+		int err = size ? ::posix_fallocate(fd, 0, static_cast<off_t>(size)) : 0;
+		if (err == EOPNOTSUPP || err == EINVAL)
+			err = ::ftruncate(fd, static_cast<off_t>(size)) == 0 ? 0 : errno;
+
+		::close(fd);
+
+		if (err != 0)
+			return FileStream::Error{ err, std::string("stripe: preallocate failed: ") + std::strerror(err) };
+
+		return std::nullopt;
+	}
+}
+
+std::tuple<bool, std::filesystem::path, FileStream::Error>
+StripeRegistry::Begin(const std::string& upload_id, const std::filesystem::path& target,
+		      const std::filesystem::path& path, uint64_t filesize, HashType hashtype) noexcept
+{
+	const auto now = std::chrono::steady_clock::now();
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	Expire(now);
+
+	auto it = uploads_.find(upload_id);
+	if (it != uploads_.end()) {
+		Upload& upload = it->second;
+		if (upload.target != target || upload.filesize != filesize || upload.hashtype != hashtype)
+			return { false, {}, FileStream::Error{ -1, "stripe: init does not match other stripes of this upload" } };
+
+		upload.touched = now;
+		return { true, upload.path, FileStream::Error{} };
+	}
+
+	if (auto err = CreatePreallocated(path, filesize))
+		return { false, {}, *err };
+
+	uploads_.emplace(upload_id, Upload{ target, path, filesize, hashtype, {}, now });
+
+	return { true, path, FileStream::Error{} };
+}
+
+void StripeRegistry::Complete(const std::string& upload_id, uint64_t offset, uint64_t length) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = uploads_.find(upload_id);
+	if (it == uploads_.end())
+		return;
+
+	it->second.ranges[offset] = length;
+	it->second.touched = std::chrono::steady_clock::now();
+}
+
+std::tuple<bool, std::filesystem::path, std::string>
+StripeRegistry::Commit(const std::string& upload_id, const std::filesystem::path& target) noexcept
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	Expire(std::chrono::steady_clock::now());
+
+	auto it = uploads_.find(upload_id);
+	if (it == uploads_.end())
+		return { false, {}, "unknown upload_id" };
+
+	const Upload& upload = it->second;
+	if (upload.target != target)
+		return { false, {}, "filepath does not match upload_id" };
+
+	uint64_t covered = 0;
+	for (const auto& [offset, length] : upload.ranges) {
+		if (offset > covered)
+			break;
+
+		covered = std::max(covered, offset + length);
+	}
+
+	if (covered < upload.filesize)
+		return { false, {}, "stripes missing from offset " + std::to_string(covered) };
+
+	std::filesystem::path result = upload.path;
+	uploads_.erase(it);
+
+	return { true, std::move(result), "" };
+}
+
+void StripeRegistry::Expire(std::chrono::steady_clock::time_point now) noexcept
+{
+	for (auto it = uploads_.begin(); it != uploads_.end(); ) {
+		if (now - it->second.touched < kIdleTimeout) {
+			++it;
+			continue;
+		}
+
+		spdlog::warn("striped upload {} of {} expired", it->first, it->second.target.string());
+
+		std::error_code ec;
+		std::filesystem::remove(it->second.path, ec);
+		it = uploads_.erase(it);
+	}
+}
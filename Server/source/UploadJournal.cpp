@@ -0,0 +1,113 @@
+#include "UploadJournal.hpp"
+
+#include <system_error>
+#include <string_view>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "spdlog/spdlog.h"
+
+#include "Hasher.hpp"
+
+// Named after a digest of target, so that any path maps to a plain file name.
+std::filesystem::path UploadJournalPathFor(const std::filesystem::path& dir, const std::filesystem::path& target)
+{
+    static const char* kHex = "0123456789abcdef";
+
+    Hasher hasher(Hasher::Type::SHA256);
+    std::vector<uint8_t> digest;
+    if (!hasher.Initialize() && !hasher.Update(target.string()))
+        digest = std::get<1>(hasher.Finalize());
+
+    std::string name;
+    for (const uint8_t b : digest) {
+        name.push_back(kHex[b >> 4]);
+        name.push_back(kHex[b & 0xF]);
+    }
+
+    return dir / (name + ".journal");
+}
+
+// What FTPServiceImpl stages uploads under: 16 hex digits and ".partial".
+bool IsStagingPath(const std::filesystem::path& dir, const std::filesystem::path& path) noexcept
+{
+    if (path.parent_path() != dir)
+        return false;
+
+    const std::string name = path.filename().string();
+    if (name.size() != 16 + std::string_view(".partial").size() || !name.ends_with(".partial"))
+        return false;
+
+    return name.find_first_not_of("0123456789abcdef") == 16;
+}
+
+std::optional<UploadJournal> LoadUploadJournal(const std::filesystem::path& dir, const std::filesystem::path& target) noexcept
+{
+    std::ifstream in(UploadJournalPathFor(dir, target), std::ios::binary);
+    if (!in.is_open())
+        return std::nullopt;
+
+    UploadJournal journal;
+    if (!journal.ParseFromIstream(&in))
+        return std::nullopt;
+
+    if (journal.filepath() != target.string() || !IsStagingPath(dir, journal.staging()))
+        return std::nullopt;
+
+    return journal;
+}
+
+// Written to a temporary file and renamed over the old journal, so a crash
+// leaves either the previous record or the new one, never a torn one.
+std::optional<FileStream::Error> SaveUploadJournal(const std::filesystem::path& path, const UploadJournal& journal) noexcept
+{
+    std::filesystem::path temp = path;
+    temp += ".tmp";
+
+    {
+        std::ofstream out(temp, std::ios::binary | std::ios::trunc);
+        if (!out.is_open())
+            return FileStream::Error{ -1, "journal: failed to open " + temp.string() };
+
+        if (!journal.SerializeToOstream(&out) || !out.flush())
+            return FileStream::Error{ -1, "journal: failed to write " + temp.string() };
+    }
+
+    std::error_code ec;
+    std::filesystem::rename(temp, path, ec);
+    if (ec)
+        return FileStream::Error{ ec.value(), "journal: rename failed: " + ec.message() };
+
+    return std::nullopt;
+}
+
+void RemoveUploadJournal(const std::filesystem::path& dir, const std::filesystem::path& target) noexcept
+{
+    std::error_code ec;
+    std::filesystem::remove(UploadJournalPathFor(dir, target), ec);
+}
+
+// Only dir itself is looked at; the server keeps nothing below it.
+void RemoveStaleUploads(const std::filesystem::path& dir, std::chrono::seconds max_age) noexcept
+{
+    const auto before = std::filesystem::file_time_type::clock::now() - max_age;
+    std::size_t removed = 0;
+
+    std::error_code ec;
+    std::filesystem::directory_iterator it(dir, ec);
+    for (const std::filesystem::directory_iterator end; !ec && it != end; it.increment(ec)) {
+        std::error_code file_ec;
+        if (!it->is_regular_file(file_ec) || it->last_write_time(file_ec) >= before || file_ec)
+            continue;
+
+        if (std::filesystem::remove(it->path(), file_ec))
+            removed++;
+    }
+
+    if (ec)
+        spdlog::warn("failed to look for stale uploads in {}: {}", dir.string(), ec.message());
+
+    if (removed > 0)
+        spdlog::info("removed {} stale journals and staged uploads", removed);
+}
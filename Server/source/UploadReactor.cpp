@@ -0,0 +1,144 @@
+#include "UploadReactor.hpp"
+
+#include "spdlog/spdlog.h"
+
+#include "FTPServiceImpl.hpp"
+#include "Metrics.hpp"
+#include "Logging.hpp"
+
+UploadReactor::UploadReactor(FTPServiceImpl& service, WorkerPool& pool, UploadFileResponse* response)
+    : service_(service)
+    , pool_(pool)
+    , response_(response)
+    , memory_(&service.memory_)
+{
+    if (Logging::Sampled(Logging::Class::Invoked, spdlog::level::info))
+        spdlog::info("UploadFile() reactor started");
+
+    memory_.Reserve(service_.UploadMemory(requests_.Get()), [this] { Read(); });
+}
+
+void UploadReactor::OnReadDone(bool ok)
+{
+    Metrics::Record(Metrics::Phase::Read, std::chrono::steady_clock::now() - read_start_);
+
+    pool_.Submit([this, ok] { Process(ok); });
+}
+
+void UploadReactor::OnDone()
+{
+    delete this;
+}
+
+void UploadReactor::Process(bool ok) noexcept
+{
+    // A message that doesn't parse ends the stream, as with the sync reads.
+    ok = ok && requests_.Parse();
+
+    switch (state_) {
+    case State::Init: {
+        if (!ok)
+            return Fail("open file", grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "empty request stream"));
+
+        auto [ok_open, session, st_open] = service_.OpenFile(requests_.Get());
+        if (!ok_open) {
+            session.Discard();
+            return Fail("open file", std::move(st_open));
+        }
+
+        session_ = std::move(session);
+        if (Logging::Sampled(Logging::Class::Opened, spdlog::level::info))
+            spdlog::info("open file successfully: {} (hash: {}) (size: {})",
+                         session_.target.c_str(), HashType_Name(session_.hash_type),
+                         session_.expected_size);
+
+        state_ = State::Chunk;
+        if (session_.received == session_.expected_size)
+            return Complete();
+
+        return ReadChunk();
+    }
+
+    case State::Chunk: {
+        if (!ok)
+            return Complete();
+
+        // The message may be bigger than what was reserved for it.
+        memory_.Charge(service_.UploadMemory(requests_.Get(), session_.GetBufferSize()));
+
+        if (auto [ok_write, st_write] = service_.WriteToFile(requests_.Get(), session_); !ok_write)
+            return Fail("write file", std::move(st_write));
+
+        if (session_.received == session_.expected_size)
+            return Complete();
+
+        return ReadChunk();
+    }
+
+    case State::Finish: {
+        if (!ok)
+            return Fail("check hash", grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "failed to read last request"));
+
+        return service_.CheckHash(requests_.Get(), session_, [this](bool ok_hash, FileMetaData metadata, grpc::Status st_meta) {
+            if (!ok_hash)
+                return Fail("check hash", std::move(st_meta));
+
+            service_.FillResponse(session_, std::move(metadata), response_);
+
+            state_ = State::Trailer;
+            Read();
+        });
+    }
+
+    case State::Trailer:
+        if (ok)
+            return Fail("check hash", grpc::Status(grpc::StatusCode::INVALID_ARGUMENT, "extra messages after finish are not allowed"));
+
+        return Finish(grpc::Status::OK);
+    }
+}
+
+// The read starts once the memory budget has room for another chunk.
+void UploadReactor::ReadChunk() noexcept
+{
+    memory_.Reserve(service_.UploadMemory(requests_.Get(), session_.GetBufferSize()), [this] { Read(); });
+}
+
+void UploadReactor::Read() noexcept
+{
+    read_start_ = std::chrono::steady_clock::now();
+    StartRead(requests_.GetBuffer());
+}
+
+// Called once every chunk has been received (or the stream ended early).
+void UploadReactor::Complete() noexcept
+{
+    if (auto [ok_close, st_close] = service_.CloseFile(session_); !ok_close)
+        return Fail("write file", std::move(st_close));
+
+    if (session_.hashing_enabled) {
+        state_ = State::Finish;
+        return Read();
+    }
+
+    // With group durability this finishes on the commit thread, leaving
+    // the I/O pool to other streams in the meantime.
+    service_.CheckHash(requests_.Get(), session_, [this](bool ok_hash, FileMetaData metadata, grpc::Status st_meta) {
+        if (!ok_hash)
+            return Fail("check hash", std::move(st_meta));
+
+        service_.FillResponse(session_, std::move(metadata), response_);
+
+        Finish(grpc::Status::OK);
+    });
+}
+
+void UploadReactor::Fail(const char* what, grpc::Status status) noexcept
+{
+    spdlog::error("failed to {}: {}", what, status.error_message());
+
+    session_.Discard();
+    Metrics::Add(Metrics::Counter::UploadsFailed);
+
+    Finish(std::move(status));
+}
@@ -1,5 +1,11 @@
 #include "UploadSession.hpp"
 
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "UploadJournal.hpp"
+
 std::optional<FileStream::Error> UploadSession::UploadSession::Open(std::ios::openmode mode) noexcept
 {
     if (hashing) return hashing->Open(mode);
@@ -14,6 +20,26 @@ std::optional<FileStream::Error> UploadSession::UploadSession::Write(std::string
     return FileStream::Error{ -1, "session: no stream object" };
 }
 
+std::optional<FileStream::Error> UploadSession::UploadSession::WriteLeaf(std::string_view data, const std::vector<uint8_t>& digest) noexcept
+{
+    if (hashing) return hashing->WriteLeaf(data, digest);
+    return FileStream::Error{ -1, "session: no hashing stream" };
+}
+
+std::tuple<bool, std::streamsize, FileStream::Error> UploadSession::UploadSession::Read(char* data, std::streamsize size) noexcept
+{
+    if (hashing) return hashing->Read(data, size);
+    if (plain)   return plain->Read(data, size);
+    return { false, 0, FileStream::Error{ -1, "session: no stream object" } };
+}
+
+std::optional<FileStream::Error> UploadSession::UploadSession::Seek(std::streamoff offset) noexcept
+{
+    if (hashing) return hashing->Seek(offset);
+    if (plain)   return plain->Seek(offset);
+    return FileStream::Error{ -1, "session: no stream object" };
+}
+
 std::optional<FileStream::Error> UploadSession::UploadSession::Close() noexcept
 {
     if (hashing) return hashing->Close();
@@ -21,9 +47,106 @@ std::optional<FileStream::Error> UploadSession::UploadSession::Close() noexcept
     return std::nullopt;
 }
 
-std::optional<std::vector<uint8_t>> UploadSession::UploadSession::GetHash() const noexcept
+const std::vector<uint8_t>* UploadSession::UploadSession::GetHash() const noexcept
+{
+    if (hashing && hashing->GetHash()) return &*hashing->GetHash();
+    return nullptr;
+}
+
+// Continues a journaled upload. The file must already be open for reading and
+// writing and cut back to journal.offset(); the kept prefix is hashed again
+// and compared with the journal before new data is accepted.
+std::optional<FileStream::Error> UploadSession::UploadSession::Restore(const UploadJournal& journal) noexcept
+{
+    const uint64_t offset = journal.offset();
+
+    if (hashing) {
+        std::vector<char> buffer(64 * BUFSIZ);
+
+        for (uint64_t done = 0; done < offset; ) {
+            const uint64_t want = std::min<uint64_t>(buffer.size(), offset - done);
+            const auto [ok, len, err] = hashing->Read(buffer.data(), static_cast<std::streamsize>(want));
+            if (!ok)
+                return err;
+
+            if (len <= 0)
+                return FileStream::Error{ -1, "resume: file is shorter than journal offset" };
+
+            done += static_cast<uint64_t>(len);
+        }
+
+        const auto prefix = hashing->GetPartialHash();
+        if (!prefix || journal.prefix_hash() != std::string(prefix->begin(), prefix->end()))
+            return FileStream::Error{ -1, "resume: stored data does not match journal hash" };
+    }
+
+    if (auto err = Seek(static_cast<std::streamoff>(offset)))
+        return err;
+
+    received = offset;
+    checkpointed = offset;
+
+    return std::nullopt;
+}
+
+std::size_t UploadSession::UploadSession::GetBufferSize() const noexcept
 {
-    if (hashing) return hashing->GetHash();
+    return inflated.capacity() + (leaves ? leaves->GetBufferSize() : 0);
+}
+
+// Makes everything received so far durable and records it in the journal.
+// Leaves still being checked are waited for: only checked ones go in.
+std::optional<FileStream::Error> UploadSession::UploadSession::Checkpoint() noexcept
+{
+    if (touch_only || !stripe_id.empty() || base || received == checkpointed)
+        return std::nullopt;
+
+    if (leaves)
+        if (auto err = leaves->Wait())
+            return err;
+
+    // Keyed by the target, which is what the client asks about.
+    UploadJournal journal;
+    journal.set_filepath(target.string());
+    journal.set_filesize(expected_size);
+    journal.set_hashtype(hash_type);
+    journal.set_offset(received);
+    journal.set_staging(path.string());
+
+    if (hashing) {
+        if (auto err = hashing->Sync())
+            return err;
+
+        const auto prefix = hashing->GetPartialHash();
+        if (!prefix)
+            return FileStream::Error{ -1, "checkpoint: failed to read partial hash" };
+
+        journal.set_prefix_hash(prefix->data(), prefix->size());
+    } else if (plain) {
+        if (auto err = plain->Sync())
+            return err;
+    } else {
+        return FileStream::Error{ -1, "session: no stream object" };
+    }
+
+    if (auto err = SaveUploadJournal(journal_path, journal))
+        return err;
+
+    checkpointed = received;
+
     return std::nullopt;
 }
 
+// Drops the staged file of a failed upload; target keeps its old version.
+// An interrupted upload that was checkpointed keeps it to be resumed, and a
+// stripe leaves it to the other stripes of its upload.
+void UploadSession::UploadSession::Discard() noexcept
+{
+    if (path.empty() || !stripe_id.empty() || (checkpointed > 0 && received < expected_size))
+        return;
+
+    (void)Close();
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+}
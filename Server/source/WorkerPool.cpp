@@ -0,0 +1,56 @@
+#include "WorkerPool.hpp"
+
+WorkerPool::WorkerPool(std::size_t threads)
+{
+    if (threads == 0)
+        threads = 1;
+
+    threads_.reserve(threads);
+    for (std::size_t i = 0; i < threads; i++)
+        threads_.emplace_back([this] { Run(); });
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+    }
+    cv_.notify_all();
+
+    for (auto& thread : threads_)
+        thread.join();
+}
+
+void WorkerPool::Submit(Task task)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        tasks_.push_back(std::move(task));
+    }
+    cv_.notify_one();
+}
+
+std::size_t WorkerPool::Size() const noexcept
+{
+    return threads_.size();
+}
+
+void WorkerPool::Run() noexcept
+{
+    while (true) {
+        Task task;
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            cv_.wait(lock, [this] { return stopping_ || !tasks_.empty(); });
+
+            if (tasks_.empty())
+                return;
+
+            task = std::move(tasks_.front());
+            tasks_.pop_front();
+        }
+
+        task();
+    }
+}
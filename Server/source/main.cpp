@@ -1,5 +1,10 @@
 
+#include <algorithm>
+#include <climits>
+#include <chrono>
+#include <cstring>
 #include <memory>
+#include <optional>
 #include <variant>
 #include <string>
 #include <map>
@@ -9,13 +14,18 @@
 #include <grpcpp/support/server_interceptor.h>
 #include <grpcpp/grpcpp.h>
 #include <spdlog/spdlog.h>
-#include <spdlog/sinks/stdout_color_sinks.h>
 
 #include "FTPServiceImpl.hpp"
+#include "Logging.hpp"
+#include "MetricsServer.hpp"
+#include "Metrics.hpp"
 #include "ServerInterceptor.hpp"
 
 using ArgList = std::map<std::string, std::string>;
 
+// Messages the background logger can fall behind by before dropping.
+constexpr std::size_t kLogQueueSize = 8192;
+
 std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char* argv[])
 {
     ArgList arglist;
@@ -23,12 +33,28 @@ std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char
     const struct option options[] = {
             { "loglevel", required_argument, nullptr, 'l' },
             { "root-dir", required_argument, nullptr, 'r' },
+            { "chunk-store-limit", required_argument, nullptr, 'k' },
+            { "engine", required_argument, nullptr, 'e' },
+            { "io-threads", required_argument, nullptr, 't' },
+            { "hash-threads", required_argument, nullptr, 'H' },
+            { "storage", required_argument, nullptr, 's' },
+            { "queue-depth", required_argument, nullptr, 'q' },
+            { "max-message-size", required_argument, nullptr, 'm' },
+            { "window-size", required_argument, nullptr, 'w' },
+            { "bdp-probe", required_argument, nullptr, 'p' },
+            { "memory-budget", required_argument, nullptr, 'b' },
+            { "metrics", required_argument, nullptr, 'M' },
+            { "log-sample", required_argument, nullptr, 'S' },
+            { "durability", required_argument, nullptr, 'd' },
+            { "metadata-cache", required_argument, nullptr, 'c' },
+            { "index", required_argument, nullptr, 'i' },
+            { "upload-expiry", required_argument, nullptr, 'x' },
             { nullptr, 0, nullptr, 0 }
     };
 
     try {
         int optidx;
-        for (int opt; (opt = getopt_long(argc, argv, "l:r:", options, &optidx)) != -1; ) {
+        for (int opt; (opt = getopt_long(argc, argv, "l:r:k:e:t:H:s:q:m:w:p:b:M:S:d:c:i:x:", options, &optidx)) != -1; ) {
             switch (opt) {
             case 'l':
                 arglist["loglevel"] = optarg;
@@ -36,6 +62,54 @@ std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char
             case 'r':
                 arglist["root-dir"] = optarg;
                 break;
+            case 'k':
+                arglist["chunk-store-limit"] = optarg;
+                break;
+            case 'e':
+                arglist["engine"] = optarg;
+                break;
+            case 't':
+                arglist["io-threads"] = optarg;
+                break;
+            case 'H':
+                arglist["hash-threads"] = optarg;
+                break;
+            case 's':
+                arglist["storage"] = optarg;
+                break;
+            case 'q':
+                arglist["queue-depth"] = optarg;
+                break;
+            case 'm':
+                arglist["max-message-size"] = optarg;
+                break;
+            case 'w':
+                arglist["window-size"] = optarg;
+                break;
+            case 'p':
+                arglist["bdp-probe"] = optarg;
+                break;
+            case 'b':
+                arglist["memory-budget"] = optarg;
+                break;
+            case 'M':
+                arglist["metrics"] = optarg;
+                break;
+            case 'S':
+                arglist["log-sample"] = optarg;
+                break;
+            case 'd':
+                arglist["durability"] = optarg;
+                break;
+            case 'c':
+                arglist["metadata-cache"] = optarg;
+                break;
+            case 'i':
+                arglist["index"] = optarg;
+                break;
+            case 'x':
+                arglist["upload-expiry"] = optarg;
+                break;
             case ':':
                 return { false, fmt::format("missing argument: {}", static_cast<char>(opt)) };
             case '?':
@@ -49,7 +123,7 @@ std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char
 
     argc -= optind;
     if (argc < 2)
-        return { false, fmt::format("usage: {} [--loglevel <level>] [--root-dir <directory>] <host> <service>", *argv) };
+        return { false, fmt::format("usage: {} [--loglevel <level>] [--root-dir <directory>] [--chunk-store-limit <bytes>] [--engine <sync|callback>] [--io-threads <count>] [--hash-threads <count>] [--storage <fstream|uring|direct>] [--queue-depth <count>] [--max-message-size <bytes>] [--window-size <bytes>] [--bdp-probe <on|off>] [--memory-budget <bytes>] [--metrics <host:port|off>] [--log-sample <n|class=n,...>] [--durability <none|fdatasync|group>] [--metadata-cache <entries>] [--index <on|off>] [--upload-expiry <seconds>] <host> <service>", *argv) };
 
     argv += optind;
 
@@ -59,12 +133,272 @@ std::pair<bool, std::variant<ArgList, std::string>> ParseArgument(int argc, char
     if (arglist.find("root-dir") == arglist.end())
         arglist["root-dir"] = ".";
 
+    // Deduplication chunks are kept under <root-dir>/.chunks; 0 never
+    // removes any, otherwise the least recently used go past this many bytes.
+    if (arglist.find("chunk-store-limit") == arglist.end())
+        arglist["chunk-store-limit"] = "0";
+
     if (arglist.find("loglevel") == arglist.end())
-        arglist["loglevel"] = "0";
+        arglist["loglevel"] = "info";
+
+    if (arglist.find("engine") == arglist.end())
+        arglist["engine"] = "sync";
+
+    if (arglist.find("io-threads") == arglist.end())
+        arglist["io-threads"] = "4";
+
+    if (arglist.find("hash-threads") == arglist.end())
+        arglist["hash-threads"] = "4";
+
+    if (arglist.find("storage") == arglist.end())
+        arglist["storage"] = "fstream";
+
+    if (arglist.find("queue-depth") == arglist.end())
+        arglist["queue-depth"] = "8";
+
+    if (arglist.find("max-message-size") == arglist.end())
+        arglist["max-message-size"] = std::to_string(4 * 1024 * 1024);
+
+    if (arglist.find("window-size") == arglist.end())
+        arglist["window-size"] = "default";
+
+    if (arglist.find("bdp-probe") == arglist.end())
+        arglist["bdp-probe"] = "on";
+
+    if (arglist.find("memory-budget") == arglist.end())
+        arglist["memory-budget"] = std::to_string(1024ULL * 1024 * 1024);
+
+    if (arglist.find("metrics") == arglist.end())
+        arglist["metrics"] = "off";
+
+    if (arglist.find("log-sample") == arglist.end())
+        arglist["log-sample"] = "1";
+
+    if (arglist.find("durability") == arglist.end())
+        arglist["durability"] = "none";
+
+    if (arglist.find("metadata-cache") == arglist.end())
+        arglist["metadata-cache"] = "65536";
+
+    if (arglist.find("index") == arglist.end())
+        arglist["index"] = "on";
+
+    // Off: interrupted uploads stay resumable until they are resumed or
+    // started over.
+    if (arglist.find("upload-expiry") == arglist.end())
+        arglist["upload-expiry"] = "0";
 
     return { true, arglist };
 }
 
+std::optional<FTPServiceImpl::Options> MakeServiceOptions(const ArgList& arglist)
+{
+    FTPServiceImpl::Options options;
+
+    const std::string& engine = arglist.at("engine");
+    if (engine == "sync")
+        options.engine = FTPServiceImpl::Engine::Sync;
+    else if (engine == "callback")
+        options.engine = FTPServiceImpl::Engine::Callback;
+    else
+        return std::nullopt;
+
+    const std::string& storage = arglist.at("storage");
+    if (storage == "fstream")
+        options.storage = FTPServiceImpl::Storage::Stream;
+    else if (storage == "uring")
+        options.storage = FTPServiceImpl::Storage::Uring;
+    else if (storage == "direct")
+        options.storage = FTPServiceImpl::Storage::Direct;
+    else
+        return std::nullopt;
+
+    const std::string& index = arglist.at("index");
+    if (index != "on" && index != "off")
+        return std::nullopt;
+
+    options.directory_index = index == "on";
+
+    const std::string& durability = arglist.at("durability");
+    if (durability == "none")
+        options.durability = FTPServiceImpl::Durability::None;
+    else if (durability == "fdatasync")
+        options.durability = FTPServiceImpl::Durability::Sync;
+    else if (durability == "group")
+        options.durability = FTPServiceImpl::Durability::Group;
+    else
+        return std::nullopt;
+
+    try {
+        options.io_threads = std::stoul(arglist.at("io-threads"));
+        options.hash_threads = std::stoul(arglist.at("hash-threads"));
+        options.queue_depth = std::stoul(arglist.at("queue-depth"));
+        options.memory_budget = std::stoull(arglist.at("memory-budget"));
+        options.metadata_cache = std::stoull(arglist.at("metadata-cache"));
+        options.upload_expiry = std::chrono::seconds(std::stoull(arglist.at("upload-expiry")));
+        options.chunk_store_limit = std::stoull(arglist.at("chunk-store-limit"));
+    } catch (std::exception& e) {
+        return std::nullopt;
+    }
+
+    return options;
+}
+
+// Same limits and flow control as the client's; see its MakeChannelArguments().
+// Downloads are sent in 64 * BUFSIZ chunks and tree-hashed uploads in whole
+// 1 MiB leaves, so the max message size can't go below 2 MiB.
+bool ConfigureTransport(const ArgList& arglist, grpc::ServerBuilder& builder)
+{
+    try {
+        const unsigned long long max_message_size = std::stoull(arglist.at("max-message-size"));
+        if (max_message_size < 2 * 1024 * 1024 || max_message_size > INT_MAX)
+            return false;
+
+        builder.SetMaxReceiveMessageSize(static_cast<int>(max_message_size));
+        builder.SetMaxSendMessageSize(static_cast<int>(max_message_size));
+
+        if (arglist.at("window-size") != "default")
+            builder.AddChannelArgument(GRPC_ARG_HTTP2_STREAM_LOOKAHEAD_BYTES,
+                                       static_cast<int>(std::min<unsigned long long>(std::stoull(arglist.at("window-size")), INT_MAX)));
+    } catch (std::exception& e) {
+        return false;
+    }
+
+    const std::string& bdp_probe = arglist.at("bdp-probe");
+    if (bdp_probe != "on" && bdp_probe != "off")
+        return false;
+
+    builder.AddChannelArgument(GRPC_ARG_HTTP2_BDP_PROBE, bdp_probe == "on" ? 1 : 0);
+
+    return true;
+}
+
+// The service's budget covers what uploads hold after reading a message;
+// the ResourceQuota makes gRPC keep its own transport buffers (messages not
+// read yet) within the same amount, shrinking flow-control windows as it
+// gets close.
+void ConfigureMemory(const FTPServiceImpl::Options& options, grpc::ServerBuilder& builder)
+{
+    if (options.memory_budget == 0)
+        return;
+
+    grpc::ResourceQuota quota("ftp-server");
+    quota.Resize(options.memory_budget);
+
+    builder.SetResourceQuota(quota);
+}
+
+// --loglevel takes a name (trace, debug, info, warn, error, critical, off)
+// or its number, 0 (trace) to 6 (off).
+std::optional<spdlog::level::level_enum> ParseLogLevel(const std::string& loglevel)
+{
+    if (loglevel.size() == 1 && loglevel[0] >= '0' && loglevel[0] <= '6')
+        return static_cast<spdlog::level::level_enum>(loglevel[0] - '0');
+
+    const spdlog::level::level_enum level = spdlog::level::from_str(loglevel);
+    if (level == spdlog::level::off && loglevel != "off")
+        return std::nullopt;
+
+    return level;
+}
+
+// --log-sample logs 1 in n of the messages written for every upload: either
+// one n for all of them, or a list like "opened=100,result=10" where the
+// classes are invoked, opened, written and result. Errors are always logged.
+bool ConfigureLogSampling(const std::string& spec)
+{
+    static const std::map<std::string, Logging::Class> classes = {
+        { "invoked", Logging::Class::Invoked },
+        { "opened", Logging::Class::Opened },
+        { "written", Logging::Class::Written },
+        { "result", Logging::Class::Result }
+    };
+
+    try {
+        if (spec.find('=') == std::string::npos) {
+            const unsigned long every = std::stoul(spec);
+            for (const auto &[name, cls]: classes)
+                Logging::SetSampleRate(cls, static_cast<std::uint32_t>(every));
+
+            return true;
+        }
+
+        for (std::size_t begin = 0; begin <= spec.size(); ) {
+            std::size_t end = spec.find(',', begin);
+            if (end == std::string::npos)
+                end = spec.size();
+
+            const std::string item = spec.substr(begin, end - begin);
+            const std::size_t eq = item.find('=');
+            if (eq == std::string::npos)
+                return false;
+
+            const auto cls = classes.find(item.substr(0, eq));
+            if (cls == classes.end())
+                return false;
+
+            Logging::SetSampleRate(cls->second, static_cast<std::uint32_t>(std::stoul(item.substr(eq + 1))));
+            begin = end + 1;
+        }
+    } catch (std::exception& e) {
+        return false;
+    }
+
+    return true;
+}
+
+// --metrics serves Prometheus metrics at http://<host:port>/metrics.
+std::unique_ptr<MetricsServer> StartMetrics(const ArgList& arglist, const FTPServiceImpl& service)
+{
+    const std::string& address = arglist.at("metrics");
+    const std::size_t colon = address.rfind(':');
+    if (colon == std::string::npos)
+        return nullptr;
+
+    unsigned long port;
+    try {
+        port = std::stoul(address.substr(colon + 1));
+    } catch (std::exception& e) {
+        return nullptr;
+    }
+
+    if (port == 0 || port > 65535)
+        return nullptr;
+
+    Metrics::AddCallback("ftp_memory_budget_used_bytes", "Memory held by uploads.",
+                         [&service] { return static_cast<double>(service.GetMemoryUsage().used); });
+    Metrics::AddCallback("ftp_memory_budget_peak_bytes", "Most memory uploads have held at once.",
+                         [&service] { return static_cast<double>(service.GetMemoryUsage().peak); });
+    Metrics::AddCallback("ftp_memory_budget_limit_bytes", "Memory uploads may hold; 0 is unlimited.",
+                         [&service] { return static_cast<double>(service.GetMemoryUsage().limit); });
+    Metrics::AddCallback("ftp_memory_budget_waiting", "Uploads waiting for memory.",
+                         [&service] { return static_cast<double>(service.GetMemoryUsage().waiting); });
+    Metrics::AddCallback("ftp_metadata_cache_entries", "Files whose metadata is cached.",
+                         [&service] { return static_cast<double>(service.GetMetadataCacheUsage().entries); });
+    Metrics::AddCallback("ftp_metadata_cache_capacity", "Files whose metadata may be cached; 0 is disabled.",
+                         [&service] { return static_cast<double>(service.GetMetadataCacheUsage().capacity); });
+    Metrics::AddCallback("ftp_metadata_cache_hits", "Metadata lookups served from the cache.",
+                         [&service] { return static_cast<double>(service.GetMetadataCacheUsage().hits); });
+    Metrics::AddCallback("ftp_metadata_cache_misses", "Metadata lookups that took a statx().",
+                         [&service] { return static_cast<double>(service.GetMetadataCacheUsage().misses); });
+
+    if (service.GetIndexUsage()) {
+        Metrics::AddCallback("ftp_index_files", "Files in the directory index.",
+                             [&service] { return static_cast<double>(service.GetIndexUsage()->files); });
+        Metrics::AddCallback("ftp_index_directories", "Directories in the directory index.",
+                             [&service] { return static_cast<double>(service.GetIndexUsage()->directories); });
+        Metrics::AddCallback("ftp_index_ready", "1 once the directory index can serve listings.",
+                             [&service] { return service.GetIndexUsage()->ready ? 1.0 : 0.0; });
+    }
+
+    // [::1]:9100 style addresses
+    std::string host = address.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    return std::make_unique<MetricsServer>(host, static_cast<unsigned short>(port), [] { return Metrics::Render(); });
+}
+
 void ShowArgument(const ArgList& arglist)
 {
     for (const auto &[name, value]: arglist)
@@ -80,27 +414,70 @@ int main(int argc, char* argv[])
     }
 
     const ArgList& arglist = std::get<ArgList>(result);
+
+    const auto loglevel = ParseLogLevel(arglist.at("loglevel"));
+    if (!loglevel) {
+        spdlog::error("invalid --loglevel: {}", arglist.at("loglevel"));
+        return 1;
+    }
+
+    if (!ConfigureLogSampling(arglist.at("log-sample"))) {
+        spdlog::error("invalid --log-sample: {}", arglist.at("log-sample"));
+        return 1;
+    }
+
+    Logging::Start(*loglevel, kLogQueueSize);
     ShowArgument(arglist);
 
-    FTPServiceImpl service(arglist.at("root-dir"));
+    const auto options = MakeServiceOptions(arglist);
+    if (!options) {
+        spdlog::error("failed to create FTP Service: invalid engine options");
+        return 1;
+    }
+
+    FTPServiceImpl service(arglist.at("root-dir"), *options);
     if (!service.IsValid()) {
         spdlog::error("failed to create FTP Service: invalid root directory {}", arglist.at("root-dir"));
         return 1;
     }
     spdlog::info("registered service(s): FTP");
 
+    std::unique_ptr<MetricsServer> metrics;
+    if (arglist.at("metrics") != "off") {
+        metrics = StartMetrics(arglist, service);
+        if (!metrics || !metrics->IsValid()) {
+            spdlog::error("failed to serve metrics at {}: {}", arglist.at("metrics"),
+                          metrics ? std::strerror(metrics->GetError()) : "invalid address");
+            return 1;
+        }
+        spdlog::info("metrics served at http://{}/metrics", arglist.at("metrics"));
+    }
+
     grpc::ServerBuilder builder;
+    if (!ConfigureTransport(arglist, builder)) {
+        spdlog::error("failed to configure transport: invalid --max-message-size, --window-size or --bdp-probe");
+        return 1;
+    }
+    ConfigureMemory(*options, builder);
+
     builder.AddListeningPort(fmt::format("{}:{}", arglist.at("host"), arglist.at("service")), grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
 
     std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
     spdlog::info("server started: listening on {}:{}", arglist.at("host"), arglist.at("service"));
 
+    if (options->memory_budget != 0)
+        spdlog::info("memory budget: {} bytes each for uploads and for gRPC buffers", options->memory_budget);
+
+    spdlog::info("durability: {}", arglist.at("durability"));
+
     server->Wait();
 
     server->Shutdown();
 
     spdlog::info("server stopped", arglist.at("host"), arglist.at("service"));
 
+    Logging::Stop();
+
     return 0;
 }
@@ -0,0 +1,175 @@
+// Reads the chunks of one upload the way the server does, from raw
+// ByteBuffers through a RequestReader, and writes them with WriteToFile().
+// Once the first few chunks have grown the buffers, a chunk must not allocate
+// at all: one that does is a request or buffer that isn't being reused.
+#include <filesystem>
+#include <iostream>
+#include <cstdlib>
+#include <cstddef>
+#include <cstdint>
+#include <atomic>
+#include <string>
+#include <vector>
+#include <new>
+
+#include <stdlib.h>
+
+#include <grpcpp/support/byte_buffer.h>
+#include <grpcpp/support/slice.h>
+
+#include "FTPServiceImpl.hpp"
+#include "RequestReader.hpp"
+#include "hash.pb.h"
+
+namespace fs = std::filesystem;
+
+namespace {
+	constexpr std::size_t kChunkSize = 64 * 1024;
+	constexpr std::size_t kChunks = 64;
+	// Chunks that may still allocate while buffers reach their final size;
+	// after these, each one must make no allocations.
+	constexpr std::size_t kWarmup = 4;
+
+	std::atomic<bool> counting = false;
+	std::atomic<std::size_t> allocations = 0;
+
+	void* Allocate(std::size_t size, std::size_t alignment = 0) noexcept
+	{
+		if (counting.load(std::memory_order_relaxed))
+			allocations.fetch_add(1, std::memory_order_relaxed);
+
+		if (size == 0)
+			size = 1;
+
+		if (alignment <= alignof(std::max_align_t))
+			return std::malloc(size);
+
+		void* ptr = nullptr;
+		return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+	}
+
+	void* AllocateOrThrow(std::size_t size, std::size_t alignment = 0)
+	{
+		if (void* ptr = Allocate(size, alignment))
+			return ptr;
+
+		throw std::bad_alloc();
+	}
+}
+
+void* operator new(std::size_t size) { return AllocateOrThrow(size); }
+void* operator new[](std::size_t size) { return AllocateOrThrow(size); }
+void* operator new(std::size_t size, std::align_val_t al) { return AllocateOrThrow(size, static_cast<std::size_t>(al)); }
+void* operator new[](std::size_t size, std::align_val_t al) { return AllocateOrThrow(size, static_cast<std::size_t>(al)); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return Allocate(size); }
+void* operator new(std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return Allocate(size, static_cast<std::size_t>(al)); }
+void* operator new[](std::size_t size, std::align_val_t al, const std::nothrow_t&) noexcept { return Allocate(size, static_cast<std::size_t>(al)); }
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+class UploadAllocationTest
+{
+public:
+	explicit UploadAllocationTest(const fs::path& root)
+	    : root_(root)
+	    , service_(root.string(), FTPServiceImpl::Options{})
+	{
+	}
+
+	// Allocations made by each chunk, or nothing if the upload failed.
+	std::vector<std::size_t> Run()
+	{
+		RequestReader requests;
+
+		UploadFileRequest first;
+		UploadInit* init = first.mutable_init();
+		init->set_filepath((root_ / "upload").string());
+		init->set_filesize(kChunks * kChunkSize);
+		init->set_hashtype(HASH_TYPE_SHA256);
+
+		auto [ok, session, status] = service_.OpenFile(first);
+		if (!ok) {
+			std::cerr << "OpenFile: " << status.error_message() << std::endl;
+			return {};
+		}
+
+		UploadFileRequest message;
+		message.mutable_chunk()->set_data(std::string(kChunkSize, 'x'));
+		const std::string wire = message.SerializeAsString();
+
+		std::vector<std::size_t> counts;
+		for (std::size_t i = 0; i < kChunks; i++) {
+			// What gRPC would have read off the wire; not the server's to count.
+			grpc::Slice slice(wire.data(), wire.size());
+			*requests.GetBuffer() = grpc::ByteBuffer(&slice, 1);
+
+			allocations = 0;
+			counting = true;
+
+			const bool parsed = requests.Parse();
+			auto [written, error] = service_.WriteToFile(requests.Get(), session);
+
+			counting = false;
+
+			if (!parsed || !written) {
+				std::cerr << "chunk " << i << ": " << (parsed ? error.error_message() : "parse failed") << std::endl;
+				return {};
+			}
+
+			counts.push_back(allocations);
+		}
+
+		return counts;
+	}
+
+private:
+	const fs::path root_;
+	FTPServiceImpl service_;
+};
+
+int main()
+{
+	char dir[] = "/tmp/UploadAllocationTest.XXXXXX";
+	if (!mkdtemp(dir)) {
+		std::cerr << "mkdtemp failed" << std::endl;
+		return 1;
+	}
+
+	std::vector<std::size_t> counts;
+	{
+		UploadAllocationTest test(dir);
+		counts = test.Run();
+	}
+
+	std::error_code ec;
+	fs::remove_all(dir, ec);
+
+	if (counts.empty())
+		return 1;
+
+	bool steady = true;
+	for (std::size_t i = 0; i < counts.size(); i++) {
+		std::cout << "chunk " << i << ": " << counts[i] << " allocations" << std::endl;
+		if (i >= kWarmup && counts[i] != 0)
+			steady = false;
+	}
+
+	if (!steady) {
+		std::cerr << "chunks allocate after the first " << kWarmup << std::endl;
+		return 1;
+	}
+
+	return 0;
+}
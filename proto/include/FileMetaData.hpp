@@ -2,6 +2,11 @@
 
 #include "file.pb.h"
 
+#include <system_error>
 #include <filesystem>
 
+// Size and times of a file from a single statx(). The first form throws
+// std::filesystem::filesystem_error; the second sets ec and returns an empty
+// message instead.
 FileMetaData MakeFileMetaDataFrom(const std::filesystem::path& from);
+FileMetaData MakeFileMetaDataFrom(const std::filesystem::path& from, std::error_code& ec) noexcept;
@@ -1,56 +1,59 @@
 #include "FileMetaData.hpp"
 
 #include <filesystem>
+#include <cerrno>
 
 #include <sys/stat.h>
+#include <fcntl.h>
 
 #include <google/protobuf/util/time_util.h>
 #include <google/protobuf/timestamp.pb.h>
 
 namespace {
-    google::protobuf::Timestamp TimespecToTimestamp(const struct timespec& ts)
+    void SetTimestamp(google::protobuf::Timestamp* out, const struct statx_timestamp& ts)
     {
-        google::protobuf::Timestamp out;
-
-        out.set_seconds(ts.tv_sec);
-        out.set_nanos(ts.tv_nsec);
-
-        return out;
+        out->set_seconds(ts.tv_sec);
+        out->set_nanos(ts.tv_nsec);
     }
+}
 
-    enum class FileTimeKind {
-        Atime, Mtime, Ctime
-    };
+FileMetaData MakeFileMetaDataFrom(const std::filesystem::path& from)
+{
+    std::error_code ec;
+
+    FileMetaData data = MakeFileMetaDataFrom(from, ec);
+    if (ec)
+        throw std::filesystem::filesystem_error("statx", from, ec);
 
-    google::protobuf::Timestamp PathToTimestamp(const std::filesystem::path &path, FileTimeKind kind) {
-        struct stat st;
+    return data;
+}
 
-        if (stat(path.c_str(), &st) != 0)
-		return {};
+FileMetaData MakeFileMetaDataFrom(const std::filesystem::path& from, std::error_code& ec) noexcept
+{
+    constexpr unsigned int kMask = STATX_TYPE | STATX_SIZE | STATX_ATIME | STATX_MTIME | STATX_CTIME;
 
-        switch (kind) {
-        case FileTimeKind::Atime:
-            return TimespecToTimestamp(st.st_atim);
-        case FileTimeKind::Mtime:
-            return TimespecToTimestamp(st.st_mtim);
-        case FileTimeKind::Ctime:
-            return TimespecToTimestamp(st.st_ctim);
-        }
+    struct statx stx;
+    if (statx(AT_FDCWD, from.c_str(), AT_STATX_SYNC_AS_STAT, kMask, &stx) != 0) {
+        ec.assign(errno, std::generic_category());
+        return {};
+    }
 
-        return {}; // unreachable
+    // Like file_size(), which this used to be built on.
+    if (!S_ISREG(stx.stx_mode)) {
+        ec = std::make_error_code(S_ISDIR(stx.stx_mode) ? std::errc::is_a_directory : std::errc::not_supported);
+        return {};
     }
-}
 
-FileMetaData MakeFileMetaDataFrom(const std::filesystem::path& from)
-{
+    ec.clear();
+
     FileMetaData data;
 
     data.set_path(from);
-    data.set_size(std::filesystem::file_size(from));
+    data.set_size(stx.stx_size);
 
-    data.mutable_create_time()->CopyFrom(PathToTimestamp(from, FileTimeKind::Ctime));
-    data.mutable_modify_time()->CopyFrom(PathToTimestamp(from, FileTimeKind::Mtime));
-    data.mutable_access_time()->CopyFrom(PathToTimestamp(from, FileTimeKind::Atime));
+    SetTimestamp(data.mutable_create_time(), stx.stx_ctime);
+    SetTimestamp(data.mutable_modify_time(), stx.stx_mtime);
+    SetTimestamp(data.mutable_access_time(), stx.stx_atime);
 
     return data;
 }
@@ -15,4 +15,6 @@ elif [ "$1" == "Client" ]; then
 	${BASE}/build/Client/Client 127.0.0.1 1584 			\
 				    ${BASE}/Resources/image.iso		\
 				    ${BASE}/Resources/image_copy.iso
+elif [ "$1" == "Benchmark" ]; then
+	${BASE}/build/Benchmark/LoopbackBenchmark "${@:2}" > ${BASE}/benchmark.jsonl
 fi